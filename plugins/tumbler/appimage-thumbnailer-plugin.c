@@ -0,0 +1,52 @@
+/*
+ * appimage-thumbnailer-plugin.c - tumbler plugin entry points
+ *
+ * Loaded by tumblerd (XFCE) from $libdir/tumbler-1/plugins, so AppImage
+ * thumbnails are rendered in the daemon instead of exec'ing
+ * appimage-thumbnailer for every file.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gmodule.h>
+#include <tumbler/tumbler.h>
+
+#include "appimage-thumbnailer-provider.h"
+#include "appimage-thumbnailer-tumbler.h"
+
+G_MODULE_EXPORT void tumbler_plugin_initialize(TumblerProviderPlugin *plugin);
+G_MODULE_EXPORT void tumbler_plugin_shutdown(void);
+G_MODULE_EXPORT void tumbler_plugin_get_types(const GType **types, gint *n_types);
+
+static GType type_list[1];
+
+void
+tumbler_plugin_initialize(TumblerProviderPlugin *plugin)
+{
+    const gchar *mismatch = tumbler_check_version(TUMBLER_MAJOR_VERSION,
+                                                  TUMBLER_MINOR_VERSION,
+                                                  TUMBLER_MICRO_VERSION);
+    if (G_UNLIKELY(mismatch != NULL)) {
+        g_warning("Version mismatch: %s", mismatch);
+        return;
+    }
+
+    appimage_thumbnailer_provider_register(plugin);
+    appimage_thumbnailer_register(plugin);
+
+    type_list[0] = APPIMAGE_TYPE_THUMBNAILER_PROVIDER;
+}
+
+void
+tumbler_plugin_shutdown(void)
+{
+}
+
+void
+tumbler_plugin_get_types(const GType **types, gint *n_types)
+{
+    *types = type_list;
+    *n_types = G_N_ELEMENTS(type_list);
+}
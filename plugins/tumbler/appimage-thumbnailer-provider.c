@@ -0,0 +1,77 @@
+/*
+ * appimage-thumbnailer-provider.c - tumbler provider for AppImage thumbnails
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "appimage-thumbnailer-provider.h"
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tumbler/tumbler.h>
+
+#include "appimage-thumbnailer-tumbler.h"
+
+struct _AppImageThumbnailerProviderClass {
+    GObjectClass parent_class;
+};
+
+struct _AppImageThumbnailerProvider {
+    GObject parent;
+};
+
+static void appimage_thumbnailer_provider_iface_init(TumblerThumbnailerProviderIface *iface);
+
+G_DEFINE_DYNAMIC_TYPE_EXTENDED(AppImageThumbnailerProvider,
+                               appimage_thumbnailer_provider,
+                               G_TYPE_OBJECT,
+                               0,
+                               TUMBLER_ADD_INTERFACE(TUMBLER_TYPE_THUMBNAILER_PROVIDER,
+                                                     appimage_thumbnailer_provider_iface_init));
+
+void
+appimage_thumbnailer_provider_register(TumblerProviderPlugin *plugin)
+{
+    appimage_thumbnailer_provider_register_type(G_TYPE_MODULE(plugin));
+}
+
+static GList *
+appimage_thumbnailer_provider_get_thumbnailers(TumblerThumbnailerProvider *provider G_GNUC_UNUSED)
+{
+    /* Same list as appimage-thumbnailer.thumbnailer */
+    static const gchar *mime_types[] = {
+        "application/vnd.appimage",
+        "application/x-iso9660-appimage",
+        "application/x-appimage",
+        NULL,
+    };
+    /* Remote SquashFS AppImages are read in place through GVfs */
+    static const gchar *uri_schemes[] = { "file", "sftp", "smb", "dav", "davs", "nfs", NULL };
+
+    AppImageThumbnailer *thumbnailer = g_object_new(APPIMAGE_TYPE_THUMBNAILER,
+                                                    "uri-schemes", uri_schemes,
+                                                    "mime-types", mime_types,
+                                                    NULL);
+    return g_list_append(NULL, thumbnailer);
+}
+
+static void
+appimage_thumbnailer_provider_iface_init(TumblerThumbnailerProviderIface *iface)
+{
+    iface->get_thumbnailers = appimage_thumbnailer_provider_get_thumbnailers;
+}
+
+static void
+appimage_thumbnailer_provider_class_init(AppImageThumbnailerProviderClass *klass G_GNUC_UNUSED)
+{
+}
+
+static void
+appimage_thumbnailer_provider_class_finalize(AppImageThumbnailerProviderClass *klass G_GNUC_UNUSED)
+{
+}
+
+static void
+appimage_thumbnailer_provider_init(AppImageThumbnailerProvider *provider G_GNUC_UNUSED)
+{
+}
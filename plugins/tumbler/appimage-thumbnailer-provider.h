@@ -0,0 +1,29 @@
+/*
+ * appimage-thumbnailer-provider.h - tumbler provider for AppImage thumbnails
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef APPIMAGE_THUMBNAILER_PROVIDER_H
+#define APPIMAGE_THUMBNAILER_PROVIDER_H
+
+#include <glib-object.h>
+#include <tumbler/tumbler.h>
+
+G_BEGIN_DECLS
+
+#define APPIMAGE_TYPE_THUMBNAILER_PROVIDER (appimage_thumbnailer_provider_get_type())
+
+typedef struct _AppImageThumbnailerProvider      AppImageThumbnailerProvider;
+typedef struct _AppImageThumbnailerProviderClass AppImageThumbnailerProviderClass;
+
+GType appimage_thumbnailer_provider_get_type(void) G_GNUC_CONST;
+
+/**
+ * Register the provider type with the plugin's type module.
+ */
+void appimage_thumbnailer_provider_register(TumblerProviderPlugin *plugin);
+
+G_END_DECLS
+
+#endif /* APPIMAGE_THUMBNAILER_PROVIDER_H */
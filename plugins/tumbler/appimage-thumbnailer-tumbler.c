@@ -0,0 +1,141 @@
+/*
+ * appimage-thumbnailer-tumbler.c - tumbler thumbnailer for AppImages
+ *
+ * Runs the core extraction/render pipeline inside tumblerd.  tumblerd
+ * calls create() from its scheduler threads, while the pipeline keeps
+ * process-wide state (tool lookup, quality preset, cost estimates), so
+ * renders are serialized; extraction is dominated by the unsquashfs /
+ * dwarfsextract child anyway.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "appimage-thumbnailer-tumbler.h"
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <tumbler/tumbler.h>
+
+#include "thumbnail-pipeline.h"
+
+struct _AppImageThumbnailerClass {
+    TumblerAbstractThumbnailerClass parent_class;
+};
+
+struct _AppImageThumbnailer {
+    TumblerAbstractThumbnailer parent;
+};
+
+G_DEFINE_DYNAMIC_TYPE(AppImageThumbnailer, appimage_thumbnailer, TUMBLER_TYPE_ABSTRACT_THUMBNAILER);
+
+static GMutex pipeline_lock;
+
+void
+appimage_thumbnailer_register(TumblerProviderPlugin *plugin)
+{
+    appimage_thumbnailer_register_type(G_TYPE_MODULE(plugin));
+}
+
+static void
+emit_error(TumblerAbstractThumbnailer *thumbnailer, const gchar *uri, GError *error)
+{
+    g_signal_emit_by_name(thumbnailer, "error", uri, error->domain, error->code, error->message);
+    g_error_free(error);
+}
+
+static GdkPixbuf *
+render_appimage(const gchar *path, int size, GError **error)
+{
+    g_mutex_lock(&pipeline_lock);
+
+    GdkPixbuf *pixbuf = NULL;
+    GBytes *payload = thumbnail_pipeline_load_icon(path);
+    if (payload) {
+        gsize len = 0;
+        const guchar *data = g_bytes_get_data(payload, &len);
+        pixbuf = thumbnail_pipeline_render(data, len, size);
+        g_bytes_unref(payload);
+        if (!pixbuf)
+            g_set_error(error, TUMBLER_ERROR, TUMBLER_ERROR_INVALID_FORMAT,
+                        "Failed to render the AppImage icon");
+    } else {
+        g_set_error(error, TUMBLER_ERROR, TUMBLER_ERROR_NO_CONTENT,
+                    "Failed to extract .DirIcon from AppImage");
+    }
+
+    g_mutex_unlock(&pipeline_lock);
+    return pixbuf;
+}
+
+static void
+appimage_thumbnailer_create(TumblerAbstractThumbnailer *thumbnailer,
+                            GCancellable *cancellable,
+                            TumblerFileInfo *info)
+{
+    const gchar *uri = tumbler_file_info_get_uri(info);
+    GError *error = NULL;
+
+    if (g_cancellable_set_error_if_cancelled(cancellable, &error)) {
+        emit_error(thumbnailer, uri, error);
+        return;
+    }
+
+    /* Without a local path (or GVfs FUSE mount) the pipeline reads the
+     * URI itself */
+    GFile *file = g_file_new_for_uri(uri);
+    gchar *path = g_file_get_path(file);
+    g_object_unref(file);
+    if (!path)
+        path = g_strdup(uri);
+
+    TumblerThumbnail *thumbnail = tumbler_file_info_get_thumbnail(info);
+    TumblerThumbnailFlavor *flavor = tumbler_thumbnail_get_flavor(thumbnail);
+    gint width = 0;
+    gint height = 0;
+    tumbler_thumbnail_flavor_get_size(flavor, &width, &height);
+
+    GdkPixbuf *pixbuf = render_appimage(path, MAX(width, height), &error);
+    g_free(path);
+
+    if (pixbuf) {
+        TumblerImageData data = {
+            .data = gdk_pixbuf_get_pixels(pixbuf),
+            .has_alpha = gdk_pixbuf_get_has_alpha(pixbuf),
+            .bits_per_sample = gdk_pixbuf_get_bits_per_sample(pixbuf),
+            .width = gdk_pixbuf_get_width(pixbuf),
+            .height = gdk_pixbuf_get_height(pixbuf),
+            .rowstride = gdk_pixbuf_get_rowstride(pixbuf),
+            .colorspace = (TumblerColorspace)gdk_pixbuf_get_colorspace(pixbuf),
+        };
+        tumbler_thumbnail_save_image_data(thumbnail, &data, tumbler_file_info_get_mtime(info),
+                                          cancellable, &error);
+        g_object_unref(pixbuf);
+    }
+
+    if (error)
+        emit_error(thumbnailer, uri, error);
+    else
+        g_signal_emit_by_name(thumbnailer, "ready", uri);
+
+    g_object_unref(flavor);
+    g_object_unref(thumbnail);
+}
+
+static void
+appimage_thumbnailer_class_init(AppImageThumbnailerClass *klass)
+{
+    TumblerAbstractThumbnailerClass *abstractthumbnailer_class = TUMBLER_ABSTRACT_THUMBNAILER_CLASS(klass);
+    abstractthumbnailer_class->create = appimage_thumbnailer_create;
+}
+
+static void
+appimage_thumbnailer_class_finalize(AppImageThumbnailerClass *klass G_GNUC_UNUSED)
+{
+}
+
+static void
+appimage_thumbnailer_init(AppImageThumbnailer *thumbnailer G_GNUC_UNUSED)
+{
+}
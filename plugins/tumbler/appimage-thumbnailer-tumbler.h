@@ -0,0 +1,29 @@
+/*
+ * appimage-thumbnailer-tumbler.h - tumbler thumbnailer for AppImages
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef APPIMAGE_THUMBNAILER_TUMBLER_H
+#define APPIMAGE_THUMBNAILER_TUMBLER_H
+
+#include <glib-object.h>
+#include <tumbler/tumbler.h>
+
+G_BEGIN_DECLS
+
+#define APPIMAGE_TYPE_THUMBNAILER (appimage_thumbnailer_get_type())
+
+typedef struct _AppImageThumbnailer      AppImageThumbnailer;
+typedef struct _AppImageThumbnailerClass AppImageThumbnailerClass;
+
+GType appimage_thumbnailer_get_type(void) G_GNUC_CONST;
+
+/**
+ * Register the thumbnailer type with the plugin's type module.
+ */
+void appimage_thumbnailer_register(TumblerProviderPlugin *plugin);
+
+G_END_DECLS
+
+#endif /* APPIMAGE_THUMBNAILER_TUMBLER_H */
@@ -0,0 +1,283 @@
+/*
+ * appimage-reader.c - Random-access reads from local or GIO-backed AppImages
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "appimage-reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+
+/* Enough for a probe plus a directory walk without refetching */
+#define READER_CACHED_BLOCKS 16
+
+typedef struct {
+    off_t   offset;   /* block-aligned, -1 if unused */
+    gsize   len;      /* short for the last block of the file */
+    guint64 stamp;    /* LRU clock value of the last hit */
+    guchar *data;
+} ReaderBlock;
+
+struct _AppImageReader {
+    gchar                 *name;
+    int                    fd;      /* local files */
+    GFileInputStream      *stream;  /* GIO locations */
+    AppImageReaderIdentity identity;
+
+    ReaderBlock blocks[READER_CACHED_BLOCKS];
+    guint64     clock;
+
+    guint   requests; /* fetches that reached the fd / stream */
+    guint64 fetched;  /* bytes they returned */
+};
+
+gboolean
+appimage_reader_is_uri(const char *location)
+{
+    if (!location || location[0] == '/')
+        return FALSE;
+
+    gchar *scheme = g_uri_parse_scheme(location);
+    gboolean is_uri = scheme != NULL;
+    g_free(scheme);
+    return is_uri;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Backends                                                          */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+open_local(AppImageReader *reader, const char *path)
+{
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        g_debug("open_local: failed to open '%s': %s", path, g_strerror(errno));
+        return FALSE;
+    }
+
+    struct stat st;
+    if (fstat(reader->fd, &st) != 0)
+        return FALSE;
+
+    reader->identity.dev = (guint64)st.st_dev;
+    reader->identity.ino = (guint64)st.st_ino;
+    reader->identity.size = (gint64)st.st_size;
+    reader->identity.mtime_ns = (gint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return TRUE;
+}
+
+static gboolean
+open_gio(AppImageReader *reader, const char *uri)
+{
+    GFile *file = g_file_new_for_uri(uri);
+    GError *error = NULL;
+
+    GFileInfo *info = g_file_query_info(file,
+                                        G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                        G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                                        G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC ","
+                                        G_FILE_ATTRIBUTE_UNIX_DEVICE ","
+                                        G_FILE_ATTRIBUTE_UNIX_INODE,
+                                        G_FILE_QUERY_INFO_NONE, NULL, &error);
+    if (info)
+        reader->stream = g_file_read(file, NULL, &error);
+    g_object_unref(file);
+
+    if (!reader->stream) {
+        g_debug("open_gio: cannot open '%s': %s", uri, error ? error->message : "unknown error");
+        g_clear_error(&error);
+        g_clear_object(&info);
+        return FALSE;
+    }
+
+    if (!g_seekable_can_seek(G_SEEKABLE(reader->stream))) {
+        g_debug("open_gio: '%s' is not seekable", uri);
+        g_object_unref(info);
+        return FALSE;
+    }
+
+    reader->identity.size = g_file_info_get_size(info);
+    reader->identity.mtime_ns =
+        (gint64)g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * 1000000000
+        + (gint64)g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC) * 1000;
+    if (g_file_info_has_attribute(info, G_FILE_ATTRIBUTE_UNIX_INODE)) {
+        reader->identity.dev = g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_UNIX_DEVICE);
+        reader->identity.ino = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_UNIX_INODE);
+    } else {
+        reader->identity.ino = g_str_hash(uri);
+    }
+    g_object_unref(info);
+    return TRUE;
+}
+
+/* One request to the backend; returns the bytes read (short at EOF), or -1 */
+static gssize
+fetch(AppImageReader *reader, guchar *buf, gsize len, off_t offset)
+{
+    gsize done = 0;
+
+    reader->requests++;
+    if (reader->fd >= 0) {
+        while (done < len) {
+            ssize_t n = pread(reader->fd, buf + done, len - done, offset + (off_t)done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                break;
+            done += (gsize)n;
+        }
+    } else {
+        GError *error = NULL;
+        if (!g_seekable_seek(G_SEEKABLE(reader->stream), (goffset)offset, G_SEEK_SET, NULL, &error)
+            || !g_input_stream_read_all(G_INPUT_STREAM(reader->stream), buf, len, &done,
+                                        NULL, &error)) {
+            g_debug("fetch: read of %" G_GSIZE_FORMAT " bytes at %" G_GINT64_FORMAT
+                    " from '%s' failed: %s", len, (gint64)offset, reader->name, error->message);
+            g_error_free(error);
+            return -1;
+        }
+    }
+
+    reader->fetched += done;
+    return (gssize)done;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Block cache                                                       */
+/* ------------------------------------------------------------------ */
+
+static const ReaderBlock *
+get_block(AppImageReader *reader, off_t block_offset)
+{
+    ReaderBlock *victim = &reader->blocks[0];
+
+    for (guint i = 0; i < READER_CACHED_BLOCKS; ++i) {
+        ReaderBlock *block = &reader->blocks[i];
+        if (block->offset == block_offset) {
+            block->stamp = ++reader->clock;
+            return block;
+        }
+        if (block->stamp < victim->stamp)
+            victim = block;
+    }
+
+    if (!victim->data)
+        victim->data = g_malloc(APPIMAGE_READER_BLOCK_SIZE);
+
+    gssize n = fetch(reader, victim->data, APPIMAGE_READER_BLOCK_SIZE, block_offset);
+    if (n < 0) {
+        victim->offset = -1;
+        victim->stamp = 0;
+        return NULL;
+    }
+
+    victim->offset = block_offset;
+    victim->len = (gsize)n;
+    victim->stamp = ++reader->clock;
+    return victim;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Public API                                                        */
+/* ------------------------------------------------------------------ */
+
+AppImageReader *
+appimage_reader_open(const char *location)
+{
+    if (!location)
+        return NULL;
+
+    AppImageReader *reader = g_new0(AppImageReader, 1);
+    reader->name = g_strdup(location);
+    reader->fd = -1;
+    for (guint i = 0; i < READER_CACHED_BLOCKS; ++i)
+        reader->blocks[i].offset = -1;
+
+    gboolean ok = appimage_reader_is_uri(location) ? open_gio(reader, location)
+                                                   : open_local(reader, location);
+    if (!ok) {
+        appimage_reader_free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+gboolean
+appimage_reader_read(AppImageReader *reader, void *buf, gsize len, off_t offset)
+{
+    if (offset < 0 || (gint64)offset + (gint64)len > reader->identity.size)
+        return FALSE;
+
+    if (len >= APPIMAGE_READER_BLOCK_SIZE) {
+        gssize n = fetch(reader, buf, len, offset);
+        return n == (gssize)len;
+    }
+
+    guchar *out = buf;
+    while (len > 0) {
+        const off_t block_offset = offset - offset % APPIMAGE_READER_BLOCK_SIZE;
+        const ReaderBlock *block = get_block(reader, block_offset);
+        if (!block)
+            return FALSE;
+
+        const gsize skip = (gsize)(offset - block_offset);
+        if (skip >= block->len)
+            return FALSE;
+
+        const gsize chunk = MIN(len, block->len - skip);
+        memcpy(out, block->data + skip, chunk);
+        out += chunk;
+        offset += (off_t)chunk;
+        len -= chunk;
+    }
+    return TRUE;
+}
+
+off_t
+appimage_reader_size(const AppImageReader *reader)
+{
+    return (off_t)reader->identity.size;
+}
+
+const AppImageReaderIdentity *
+appimage_reader_identity(const AppImageReader *reader)
+{
+    return &reader->identity;
+}
+
+const char *
+appimage_reader_name(const AppImageReader *reader)
+{
+    return reader->name;
+}
+
+void
+appimage_reader_free(AppImageReader *reader)
+{
+    if (!reader)
+        return;
+
+    if (reader->requests > 0)
+        g_debug("appimage_reader_free: %u request(s), %" G_GUINT64_FORMAT " bytes fetched for '%s'",
+                reader->requests, reader->fetched, reader->name);
+
+    if (reader->fd >= 0)
+        close(reader->fd);
+    g_clear_object(&reader->stream);
+    for (guint i = 0; i < READER_CACHED_BLOCKS; ++i)
+        g_free(reader->blocks[i].data);
+    g_free(reader->name);
+    g_free(reader);
+}
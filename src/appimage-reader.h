@@ -0,0 +1,76 @@
+/*
+ * appimage-reader.h - Random-access reads from local or GIO-backed AppImages
+ *
+ * The format probe and the native SquashFS reader only need a handful of
+ * small ranges (ELF header, superblock, metadata, the icon's blocks).
+ * AppImageReader serves them from a local fd or, for URIs GIO can open
+ * (sftp://, smb:// through GVfs, file://), from a seekable
+ * GFileInputStream, so a remote AppImage is never copied as a whole.
+ *
+ * Small reads are coalesced: they are rounded out to aligned blocks kept
+ * in a small LRU cache, so the many few-byte header reads of a probe cost
+ * one round trip instead of one each.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef APPIMAGE_READER_H
+#define APPIMAGE_READER_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+/* Unit of remote fetches; reads at least this large bypass the cache */
+#define APPIMAGE_READER_BLOCK_SIZE (64 * 1024)
+
+typedef struct _AppImageReader AppImageReader;
+
+/* What a cached probe result is keyed on */
+typedef struct {
+    guint64 dev;      /* st_dev, or 0 for GIO locations */
+    guint64 ino;      /* st_ino, or a hash of the URI when the backend has none */
+    gint64  size;
+    gint64  mtime_ns;
+} AppImageReaderIdentity;
+
+/**
+ * Whether @location is a URI (has a scheme) rather than a local path.
+ */
+gboolean appimage_reader_is_uri(const char *location);
+
+/**
+ * Open an AppImage for random-access reads.
+ *
+ * @param location Local path, or a URI GIO can open with a seekable stream
+ * @return A new reader (free with appimage_reader_free()), or NULL
+ */
+AppImageReader *appimage_reader_open(const char *location);
+
+/**
+ * Read exactly @len bytes at @offset.
+ *
+ * @return TRUE if all bytes were read, FALSE on error or end of file
+ */
+gboolean appimage_reader_read(AppImageReader *reader, void *buf, gsize len, off_t offset);
+
+/**
+ * Size of the file in bytes.
+ */
+off_t appimage_reader_size(const AppImageReader *reader);
+
+/**
+ * Identity of the file (device, inode, size, modification time).
+ */
+const AppImageReaderIdentity *appimage_reader_identity(const AppImageReader *reader);
+
+/**
+ * Location the reader was opened with, for log messages.
+ */
+const char *appimage_reader_name(const AppImageReader *reader);
+
+/**
+ * Close the reader and log how many requests and bytes it fetched.
+ */
+void appimage_reader_free(AppImageReader *reader);
+
+#endif /* APPIMAGE_READER_H */
@@ -0,0 +1,744 @@
+/*
+ * appimage-thumbnailer-replay.c - Replay a recorded request trace
+ *
+ * Drives a running service (appimage-thumbnailer --serve/--dbus) with the
+ * requests of a trace written by --record, at the recorded pace or N times
+ * faster, and reports queueing delay, throughput and tail latency.
+ *
+ * Recorded paths are mapped onto the files of a corpus directory (each
+ * distinct path always onto the same file, so repeats stay repeats), which
+ * lets traces collected on user machines be replayed against a synthetic
+ * set of AppImages.  Socket requests are sent from a pool of client
+ * threads; D-Bus jobs are timed from the Queue call to their Started
+ * (queueing delay) and Finished (latency) signals.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+
+#include "thumbnail-dbus.h"
+#include "thumbnail-recorder.h"
+#include "thumbnail-server.h"
+
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_DRAIN_SECONDS 60
+#define SOCKET_ATTEMPTS 3 /* workers may be recycled between replies */
+
+typedef struct {
+    const ThumbnailRecord *record;
+    gint64   due;       /* replay clock, µs */
+    gint64   sent;
+    gint64   started;   /* D-Bus Started */
+    gint64   finished;
+    guint32  live_handle;
+    guint    n_thumbnails;
+    gboolean failed;
+    gboolean done;
+} ReplayRequest;
+
+typedef struct {
+    GMainLoop *loop;
+    GPtrArray *records;
+    ReplayRequest *requests;
+    guint n_requests;
+    guint next;          /* next request to dispatch */
+    guint outstanding;
+    gint64 start;
+    gint64 end;
+    gdouble speed;
+    gchar **corpus;
+    guint n_corpus;
+    const char *socket_path;
+    GThreadPool *pool;
+    GDBusConnection *bus;
+    GHashTable *by_recorded_handle; /* recorded handle -> ReplayRequest (latest session) */
+    GHashTable *by_live_handle;     /* service handle -> ReplayRequest */
+    guint drain_seconds;
+    guint skipped;
+    guint dequeues;
+} Replay;
+
+static Replay replay;
+
+/* ------------------------------------------------------------------ */
+/*  Corpus                                                            */
+/* ------------------------------------------------------------------ */
+
+static gint
+compare_paths(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+static gboolean
+load_corpus(const char *dir_path)
+{
+    GError *error = NULL;
+    GDir *dir = g_dir_open(dir_path, 0, &error);
+    if (!dir) {
+        g_printerr("Cannot open corpus: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    /* The service resolves paths in its own working directory */
+    gchar *cwd = g_get_current_dir();
+    gchar *base = g_path_is_absolute(dir_path) ? g_strdup(dir_path)
+                                               : g_build_filename(cwd, dir_path, NULL);
+    GPtrArray *files = g_ptr_array_new();
+    const gchar *name;
+    while ((name = g_dir_read_name(dir))) {
+        gchar *path = g_build_filename(base, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_REGULAR))
+            g_ptr_array_add(files, path);
+        else
+            g_free(path);
+    }
+    g_dir_close(dir);
+    g_free(base);
+    g_free(cwd);
+
+    if (files->len == 0) {
+        g_printerr("Corpus '%s' has no files\n", dir_path);
+        g_ptr_array_unref(files);
+        return FALSE;
+    }
+
+    /* Sorted, so a trace maps onto the same files on every run */
+    g_ptr_array_sort(files, compare_paths);
+    replay.n_corpus = files->len;
+    g_ptr_array_add(files, NULL);
+    replay.corpus = (gchar **)g_ptr_array_free(files, FALSE);
+    return TRUE;
+}
+
+/* Map a recorded path (or file URI) onto the corpus */
+static gchar *
+map_path(const char *recorded)
+{
+    if (!replay.corpus)
+        return g_strdup(recorded);
+    return g_strdup(replay.corpus[g_str_hash(recorded) % replay.n_corpus]);
+}
+
+static gchar *
+map_uri(const char *recorded)
+{
+    if (!replay.corpus)
+        return g_strdup(recorded);
+    gchar *path = map_path(recorded);
+    gchar *uri = g_filename_to_uri(path, NULL, NULL);
+    g_free(path);
+    return uri;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Completion                                                        */
+/* ------------------------------------------------------------------ */
+
+static void
+maybe_quit(void)
+{
+    if (replay.next == replay.n_requests && replay.outstanding == 0)
+        g_main_loop_quit(replay.loop);
+}
+
+static void
+complete(ReplayRequest *req, gboolean failed)
+{
+    if (req->done)
+        return;
+    req->done = TRUE;
+    req->failed = failed;
+    if (req->finished == 0)
+        req->finished = g_get_monotonic_time();
+    replay.end = MAX(replay.end, req->finished);
+    replay.outstanding--;
+    maybe_quit();
+}
+
+/* ------------------------------------------------------------------ */
+/*  Socket frontend                                                   */
+/* ------------------------------------------------------------------ */
+
+static int
+connect_service(const char *socket_path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const gboolean abstract = socket_path[0] == '@';
+    const gsize len = strlen(socket_path);
+    if (len >= sizeof(addr.sun_path))
+        return -1;
+    memcpy(addr.sun_path, socket_path, len);
+    if (abstract)
+        addr.sun_path[0] = '\0';
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    const socklen_t addr_len = abstract ? (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len)
+                                        : (socklen_t)sizeof(addr);
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static gboolean
+send_full(int fd, const void *buf, gsize len)
+{
+    const guint8 *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        len -= (gsize)n;
+    }
+    return TRUE;
+}
+
+/* Receive one reply, closing the memfd that comes with it */
+static gboolean
+recv_reply(int fd, ThumbnailServerReply *reply)
+{
+    struct iovec iov = { .iov_base = reply, .iov_len = sizeof(*reply) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n;
+    do
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return FALSE;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int memfd;
+            memcpy(&memfd, CMSG_DATA(cmsg), sizeof(memfd));
+            close(memfd);
+        }
+    }
+    return n == (ssize_t)sizeof(*reply) && reply->magic == THUMBNAIL_SERVER_MAGIC;
+}
+
+/* Send the sizes from @first on and read their final replies; returns
+ * the index of the first size left unanswered. */
+static guint
+serve_socket_request(ReplayRequest *req, const char *path, guint first, gboolean *failed)
+{
+    const ThumbnailRecord *record = req->record;
+    int fd = connect_service(replay.socket_path);
+    if (fd < 0)
+        return first;
+
+    ThumbnailServerRequest header = {
+        .magic = THUMBNAIL_SERVER_MAGIC,
+        .version = THUMBNAIL_SERVER_VERSION,
+        .format = record->format,
+        .flags = record->flags & ~THUMBNAIL_REQUEST_FD,
+        .n_sizes = (guint16)(record->n_sizes - first),
+        .deadline_ms = record->deadline_ms,
+        .path_len = (guint32)strlen(path),
+    };
+
+    guint answered = first;
+    if (send_full(fd, &header, sizeof(header))
+        && send_full(fd, record->sizes + first, header.n_sizes * sizeof(guint16))
+        && send_full(fd, path, header.path_len)) {
+        ThumbnailServerReply reply;
+        while (answered < record->n_sizes && recv_reply(fd, &reply)) {
+            if (reply.flags & THUMBNAIL_REPLY_PREVIEW)
+                continue;
+            if (reply.status != 0)
+                *failed = TRUE;
+            answered++;
+        }
+    }
+    close(fd);
+    return answered;
+}
+
+static gboolean
+on_socket_done(gpointer user_data)
+{
+    ReplayRequest *req = user_data;
+    complete(req, req->failed);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+run_socket_request(gpointer data, gpointer user_data G_GNUC_UNUSED)
+{
+    ReplayRequest *req = data;
+    gchar *path = map_path(req->record->paths[0] ? req->record->paths[0] : "");
+
+    req->sent = g_get_monotonic_time();
+    gboolean failed = FALSE;
+    guint answered = 0;
+    for (int attempt = 0; attempt < SOCKET_ATTEMPTS && answered < req->record->n_sizes; ++attempt)
+        answered = serve_socket_request(req, path, answered, &failed);
+    req->finished = g_get_monotonic_time();
+    req->failed = failed || answered < req->record->n_sizes;
+    req->n_thumbnails = req->record->n_sizes;
+
+    g_free(path);
+    g_idle_add(on_socket_done, req);
+}
+
+/* ------------------------------------------------------------------ */
+/*  D-Bus frontend                                                    */
+/* ------------------------------------------------------------------ */
+
+static void
+on_signal(GDBusConnection *connection G_GNUC_UNUSED, const gchar *sender G_GNUC_UNUSED,
+          const gchar *object_path G_GNUC_UNUSED, const gchar *interface_name G_GNUC_UNUSED,
+          const gchar *signal_name, GVariant *parameters, gpointer user_data G_GNUC_UNUSED)
+{
+    if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(u)")))
+        return;
+
+    guint32 handle = 0;
+    g_variant_get(parameters, "(u)", &handle);
+    ReplayRequest *req = g_hash_table_lookup(replay.by_live_handle, GUINT_TO_POINTER(handle));
+    if (!req)
+        return;
+
+    if (g_strcmp0(signal_name, "Started") == 0 && req->started == 0)
+        req->started = g_get_monotonic_time();
+    else if (g_strcmp0(signal_name, "Finished") == 0)
+        complete(req, FALSE);
+}
+
+static void
+on_queue_reply(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    ReplayRequest *req = user_data;
+    GError *error = NULL;
+    GVariant *ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
+    if (!ret) {
+        g_debug("on_queue_reply: %s", error->message);
+        g_error_free(error);
+        complete(req, TRUE);
+        return;
+    }
+
+    g_variant_get(ret, "(u)", &req->live_handle);
+    g_variant_unref(ret);
+    g_hash_table_insert(replay.by_live_handle, GUINT_TO_POINTER(req->live_handle), req);
+}
+
+static void
+on_dequeue_reply(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    ReplayRequest *queued = user_data;
+    GVariant *ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, NULL);
+    if (ret)
+        g_variant_unref(ret);
+
+    /* Jobs removed before they started never send Finished */
+    if (queued->started == 0) {
+        queued->n_thumbnails = 0;
+        complete(queued, FALSE);
+    }
+}
+
+static void
+send_queue(ReplayRequest *req)
+{
+    const ThumbnailRecord *record = req->record;
+    GVariantBuilder uris;
+    g_variant_builder_init(&uris, G_VARIANT_TYPE("as"));
+    for (guint i = 0; record->paths[i]; ++i) {
+        gchar *uri = map_uri(record->paths[i]);
+        g_variant_builder_add(&uris, "s", uri);
+        g_free(uri);
+    }
+    req->n_thumbnails = g_strv_length(record->paths);
+    g_hash_table_insert(replay.by_recorded_handle, GUINT_TO_POINTER(record->handle), req);
+
+    g_dbus_connection_call(replay.bus, THUMBNAIL_DBUS_NAME, THUMBNAIL_DBUS_PATH,
+                           THUMBNAIL_DBUS_INTERFACE, "Queue",
+                           g_variant_new("(ass)", &uris, record->flavor,
+                                         record->foreground ? "foreground" : "background"),
+                           G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                           on_queue_reply, req);
+}
+
+static void
+send_dequeue(const ThumbnailRecord *record)
+{
+    ReplayRequest *queued = g_hash_table_lookup(replay.by_recorded_handle,
+                                                GUINT_TO_POINTER(record->handle));
+    if (!queued || queued->done || queued->live_handle == 0) {
+        replay.skipped++;
+        return;
+    }
+
+    replay.dequeues++;
+    g_dbus_connection_call(replay.bus, THUMBNAIL_DBUS_NAME, THUMBNAIL_DBUS_PATH,
+                           THUMBNAIL_DBUS_INTERFACE, "Dequeue",
+                           g_variant_new("(u)", queued->live_handle), NULL,
+                           G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_dequeue_reply, queued);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Dispatch                                                          */
+/* ------------------------------------------------------------------ */
+
+static void
+dispatch(ReplayRequest *req)
+{
+    const ThumbnailRecord *record = req->record;
+    switch (record->type) {
+    case THUMBNAIL_RECORD_SOCKET:
+        if (!replay.socket_path)
+            break;
+        replay.outstanding++;
+        g_thread_pool_push(replay.pool, req, NULL);
+        return;
+    case THUMBNAIL_RECORD_QUEUE:
+        if (!replay.bus)
+            break;
+        replay.outstanding++;
+        req->sent = g_get_monotonic_time();
+        send_queue(req);
+        return;
+    case THUMBNAIL_RECORD_DEQUEUE:
+        if (!replay.bus)
+            break;
+        req->done = TRUE;
+        send_dequeue(record);
+        return;
+    case THUMBNAIL_RECORD_SESSION: /* consumed by the loader */
+        break;
+    }
+
+    req->done = TRUE;
+    replay.skipped++;
+}
+
+static gboolean
+on_drain_timeout(gpointer user_data G_GNUC_UNUSED)
+{
+    g_printerr("%u request(s) still outstanding after %u s, giving up\n", replay.outstanding,
+               replay.drain_seconds);
+    g_main_loop_quit(replay.loop);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+dispatch_due(gpointer user_data G_GNUC_UNUSED)
+{
+    const gint64 now = g_get_monotonic_time();
+    while (replay.next < replay.n_requests && replay.requests[replay.next].due <= now)
+        dispatch(&replay.requests[replay.next++]);
+
+    if (replay.next < replay.n_requests) {
+        const gint64 wait_ms = (replay.requests[replay.next].due - now + 999) / 1000;
+        g_timeout_add((guint)wait_ms, dispatch_due, NULL);
+    } else {
+        g_timeout_add_seconds(replay.drain_seconds, on_drain_timeout, NULL);
+        maybe_quit();
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Report                                                            */
+/* ------------------------------------------------------------------ */
+
+static gint
+compare_gint64(gconstpointer a, gconstpointer b)
+{
+    const gint64 x = *(const gint64 *)a;
+    const gint64 y = *(const gint64 *)b;
+    return x < y ? -1 : (x > y);
+}
+
+static gdouble
+percentile_ms(GArray *sorted, gdouble p)
+{
+    if (sorted->len == 0)
+        return 0.0;
+    guint rank = (guint)(p * sorted->len + 0.999999);
+    rank = CLAMP(rank, 1, sorted->len);
+    return g_array_index(sorted, gint64, rank - 1) / 1000.0;
+}
+
+static void
+print_row(const char *label, GArray *samples, guint failed)
+{
+    g_array_sort(samples, compare_gint64);
+    g_printerr("%-16s %7u %7u %9.1f %9.1f %9.1f %9.1f\n", label, samples->len, failed,
+               percentile_ms(samples, 0.50), percentile_ms(samples, 0.90),
+               percentile_ms(samples, 0.99), percentile_ms(samples, 1.0));
+}
+
+static void
+report(void)
+{
+    GArray *socket_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    GArray *dbus_queueing = g_array_new(FALSE, FALSE, sizeof(gint64));
+    GArray *dbus_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    GArray *lag = g_array_new(FALSE, FALSE, sizeof(gint64));
+    guint socket_failed = 0, dbus_failed = 0, incomplete = 0;
+    guint64 thumbnails = 0;
+    gint64 first_sent = 0;
+
+    for (guint i = 0; i < replay.n_requests; ++i) {
+        ReplayRequest *req = &replay.requests[i];
+        if (!req->done) {
+            incomplete++;
+            continue;
+        }
+        if (req->record->type == THUMBNAIL_RECORD_DEQUEUE || req->sent == 0)
+            continue;
+
+        const gint64 latency = req->finished - req->sent;
+        const gint64 late = req->sent - req->due;
+        g_array_append_val(lag, late);
+        if (first_sent == 0 || req->sent < first_sent)
+            first_sent = req->sent;
+        if (!req->failed)
+            thumbnails += req->n_thumbnails;
+
+        if (req->record->type == THUMBNAIL_RECORD_SOCKET) {
+            socket_failed += req->failed;
+            g_array_append_val(socket_latency, latency);
+        } else {
+            dbus_failed += req->failed;
+            g_array_append_val(dbus_latency, latency);
+            if (req->started > 0) {
+                const gint64 queueing = req->started - req->sent;
+                g_array_append_val(dbus_queueing, queueing);
+            }
+        }
+    }
+
+    const gdouble seconds = replay.end > first_sent ? (replay.end - first_sent) / 1e6 : 0.0;
+    const guint completed = socket_latency->len + dbus_latency->len;
+    g_printerr("Replayed %u request(s) at %gx in %.1f s (%u dequeue(s), %u skipped, "
+               "%u incomplete)\n", completed, replay.speed, seconds, replay.dequeues,
+               replay.skipped, incomplete);
+    g_printerr("%-16s %7s %7s %9s %9s %9s %9s\n", "ms", "count", "failed", "p50", "p90", "p99",
+               "max");
+    if (socket_latency->len > 0)
+        print_row("socket latency", socket_latency, socket_failed);
+    if (dbus_latency->len > 0) {
+        print_row("D-Bus queueing", dbus_queueing, 0);
+        print_row("D-Bus latency", dbus_latency, dbus_failed);
+    }
+    if (seconds > 0.0)
+        g_printerr("Throughput: %.1f request(s)/s, %.1f thumbnail(s)/s\n", completed / seconds,
+                   thumbnails / seconds);
+
+    /* A replayer that cannot keep up distorts everything above */
+    g_array_sort(lag, compare_gint64);
+    if (percentile_ms(lag, 0.99) > 10.0)
+        g_printerr("Warning: p99 send lag of %.1f ms behind the trace; lower --speed or "
+                   "raise --concurrency\n", percentile_ms(lag, 0.99));
+
+    g_array_unref(socket_latency);
+    g_array_unref(dbus_queueing);
+    g_array_unref(dbus_latency);
+    g_array_unref(lag);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Main                                                              */
+/* ------------------------------------------------------------------ */
+
+static void
+print_usage(const char *progname)
+{
+    g_print("Usage: %s [OPTIONS] <TRACE>\n", progname);
+    g_print("\n");
+    g_print("Replay a request trace recorded with 'appimage-thumbnailer --record=FILE'\n");
+    g_print("against a running service and report queueing delay, throughput and\n");
+    g_print("tail latency.\n");
+    g_print("\n");
+    g_print("Options:\n");
+    g_print("  -h, --help        Print this help message and exit\n");
+    g_print("  --socket=SOCKET   Replay socket requests against SOCKET (\"@name\" for\n");
+    g_print("                    an abstract socket); skipped otherwise\n");
+    g_print("  --dbus            Replay D-Bus Queue/Dequeue calls on the session bus\n");
+    g_print("  --corpus=DIR      Map recorded paths onto the files in DIR (default:\n");
+    g_print("                    replay the recorded paths)\n");
+    g_print("  --speed=N         Replay N times faster than recorded (default: 1)\n");
+    g_print("  --concurrency=N   Socket client threads (default: %d)\n", DEFAULT_CONCURRENCY);
+    g_print("  --timeout=SECONDS Wait at most SECONDS for outstanding requests after\n");
+    g_print("                    the last one was sent (default: %d)\n", DEFAULT_DRAIN_SECONDS);
+}
+
+static gint
+compare_records(gconstpointer a, gconstpointer b)
+{
+    const ThumbnailRecord *x = *(const ThumbnailRecord *const *)a;
+    const ThumbnailRecord *y = *(const ThumbnailRecord *const *)b;
+    if (x->session != y->session)
+        return x->session < y->session ? -1 : 1;
+    return x->time_usec < y->time_usec ? -1 : (x->time_usec > y->time_usec);
+}
+
+static guint
+parse_count_argument(const char *value)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long n = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || n == 0 || n > G_MAXUINT) {
+        g_printerr("Invalid count: %s\n", value);
+        exit(EXIT_FAILURE);
+    }
+    return (guint)n;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *trace_path = NULL;
+    const char *corpus_path = NULL;
+    gboolean dbus = FALSE;
+    guint concurrency = DEFAULT_CONCURRENCY;
+
+    replay.speed = 1.0;
+    replay.drain_seconds = DEFAULT_DRAIN_SECONDS;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            print_usage(argv[0]);
+            return EXIT_SUCCESS;
+        } else if (g_str_has_prefix(arg, "--socket=")) {
+            replay.socket_path = arg + strlen("--socket=");
+        } else if (strcmp(arg, "--dbus") == 0) {
+            dbus = TRUE;
+        } else if (g_str_has_prefix(arg, "--corpus=")) {
+            corpus_path = arg + strlen("--corpus=");
+        } else if (g_str_has_prefix(arg, "--speed=")) {
+            replay.speed = g_ascii_strtod(arg + strlen("--speed="), NULL);
+            if (!(replay.speed > 0.0)) {
+                g_printerr("Invalid speed: %s\n", arg + strlen("--speed="));
+                return EXIT_FAILURE;
+            }
+        } else if (g_str_has_prefix(arg, "--concurrency=")) {
+            concurrency = parse_count_argument(arg + strlen("--concurrency="));
+        } else if (g_str_has_prefix(arg, "--timeout=")) {
+            replay.drain_seconds = parse_count_argument(arg + strlen("--timeout="));
+        } else if (arg[0] != '-' && !trace_path) {
+            trace_path = arg;
+        } else {
+            g_printerr("Unknown option: %s\n", arg);
+            g_printerr("Try '%s --help' for more information.\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!trace_path || (!replay.socket_path && !dbus)) {
+        g_printerr("Usage: %s [--socket=SOCKET] [--dbus] [OPTIONS] <TRACE>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (corpus_path && !load_corpus(corpus_path))
+        return EXIT_FAILURE;
+
+    GError *error = NULL;
+    replay.records = thumbnail_recorder_load(trace_path, &error);
+    if (!replay.records) {
+        g_printerr("Cannot read trace: %s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if (replay.records->len == 0) {
+        g_printerr("Trace '%s' holds no requests\n", trace_path);
+        return EXIT_FAILURE;
+    }
+
+    if (dbus) {
+        replay.bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+        if (!replay.bus) {
+            g_printerr("Cannot connect to the session bus: %s\n", error->message);
+            g_error_free(error);
+            return EXIT_FAILURE;
+        }
+        g_dbus_connection_signal_subscribe(replay.bus, THUMBNAIL_DBUS_NAME,
+                                           THUMBNAIL_DBUS_INTERFACE, NULL, THUMBNAIL_DBUS_PATH,
+                                           NULL, G_DBUS_SIGNAL_FLAGS_NONE, on_signal, NULL, NULL);
+    }
+    if (replay.socket_path)
+        replay.pool = g_thread_pool_new(run_socket_request, NULL, (gint)concurrency, FALSE, NULL);
+
+    replay.by_recorded_handle = g_hash_table_new(g_direct_hash, g_direct_equal);
+    replay.by_live_handle = g_hash_table_new(g_direct_hash, g_direct_equal);
+    replay.loop = g_main_loop_new(NULL, FALSE);
+
+    /* Records from forked workers may interleave slightly out of order */
+    g_ptr_array_sort(replay.records, compare_records);
+    replay.n_requests = replay.records->len;
+    replay.requests = g_new0(ReplayRequest, replay.n_requests);
+    /* Sessions (service restarts) are paced from their own first record
+     * and replayed back to back, without the downtime between them */
+    const ThumbnailRecord *head = replay.records->pdata[0];
+    guint session = head->session;
+    gint64 session_first = head->time_usec;
+    gint64 session_last = head->time_usec;
+    gint64 elapsed = 0; /* recorded time of the sessions before */
+    replay.start = g_get_monotonic_time();
+    for (guint i = 0; i < replay.n_requests; ++i) {
+        ReplayRequest *req = &replay.requests[i];
+        req->record = replay.records->pdata[i];
+        if (req->record->session != session) {
+            elapsed += session_last - session_first;
+            session = req->record->session;
+            session_first = req->record->time_usec;
+        }
+        session_last = req->record->time_usec;
+        req->due = replay.start
+                   + (gint64)((elapsed + req->record->time_usec - session_first) / replay.speed);
+    }
+
+    g_idle_add(dispatch_due, NULL);
+    g_main_loop_run(replay.loop);
+
+    /* Requests not yet picked up by a client thread stay incomplete */
+    if (replay.pool)
+        g_thread_pool_free(replay.pool, TRUE, TRUE);
+    /* Completions of the last socket requests are still queued as idles */
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    report();
+
+    g_main_loop_unref(replay.loop);
+    g_hash_table_unref(replay.by_live_handle);
+    g_hash_table_unref(replay.by_recorded_handle);
+    g_clear_object(&replay.bus);
+    g_free(replay.requests);
+    g_ptr_array_unref(replay.records);
+    g_strfreev(replay.corpus);
+    return EXIT_SUCCESS;
+}
@@ -2,432 +2,501 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include <cairo.h>
-#include <gio/gio.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <glib.h>
 #include <glib/gstdio.h>
-#include <librsvg/rsvg.h>
 
+#include "appimage-reader.h"
 #include "appimage-type.h"
 #include "dwarfs-extract.h"
 #include "squashfs-extract.h"
+#include "thumbnail-cache.h"
+#include "thumbnail-dbus.h"
+#include "thumbnail-mipcache.h"
+#include "thumbnail-pipeline.h"
+#include "thumbnail-server.h"
+#include "thumbnail-trace.h"
+#include "thumbnail-usdt.h"
+#include "thumbnail-xattr.h"
+#include "thumbnail-zygote.h"
 
 #define DEFAULT_THUMBNAIL_SIZE 256
-#define MAX_SYMLINK_DEPTH 5
-#define POINTER_TEXT_LIMIT 1024
+
+/* EX_TEMPFAIL: the AppImage is still being written, retry once it changes */
+#define EXIT_INCOMPLETE 75
 
 #ifndef APPIMAGE_THUMBNAILER_VERSION
 #define APPIMAGE_THUMBNAILER_VERSION "unknown"
 #endif
 
-#ifndef MIN
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#endif
-
-#ifndef MAX
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#endif
-
 /* ------------------------------------------------------------------ */
-/*  Entry extraction dispatch (SquashFS via unsquashfs / DwarFS)       */
+/*  CLI helpers                                                        */
 /* ------------------------------------------------------------------ */
 
-static gboolean
-extract_entry(const char *archive, const char *entry,
-              AppImageFormat format, off_t offset, GByteArray **output)
+static char *
+canonicalize_path(const char *path)
 {
-    if (!archive || !entry || *entry == '\0')
-        return FALSE;
+    /* URIs are opened through GIO as given */
+    if (appimage_reader_is_uri(path))
+        return g_strdup(path);
 
-    g_debug("extract_entry: trying '%s' from '%s' (format=%s, offset=%" G_GINT64_FORMAT ")",
-            entry, archive, appimage_format_name(format), (gint64)offset);
+    char *resolved = realpath(path, NULL);
+    if (resolved)
+        return resolved;
+    return g_canonicalize_filename(path, NULL);
+}
 
-    /* Try SquashFS extraction unless format is definitely DwarFS */
-    if (format != APPIMAGE_FORMAT_DWARFS && squashfs_tools_available() && offset > 0) {
-        if (squashfs_extract_entry(archive, entry, offset, output)) {
-            g_debug("extract_entry: unsquashfs succeeded for '%s'", entry);
-            return TRUE;
-        }
-        g_debug("extract_entry: unsquashfs failed for '%s'", entry);
-    }
+static int
+parse_size_argument(const char *arg)
+{
+    if (!arg)
+        return DEFAULT_THUMBNAIL_SIZE;
+    char *endptr = NULL;
+    long value = strtol(arg, &endptr, 10);
+    if (endptr == arg || value <= 0 || value > 4096)
+        return DEFAULT_THUMBNAIL_SIZE;
+    return (int)value;
+}
 
-    /* Try DwarFS extraction unless format is definitely SquashFS */
-    if (format != APPIMAGE_FORMAT_SQUASHFS && dwarfs_tools_available()) {
-        if (dwarfs_extract_entry(archive, entry, output)) {
-            g_debug("extract_entry: dwarfsextract succeeded for '%s'", entry);
-            return TRUE;
+static guint
+parse_count_argument(const char *arg)
+{
+    char *endptr = NULL;
+    long value = strtol(arg, &endptr, 10);
+    if (endptr == arg || value < 0)
+        return 0;
+    return (guint)MIN(value, (long)G_MAXINT);
+}
+
+/* Comma-separated --trace options; -1 if one is unknown */
+static int
+parse_trace_flags(const char *list)
+{
+    int flags = 0;
+    gchar **names = g_strsplit(list, ",", -1);
+    for (gchar **name = names; *name && flags >= 0; ++name) {
+        if (strcmp(*name, "counters") == 0) {
+            flags |= THUMBNAIL_TRACE_COUNTERS;
+        } else if (strcmp(*name, "alloc") == 0) {
+#ifdef HAVE_ALLOC_ACCOUNTING
+            flags |= THUMBNAIL_TRACE_ALLOC;
+#else
+            g_printerr("Allocation accounting needs a build with -Dalloc_accounting=true\n");
+#endif
+        } else {
+            flags = -1;
         }
-        g_debug("extract_entry: dwarfsextract failed for '%s'", entry);
     }
-
-    g_debug("extract_entry: all extraction methods failed for '%s'", entry);
-    return FALSE;
+    g_strfreev(names);
+    return flags;
 }
 
-/* ------------------------------------------------------------------ */
-/*  Symlink / pointer detection                                       */
-/* ------------------------------------------------------------------ */
+static void
+print_usage(const char *progname)
+{
+    g_print("Usage: %s [OPTIONS] <APPIMAGE> <OUTPUT> [SIZE]\n", progname);
+    g_print("       %s --serve [SOCKET] [--dbus] [SERVICE OPTIONS]\n", progname);
+    g_print("       %s [OPTIONS] --populate-shared <APPIMAGE>...\n", progname);
+    g_print("       %s [OPTIONS] --compare-backends <APPIMAGE>...\n", progname);
+    g_print("\n");
+    g_print("Extract the embedded icon from an AppImage and write it as a PNG thumbnail.\n");
+    g_print("Uses unsquashfs for SquashFS-based AppImages and bundled DwarFS tools for\n");
+    g_print("DwarFS-based AppImages.\n");
+    g_print("\n");
+    g_print("Arguments:\n");
+    g_print("  <APPIMAGE>        Path to the AppImage file, or a URI GIO can open\n");
+    g_print("                    (sftp://, smb://, ...); SquashFS only for URIs\n");
+    g_print("  <OUTPUT>          Path to the output PNG thumbnail\n");
+    g_print("  [SIZE]            Thumbnail size in pixels (default: 256, range: 1-4096)\n");
+    g_print("\n");
+    g_print("Options:\n");
+    g_print("  -h, --help        Print this help message and exit\n");
+    g_print("  -V, --version     Print version information and exit\n");
+    g_print("  --fast            Favour speed: nearest-neighbour scaling, light PNG\n");
+    g_print("                    compression, fast SVG antialiasing\n");
+    g_print("  --balanced        Bilinear scaling, default PNG compression (default)\n");
+    g_print("  --best            Favour quality: hyper scaling, maximum PNG compression,\n");
+    g_print("                    supersampled SVG rendering\n");
+    g_print("  --serve [SOCKET]  Run as a service on a unix socket (\"@name\" for an\n");
+    g_print("                    abstract socket); thumbnails are returned as sealed\n");
+    g_print("                    memfds holding a PNG or raw RGBA pixels.  Without\n");
+    g_print("                    SOCKET, a socket passed by systemd is used\n");
+    g_print("  --dbus            Serve the " THUMBNAIL_DBUS_NAME " D-Bus interface,\n");
+    g_print("                    writing into the user's thumbnail cache\n");
+    g_print("  --idle-timeout=SECONDS\n");
+    g_print("                    Exit after SECONDS without requests (default: never)\n");
+    g_print("  --workers=N       Render in N isolated worker processes forked from a\n");
+    g_print("                    pre-initialized zygote (default: %d; 0 renders in the\n",
+            THUMBNAIL_ZYGOTE_DEFAULT_WORKERS);
+    g_print("                    service process, one request at a time)\n");
+    g_print("  --worker-jobs=N   Requests a worker serves before it is replaced\n");
+    g_print("                    (default: %d)\n", THUMBNAIL_ZYGOTE_DEFAULT_JOBS_PER_WORKER);
+    g_print("  --refine          Re-render thumbnails that were degraded to meet a\n");
+    g_print("                    foreground deadline at --best quality in the background\n");
+    g_print("  --progressive     Cache and announce a quick preview of expensive icons\n");
+    g_print("                    (large SVGs, huge rasters) before the full thumbnail\n");
+    g_print("  --disk-order      Process the URIs of background D-Bus jobs in on-disk\n");
+    g_print("                    order (for bulk runs on rotational disks)\n");
+    g_print("  --record=FILE     Append a trace of incoming socket and D-Bus requests\n");
+    g_print("                    to FILE, for appimage-thumbnailer-replay\n");
+    g_print("  --backend=NAME    Extract with one backend only: reader (in-process\n");
+    g_print("                    SquashFS), unsquashfs or dwarfsextract (default: auto)\n");
+    g_print("  --compare-backends <APPIMAGE>...\n");
+    g_print("                    Extract each AppImage's icon with every available\n");
+    g_print("                    backend, check that the bytes agree and report\n");
+    g_print("                    latency and CPU time per backend\n");
+    g_print("  --populate-shared <APPIMAGE>...\n");
+    g_print("                    Write normal and large thumbnails into the shared\n");
+    g_print("                    repository (.sh_thumbnails/) next to each AppImage,\n");
+    g_print("                    which the thumbnailer checks before extracting.\n");
+    g_print("                    Takes the remaining arguments as AppImages\n");
+    g_print("  --trace[=counters,alloc]\n");
+    g_print("                    Print time and memory per pipeline stage (probe,\n");
+    g_print("                    extract, classify, decode, scale, encode) to stderr,\n");
+    g_print("                    with the peak RSS of extractor children; counters adds\n");
+    g_print("                    cycles, instructions, cache and branch misses\n");
+    g_print("                    (perf_event_open, including children); alloc adds\n");
+    g_print("                    allocation counts and bytes (-Dalloc_accounting builds)\n");
+    g_print("  --mip-cache       Keep decoded icons as mip pyramids in the user's cache,\n");
+    g_print("                    shared by all processes, so other sizes of the same\n");
+    g_print("                    icon are resampled instead of decoded again\n");
+    g_print("  --xattr-cache     Also keep a compact thumbnail in the AppImage's\n");
+    g_print("                    " THUMBNAIL_XATTR_NAME " xattr, so it survives\n");
+    g_print("                    moves and renames; checked before extracting\n");
+    g_print("\n");
+    g_print("Exit status:\n");
+    g_print("  0 on success, 1 on failure, %d if the AppImage is truncated (still\n", EXIT_INCOMPLETE);
+    g_print("  downloading); retry once the file has changed\n");
+    g_print("\n");
+    g_print("Examples:\n");
+    g_print("  %s app.AppImage thumbnail.png\n", progname);
+    g_print("  %s app.AppImage thumbnail.png 128\n", progname);
+    g_print("\n");
+    g_print("Conforms to the freedesktop.org thumbnail specification:\n");
+    g_print("  <https://specifications.freedesktop.org/thumbnail-spec/latest>\n");
+    g_print("\n");
+    g_print("License:\n");
+    g_print("  MIT License\n");
+    g_print("  Copyright (c) Arnis Kemlers\n");
+    g_print("  <https://github.com/kem-a/appimage-thumbnailer>\n");
+    g_print("\n");
+    g_print("Third-party components:\n");
+    g_print("  Includes prebuilt DwarFS binaries from <https://github.com/mhx/dwarfs>\n");
+    g_print("  DwarFS is distributed under the MIT and GPL-3.0 licenses.\n");
+    g_print("  Uses unsquashfs from squashfs-tools <https://github.com/plougher/squashfs-tools>\n");
+    g_print("  squashfs-tools is distributed under the GPL-2.0 license.\n");
+}
 
-static gboolean
-is_pointer_candidate(const guchar *data, gsize len, gchar **pointer_out)
+static void
+print_version(void)
 {
-    if (!data || len == 0 || len > POINTER_TEXT_LIMIT)
-        return FALSE;
+    g_print("appimage-thumbnailer %s\n", APPIMAGE_THUMBNAILER_VERSION);
+    g_print("Copyright (c) Arnis Kemlers\n");
+    g_print("License: MIT\n");
+}
 
-    for (gsize i = 0; i < len; ++i) {
-        if (data[i] == '\0')
-            return FALSE;
-        if (!g_ascii_isprint(data[i]) && !g_ascii_isspace(data[i]))
-            return FALSE;
-    }
+/* ------------------------------------------------------------------ */
+/*  Thumbnail generation                                              */
+/* ------------------------------------------------------------------ */
 
-    gchar *text = g_strndup((const gchar *)data, (gssize)len);
-    gchar *trimmed = g_strstrip(text);
-    if (*trimmed == '\0') {
-        g_free(text);
-        return FALSE;
-    }
+/* Flavors an admin job writes into a shared repository */
+static const char *const SHARED_FLAVORS[] = { "normal", "large" };
 
-    for (const gchar *c = trimmed; *c != '\0'; ++c) {
-        if (*c == '/' || *c == '.' || *c == '-' || *c == '_' || g_ascii_isalnum(*c))
-            continue;
-        g_free(text);
-        return FALSE;
+/* A thumbnail that is already available without extracting: from the
+ * shared repository next to the file (when @size is a flavor size), or
+ * from the file's own xattr */
+static GdkPixbuf *
+load_stored_thumbnail(const char *input, int size)
+{
+    const char *flavor = thumbnail_cache_flavor_for_size(size);
+    GStatBuf st;
+    if (flavor && thumbnail_cache_flavor_size(flavor) == size
+        && !appimage_reader_is_uri(input) && g_stat(input, &st) == 0) {
+        GdkPixbuf *shared = thumbnail_cache_load_shared(input, (gint64)st.st_mtime, flavor);
+        if (shared)
+            return shared;
     }
-
-    if (pointer_out)
-        *pointer_out = g_strdup(trimmed);
-
-    g_debug("is_pointer_candidate: detected pointer/symlink target '%s'", trimmed);
-    g_free(text);
-    return TRUE;
+    return thumbnail_xattr_load(input, size);
 }
 
-/* ------------------------------------------------------------------ */
-/*  Image processing (SVG / raster)                                   */
-/* ------------------------------------------------------------------ */
-
 static gboolean
-payload_is_svg(const guchar *data, gsize len)
+generate_thumbnail(const char *input, const char *output, int size,
+                   AppImageFormat format, off_t offset)
 {
-    if (!data || len == 0)
+    GdkPixbuf *stored = load_stored_thumbnail(input, size);
+    if (stored) {
+        gboolean ok = thumbnail_pipeline_save_png(stored, output);
+        g_object_unref(stored);
+        return ok;
+    }
+
+    /* Extract .DirIcon (required by AppImage spec) */
+    g_debug("generate_thumbnail: trying %s", THUMBNAIL_ICON_ENTRY);
+    GBytes *payload = thumbnail_pipeline_extract_icon(input, THUMBNAIL_ICON_ENTRY,
+                                                      format, offset);
+    if (!payload)
         return FALSE;
 
-    gboolean uncertain = FALSE;
-    gchar *mime = g_content_type_guess(NULL, data, len, &uncertain);
-    gboolean is_svg = mime && g_content_type_is_a(mime, "image/svg+xml");
-    g_debug("payload_is_svg: content-type guess '%s' (uncertain=%d, is_svg=%d)",
-            mime ? mime : "(null)", uncertain, is_svg);
-    g_free(mime);
-    if (is_svg)
-        return TRUE;
+    gsize len = 0;
+    const guchar *data = g_bytes_get_data(payload, &len);
+    GdkPixbuf *pixbuf = thumbnail_pipeline_render(data, len, size);
+    g_bytes_unref(payload);
+    if (!pixbuf)
+        return FALSE;
 
-    const gsize probe = MIN(len, (gsize)1024);
-    gchar *lower = g_ascii_strdown((const gchar *)data, (gssize)probe);
-    gboolean found = lower && g_strstr_len(lower, (gssize)probe, "<svg") != NULL;
-    g_free(lower);
-    g_debug("payload_is_svg: <svg> tag probe result: %s", found ? "found" : "not found");
-    return found;
+    gboolean ok = thumbnail_pipeline_save_png(pixbuf, output);
+    if (ok)
+        thumbnail_xattr_store(input, pixbuf);
+    g_object_unref(pixbuf);
+    return ok;
 }
 
+/* Render one AppImage into the shared repository next to it, skipping
+ * flavors that are already current; the icon is extracted once */
 static gboolean
-process_svg_payload(const guchar *data, gsize len, const char *out_path, int size)
+populate_shared(const char *file)
 {
-    g_debug("process_svg_payload: %" G_GSIZE_FORMAT " bytes, target %d, output '%s'",
-            len, size, out_path);
-
-    GError *error = NULL;
-    RsvgHandle *handle = rsvg_handle_new_from_data(data, len, &error);
-    if (!handle) {
-        g_debug("process_svg_payload: parse failed: %s", error ? error->message : "unknown");
-        g_printerr("Failed to parse SVG icon: %s\n", error ? error->message : "unknown");
-        if (error)
-            g_error_free(error);
+    if (appimage_reader_is_uri(file)) {
+        g_printerr("%s: shared repositories need a local path\n", file);
         return FALSE;
     }
 
-    RsvgDimensionData dim;
-    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
-    rsvg_handle_get_dimensions(handle, &dim);
-    G_GNUC_END_IGNORE_DEPRECATIONS
-
-    double width  = dim.width  > 0 ? dim.width  : size;
-    double height = dim.height > 0 ? dim.height : size;
-    if (width  <= 0) width  = size;
-    if (height <= 0) height = size;
-
-    double scale = MIN((double)size / width, (double)size / height);
-    if (!isfinite(scale) || scale <= 0)
-        scale = (double)size / MAX(width, height);
-    if (!isfinite(scale) || scale <= 0)
-        scale = 1.0;
-
-    const double scaled_w = width * scale;
-    const double scaled_h = height * scale;
-    const int target_w = size;
-    const int target_h = size;
-
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, target_w, target_h);
-    cairo_t *cr = cairo_create(surface);
-
-    cairo_save(cr);
-    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-    cairo_paint(cr);
-    cairo_restore(cr);
-
-    const double translate_x = (target_w - scaled_w) / 2.0;
-    const double translate_y = (target_h - scaled_h) / 2.0;
-    cairo_translate(cr, translate_x, translate_y);
-    cairo_scale(cr, scale, scale);
-
-    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
-    gboolean render_ok = rsvg_handle_render_cairo(handle, cr);
-    G_GNUC_END_IGNORE_DEPRECATIONS
-    cairo_destroy(cr);
-
-    if (!render_ok || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-        g_printerr("Failed to render SVG icon\n");
-        cairo_surface_destroy(surface);
-        g_object_unref(handle);
+    char *path = canonicalize_path(file);
+    GStatBuf st;
+    if (g_stat(path, &st) < 0) {
+        g_printerr("%s: %s\n", file, g_strerror(errno));
+        g_free(path);
         return FALSE;
     }
-
-    cairo_status_t status = cairo_surface_write_to_png(surface, out_path);
-    cairo_surface_destroy(surface);
-    g_object_unref(handle);
-
-    if (status != CAIRO_STATUS_SUCCESS) {
-        g_printerr("Failed to write SVG thumbnail: %s\n", cairo_status_to_string(status));
+    if (appimage_payload_truncated(path)) {
+        g_printerr("%s: AppImage is truncated (incomplete download?)\n", file);
+        g_free(path);
         return FALSE;
     }
 
-    g_debug("process_svg_payload: thumbnail written to '%s'", out_path);
-    return TRUE;
-}
+    const gint64 mtime = (gint64)st.st_mtime;
+    GBytes *payload = NULL;
+    gboolean ok = TRUE;
+    thumbnail_usdt_job_begin(0, path);
 
-static GdkPixbuf *
-scale_pixbuf(GdkPixbuf *pixbuf, int size)
-{
-    const int width  = gdk_pixbuf_get_width(pixbuf);
-    const int height = gdk_pixbuf_get_height(pixbuf);
-
-    if (width <= 0 || height <= 0)
-        return NULL;
-
-    double scale = MIN((double)size / (double)width, (double)size / (double)height);
-    if (!isfinite(scale) || scale <= 0)
-        scale = 1.0;
+    for (gsize i = 0; ok && i < G_N_ELEMENTS(SHARED_FLAVORS); ++i) {
+        GdkPixbuf *current = thumbnail_cache_load_shared(path, mtime, SHARED_FLAVORS[i]);
+        if (current) {
+            g_object_unref(current);
+            continue;
+        }
 
-    int target_w = MAX(1, (int)lround(width * scale));
-    int target_h = MAX(1, (int)lround(height * scale));
-    target_w = MIN(target_w, size);
-    target_h = MIN(target_h, size);
+        if (!payload)
+            payload = thumbnail_pipeline_load_icon(path);
+        if (!payload) {
+            ok = FALSE;
+            break;
+        }
 
-    if (target_w == width && target_h == height) {
-        g_object_ref(pixbuf);
-        return pixbuf;
+        gsize len = 0;
+        const guchar *data = g_bytes_get_data(payload, &len);
+        GdkPixbuf *pixbuf = thumbnail_pipeline_render(data, len,
+                                                      thumbnail_cache_flavor_size(SHARED_FLAVORS[i]));
+        ok = pixbuf && thumbnail_cache_save_shared(pixbuf, path, mtime, SHARED_FLAVORS[i]);
+        if (pixbuf)
+            g_object_unref(pixbuf);
     }
 
-    return gdk_pixbuf_scale_simple(pixbuf, target_w, target_h, GDK_INTERP_BILINEAR);
+    thumbnail_usdt_job_end(ok ? 0 : 1);
+    if (!ok)
+        g_printerr("%s: failed to write shared thumbnails\n", file);
+    if (payload)
+        g_bytes_unref(payload);
+    g_free(path);
+    return ok;
 }
 
 static gboolean
-process_icon_payload(const guchar *data, gsize len, const char *out_path, int size)
+check_tools_for_format(AppImageFormat format)
 {
-    g_debug("process_icon_payload: %" G_GSIZE_FORMAT " bytes, target size %d", len, size);
-
-    static gboolean empty_warned = FALSE;
-    if (!data || len == 0) {
-        if (!empty_warned) {
-            g_printerr("Icon payload is empty or missing\n");
-            empty_warned = TRUE;
-        }
-        return FALSE;
-    }
-
-    if (payload_is_svg(data, len)) {
-        g_debug("process_icon_payload: detected SVG, delegating");
-        if (process_svg_payload(data, len, out_path, size))
-            return TRUE;
-        g_debug("process_icon_payload: SVG failed, trying raster fallback");
-    }
+    gboolean have_squashfs = squashfs_tools_available();
+    gboolean have_dwarfs   = dwarfs_tools_available();
 
-    GError *error = NULL;
-    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    g_debug("check_tools_for_format: unsquashfs available: %s", have_squashfs ? "yes" : "no");
+    g_debug("check_tools_for_format: dwarfs tools available: %s", have_dwarfs  ? "yes" : "no");
 
-    if (!gdk_pixbuf_loader_write(loader, data, len, &error)) {
-        g_printerr("Failed to load image bytes: %s\n", error->message);
-        g_error_free(error);
-        g_object_unref(loader);
+    if (!have_squashfs && !have_dwarfs) {
+        g_printerr("Neither unsquashfs (squashfs-tools) nor dwarfs tools are available.\n");
+        g_printerr("Install squashfs-tools for SquashFS AppImages or dwarfs for DwarFS AppImages.\n");
         return FALSE;
     }
 
-    if (!gdk_pixbuf_loader_close(loader, &error)) {
-        g_printerr("Failed to finalize image decode: %s\n", error->message);
-        g_error_free(error);
-        g_object_unref(loader);
+    if (format == APPIMAGE_FORMAT_SQUASHFS && !have_squashfs) {
+        g_printerr("SquashFS AppImage detected but unsquashfs is not available.\n");
+        g_printerr("Install squashfs-tools to handle this AppImage.\n");
         return FALSE;
     }
 
-    GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
-    if (!pixbuf) {
-        g_printerr("Image loader returned NULL pixbuf\n");
-        g_object_unref(loader);
+    if (format == APPIMAGE_FORMAT_DWARFS && !have_dwarfs) {
+        g_printerr("DwarFS AppImage detected but dwarfs tools are not available.\n");
         return FALSE;
     }
 
-    g_object_ref(pixbuf);
-    g_object_unref(loader);
-
-    g_debug("process_icon_payload: loaded raster %dx%d",
-            gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf));
-
-    GdkPixbuf *scaled = scale_pixbuf(pixbuf, size);
-    if (!scaled)
-        scaled = g_object_ref(pixbuf);
-
-    gboolean ok = gdk_pixbuf_save(scaled, out_path, "png", &error, NULL);
-    if (!ok) {
-        g_printerr("Failed to write thumbnail: %s\n", error->message);
-        g_error_free(error);
-    } else {
-        g_debug("process_icon_payload: thumbnail written to '%s'", out_path);
-    }
-
-    g_object_unref(scaled);
-    g_object_unref(pixbuf);
-    return ok;
+    return TRUE;
 }
 
 /* ------------------------------------------------------------------ */
-/*  Symlink-following entry processor (up to MAX_SYMLINK_DEPTH)       */
+/*  Backend comparison                                                */
 /* ------------------------------------------------------------------ */
 
-static gboolean
-process_entry_following_symlinks(const char *archive, const char *entry,
-                                 const char *out_path, int size,
-                                 AppImageFormat format, off_t offset)
+/* Each backend extracts each file this often; the fastest run counts,
+ * so the first one (cold page cache) does not skew the comparison */
+#define COMPARE_ROUNDS 3
+
+/* The external tools are the reference the native reader is held to */
+static const ThumbnailBackend COMPARED_BACKENDS[] = {
+    THUMBNAIL_BACKEND_UNSQUASHFS,
+    THUMBNAIL_BACKEND_DWARFSEXTRACT,
+    THUMBNAIL_BACKEND_READER,
+};
+
+typedef struct {
+    guint  files;
+    guint  failed;
+    guint  mismatched;
+    gint64 best_usec;  /* sum over files of the fastest round */
+    gint64 cpu_usec;   /* user + system, this process and its children */
+    guint  runs;
+} BackendTotals;
+
+static gint64
+cpu_time_usec(void)
 {
-    if (!entry)
-        return FALSE;
+    gint64 total = 0;
+    const int who[] = { RUSAGE_SELF, RUSAGE_CHILDREN };
+    for (gsize i = 0; i < G_N_ELEMENTS(who); ++i) {
+        struct rusage usage;
+        if (getrusage(who[i], &usage) == 0)
+            total += (gint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+                     + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+    return total;
+}
 
-    g_debug("process_entry_following_symlinks: starting with '%s'", entry);
+/* Extract one file's icon with every backend that can read it and check
+ * that they agree; returns FALSE on a mismatch */
+static gboolean
+compare_file(const char *file, BackendTotals *totals)
+{
+    char *path = canonicalize_path(file);
+    off_t offset = 0;
+    AppImageFormat format = path ? appimage_locate_payload(path, &offset) : APPIMAGE_FORMAT_UNKNOWN;
+    if (!path || offset <= 0 || appimage_payload_truncated(path)) {
+        g_printerr("%s: not a complete AppImage, skipped\n", file);
+        g_free(path);
+        return TRUE;
+    }
 
-    gchar *current = g_strdup(entry);
-    for (int depth = 0; depth < MAX_SYMLINK_DEPTH && current != NULL; ++depth) {
-        g_debug("process_entry_following_symlinks: depth %d, trying '%s'", depth, current);
+    const gsize n = G_N_ELEMENTS(COMPARED_BACKENDS);
+    gchar *digest[G_N_ELEMENTS(COMPARED_BACKENDS)] = { NULL };
+    gint64 best[G_N_ELEMENTS(COMPARED_BACKENDS)];
+    gboolean usable[G_N_ELEMENTS(COMPARED_BACKENDS)];
+    for (gsize b = 0; b < n; ++b) {
+        best[b] = G_MAXINT64;
+        usable[b] = thumbnail_backend_available(COMPARED_BACKENDS[b], format)
+                    && (!appimage_reader_is_uri(path)
+                        || COMPARED_BACKENDS[b] == THUMBNAIL_BACKEND_READER);
+    }
 
-        GByteArray *payload = NULL;
-        if (!extract_entry(archive, current, format, offset, &payload)) {
-            g_debug("process_entry_following_symlinks: extraction failed for '%s' at depth %d",
-                    current, depth);
-            g_free(current);
-            return FALSE;
+    /* Rotating the order keeps caches warmed by one backend from always
+     * favouring the next */
+    for (int round = 0; round < COMPARE_ROUNDS; ++round) {
+        for (gsize i = 0; i < n; ++i) {
+            const gsize b = (i + (gsize)round) % n;
+            if (!usable[b])
+                continue;
+
+            thumbnail_pipeline_set_backend(COMPARED_BACKENDS[b]);
+            const gint64 cpu_start = cpu_time_usec();
+            const gint64 start = g_get_monotonic_time();
+            GBytes *payload = thumbnail_pipeline_extract_icon(path, THUMBNAIL_ICON_ENTRY,
+                                                              format, offset);
+            const gint64 elapsed = g_get_monotonic_time() - start;
+            totals[b].cpu_usec += cpu_time_usec() - cpu_start;
+            totals[b].runs++;
+
+            if (!payload) {
+                usable[b] = FALSE;
+                g_clear_pointer(&digest[b], g_free);
+                continue;
+            }
+            best[b] = MIN(best[b], elapsed);
+            if (!digest[b])
+                digest[b] = g_compute_checksum_for_bytes(G_CHECKSUM_SHA256, payload);
+            g_bytes_unref(payload);
         }
-
-        gchar *next = NULL;
-        if (is_pointer_candidate(payload->data, payload->len, &next)) {
-            g_debug("process_entry_following_symlinks: '%s' -> '%s' (depth %d)",
-                    current, next, depth);
-            g_byte_array_unref(payload);
-            g_free(current);
-            current = next;
+    }
+    thumbnail_pipeline_set_backend(THUMBNAIL_BACKEND_AUTO);
+
+    GString *line = g_string_new(NULL);
+    g_string_printf(line, "%s (%s):", file, appimage_format_name(format));
+    const gchar *reference = NULL;
+    gboolean agree = TRUE;
+    for (gsize b = 0; b < n; ++b) {
+        if (!thumbnail_backend_available(COMPARED_BACKENDS[b], format))
+            continue;
+        totals[b].files++;
+        if (!digest[b]) {
+            totals[b].failed++;
+            g_string_append_printf(line, " %s failed", thumbnail_backend_name(COMPARED_BACKENDS[b]));
             continue;
         }
 
-        g_debug("process_entry_following_symlinks: '%s' is data (%u bytes), processing",
-                current, payload->len);
-        gboolean ok = process_icon_payload(payload->data, payload->len, out_path, size);
-        g_byte_array_unref(payload);
-        g_free(current);
-        g_free(next);
-        return ok;
+        totals[b].best_usec += best[b];
+        g_string_append_printf(line, " %s %.1f ms", thumbnail_backend_name(COMPARED_BACKENDS[b]),
+                               best[b] / 1000.0);
+        if (!reference) {
+            reference = digest[b];
+        } else if (strcmp(reference, digest[b]) != 0) {
+            totals[b].mismatched++;
+            agree = FALSE;
+            g_string_append(line, " (MISMATCH)");
+        }
     }
+    g_printerr("%s\n", line->str);
 
-    g_debug("process_entry_following_symlinks: exceeded max depth (%d) for '%s'",
-            MAX_SYMLINK_DEPTH, entry);
-    g_free(current);
-    return FALSE;
+    g_string_free(line, TRUE);
+    for (gsize b = 0; b < n; ++b)
+        g_free(digest[b]);
+    g_free(path);
+    return agree;
 }
 
-/* ------------------------------------------------------------------ */
-/*  CLI helpers                                                        */
-/* ------------------------------------------------------------------ */
-
-static char *
-canonicalize_path(const char *path)
-{
-    char *resolved = realpath(path, NULL);
-    if (resolved)
-        return resolved;
-    return g_canonicalize_filename(path, NULL);
-}
-
-static int
-parse_size_argument(const char *arg)
-{
-    if (!arg)
-        return DEFAULT_THUMBNAIL_SIZE;
-    char *endptr = NULL;
-    long value = strtol(arg, &endptr, 10);
-    if (endptr == arg || value <= 0 || value > 4096)
-        return DEFAULT_THUMBNAIL_SIZE;
-    return (int)value;
-}
-
-static void
-print_usage(const char *progname)
-{
-    g_print("Usage: %s [OPTIONS] <APPIMAGE> <OUTPUT> [SIZE]\n", progname);
-    g_print("\n");
-    g_print("Extract the embedded icon from an AppImage and write it as a PNG thumbnail.\n");
-    g_print("Uses unsquashfs for SquashFS-based AppImages and bundled DwarFS tools for\n");
-    g_print("DwarFS-based AppImages.\n");
-    g_print("\n");
-    g_print("Arguments:\n");
-    g_print("  <APPIMAGE>        Path to the AppImage file\n");
-    g_print("  <OUTPUT>          Path to the output PNG thumbnail\n");
-    g_print("  [SIZE]            Thumbnail size in pixels (default: 256, range: 1-4096)\n");
-    g_print("\n");
-    g_print("Options:\n");
-    g_print("  -h, --help        Print this help message and exit\n");
-    g_print("  -V, --version     Print version information and exit\n");
-    g_print("\n");
-    g_print("Examples:\n");
-    g_print("  %s app.AppImage thumbnail.png\n", progname);
-    g_print("  %s app.AppImage thumbnail.png 128\n", progname);
-    g_print("\n");
-    g_print("Conforms to the freedesktop.org thumbnail specification:\n");
-    g_print("  <https://specifications.freedesktop.org/thumbnail-spec/latest>\n");
-    g_print("\n");
-    g_print("License:\n");
-    g_print("  MIT License\n");
-    g_print("  Copyright (c) Arnis Kemlers\n");
-    g_print("  <https://github.com/kem-a/appimage-thumbnailer>\n");
-    g_print("\n");
-    g_print("Third-party components:\n");
-    g_print("  Includes prebuilt DwarFS binaries from <https://github.com/mhx/dwarfs>\n");
-    g_print("  DwarFS is distributed under the MIT and GPL-3.0 licenses.\n");
-    g_print("  Uses unsquashfs from squashfs-tools <https://github.com/plougher/squashfs-tools>\n");
-    g_print("  squashfs-tools is distributed under the GPL-2.0 license.\n");
-}
-
-static void
-print_version(void)
+static gboolean
+compare_backends(char **files)
 {
-    g_print("appimage-thumbnailer %s\n", APPIMAGE_THUMBNAILER_VERSION);
-    g_print("Copyright (c) Arnis Kemlers\n");
-    g_print("License: MIT\n");
+    BackendTotals totals[G_N_ELEMENTS(COMPARED_BACKENDS)] = { { 0 } };
+    gboolean agree = TRUE;
+    for (char **file = files; *file; ++file)
+        agree &= compare_file(*file, totals);
+
+    g_printerr("\n%-14s %6s %7s %9s %14s %14s\n", "backend", "files", "failed", "mismatch",
+               "best ms (sum)", "cpu ms / run");
+    for (gsize b = 0; b < G_N_ELEMENTS(COMPARED_BACKENDS); ++b) {
+        if (totals[b].files == 0)
+            continue;
+        g_printerr("%-14s %6u %7u %9u %14.1f %14.2f\n",
+                   thumbnail_backend_name(COMPARED_BACKENDS[b]), totals[b].files,
+                   totals[b].failed, totals[b].mismatched, totals[b].best_usec / 1000.0,
+                   totals[b].runs ? totals[b].cpu_usec / 1000.0 / totals[b].runs : 0.0);
+    }
+    if (!agree)
+        g_printerr("Backends disagree on some files, see MISMATCH above\n");
+    return agree;
 }
 
 /* ------------------------------------------------------------------ */
@@ -437,25 +506,137 @@ print_version(void)
 int
 main(int argc, char **argv)
 {
-    if (argc == 2) {
-        if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
+    ThumbnailServerOptions serve_options = { .workers = THUMBNAIL_ZYGOTE_DEFAULT_WORKERS };
+    gboolean serve = FALSE;
+    const char *positional[3] = {NULL, NULL, NULL};
+    int n_positional = 0;
+    gboolean options_done = FALSE;
+    char **shared_files = NULL;
+    char **compare_files = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (options_done || arg[0] != '-' || arg[1] == '\0') {
+            if (n_positional == G_N_ELEMENTS(positional)) {
+                g_printerr("Usage: %s <AppImage> <output.png> [size]\n", argv[0]);
+                return EXIT_FAILURE;
+            }
+            positional[n_positional++] = arg;
+        } else if (strcmp(arg, "--") == 0) {
+            options_done = TRUE;
+        } else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
             print_usage(argv[0]);
             return EXIT_SUCCESS;
-        }
-        if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-V") == 0) {
+        } else if (strcmp(arg, "--version") == 0 || strcmp(arg, "-V") == 0) {
             print_version();
             return EXIT_SUCCESS;
+        } else if (strcmp(arg, "--serve") == 0) {
+            serve = TRUE;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                serve_options.socket_path = argv[++i];
+        } else if (g_str_has_prefix(arg, "--serve=")) {
+            serve = TRUE;
+            serve_options.socket_path = arg + strlen("--serve=");
+        } else if (strcmp(arg, "--fast") == 0) {
+            thumbnail_pipeline_set_quality(THUMBNAIL_QUALITY_FAST);
+        } else if (strcmp(arg, "--balanced") == 0) {
+            thumbnail_pipeline_set_quality(THUMBNAIL_QUALITY_BALANCED);
+        } else if (strcmp(arg, "--best") == 0) {
+            thumbnail_pipeline_set_quality(THUMBNAIL_QUALITY_BEST);
+        } else if (strcmp(arg, "--refine") == 0) {
+            serve_options.refine = TRUE;
+        } else if (strcmp(arg, "--progressive") == 0) {
+            serve_options.progressive = TRUE;
+        } else if (strcmp(arg, "--disk-order") == 0) {
+            serve_options.disk_order = TRUE;
+        } else if (g_str_has_prefix(arg, "--record=")) {
+            serve_options.record_path = arg + strlen("--record=");
+        } else if (strcmp(arg, "--populate-shared") == 0) {
+            shared_files = argv + i + 1;
+            break;
+        } else if (strcmp(arg, "--compare-backends") == 0) {
+            compare_files = argv + i + 1;
+            break;
+        } else if (g_str_has_prefix(arg, "--backend=")) {
+            ThumbnailBackend backend;
+            if (!thumbnail_backend_from_name(arg + strlen("--backend="), &backend)) {
+                g_printerr("Unknown backend: %s\n", arg + strlen("--backend="));
+                return EXIT_FAILURE;
+            }
+            thumbnail_pipeline_set_backend(backend);
+        } else if (strcmp(arg, "--trace") == 0) {
+            thumbnail_trace_enable(0);
+        } else if (g_str_has_prefix(arg, "--trace=")) {
+            int flags = parse_trace_flags(arg + strlen("--trace="));
+            if (flags < 0) {
+                g_printerr("Invalid --trace value: %s\n", arg + strlen("--trace="));
+                return EXIT_FAILURE;
+            }
+            thumbnail_trace_enable((ThumbnailTraceFlags)flags);
+        } else if (strcmp(arg, "--mip-cache") == 0) {
+            thumbnail_mipcache_set_enabled(TRUE);
+        } else if (strcmp(arg, "--xattr-cache") == 0) {
+            thumbnail_xattr_set_enabled(TRUE);
+        } else if (strcmp(arg, "--dbus") == 0) {
+            serve = TRUE;
+            serve_options.dbus = TRUE;
+        } else if (g_str_has_prefix(arg, "--idle-timeout=")) {
+            serve_options.idle_timeout = parse_count_argument(arg + strlen("--idle-timeout="));
+        } else if (g_str_has_prefix(arg, "--workers=")) {
+            serve_options.workers = parse_count_argument(arg + strlen("--workers="));
+        } else if (g_str_has_prefix(arg, "--worker-jobs=")) {
+            serve_options.jobs_per_worker = parse_count_argument(arg + strlen("--worker-jobs="));
+        } else {
+            g_printerr("Unknown option: %s\n", arg);
+            g_printerr("Try '%s --help' for more information.\n", argv[0]);
+            return EXIT_FAILURE;
         }
     }
 
-    if (argc < 3 || argc > 4) {
+    if (compare_files) {
+        if (serve || n_positional != 0 || !*compare_files) {
+            g_printerr("Usage: %s [OPTIONS] --compare-backends <AppImage>...\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        const gboolean agree = compare_backends(compare_files);
+        thumbnail_trace_report();
+        return agree ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (shared_files) {
+        if (serve || n_positional != 0 || !*shared_files) {
+            g_printerr("Usage: %s [OPTIONS] --populate-shared <AppImage>...\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (!check_tools_for_format(APPIMAGE_FORMAT_UNKNOWN))
+            return EXIT_FAILURE;
+
+        gboolean all_ok = TRUE;
+        for (char **file = shared_files; *file; ++file)
+            all_ok &= populate_shared(*file);
+        thumbnail_trace_report();
+        return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (serve) {
+        if (n_positional != 0) {
+            g_printerr("--serve does not take an AppImage or output path\n");
+            return EXIT_FAILURE;
+        }
+        if (!check_tools_for_format(APPIMAGE_FORMAT_UNKNOWN))
+            return EXIT_FAILURE;
+        return thumbnail_server_run(&serve_options);
+    }
+
+    if (n_positional < 2) {
         g_printerr("Usage: %s <AppImage> <output.png> [size]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     /* Detect AppImage format and payload offset */
-    char *input  = canonicalize_path(argv[1]);
-    char *output = g_canonicalize_filename(argv[2], NULL);
+    char *input  = canonicalize_path(positional[0]);
+    char *output = g_canonicalize_filename(positional[1], NULL);
     if (!input || !output) {
         g_printerr("Failed to resolve paths\n");
         g_free(input);
@@ -463,48 +644,52 @@ main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
-    const int size = parse_size_argument(argc == 4 ? argv[3] : NULL);
+    const int size = parse_size_argument(positional[2]);
 
-    AppImageFormat format = appimage_detect_format(input);
-    off_t offset = appimage_payload_offset(input);
+    thumbnail_usdt_job_begin(size, input);
+    thumbnail_trace_begin(THUMBNAIL_STAGE_PROBE);
+    off_t offset;
+    AppImageFormat format = appimage_locate_payload(input, &offset);
+    const gboolean truncated = appimage_payload_truncated(input);
+    thumbnail_trace_end(THUMBNAIL_STAGE_PROBE);
+    THUMBNAIL_USDT3(probe__done, (int)format, (gint64)offset, truncated);
 
     g_debug("main: input='%s', output='%s', size=%d", input, output, size);
     g_debug("main: format=%s, offset=%" G_GINT64_FORMAT,
             appimage_format_name(format), (gint64)offset);
 
-    gboolean have_squashfs = squashfs_tools_available();
-    gboolean have_dwarfs   = dwarfs_tools_available();
-
-    g_debug("main: unsquashfs available: %s", have_squashfs ? "yes" : "no");
-    g_debug("main: dwarfs tools available: %s", have_dwarfs  ? "yes" : "no");
-
-    if (!have_squashfs && !have_dwarfs) {
-        g_printerr("Neither unsquashfs (squashfs-tools) nor dwarfs tools are available.\n");
-        g_printerr("Install squashfs-tools for SquashFS AppImages or dwarfs for DwarFS AppImages.\n");
+    /* Refuse before spawning an extractor that would read to EOF and fail */
+    if (truncated) {
+        g_printerr("AppImage is truncated (incomplete download?)\n");
+        thumbnail_usdt_job_end(EXIT_INCOMPLETE);
         g_free(input);
         g_free(output);
-        return EXIT_FAILURE;
+        return EXIT_INCOMPLETE;
     }
 
-    if (format == APPIMAGE_FORMAT_SQUASHFS && !have_squashfs) {
-        g_printerr("SquashFS AppImage detected but unsquashfs is not available.\n");
-        g_printerr("Install squashfs-tools to handle this AppImage.\n");
+    const ThumbnailBackend backend = thumbnail_pipeline_get_backend();
+    if (!thumbnail_backend_available(backend, format)) {
+        g_printerr("The %s backend cannot read this %s AppImage\n",
+                   thumbnail_backend_name(backend), appimage_format_name(format));
+        thumbnail_usdt_job_end(EXIT_FAILURE);
         g_free(input);
         g_free(output);
         return EXIT_FAILURE;
     }
 
-    if (format == APPIMAGE_FORMAT_DWARFS && !have_dwarfs) {
-        g_printerr("DwarFS AppImage detected but dwarfs tools are not available.\n");
+    /* SquashFS URIs are read natively; everything else needs the tools */
+    const gboolean native = format == APPIMAGE_FORMAT_SQUASHFS
+                            && (appimage_reader_is_uri(input) || backend == THUMBNAIL_BACKEND_READER);
+    if (!native && !check_tools_for_format(format)) {
+        thumbnail_usdt_job_end(EXIT_FAILURE);
         g_free(input);
         g_free(output);
         return EXIT_FAILURE;
     }
 
-    /* Extract .DirIcon (required by AppImage spec) */
-    g_debug("main: trying .DirIcon");
-    gboolean success = process_entry_following_symlinks(
-        input, ".DirIcon", output, size, format, offset);
+    gboolean success = generate_thumbnail(input, output, size, format, offset);
+    thumbnail_usdt_job_end(success ? EXIT_SUCCESS : EXIT_FAILURE);
+    thumbnail_trace_report();
 
     if (!success) {
         g_debug("main: .DirIcon not found or extraction failed for '%s'", input);
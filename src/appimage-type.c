@@ -7,11 +7,16 @@
  *   - Type detection (AI magic at ELF e_ident[8..10])
  *   - Payload offset (ELF section header end)
  *   - Format detection (SquashFS vs DwarFS magic at payload offset)
+ *   - Payload recovery by magic scan when the section table is wrong
+ *   - Truncation checks for partially downloaded files
+ *
+ * Everything past appimage_get_type() reads through AppImageReader, so
+ * the probe works on GIO locations (sftp://, smb://) without a copy.
  *
  * SPDX-License-Identifier: MIT
  */
 
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include "appimage-type.h"
 
@@ -23,6 +28,8 @@
 
 #include <glib.h>
 
+#include "appimage-reader.h"
+
 /* ELF magic: "\x7fELF" */
 static const unsigned char ELF_MAGIC[4] = {0x7f, 'E', 'L', 'F'};
 
@@ -84,30 +91,27 @@ appimage_get_type(const char *path)
     return type;
 }
 
-off_t
-appimage_payload_offset(const char *path)
-{
-    if (!path)
-        return (off_t)-1;
 
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        g_debug("appimage_payload_offset: failed to open '%s': %s", path, g_strerror(errno));
-        return (off_t)-1;
-    }
+/* ------------------------------------------------------------------ */
+/* ELF section table                                                   */
+/* ------------------------------------------------------------------ */
 
+/*
+ * Offset right after the ELF section header table, which is where
+ * appimagetool places the payload.  Returns -1 if the header is unreadable.
+ */
+static off_t
+elf_section_table_end(AppImageReader *reader, const char *path)
+{
     unsigned char ident[16];
-    ssize_t n = read(fd, ident, sizeof(ident));
-    if (n < 16) {
-        g_debug("appimage_payload_offset: short read on '%s'", path);
-        close(fd);
+    if (!appimage_reader_read(reader, ident, sizeof(ident), 0)) {
+        g_debug("elf_section_table_end: short read on '%s'", path);
         return (off_t)-1;
     }
 
     /* Verify ELF magic */
     if (memcmp(ident, ELF_MAGIC, 4) != 0) {
-        g_debug("appimage_payload_offset: '%s' is not an ELF file", path);
-        close(fd);
+        g_debug("elf_section_table_end: '%s' is not an ELF file", path);
         return (off_t)-1;
     }
 
@@ -121,17 +125,13 @@ appimage_payload_offset(const char *path)
     if (elf_class == 2) {
         /* ELF64: e_shoff at offset 40 (8 bytes) */
         uint64_t shoff64;
-        if (lseek(fd, 40, SEEK_SET) < 0 || read(fd, &shoff64, 8) != 8) {
-            close(fd);
+        if (!appimage_reader_read(reader, &shoff64, 8, 40))
             return (off_t)-1;
-        }
 
         /* e_shentsize at offset 58, e_shnum at offset 60 (2 bytes each) */
-        if (lseek(fd, 58, SEEK_SET) < 0 || read(fd, &shentsize, 2) != 2
-            || read(fd, &shnum, 2) != 2) {
-            close(fd);
+        if (!appimage_reader_read(reader, &shentsize, 2, 58)
+            || !appimage_reader_read(reader, &shnum, 2, 60))
             return (off_t)-1;
-        }
 
         if (elf_data == 2) { /* big-endian */
             shoff64   = GUINT64_FROM_BE(shoff64);
@@ -147,17 +147,13 @@ appimage_payload_offset(const char *path)
     } else if (elf_class == 1) {
         /* ELF32: e_shoff at offset 32 (4 bytes) */
         uint32_t shoff32;
-        if (lseek(fd, 32, SEEK_SET) < 0 || read(fd, &shoff32, 4) != 4) {
-            close(fd);
+        if (!appimage_reader_read(reader, &shoff32, 4, 32))
             return (off_t)-1;
-        }
 
         /* e_shentsize at offset 46, e_shnum at offset 48 */
-        if (lseek(fd, 46, SEEK_SET) < 0 || read(fd, &shentsize, 2) != 2
-            || read(fd, &shnum, 2) != 2) {
-            close(fd);
+        if (!appimage_reader_read(reader, &shentsize, 2, 46)
+            || !appimage_reader_read(reader, &shnum, 2, 48))
             return (off_t)-1;
-        }
 
         if (elf_data == 2) {
             shoff32   = GUINT32_FROM_BE(shoff32);
@@ -171,65 +167,381 @@ appimage_payload_offset(const char *path)
         shoff = (off_t)shoff32;
 
     } else {
-        g_debug("appimage_payload_offset: unknown ELF class %d in '%s'", elf_class, path);
-        close(fd);
+        g_debug("elf_section_table_end: unknown ELF class %d in '%s'", elf_class, path);
         return (off_t)-1;
     }
 
-    close(fd);
-
     off_t payload = shoff + (off_t)((uint32_t)shnum * (uint32_t)shentsize);
-    g_debug("appimage_payload_offset: ELF payload at offset %" G_GINT64_FORMAT
+    g_debug("elf_section_table_end: ELF payload at offset %" G_GINT64_FORMAT
             " (shoff=%" G_GINT64_FORMAT ", shnum=%u, shentsize=%u) for '%s'",
             (gint64)payload, (gint64)shoff, (unsigned)shnum, (unsigned)shentsize, path);
     return payload;
 }
 
-AppImageFormat
-appimage_detect_format(const char *path)
+/* ------------------------------------------------------------------ */
+/* Superblock validation                                               */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The runtime itself embeds both magics (squashfuse compares against
+ * "hsqs", DwarFS-capable runtimes carry the "DWARFS" string), so a scan
+ * hit only counts once the bytes behind it look like a real superblock
+ * that fits inside the file.
+ */
+
+#define SQFS_SUPERBLOCK_SIZE 96
+#define DWARFS_HEADER_SIZE   64
+
+static gboolean
+squashfs_superblock_valid(const unsigned char *sb, gsize avail, off_t offset, off_t file_size)
 {
-    off_t offset = appimage_payload_offset(path);
-    if (offset <= 0) {
-        g_debug("appimage_detect_format: could not determine payload offset for '%s'", path);
-        return APPIMAGE_FORMAT_UNKNOWN;
+    if (avail < SQFS_SUPERBLOCK_SIZE || memcmp(sb, SQFS_MAGIC, 4) != 0)
+        return FALSE;
+
+    uint32_t block_size;
+    uint16_t compression, block_log, s_major;
+    uint64_t bytes_used, id_table, inode_table, directory_table;
+    memcpy(&block_size, sb + 12, 4);
+    memcpy(&compression, sb + 20, 2);
+    memcpy(&block_log, sb + 22, 2);
+    memcpy(&s_major, sb + 28, 2);
+    memcpy(&bytes_used, sb + 40, 8);
+    memcpy(&id_table, sb + 48, 8);
+    memcpy(&inode_table, sb + 64, 8);
+    memcpy(&directory_table, sb + 72, 8);
+
+    block_size      = GUINT32_FROM_LE(block_size);
+    compression     = GUINT16_FROM_LE(compression);
+    block_log       = GUINT16_FROM_LE(block_log);
+    s_major         = GUINT16_FROM_LE(s_major);
+    bytes_used      = GUINT64_FROM_LE(bytes_used);
+    id_table        = GUINT64_FROM_LE(id_table);
+    inode_table     = GUINT64_FROM_LE(inode_table);
+    directory_table = GUINT64_FROM_LE(directory_table);
+
+    if (s_major != 4 || compression < 1 || compression > 6)
+        return FALSE;
+    if (block_log < 12 || block_log > 20 || block_size != (1u << block_log))
+        return FALSE;
+    if (bytes_used < SQFS_SUPERBLOCK_SIZE || (guint64)offset + bytes_used > (guint64)file_size)
+        return FALSE;
+    if (inode_table >= directory_table || directory_table >= bytes_used || id_table >= bytes_used)
+        return FALSE;
+    return TRUE;
+}
+
+static gboolean
+dwarfs_header_valid(const unsigned char *hdr, gsize avail, off_t offset, off_t file_size)
+{
+    if (avail < DWARFS_HEADER_SIZE || memcmp(hdr, DWARFS_MAGIC, 6) != 0)
+        return FALSE;
+
+    /* v2 section header: magic, major, minor, sha512/256, xxh3, number, type, compression, length */
+    uint8_t major = hdr[6];
+    uint32_t number;
+    uint64_t length;
+    memcpy(&number, hdr + 48, 4);
+    memcpy(&length, hdr + 56, 8);
+    number = GUINT32_FROM_LE(number);
+    length = GUINT64_FROM_LE(length);
+
+    if (major != 2 || number != 0)
+        return FALSE;
+    if (length == 0 || (guint64)offset + DWARFS_HEADER_SIZE + length > (guint64)file_size)
+        return FALSE;
+    return TRUE;
+}
+
+/* ------------------------------------------------------------------ */
+/* Magic scan                                                          */
+/* ------------------------------------------------------------------ */
+
+/* Runtimes are a few hundred KiB; anything further out is not an AppImage payload */
+#define APPIMAGE_SCAN_WINDOW (8 * 1024 * 1024)
+#define APPIMAGE_SCAN_CHUNK  (1024 * 1024)
+/* Read past each chunk so a superblock straddling its end still validates */
+#define APPIMAGE_SCAN_TAIL   (SQFS_SUPERBLOCK_SIZE + DWARFS_HEADER_SIZE)
+
+typedef gboolean (*SuperblockValidator)(const unsigned char *data, gsize avail,
+                                        off_t offset, off_t file_size);
+
+/*
+ * First position in [from, scan_len) of @buf whose magic is followed by a
+ * valid superblock, or -1.  memmem() is the libc SIMD implementation (a
+ * vectorized first-byte/pair filter), so the scan stays I/O-bound.
+ */
+static gssize
+scan_for_magic(const unsigned char *buf, gsize buf_len, gsize from, gsize scan_len,
+               off_t base, const unsigned char *magic, gsize magic_len,
+               SuperblockValidator valid, off_t file_size)
+{
+    gsize pos = from;
+    while (pos < scan_len) {
+        const unsigned char *hit = memmem(buf + pos, MIN(scan_len - pos + magic_len - 1, buf_len - pos),
+                                          magic, magic_len);
+        if (!hit || (gsize)(hit - buf) >= scan_len)
+            break;
+
+        gsize at = (gsize)(hit - buf);
+        if (valid(hit, buf_len - at, base + (off_t)at, file_size))
+            return (gssize)at;
+        pos = at + 1;
     }
+    return -1;
+}
 
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        g_debug("appimage_detect_format: failed to open '%s': %s", path, g_strerror(errno));
-        return APPIMAGE_FORMAT_UNKNOWN;
+static AppImageFormat
+scan_payload(AppImageReader *reader, off_t file_size, off_t *out_offset)
+{
+    const off_t window = MIN(file_size, (off_t)APPIMAGE_SCAN_WINDOW);
+    unsigned char *buf = g_malloc(APPIMAGE_SCAN_CHUNK + APPIMAGE_SCAN_TAIL);
+    AppImageFormat format = APPIMAGE_FORMAT_UNKNOWN;
+
+    /* Skip the ELF header itself */
+    for (off_t base = 64; base < window && format == APPIMAGE_FORMAT_UNKNOWN;
+         base += APPIMAGE_SCAN_CHUNK) {
+        const gsize scan_len = (gsize)MIN((off_t)APPIMAGE_SCAN_CHUNK, window - base);
+        const gsize buf_len = (gsize)MIN((off_t)(scan_len + APPIMAGE_SCAN_TAIL), file_size - base);
+        if (!appimage_reader_read(reader, buf, buf_len, base))
+            break;
+
+        gssize sqfs = scan_for_magic(buf, buf_len, 0, scan_len, base, SQFS_MAGIC,
+                                     sizeof(SQFS_MAGIC), squashfs_superblock_valid, file_size);
+        gssize dwarfs = scan_for_magic(buf, buf_len, 0, scan_len, base, DWARFS_MAGIC,
+                                       sizeof(DWARFS_MAGIC), dwarfs_header_valid, file_size);
+
+        if (sqfs >= 0 && (dwarfs < 0 || sqfs < dwarfs)) {
+            *out_offset = base + (off_t)sqfs;
+            format = APPIMAGE_FORMAT_SQUASHFS;
+        } else if (dwarfs >= 0) {
+            *out_offset = base + (off_t)dwarfs;
+            format = APPIMAGE_FORMAT_DWARFS;
+        }
     }
 
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        g_debug("appimage_detect_format: failed to seek to offset %" G_GINT64_FORMAT, (gint64)offset);
-        close(fd);
-        return APPIMAGE_FORMAT_UNKNOWN;
+    g_free(buf);
+    return format;
+}
+
+/* ------------------------------------------------------------------ */
+/* Per-file cache                                                      */
+/* ------------------------------------------------------------------ */
+
+/* Cleared wholesale when full; the service only revisits a handful of files */
+#define PAYLOAD_CACHE_MAX 256
+
+typedef struct {
+    AppImageReaderIdentity   identity;
+    off_t          offset;
+    AppImageFormat format;
+    gboolean       truncated;
+} PayloadLocation;
+
+static GMutex payload_cache_lock;
+static GHashTable *payload_cache = NULL; /* AppImageReaderIdentity* -> PayloadLocation* (same block) */
+
+static guint
+file_identity_hash(gconstpointer key)
+{
+    const AppImageReaderIdentity *id = key;
+    return (guint)id->ino ^ (guint)(id->ino >> 32) ^ (guint)id->dev
+           ^ (guint)id->size ^ (guint)id->mtime_ns;
+}
+
+static gboolean
+file_identity_equal(gconstpointer a, gconstpointer b)
+{
+    const AppImageReaderIdentity *x = a;
+    const AppImageReaderIdentity *y = b;
+    return x->dev == y->dev && x->ino == y->ino && x->size == y->size
+           && x->mtime_ns == y->mtime_ns;
+}
+
+static gboolean
+payload_cache_lookup(const AppImageReaderIdentity *identity, PayloadLocation *out)
+{
+    gboolean found = FALSE;
+
+    g_mutex_lock(&payload_cache_lock);
+    PayloadLocation *loc = payload_cache ? g_hash_table_lookup(payload_cache, identity) : NULL;
+    if (loc) {
+        *out = *loc;
+        found = TRUE;
     }
+    g_mutex_unlock(&payload_cache_lock);
+    return found;
+}
 
-    unsigned char magic[8];
-    ssize_t n = read(fd, magic, sizeof(magic));
-    close(fd);
+static void
+payload_cache_store(const PayloadLocation *location)
+{
+    PayloadLocation *loc = g_new(PayloadLocation, 1);
+    *loc = *location;
+
+    g_mutex_lock(&payload_cache_lock);
+    if (!payload_cache)
+        payload_cache = g_hash_table_new_full(file_identity_hash, file_identity_equal,
+                                              NULL, g_free);
+    if (g_hash_table_size(payload_cache) >= PAYLOAD_CACHE_MAX)
+        g_hash_table_remove_all(payload_cache);
+    g_hash_table_replace(payload_cache, &loc->identity, loc);
+    g_mutex_unlock(&payload_cache_lock);
+}
 
-    if (n < 4) {
-        g_debug("appimage_detect_format: could not read magic bytes at offset %" G_GINT64_FORMAT,
-                (gint64)offset);
-        return APPIMAGE_FORMAT_UNKNOWN;
+void
+appimage_payload_cache_flush(void)
+{
+    g_mutex_lock(&payload_cache_lock);
+    g_clear_pointer(&payload_cache, g_hash_table_destroy);
+    g_mutex_unlock(&payload_cache_lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Truncation checks                                                   */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Browsers create the final file name early and keep appending, so a
+ * partial download already has a valid ELF header and payload magic.
+ * These checks let callers refuse it without spawning an extractor
+ * that would read to EOF and fail.
+ */
+
+/* Upper bound on DwarFS sections walked; real images have a few hundred */
+#define DWARFS_MAX_SECTIONS 65536
+
+static gboolean
+squashfs_truncated(AppImageReader *reader, off_t offset, off_t file_size)
+{
+    uint64_t bytes_used;
+    if (!appimage_reader_read(reader, &bytes_used, 8, offset + 40))
+        return TRUE;
+    bytes_used = GUINT64_FROM_LE(bytes_used);
+    return (guint64)offset + bytes_used > (guint64)file_size;
+}
+
+/* Walk the v2 section headers; each is followed by 'length' bytes of data. */
+static gboolean
+dwarfs_truncated(AppImageReader *reader, off_t offset, off_t file_size)
+{
+    off_t pos = offset;
+
+    for (guint i = 0; i < DWARFS_MAX_SECTIONS && pos < file_size; ++i) {
+        unsigned char hdr[DWARFS_HEADER_SIZE];
+        if (!appimage_reader_read(reader, hdr, sizeof(hdr), pos))
+            return TRUE; /* file ends inside a section header */
+        if (memcmp(hdr, DWARFS_MAGIC, 6) != 0)
+            return FALSE; /* trailing data after the last section */
+
+        uint64_t length;
+        memcpy(&length, hdr + 56, 8);
+        length = GUINT64_FROM_LE(length);
+        if (length > (guint64)(file_size - pos - DWARFS_HEADER_SIZE))
+            return TRUE;
+        pos += DWARFS_HEADER_SIZE + (off_t)length;
     }
+    return FALSE;
+}
 
-    if (memcmp(magic, SQFS_MAGIC, 4) == 0) {
-        g_debug("appimage_detect_format: SquashFS magic found at offset %" G_GINT64_FORMAT
-                " in '%s'", (gint64)offset, path);
+/* ------------------------------------------------------------------ */
+/* Payload location                                                    */
+/* ------------------------------------------------------------------ */
+
+static AppImageFormat
+probe_magic(AppImageReader *reader, off_t offset, off_t file_size)
+{
+    unsigned char magic[8] = { 0 };
+    gsize n = (gsize)MIN((off_t)sizeof(magic), file_size - offset);
+    if (!appimage_reader_read(reader, magic, n, offset))
+        return APPIMAGE_FORMAT_UNKNOWN;
+
+    if (n >= 4 && memcmp(magic, SQFS_MAGIC, 4) == 0)
         return APPIMAGE_FORMAT_SQUASHFS;
+    if (n >= 6 && memcmp(magic, DWARFS_MAGIC, 6) == 0)
+        return APPIMAGE_FORMAT_DWARFS;
+    return APPIMAGE_FORMAT_UNKNOWN;
+}
+
+static gboolean
+locate_payload(const char *location, PayloadLocation *loc)
+{
+    memset(loc, 0, sizeof(*loc));
+    loc->offset = (off_t)-1;
+
+    AppImageReader *reader = appimage_reader_open(location);
+    if (!reader)
+        return FALSE;
+
+    if (payload_cache_lookup(appimage_reader_identity(reader), loc)) {
+        appimage_reader_free(reader);
+        g_debug("locate_payload: cached %s payload at offset %" G_GINT64_FORMAT " for '%s'",
+                appimage_format_name(loc->format), (gint64)loc->offset, location);
+        return TRUE;
     }
 
-    if (n >= 6 && memcmp(magic, DWARFS_MAGIC, 6) == 0) {
-        g_debug("appimage_detect_format: DwarFS magic found at offset %" G_GINT64_FORMAT
-                " in '%s'", (gint64)offset, path);
-        return APPIMAGE_FORMAT_DWARFS;
+    const off_t file_size = appimage_reader_size(reader);
+    loc->identity = *appimage_reader_identity(reader);
+    loc->offset = elf_section_table_end(reader, location);
+    if (loc->offset > 0 && loc->offset < file_size)
+        loc->format = probe_magic(reader, loc->offset, file_size);
+
+    if (loc->format == APPIMAGE_FORMAT_UNKNOWN && file_size > 0) {
+        off_t recovered = (off_t)-1;
+        loc->format = scan_payload(reader, file_size, &recovered);
+        if (loc->format != APPIMAGE_FORMAT_UNKNOWN) {
+            g_debug("locate_payload: section table points at %" G_GINT64_FORMAT
+                    ", recovered %s payload at %" G_GINT64_FORMAT " in '%s'",
+                    (gint64)loc->offset, appimage_format_name(loc->format),
+                    (gint64)recovered, location);
+            loc->offset = recovered;
+        }
     }
 
-    g_debug("appimage_detect_format: unknown format at offset %" G_GINT64_FORMAT
-            " in '%s' (magic: %02x %02x %02x %02x)",
-            (gint64)offset, path, magic[0], magic[1], magic[2], magic[3]);
-    return APPIMAGE_FORMAT_UNKNOWN;
+    if (loc->format == APPIMAGE_FORMAT_SQUASHFS)
+        loc->truncated = squashfs_truncated(reader, loc->offset, file_size);
+    else if (loc->format == APPIMAGE_FORMAT_DWARFS)
+        loc->truncated = dwarfs_truncated(reader, loc->offset, file_size);
+    appimage_reader_free(reader);
+
+    if (loc->format == APPIMAGE_FORMAT_UNKNOWN)
+        g_debug("locate_payload: no payload magic found in '%s'", location);
+    if (loc->truncated)
+        g_debug("locate_payload: %s payload of '%s' extends past its %" G_GINT64_FORMAT
+                " bytes", appimage_format_name(loc->format), location, (gint64)file_size);
+
+    /* Negative results are cached too; the identity changes if the file does */
+    if (loc->offset > 0)
+        payload_cache_store(loc);
+    return TRUE;
+}
+
+AppImageFormat
+appimage_locate_payload(const char *location, off_t *out_offset)
+{
+    PayloadLocation loc;
+    locate_payload(location, &loc);
+    if (out_offset)
+        *out_offset = loc.offset;
+    return loc.format;
+}
+
+gboolean
+appimage_payload_truncated(const char *location)
+{
+    PayloadLocation loc;
+    return locate_payload(location, &loc) && loc.truncated;
+}
+
+off_t
+appimage_payload_offset(const char *path)
+{
+    off_t offset;
+    appimage_locate_payload(path, &offset);
+    return offset;
+}
+
+AppImageFormat
+appimage_detect_format(const char *path)
+{
+    return appimage_locate_payload(path, NULL);
 }
@@ -20,24 +20,61 @@ typedef enum {
     APPIMAGE_FORMAT_DWARFS   = 2,
 } AppImageFormat;
 
+/**
+ * Locate the payload of an AppImage and detect its format.
+ * The payload normally starts at e_shoff + (e_shnum * e_shentsize); when
+ * no SquashFS/DwarFS magic is found there (stripped or rewritten section
+ * headers, unusual runtimes), a bounded window of the file is scanned for
+ * the magics and each hit is accepted only if its superblock validates.
+ * Results are cached per file identity (device, inode, size, mtime).
+ *
+ * Only the ranges the probe needs are read (see appimage-reader.h), so
+ * @location may also be a URI on a GVfs mount (sftp://, smb://).
+ *
+ * @param location   Path to the AppImage file, or a URI GIO can open
+ * @param out_offset Receives the payload offset, or -1 on failure (may be NULL)
+ * @return The detected payload format
+ */
+AppImageFormat appimage_locate_payload(const char *location, off_t *out_offset);
+
 /**
  * Detect the payload format of an AppImage.
- * Parses the ELF header to determine payload offset, then checks magic bytes.
+ * Equivalent to appimage_locate_payload(location, NULL).
  *
- * @param path Path to the AppImage file
+ * @param path Path to the AppImage file, or a URI GIO can open
  * @return The detected payload format
  */
 AppImageFormat appimage_detect_format(const char *path);
 
 /**
  * Get the payload offset within an AppImage.
- * Computes: e_shoff + (e_shnum * e_shentsize) from the ELF header.
+ * The offset reported by appimage_locate_payload(); when no payload magic
+ * is found anywhere, this is still the ELF section header end.
  *
- * @param path Path to the AppImage file
+ * @param path Path to the AppImage file, or a URI GIO can open
  * @return The byte offset where the payload begins, or -1 on failure
  */
 off_t appimage_payload_offset(const char *path);
 
+/**
+ * Check whether the payload extends past the end of the file, as it does
+ * while a browser is still downloading the AppImage.  SquashFS payloads
+ * are checked against the superblock's bytes_used, DwarFS payloads by
+ * walking the section headers.  Cheap (a few preads, cached per file
+ * identity), so callers can refuse before spawning an extractor.
+ *
+ * @param location Path to the AppImage file, or a URI GIO can open
+ * @return TRUE if the payload is known to be incomplete
+ */
+gboolean appimage_payload_truncated(const char *location);
+
+/**
+ * Forget the payload locations cached by appimage_locate_payload() and
+ * appimage_payload_truncated().  Used by the long-running server when
+ * memory is tight; the next probe of each file reads its headers again.
+ */
+void appimage_payload_cache_flush(void);
+
 /**
  * Get the AppImage type (1 or 2).
  * Reads the ELF e_ident bytes 8-10 which encode "AI" + type for AppImages.
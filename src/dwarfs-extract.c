@@ -4,7 +4,7 @@
  * SPDX-License-Identifier: MIT
  */
 
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include "dwarfs-extract.h"
 
@@ -12,6 +12,8 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -19,6 +21,10 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include "thumbnail-payload.h"
+#include "thumbnail-trace.h"
+#include "thumbnail-usdt.h"
+
 /* Bundled tools directory - set at compile time */
 #ifndef DWARFS_TOOLS_DIR
 #define DWARFS_TOOLS_DIR "/usr/lib/appimage-thumbnailer"
@@ -28,32 +34,28 @@ static gchar *dwarfsextract_path = NULL;
 static gboolean tools_checked = FALSE;
 static gboolean tools_available_cached = FALSE;
 
+/* The entry is written to a directory, so the tool's output is not needed */
 static gboolean
-command_capture_dwarfs(const char *const argv[], GByteArray **output)
+command_run_dwarfs(const char *const argv[])
 {
     if (argv && argv[0])
-        g_debug("command_capture_dwarfs: running '%s'", argv[0]);
-
-    int pipe_fd[2];
-    if (pipe(pipe_fd) != 0) {
-        g_debug("command_capture_dwarfs: pipe() failed: %s", g_strerror(errno));
-        return FALSE;
-    }
+        g_debug("command_run_dwarfs: running '%s'", argv[0]);
 
     pid_t pid = fork();
-    if (pid < 0) {
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
+    if (pid < 0)
         return FALSE;
-    }
 
     if (pid == 0) {
-        close(pipe_fd[0]);
-        if (dup2(pipe_fd[1], STDOUT_FILENO) < 0) {
-            _exit(127);
+        /* A service worker caps its own address space; the tool maps
+         * whole images, so give it the hard limit back. */
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_AS, &rl) == 0 && rl.rlim_cur != rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_AS, &rl);
         }
         int devnull = open("/dev/null", O_WRONLY);
         if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
             dup2(devnull, STDERR_FILENO);
             close(devnull);
         }
@@ -63,43 +65,25 @@ command_capture_dwarfs(const char *const argv[], GByteArray **output)
         _exit(127);
     }
 
-    g_debug("command_capture_dwarfs: forked child pid %d for '%s'", (int) pid, argv[0]);
-
-    close(pipe_fd[1]);
-    GByteArray *arr = g_byte_array_new();
-    guchar buffer[8192];
-    ssize_t bytes_read;
-
-    while ((bytes_read = read(pipe_fd[0], buffer, sizeof buffer)) != 0) {
-        if (bytes_read < 0) {
-            if (errno == EINTR)
-                continue;
-            g_byte_array_unref(arr);
-            close(pipe_fd[0]);
-            waitpid(pid, NULL, 0);
-            return FALSE;
-        }
-        g_byte_array_append(arr, buffer, (guint) bytes_read);
-    }
+    g_debug("command_run_dwarfs: forked child pid %d for '%s'", (int) pid, argv[0]);
 
-    close(pipe_fd[0]);
+    THUMBNAIL_USDT2(extractor__spawn, (int)pid, argv[0]);
 
     int status = 0;
-    if (waitpid(pid, &status, 0) < 0) {
-        g_byte_array_unref(arr);
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
         return FALSE;
-    }
+    thumbnail_trace_child_exited(&usage);
+    THUMBNAIL_USDT3(extractor__exit, (int)pid, status, (gint64)usage.ru_maxrss);
 
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-        g_debug("command_capture_dwarfs: '%s' exited with status %d (normal=%d)",
+        g_debug("command_run_dwarfs: '%s' exited with status %d (normal=%d)",
                 argv[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1,
                 WIFEXITED(status));
-        g_byte_array_unref(arr);
         return FALSE;
     }
 
-    g_debug("command_capture_dwarfs: '%s' succeeded, captured %u bytes", argv[0], arr->len);
-    *output = arr;
+    g_debug("command_run_dwarfs: '%s' succeeded", argv[0]);
     return TRUE;
 }
 
@@ -179,7 +163,8 @@ dwarfs_tools_available(void)
 }
 
 gboolean
-dwarfs_extract_entry(const char *archive, const char *entry, GByteArray **output)
+dwarfs_extract_entry(const char *archive, const char *entry,
+                     ThumbnailArena *arena, GBytes **output)
 {
     g_debug("dwarfs_extract_entry: attempting to extract '%s' from '%s'",
             entry ? entry : "(null)", archive ? archive : "(null)");
@@ -193,21 +178,12 @@ dwarfs_extract_entry(const char *archive, const char *entry, GByteArray **output
         return FALSE;
     }
 
-    gchar *clean_entry = NULL;
-    if (entry[0] == '/')
-        clean_entry = g_strdup(entry + 1);
-    else
-        clean_entry = g_strdup(entry);
-
-    /* Build the pattern for dwarfsextract */
-    gchar *pattern = g_strdup(clean_entry);
+    const gchar *clean_entry = entry[0] == '/' ? entry + 1 : entry;
 
     /* Extract to a temp directory and read from there */
-    gchar *tmpdir = g_dir_make_tmp("appimage-thumb-XXXXXX", NULL);
-    if (!tmpdir) {
+    gchar *tmpdir = thumbnail_arena_build_path(arena, g_get_tmp_dir(), "appimage-thumb-XXXXXX");
+    if (!mkdtemp(tmpdir)) {
         g_debug("dwarfs_extract_entry: failed to create temp directory");
-        g_free(clean_entry);
-        g_free(pattern);
         return FALSE;
     }
 
@@ -217,83 +193,34 @@ dwarfs_extract_entry(const char *archive, const char *entry, GByteArray **output
         dwarfsextract_path,
         "-i", archive,
         "-O", "auto",
-        "--pattern", pattern,
+        "--pattern", clean_entry,
         "-o", tmpdir,
         "--log-level=error",
         NULL
     };
 
-    GByteArray *dummy = NULL;
-    gboolean extract_ok = command_capture_dwarfs(argv, &dummy);
-    if (dummy)
-        g_byte_array_unref(dummy);
-
     gboolean result = FALSE;
-    if (extract_ok) {
-        gchar *extracted_path = g_build_filename(tmpdir, clean_entry, NULL);
-        gchar *contents = NULL;
-        gsize length = 0;
-        GError *error = NULL;
-
-        g_debug("dwarfs_extract_entry: checking extracted file at '%s'", extracted_path);
-
-        /* Check if the extracted file is a symlink.
-         * For symlinks, return the link target as the content (this is the "pointer"
-         * that process_entry_following_symlinks will follow) */
-        if (g_file_test(extracted_path, G_FILE_TEST_IS_SYMLINK)) {
-            contents = g_file_read_link(extracted_path, &error);
-            if (contents) {
-                g_debug("dwarfs_extract_entry: '%s' is a symlink pointing to '%s'", clean_entry, contents);
-                length = strlen(contents);
-                *output = g_byte_array_new();
-                g_byte_array_append(*output, (const guchar *) contents, (guint) length);
-                g_free(contents);
-                result = TRUE;
-            } else {
-                g_debug("dwarfs_extract_entry: failed to read symlink '%s': %s",
-                        extracted_path, error ? error->message : "unknown");
-                if (error)
-                    g_error_free(error);
-            }
-        } else if (g_file_get_contents(extracted_path, &contents, &length, &error)) {
-            g_debug("dwarfs_extract_entry: read %" G_GSIZE_FORMAT " bytes from '%s'", length, clean_entry);
-            *output = g_byte_array_new();
-            g_byte_array_append(*output, (const guchar *) contents, (guint) length);
-            g_free(contents);
-            result = TRUE;
-        } else {
-            g_debug("dwarfs_extract_entry: failed to read extracted file '%s': %s",
-                    extracted_path, error ? error->message : "unknown");
-            if (error)
-                g_error_free(error);
-        }
-
-        g_free(extracted_path);
+    gchar *extracted_path = thumbnail_arena_build_path(arena, tmpdir, clean_entry);
+
+    if (command_run_dwarfs(argv)) {
+        /* For symlinks, the link target is returned as the content (this
+         * is the "pointer" that thumbnail_pipeline_extract_icon follows) */
+        *output = thumbnail_payload_from_file(extracted_path, arena);
+        result = *output != NULL;
+        if (result)
+            g_debug("dwarfs_extract_entry: read %" G_GSIZE_FORMAT " bytes for '%s'",
+                    g_bytes_get_size(*output), clean_entry);
     }
 
-    /* Clean up temp directory recursively */
-    gchar *cleanup_path = g_build_filename(tmpdir, clean_entry, NULL);
-    
-    /* Handle nested paths - need to clean up parent directories */
-    gchar *parent = g_path_get_dirname(cleanup_path);
-    g_unlink(cleanup_path);
-    
-    /* Remove parent directories up to tmpdir */
-    while (parent && g_strcmp0(parent, tmpdir) != 0 && g_strcmp0(parent, ".") != 0) {
+    /* Clean up temp directory, including parents of nested entries */
+    g_unlink(extracted_path);
+    gchar *parent = extracted_path;
+    gchar *slash;
+    while ((slash = strrchr(parent, '/')) != NULL && slash > parent + strlen(tmpdir)) {
+        *slash = '\0';
         g_rmdir(parent);
-        gchar *grandparent = g_path_get_dirname(parent);
-        g_free(parent);
-        parent = grandparent;
     }
-    g_free(parent);
-    
-    g_free(cleanup_path);
     g_rmdir(tmpdir);
-    g_free(tmpdir);
 
-    g_free(clean_entry);
-    g_free(pattern);
     return result;
 }
-
-
@@ -9,6 +9,8 @@
 
 #include <glib.h>
 
+#include "thumbnail-arena.h"
+
 /**
  * Check if DwarFS tools are available.
  * Looks for bundled tools first, then system PATH.
@@ -22,9 +24,12 @@ gboolean dwarfs_tools_available(void);
  *
  * @param archive Path to the DwarFS archive (AppImage)
  * @param entry   Path of the entry to extract (without leading slash)
- * @param output  Output byte array (allocated on success)
+ * @param arena   Job arena for temporary paths (not reset here)
+ * @param output  Payload, mapped from the extracted file (set on success,
+ *                caller unrefs)
  * @return TRUE on success, FALSE on failure
  */
-gboolean dwarfs_extract_entry(const char *archive, const char *entry, GByteArray **output);
+gboolean dwarfs_extract_entry(const char *archive, const char *entry,
+                              ThumbnailArena *arena, GBytes **output);
 
 #endif /* DWARFS_EXTRACT_H */
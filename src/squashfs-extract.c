@@ -8,7 +8,7 @@
  * SPDX-License-Identifier: MIT
  */
 
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include "squashfs-extract.h"
 
@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -24,6 +26,11 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include "squashfs-reader.h"
+#include "thumbnail-payload.h"
+#include "thumbnail-trace.h"
+#include "thumbnail-usdt.h"
+
 /* Bundled tools directory - set at compile time */
 #ifndef SQUASHFS_TOOLS_DIR
 #define SQUASHFS_TOOLS_DIR "/usr/lib/appimage-thumbnailer"
@@ -33,6 +40,12 @@ static gchar *unsquashfs_path = NULL;
 static gboolean tool_checked = FALSE;
 static gboolean tool_available_cached = FALSE;
 
+/* Bit n set: unsquashfs decodes compressor id n */
+#define ALL_COMPRESSORS 0xffffffffu
+static GMutex compressors_lock;
+static gboolean compressors_checked = FALSE;
+static guint32 tool_compressors = ALL_COMPRESSORS;
+
 /* ------------------------------------------------------------------ */
 /*  Helper: run a command and wait, discarding output                 */
 /* ------------------------------------------------------------------ */
@@ -48,6 +61,13 @@ command_run_squashfs(const char *const argv[])
         return FALSE;
 
     if (pid == 0) {
+        /* A service worker caps its own address space; the tool maps
+         * whole images, so give it the hard limit back. */
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_AS, &rl) == 0 && rl.rlim_cur != rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_AS, &rl);
+        }
         int devnull = open("/dev/null", O_WRONLY);
         if (devnull >= 0) {
             dup2(devnull, STDOUT_FILENO);
@@ -59,9 +79,14 @@ command_run_squashfs(const char *const argv[])
         _exit(127);
     }
 
+    THUMBNAIL_USDT2(extractor__spawn, (int)pid, argv[0]);
+
     int status = 0;
-    if (waitpid(pid, &status, 0) < 0)
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
         return FALSE;
+    thumbnail_trace_child_exited(&usage);
+    THUMBNAIL_USDT3(extractor__exit, (int)pid, status, (gint64)usage.ru_maxrss);
 
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         g_debug("command_run_squashfs: '%s' exited with status %d",
@@ -150,11 +175,160 @@ squashfs_tools_available(void)
 }
 
 /* ------------------------------------------------------------------ */
-/*  Recursive cleanup helper                                          */
+/*  Decompressor capabilities                                         */
+/* ------------------------------------------------------------------ */
+
+static guint32
+compressor_bit(const char *name, gsize len)
+{
+    if (len == 3 && strncmp(name, "all", 3) == 0)
+        return ALL_COMPRESSORS;
+    for (guint16 id = SQFS_COMPRESSION_GZIP; id <= SQFS_COMPRESSION_ZSTD; ++id) {
+        const char *known = squashfs_compression_name(id);
+        if (strlen(known) == len && strncmp(name, known, len) == 0)
+            return 1u << id;
+    }
+    return 0;
+}
+
+/* The help text ends with "Decompressors available:" and one name per
+ * line, some builds marking one "(default)" */
+static guint32
+parse_decompressors(const gchar *help)
+{
+    const gchar *list = help ? strstr(help, "Decompressors available") : NULL;
+    if (!list)
+        return 0;
+
+    guint32 mask = 0;
+    gchar **lines = g_strsplit(list, "\n", -1);
+    for (guint i = 1; lines[i] != NULL; ++i) {
+        const gchar *name = g_strstrip(lines[i]);
+        const guint32 bit = compressor_bit(name, strcspn(name, " \t"));
+        if (bit == 0)
+            break;
+        mask |= bit;
+    }
+    g_strfreev(lines);
+    return mask;
+}
+
+/* An unfamiliar help text rules nothing out */
+static guint32
+probe_compressors(const gchar *tool)
+{
+    const gchar *argv[] = { tool, "-help", NULL };
+    gchar *out = NULL;
+    gchar *err = NULL;
+    guint32 mask = 0;
+
+    if (g_spawn_sync(NULL, (gchar **)argv, NULL, G_SPAWN_DEFAULT, NULL, NULL,
+                     &out, &err, NULL, NULL))
+        mask = parse_decompressors(out) | parse_decompressors(err);
+    g_free(out);
+    g_free(err);
+
+    g_debug("probe_compressors: '%s' %s", tool,
+            mask ? "lists its decompressors" : "does not list its decompressors");
+    return mask ? mask : ALL_COMPRESSORS;
+}
+
+static gchar *
+capabilities_path(void)
+{
+    return g_build_filename(g_get_user_cache_dir(), "appimage-thumbnailer", "tools", NULL);
+}
+
+static void
+store_compressors(GKeyFile *file, const gchar *path, const struct stat *st)
+{
+    GPtrArray *names = g_ptr_array_new();
+    if (tool_compressors == ALL_COMPRESSORS) {
+        g_ptr_array_add(names, (gpointer)"all");
+    } else {
+        for (guint16 id = SQFS_COMPRESSION_GZIP; id <= SQFS_COMPRESSION_ZSTD; ++id)
+            if (tool_compressors & (1u << id))
+                g_ptr_array_add(names, (gpointer)squashfs_compression_name(id));
+    }
+
+    g_key_file_set_int64(file, unsquashfs_path, "size", (gint64)st->st_size);
+    g_key_file_set_int64(file, unsquashfs_path, "mtime-ns",
+                         (gint64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec);
+    g_key_file_set_string_list(file, unsquashfs_path, "compressors",
+                               (const gchar *const *)names->pdata, names->len);
+    g_ptr_array_free(names, TRUE);
+
+    gchar *dir = g_path_get_dirname(path);
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_debug("store_compressors: cannot create '%s': %s", dir, g_strerror(errno));
+    } else if (!g_key_file_save_to_file(file, path, &error)) {
+        g_debug("store_compressors: %s", error->message);
+        g_error_free(error);
+    }
+    g_free(dir);
+}
+
+/* Probing spawns the tool, so the result is kept on disk for as long as
+ * the binary (path, size, mtime) stays the same. Called with
+ * compressors_lock held. */
+static void
+init_compressors(void)
+{
+    if (compressors_checked)
+        return;
+    compressors_checked = TRUE;
+
+    struct stat st;
+    init_tool();
+    if (!unsquashfs_path || stat(unsquashfs_path, &st) < 0)
+        return;
+
+    gchar *path = capabilities_path();
+    GKeyFile *file = g_key_file_new();
+    g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, NULL);
+
+    const gint64 mtime_ns = (gint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    gchar **names = NULL;
+    if (g_key_file_get_int64(file, unsquashfs_path, "size", NULL) == (gint64)st.st_size
+        && g_key_file_get_int64(file, unsquashfs_path, "mtime-ns", NULL) == mtime_ns)
+        names = g_key_file_get_string_list(file, unsquashfs_path, "compressors", NULL, NULL);
+
+    if (names) {
+        tool_compressors = 0;
+        for (guint i = 0; names[i] != NULL; ++i)
+            tool_compressors |= compressor_bit(names[i], strlen(names[i]));
+        g_strfreev(names);
+    } else {
+        tool_compressors = probe_compressors(unsquashfs_path);
+        store_compressors(file, path, &st);
+    }
+
+    g_key_file_free(file);
+    g_free(path);
+}
+
+gboolean
+squashfs_tools_support(guint16 compression)
+{
+    g_mutex_lock(&compressors_lock);
+    init_compressors();
+    const gboolean supported = unsquashfs_path && compression < 32
+                               && (tool_compressors & (1u << compression)) != 0;
+    g_mutex_unlock(&compressors_lock);
+
+    if (!supported)
+        g_debug("squashfs_tools_support: '%s' cannot decode %s", unsquashfs_path,
+                squashfs_compression_name(compression));
+    return supported;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Extracted file helpers (scratch memory from the job arena)        */
 /* ------------------------------------------------------------------ */
 
 static void
-remove_directory_recursive(const gchar *dir_path)
+remove_directory_recursive(const gchar *dir_path, ThumbnailArena *arena)
 {
     GDir *dir = g_dir_open(dir_path, 0, NULL);
     if (!dir) {
@@ -164,14 +338,13 @@ remove_directory_recursive(const gchar *dir_path)
 
     const gchar *name;
     while ((name = g_dir_read_name(dir)) != NULL) {
-        gchar *child = g_build_filename(dir_path, name, NULL);
+        gchar *child = thumbnail_arena_build_path(arena, dir_path, name);
         if (g_file_test(child, G_FILE_TEST_IS_DIR) &&
             !g_file_test(child, G_FILE_TEST_IS_SYMLINK)) {
-            remove_directory_recursive(child);
+            remove_directory_recursive(child, arena);
         } else {
             g_unlink(child);
         }
-        g_free(child);
     }
     g_dir_close(dir);
     g_rmdir(dir_path);
@@ -183,7 +356,7 @@ remove_directory_recursive(const gchar *dir_path)
 
 gboolean
 squashfs_extract_entry(const char *archive, const char *entry,
-                       off_t offset, GByteArray **output)
+                       off_t offset, ThumbnailArena *arena, GBytes **output)
 {
     g_debug("squashfs_extract_entry: extracting '%s' from '%s' at offset %" G_GINT64_FORMAT,
             entry ? entry : "(null)", archive ? archive : "(null)", (gint64)offset);
@@ -197,25 +370,20 @@ squashfs_extract_entry(const char *archive, const char *entry,
         return FALSE;
     }
 
-    gchar *clean_entry = NULL;
-    if (entry[0] == '/')
-        clean_entry = g_strdup(entry + 1);
-    else
-        clean_entry = g_strdup(entry);
+    const gchar *clean_entry = entry[0] == '/' ? entry + 1 : entry;
 
     /* Create a temporary directory for extraction */
-    gchar *tmpdir = g_dir_make_tmp("appimage-sqfs-XXXXXX", NULL);
-    if (!tmpdir) {
+    gchar *tmpdir = thumbnail_arena_build_path(arena, g_get_tmp_dir(), "appimage-sqfs-XXXXXX");
+    if (!mkdtemp(tmpdir)) {
         g_debug("squashfs_extract_entry: failed to create temp directory");
-        g_free(clean_entry);
         return FALSE;
     }
 
     /* unsquashfs wants to create (-d) a new directory; use a subdir */
-    gchar *extract_dir = g_build_filename(tmpdir, "root", NULL);
+    gchar *extract_dir = thumbnail_arena_build_path(arena, tmpdir, "root");
 
     /* Format offset as string */
-    gchar *offset_str = g_strdup_printf("%" G_GINT64_FORMAT, (gint64)offset);
+    gchar *offset_str = thumbnail_arena_printf(arena, "%" G_GINT64_FORMAT, (gint64)offset);
 
     g_debug("squashfs_extract_entry: running unsquashfs -o %s -d '%s' '%s' '%s'",
             offset_str, extract_dir, archive, clean_entry);
@@ -230,62 +398,23 @@ squashfs_extract_entry(const char *archive, const char *entry,
         NULL
     };
 
-    gboolean extract_ok = command_run_squashfs(argv);
     gboolean result = FALSE;
 
-    if (extract_ok) {
-        gchar *extracted_path = g_build_filename(extract_dir, clean_entry, NULL);
-
-        g_debug("squashfs_extract_entry: checking extracted file at '%s'", extracted_path);
-
-        /* If the entry is a symlink, return its target as content.
-         * The caller (process_entry_following_symlinks) will follow it. */
-        if (g_file_test(extracted_path, G_FILE_TEST_IS_SYMLINK)) {
-            gchar *link_target = g_file_read_link(extracted_path, NULL);
-            if (link_target) {
-                g_debug("squashfs_extract_entry: '%s' is a symlink -> '%s'",
-                        clean_entry, link_target);
-                gsize len = strlen(link_target);
-                *output = g_byte_array_new();
-                g_byte_array_append(*output, (const guchar *)link_target, (guint)len);
-                g_free(link_target);
-                result = TRUE;
-            }
-        } else if (g_file_test(extracted_path, G_FILE_TEST_EXISTS)) {
-            gchar *contents = NULL;
-            gsize length = 0;
-            GError *error = NULL;
-
-            if (g_file_get_contents(extracted_path, &contents, &length, &error)) {
-                g_debug("squashfs_extract_entry: read %" G_GSIZE_FORMAT " bytes from '%s'",
-                        length, clean_entry);
-                *output = g_byte_array_new();
-                g_byte_array_append(*output, (const guchar *)contents, (guint)length);
-                g_free(contents);
-                result = TRUE;
-            } else {
-                g_debug("squashfs_extract_entry: failed to read '%s': %s",
-                        extracted_path, error ? error->message : "unknown");
-                if (error)
-                    g_error_free(error);
-            }
-        } else {
-            g_debug("squashfs_extract_entry: extracted file not found at '%s'", extracted_path);
-        }
+    if (command_run_squashfs(argv)) {
+        gchar *extracted_path = thumbnail_arena_build_path(arena, extract_dir, clean_entry);
 
-        g_free(extracted_path);
+        /* If the entry is a symlink, its target is returned as content.
+         * The caller (thumbnail_pipeline_extract_icon) will follow it. */
+        *output = thumbnail_payload_from_file(extracted_path, arena);
+        result = *output != NULL;
+        if (result)
+            g_debug("squashfs_extract_entry: read %" G_GSIZE_FORMAT " bytes for '%s'",
+                    g_bytes_get_size(*output), clean_entry);
     } else {
         g_debug("squashfs_extract_entry: unsquashfs command failed");
     }
 
     /* Clean up temp directory */
-    remove_directory_recursive(tmpdir);
-
-    g_free(offset_str);
-    g_free(extract_dir);
-    g_free(tmpdir);
-    g_free(clean_entry);
+    remove_directory_recursive(tmpdir, arena);
     return result;
 }
-
-
@@ -13,6 +13,8 @@
 #include <glib.h>
 #include <sys/types.h>
 
+#include "thumbnail-arena.h"
+
 /**
  * Check if unsquashfs tool is available.
  * Looks for a bundled copy first, then the system PATH.
@@ -21,6 +23,17 @@
  */
 gboolean squashfs_tools_available(void);
 
+/**
+ * Check whether unsquashfs can decode a SquashFS compressor.  The list
+ * of decompressors the tool reports is read once and cached on disk by
+ * tool path, size and mtime; a tool whose list cannot be read is
+ * assumed to decode everything.
+ *
+ * @param compression A SquashfsCompression id (see squashfs-reader.h)
+ * @return TRUE if unsquashfs is available and decodes @compression
+ */
+gboolean squashfs_tools_support(guint16 compression);
+
 /**
  * Extract a single entry from a SquashFS-based AppImage.
  *
@@ -30,10 +43,12 @@ gboolean squashfs_tools_available(void);
  * @param archive Path to the AppImage file
  * @param entry   Path of the entry to extract (without leading slash)
  * @param offset  SquashFS payload offset within the AppImage
- * @param output  Output byte array (allocated on success, caller frees)
+ * @param arena   Job arena for temporary paths (not reset here)
+ * @param output  Payload, mapped from the extracted file (set on success,
+ *                caller unrefs)
  * @return TRUE on success, FALSE on failure
  */
 gboolean squashfs_extract_entry(const char *archive, const char *entry,
-                                off_t offset, GByteArray **output);
+                                off_t offset, ThumbnailArena *arena, GBytes **output);
 
 #endif /* SQUASHFS_EXTRACT_H */
@@ -0,0 +1,748 @@
+/*
+ * squashfs-reader.c - Native SquashFS entry reader for appimage-thumbnailer
+ *
+ * Implements just enough of the SquashFS 4.0 on-disk format to look up
+ * one path and read it: metadata blocks, directory listings, basic and
+ * extended directory/file/symlink inodes, data blocks and fragments.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "squashfs-reader.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#define SQFS_SUPERBLOCK_SIZE       96
+#define SQFS_METADATA_SIZE         8192
+#define SQFS_METADATA_UNCOMPRESSED 0x8000
+#define SQFS_BLOCK_UNCOMPRESSED    (1u << 24)
+#define SQFS_BLOCK_SIZE_MASK       0x00ffffffu
+#define SQFS_NO_FRAGMENT           0xffffffffu
+#define SQFS_FRAGMENTS_PER_BLOCK   (SQFS_METADATA_SIZE / 16)
+#define SQFS_MAX_DIR_HEADER_COUNT  256
+#define SQFS_MAX_NAME              256
+#define SQFS_MAX_LINK              4096
+
+/* Icons are small; refuse to inflate anything implausibly large */
+#define SQFS_MAX_ENTRY_SIZE (64 * 1024 * 1024)
+
+enum {
+    SQFS_INODE_DIR          = 1,
+    SQFS_INODE_FILE         = 2,
+    SQFS_INODE_SYMLINK      = 3,
+    SQFS_INODE_EXT_DIR      = 8,
+    SQFS_INODE_EXT_FILE     = 9,
+    SQFS_INODE_EXT_SYMLINK  = 10,
+};
+
+typedef struct {
+    AppImageReader *reader;
+    off_t           base;           /* image start within the AppImage */
+    guint32         block_size;
+    guint16         compression;
+    guint64         root_inode;
+    guint64         inode_table;
+    guint64         directory_table;
+    guint64         fragment_table;
+    GConverter     *zlib;
+} SquashfsImage;
+
+typedef struct {
+    SquashfsImage *image;
+    guint64        block;           /* image position of the loaded block */
+    guint64        next;            /* image position of the block after it */
+    guint          offset;          /* read position within data */
+    guint          len;             /* decompressed length, 0 if none loaded */
+    guchar         data[SQFS_METADATA_SIZE];
+} MetadataCursor;
+
+typedef struct {
+    guint16 type;
+    guint32 dir_block;              /* directories */
+    guint16 dir_offset;
+    guint32 dir_size;
+    guint64 blocks_start;           /* files */
+    guint64 file_size;
+    guint32 fragment;
+    guint32 fragment_offset;
+    guint32 target_size;            /* symlinks */
+} SquashfsInode;
+
+static guint16
+get_le16(const guchar *p)
+{
+    guint16 v;
+    memcpy(&v, p, sizeof(v));
+    return GUINT16_FROM_LE(v);
+}
+
+static guint32
+get_le32(const guchar *p)
+{
+    guint32 v;
+    memcpy(&v, p, sizeof(v));
+    return GUINT32_FROM_LE(v);
+}
+
+static guint64
+get_le64(const guchar *p)
+{
+    guint64 v;
+    memcpy(&v, p, sizeof(v));
+    return GUINT64_FROM_LE(v);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Decompression                                                     */
+/* ------------------------------------------------------------------ */
+
+gboolean
+squashfs_compression_native(guint16 compression)
+{
+    switch (compression) {
+    case SQFS_COMPRESSION_GZIP:
+        return TRUE;
+#ifdef HAVE_LIBLZMA
+    case SQFS_COMPRESSION_XZ:
+        return TRUE;
+#endif
+#ifdef HAVE_LIBZSTD
+    case SQFS_COMPRESSION_ZSTD:
+        return TRUE;
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+const char *
+squashfs_compression_name(guint16 compression)
+{
+    switch (compression) {
+    case SQFS_COMPRESSION_GZIP:
+        return "gzip";
+    case SQFS_COMPRESSION_LZMA:
+        return "lzma";
+    case SQFS_COMPRESSION_LZO:
+        return "lzo";
+    case SQFS_COMPRESSION_XZ:
+        return "xz";
+    case SQFS_COMPRESSION_LZ4:
+        return "lz4";
+    case SQFS_COMPRESSION_ZSTD:
+        return "zstd";
+    default:
+        return "unknown";
+    }
+}
+
+/* Returns the decompressed length, or -1 */
+static gssize
+decompress(SquashfsImage *image, const guchar *src, gsize len, guchar *dst, gsize cap)
+{
+    switch (image->compression) {
+    case SQFS_COMPRESSION_GZIP: {
+        gsize in_total = 0;
+        gsize out_total = 0;
+
+        g_converter_reset(image->zlib);
+        for (;;) {
+            gsize bytes_read = 0;
+            gsize bytes_written = 0;
+            GError *error = NULL;
+            GConverterResult res = g_converter_convert(image->zlib, src + in_total, len - in_total,
+                                                       dst + out_total, cap - out_total,
+                                                       G_CONVERTER_INPUT_AT_END,
+                                                       &bytes_read, &bytes_written, &error);
+            if (res == G_CONVERTER_ERROR) {
+                g_debug("decompress: zlib: %s", error->message);
+                g_error_free(error);
+                return -1;
+            }
+            in_total += bytes_read;
+            out_total += bytes_written;
+            if (res == G_CONVERTER_FINISHED)
+                return (gssize)out_total;
+            if (bytes_read == 0 && bytes_written == 0)
+                return -1;
+        }
+    }
+#ifdef HAVE_LIBLZMA
+    case SQFS_COMPRESSION_XZ: {
+        uint64_t memlimit = UINT64_MAX;
+        size_t in_pos = 0;
+        size_t out_pos = 0;
+        lzma_ret ret = lzma_stream_buffer_decode(&memlimit, 0, NULL, src, &in_pos, len,
+                                                 dst, &out_pos, cap);
+        if (ret != LZMA_OK) {
+            g_debug("decompress: xz error %d", (int)ret);
+            return -1;
+        }
+        return (gssize)out_pos;
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+    case SQFS_COMPRESSION_ZSTD: {
+        size_t n = ZSTD_decompress(dst, cap, src, len);
+        if (ZSTD_isError(n)) {
+            g_debug("decompress: zstd: %s", ZSTD_getErrorName(n));
+            return -1;
+        }
+        return (gssize)n;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Raw and metadata reads                                            */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+read_raw(SquashfsImage *image, guint64 pos, void *buf, gsize len)
+{
+    return appimage_reader_read(image->reader, buf, len, image->base + (off_t)pos);
+}
+
+static gboolean
+load_metadata(MetadataCursor *cursor, guint64 pos)
+{
+    SquashfsImage *image = cursor->image;
+    guchar header[2];
+    guchar raw[SQFS_METADATA_SIZE];
+
+    cursor->len = 0;
+    if (!read_raw(image, pos, header, sizeof(header)))
+        return FALSE;
+
+    const guint16 word = get_le16(header);
+    const gsize size = word & ~SQFS_METADATA_UNCOMPRESSED;
+    if (size == 0 || size > SQFS_METADATA_SIZE || !read_raw(image, pos + 2, raw, size))
+        return FALSE;
+
+    if (word & SQFS_METADATA_UNCOMPRESSED) {
+        memcpy(cursor->data, raw, size);
+        cursor->len = (guint)size;
+    } else {
+        gssize n = decompress(image, raw, size, cursor->data, SQFS_METADATA_SIZE);
+        if (n <= 0)
+            return FALSE;
+        cursor->len = (guint)n;
+    }
+
+    cursor->block = pos;
+    cursor->next = pos + 2 + size;
+    cursor->offset = 0;
+    return TRUE;
+}
+
+static gboolean
+cursor_seek(MetadataCursor *cursor, guint64 block, guint offset)
+{
+    if ((cursor->len == 0 || cursor->block != block) && !load_metadata(cursor, block))
+        return FALSE;
+    if (offset > cursor->len)
+        return FALSE;
+    cursor->offset = offset;
+    return TRUE;
+}
+
+/* Reads continue into the following metadata blocks as needed */
+static gboolean
+cursor_read(MetadataCursor *cursor, void *buf, gsize len)
+{
+    guchar *out = buf;
+
+    while (len > 0) {
+        if (cursor->offset >= cursor->len && !load_metadata(cursor, cursor->next))
+            return FALSE;
+
+        const gsize chunk = MIN(len, (gsize)(cursor->len - cursor->offset));
+        memcpy(out, cursor->data + cursor->offset, chunk);
+        cursor->offset += (guint)chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    return TRUE;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Inodes and directories                                            */
+/* ------------------------------------------------------------------ */
+
+/* Leaves the cursor right after the inode (at a file's block list) */
+static gboolean
+read_inode(MetadataCursor *cursor, guint64 ref, SquashfsInode *inode)
+{
+    SquashfsImage *image = cursor->image;
+    guchar buf[40];
+
+    memset(inode, 0, sizeof(*inode));
+    if (!cursor_seek(cursor, image->inode_table + (ref >> 16), (guint)(ref & 0xffff))
+        || !cursor_read(cursor, buf, 16))
+        return FALSE;
+
+    inode->type = get_le16(buf);
+    switch (inode->type) {
+    case SQFS_INODE_DIR:
+        if (!cursor_read(cursor, buf, 16))
+            return FALSE;
+        inode->dir_block = get_le32(buf);
+        inode->dir_size = get_le16(buf + 8);
+        inode->dir_offset = get_le16(buf + 10);
+        return TRUE;
+    case SQFS_INODE_EXT_DIR:
+        if (!cursor_read(cursor, buf, 24))
+            return FALSE;
+        inode->dir_size = get_le32(buf + 4);
+        inode->dir_block = get_le32(buf + 8);
+        inode->dir_offset = get_le16(buf + 18);
+        return TRUE;
+    case SQFS_INODE_FILE:
+        if (!cursor_read(cursor, buf, 16))
+            return FALSE;
+        inode->blocks_start = get_le32(buf);
+        inode->fragment = get_le32(buf + 4);
+        inode->fragment_offset = get_le32(buf + 8);
+        inode->file_size = get_le32(buf + 12);
+        return TRUE;
+    case SQFS_INODE_EXT_FILE:
+        if (!cursor_read(cursor, buf, 40))
+            return FALSE;
+        inode->blocks_start = get_le64(buf);
+        inode->file_size = get_le64(buf + 8);
+        inode->fragment = get_le32(buf + 28);
+        inode->fragment_offset = get_le32(buf + 32);
+        return TRUE;
+    case SQFS_INODE_SYMLINK:
+    case SQFS_INODE_EXT_SYMLINK:
+        if (!cursor_read(cursor, buf, 8))
+            return FALSE;
+        inode->target_size = get_le32(buf + 4);
+        return TRUE;
+    default:
+        g_debug("read_inode: unsupported inode type %u", inode->type);
+        return FALSE;
+    }
+}
+
+static gboolean
+is_directory(const SquashfsInode *inode)
+{
+    return inode->type == SQFS_INODE_DIR || inode->type == SQFS_INODE_EXT_DIR;
+}
+
+static gboolean
+find_child(MetadataCursor *cursor, const SquashfsInode *dir, const char *name, guint64 *child)
+{
+    SquashfsImage *image = cursor->image;
+    const gsize name_len = strlen(name);
+
+    /* The listing size includes the implicit "." and ".." (3 bytes) */
+    if (dir->dir_size <= 3)
+        return FALSE;
+    if (!cursor_seek(cursor, image->directory_table + dir->dir_block, dir->dir_offset))
+        return FALSE;
+
+    guint64 remaining = dir->dir_size - 3;
+    while (remaining >= 12) {
+        guchar header[12];
+        if (!cursor_read(cursor, header, sizeof(header)))
+            return FALSE;
+        remaining -= sizeof(header);
+
+        const guint32 count = get_le32(header) + 1;
+        const guint32 start = get_le32(header + 4);
+        if (count > SQFS_MAX_DIR_HEADER_COUNT)
+            return FALSE;
+
+        for (guint32 i = 0; i < count; ++i) {
+            guchar entry[8];
+            char entry_name[SQFS_MAX_NAME + 1];
+            if (remaining < sizeof(entry) || !cursor_read(cursor, entry, sizeof(entry)))
+                return FALSE;
+            remaining -= sizeof(entry);
+
+            const gsize entry_len = (gsize)get_le16(entry + 6) + 1;
+            if (entry_len > SQFS_MAX_NAME || remaining < entry_len
+                || !cursor_read(cursor, entry_name, entry_len))
+                return FALSE;
+            remaining -= entry_len;
+
+            if (entry_len == name_len && memcmp(entry_name, name, name_len) == 0) {
+                *child = ((guint64)start << 16) | get_le16(entry);
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+static gboolean
+resolve_path(MetadataCursor *cursor, const char *entry, guint64 *out_ref)
+{
+    gchar **parts = g_strsplit(entry, "/", -1);
+    GArray *stack = g_array_new(FALSE, FALSE, sizeof(guint64));
+    g_array_append_val(stack, cursor->image->root_inode);
+    gboolean ok = TRUE;
+
+    for (guint i = 0; ok && parts[i] != NULL; ++i) {
+        const char *part = parts[i];
+        if (*part == '\0' || strcmp(part, ".") == 0)
+            continue;
+        if (strcmp(part, "..") == 0) {
+            if (stack->len > 1)
+                g_array_set_size(stack, stack->len - 1);
+            continue;
+        }
+
+        SquashfsInode dir;
+        guint64 child = 0;
+        ok = read_inode(cursor, g_array_index(stack, guint64, stack->len - 1), &dir)
+             && is_directory(&dir) && find_child(cursor, &dir, part, &child);
+        if (ok)
+            g_array_append_val(stack, child);
+        else
+            g_debug("resolve_path: '%s' not found in '%s'", part, entry);
+    }
+
+    if (ok)
+        *out_ref = g_array_index(stack, guint64, stack->len - 1);
+    g_array_free(stack, TRUE);
+    g_strfreev(parts);
+    return ok;
+}
+
+/* ------------------------------------------------------------------ */
+/*  File data                                                         */
+/* ------------------------------------------------------------------ */
+
+/* Read an on-disk data block (entry from a block list or fragment table) */
+static gssize
+read_block(SquashfsImage *image, guint64 pos, guint32 entry, guchar *staging,
+           guchar *dst, gsize cap)
+{
+    const gsize disk = entry & SQFS_BLOCK_SIZE_MASK;
+    if (disk > image->block_size)
+        return -1;
+
+    if (entry & SQFS_BLOCK_UNCOMPRESSED) {
+        const gsize n = MIN(disk, cap);
+        return read_raw(image, pos, dst, n) ? (gssize)n : -1;
+    }
+    if (!read_raw(image, pos, staging, disk))
+        return -1;
+    return decompress(image, staging, disk, dst, cap);
+}
+
+/* Number of full data blocks; the rest of the file is in the fragment */
+static guint64
+location_block_count(guint64 size, guint32 block_size, gboolean has_fragment)
+{
+    return has_fragment ? size / block_size : (size + block_size - 1) / block_size;
+}
+
+/* Collects the block list (the cursor sits right after the inode) and
+ * the fragment table entry into an AppImage-absolute location. */
+static SquashfsLocation *
+locate_file(MetadataCursor *cursor, const SquashfsInode *inode)
+{
+    SquashfsImage *image = cursor->image;
+    const guint64 size = inode->file_size;
+
+    if (size > SQFS_MAX_ENTRY_SIZE) {
+        g_debug("locate_file: %" G_GUINT64_FORMAT " bytes is too large for an icon", size);
+        return NULL;
+    }
+
+    const gboolean has_fragment = inode->fragment != SQFS_NO_FRAGMENT;
+    const guint64 n_blocks = location_block_count(size, image->block_size, has_fragment);
+
+    SquashfsLocation *location = g_malloc0(sizeof(*location) + n_blocks * sizeof(guint32));
+    location->compression = image->compression;
+    location->block_size = image->block_size;
+    location->file_size = size;
+    location->blocks_start = (guint64)image->base + inode->blocks_start;
+    location->n_blocks = (guint32)n_blocks;
+
+    for (guint64 i = 0; i < n_blocks; ++i) {
+        guchar word[4];
+        if (!cursor_read(cursor, word, sizeof(word))) {
+            g_free(location);
+            return NULL;
+        }
+        location->blocks[i] = get_le32(word);
+    }
+
+    if (has_fragment && size > n_blocks * image->block_size) {
+        guchar index[8];
+        guchar entry[16];
+        const guint64 index_pos = image->fragment_table
+                                  + (guint64)(inode->fragment / SQFS_FRAGMENTS_PER_BLOCK) * 8;
+        if (!read_raw(image, index_pos, index, sizeof(index))
+            || !cursor_seek(cursor, get_le64(index),
+                            (inode->fragment % SQFS_FRAGMENTS_PER_BLOCK) * 16)
+            || !cursor_read(cursor, entry, sizeof(entry))) {
+            g_free(location);
+            return NULL;
+        }
+        location->fragment_start = (guint64)image->base + get_le64(entry);
+        location->fragment_block = get_le32(entry + 8);
+        location->fragment_offset = inode->fragment_offset;
+    }
+    return location;
+}
+
+gboolean
+squashfs_location_valid(const SquashfsLocation *location, gsize len)
+{
+    if (len < sizeof(*location))
+        return FALSE;
+    if ((len - sizeof(*location)) / sizeof(guint32) != location->n_blocks
+        || (len - sizeof(*location)) % sizeof(guint32) != 0)
+        return FALSE;
+
+    const guint32 bs = location->block_size;
+    if (bs < 4096 || bs > (1u << 20) || (bs & (bs - 1)) != 0
+        || location->file_size > SQFS_MAX_ENTRY_SIZE)
+        return FALSE;
+
+    const gboolean has_fragment = location->fragment_block != 0;
+    return location->n_blocks
+           == location_block_count(location->file_size, bs, has_fragment);
+}
+
+gsize
+squashfs_location_size(const SquashfsLocation *location)
+{
+    return sizeof(*location) + (gsize)location->n_blocks * sizeof(guint32);
+}
+
+/* Positions in the location are AppImage-absolute: read with base 0.
+ * Blocks are decompressed straight into the buffer the payload owns. */
+static GBytes *
+read_location(SquashfsImage *image, const SquashfsLocation *location)
+{
+    SquashfsImage flat = *image;
+    flat.base = 0;
+
+    const guint64 size = location->file_size;
+    const guint32 bs = location->block_size;
+    guchar *data = g_malloc(MAX(size, 1));
+    guchar *staging = g_malloc(bs);
+    guint64 pos = location->blocks_start;
+    gboolean ok = TRUE;
+
+    for (guint32 i = 0; ok && i < location->n_blocks; ++i) {
+        const guint32 entry = location->blocks[i];
+        const gsize want = (gsize)MIN((guint64)bs, size - (guint64)i * bs);
+        guchar *dst = data + (gsize)i * bs;
+
+        if ((entry & SQFS_BLOCK_SIZE_MASK) == 0) {
+            memset(dst, 0, want); /* sparse block */
+            continue;
+        }
+        ok = read_block(&flat, pos, entry, staging, dst, want) == (gssize)want;
+        pos += entry & SQFS_BLOCK_SIZE_MASK;
+    }
+
+    const gsize tail = (gsize)(size - MIN(size, (guint64)location->n_blocks * bs));
+    if (ok && tail > 0) {
+        guchar *fragment = g_malloc(bs);
+        gssize n = read_block(&flat, location->fragment_start, location->fragment_block,
+                              staging, fragment, bs);
+        ok = n >= 0 && (guint64)location->fragment_offset + tail <= (guint64)n;
+        if (ok)
+            memcpy(data + (gsize)location->n_blocks * bs, fragment + location->fragment_offset,
+                   tail);
+        g_free(fragment);
+    }
+
+    g_free(staging);
+    if (!ok) {
+        g_free(data);
+        return NULL;
+    }
+    return g_bytes_new_take(data, (gsize)size);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Public API                                                        */
+/* ------------------------------------------------------------------ */
+
+guint16
+squashfs_read_compression(AppImageReader *reader, off_t offset)
+{
+    guchar sb[24];
+    if (!reader || !appimage_reader_read(reader, sb, sizeof(sb), offset) || memcmp(sb, "hsqs", 4) != 0)
+        return 0;
+    return get_le16(sb + 20);
+}
+
+static void
+init_decompressor(SquashfsImage *image)
+{
+    if (image->compression == SQFS_COMPRESSION_GZIP)
+        image->zlib = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+}
+
+static gboolean
+open_image(SquashfsImage *image, AppImageReader *reader, off_t offset)
+{
+    guchar sb[SQFS_SUPERBLOCK_SIZE];
+
+    memset(image, 0, sizeof(*image));
+    image->reader = reader;
+    image->base = offset;
+    if (!read_raw(image, 0, sb, sizeof(sb)) || memcmp(sb, "hsqs", 4) != 0)
+        return FALSE;
+
+    image->block_size = get_le32(sb + 12);
+    image->compression = get_le16(sb + 20);
+    const guint16 block_log = get_le16(sb + 22);
+    const guint16 s_major = get_le16(sb + 28);
+    image->root_inode = get_le64(sb + 32);
+    image->inode_table = get_le64(sb + 64);
+    image->directory_table = get_le64(sb + 72);
+    image->fragment_table = get_le64(sb + 80);
+
+    if (s_major != 4 || block_log < 12 || block_log > 20 || image->block_size != (1u << block_log)) {
+        g_debug("open_image: not a SquashFS 4.0 superblock");
+        return FALSE;
+    }
+    if (!squashfs_compression_native(image->compression)) {
+        g_debug("open_image: compression %u is not supported natively", image->compression);
+        return FALSE;
+    }
+
+    init_decompressor(image);
+    return TRUE;
+}
+
+/* Resolve @entry and read its inode; the cursor is left after the inode */
+static gboolean
+lookup_entry(MetadataCursor *cursor, const char *entry, SquashfsInode *inode)
+{
+    guint64 ref = 0;
+    return resolve_path(cursor, entry, &ref) && read_inode(cursor, ref, inode);
+}
+
+static gboolean
+is_file(const SquashfsInode *inode)
+{
+    return inode->type == SQFS_INODE_FILE || inode->type == SQFS_INODE_EXT_FILE;
+}
+
+gboolean
+squashfs_read_entry(AppImageReader *reader, off_t offset, const char *entry,
+                    GBytes **output, SquashfsLocation **location)
+{
+    g_debug("squashfs_read_entry: reading '%s' from '%s' at offset %" G_GINT64_FORMAT,
+            entry ? entry : "(null)", reader ? appimage_reader_name(reader) : "(null)",
+            (gint64)offset);
+
+    *output = NULL;
+    if (location)
+        *location = NULL;
+    if (!reader || !entry || *entry == '\0' || offset <= 0)
+        return FALSE;
+
+    SquashfsImage image;
+    if (!open_image(&image, reader, offset))
+        return FALSE;
+
+    MetadataCursor *cursor = g_new0(MetadataCursor, 1);
+    cursor->image = &image;
+
+    gboolean result = FALSE;
+    SquashfsInode inode;
+    if (lookup_entry(cursor, entry, &inode)) {
+        if (is_file(&inode)) {
+            SquashfsLocation *found = locate_file(cursor, &inode);
+            if (found)
+                *output = read_location(&image, found);
+            if (*output && location)
+                *location = found;
+            else
+                g_free(found);
+        } else if ((inode.type == SQFS_INODE_SYMLINK || inode.type == SQFS_INODE_EXT_SYMLINK)
+                   && inode.target_size > 0 && inode.target_size < SQFS_MAX_LINK) {
+            /* The symlink target is returned as content for the caller to follow */
+            gchar *target = g_malloc(inode.target_size);
+            if (cursor_read(cursor, target, inode.target_size)) {
+                g_debug("squashfs_read_entry: symlink -> '%.*s'", (int)inode.target_size, target);
+                *output = g_bytes_new_take(target, inode.target_size);
+            } else {
+                g_free(target);
+            }
+        }
+        result = *output != NULL;
+    }
+
+    if (result)
+        g_debug("squashfs_read_entry: read %" G_GSIZE_FORMAT " bytes for '%s'",
+                g_bytes_get_size(*output), entry);
+    else
+        g_debug("squashfs_read_entry: '%s' not found or unreadable", entry);
+
+    g_free(cursor);
+    g_clear_object(&image.zlib);
+    return result;
+}
+
+SquashfsLocation *
+squashfs_locate_entry(AppImageReader *reader, off_t offset, const char *entry)
+{
+    if (!reader || !entry || *entry == '\0' || offset <= 0)
+        return NULL;
+
+    SquashfsImage image;
+    if (!open_image(&image, reader, offset))
+        return NULL;
+
+    MetadataCursor *cursor = g_new0(MetadataCursor, 1);
+    cursor->image = &image;
+
+    SquashfsLocation *location = NULL;
+    SquashfsInode inode;
+    if (lookup_entry(cursor, entry, &inode) && is_file(&inode))
+        location = locate_file(cursor, &inode);
+
+    g_debug("squashfs_locate_entry: '%s' %s", entry, location ? "located" : "not a readable file");
+    g_free(cursor);
+    g_clear_object(&image.zlib);
+    return location;
+}
+
+GBytes *
+squashfs_read_location(AppImageReader *reader, const SquashfsLocation *location)
+{
+    if (!reader || !location || !squashfs_compression_native(location->compression))
+        return NULL;
+
+    SquashfsImage image;
+    memset(&image, 0, sizeof(image));
+    image.reader = reader;
+    image.block_size = location->block_size;
+    image.compression = location->compression;
+    init_decompressor(&image);
+
+    GBytes *bytes = read_location(&image, location);
+    g_clear_object(&image.zlib);
+    return bytes;
+}
@@ -0,0 +1,115 @@
+/*
+ * squashfs-reader.h - Native SquashFS entry reader for appimage-thumbnailer
+ *
+ * Reads a single entry straight from the SquashFS image through an
+ * AppImageReader: the superblock, the metadata blocks on the path to the
+ * entry, and the entry's own data blocks.  Used for AppImages that have
+ * no local path (GVfs locations), where unsquashfs cannot be run without
+ * copying the whole file first.
+ *
+ * gzip payloads are decoded with GIO's zlib decompressor; xz and zstd
+ * need liblzma / libzstd at build time.  lzo, lz4 and legacy lzma
+ * payloads are not supported.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef SQUASHFS_READER_H
+#define SQUASHFS_READER_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+#include "appimage-reader.h"
+
+/* Compressor ids of the SquashFS 4.0 superblock */
+typedef enum {
+    SQFS_COMPRESSION_GZIP = 1,
+    SQFS_COMPRESSION_LZMA = 2,
+    SQFS_COMPRESSION_LZO  = 3,
+    SQFS_COMPRESSION_XZ   = 4,
+    SQFS_COMPRESSION_LZ4  = 5,
+    SQFS_COMPRESSION_ZSTD = 6,
+} SquashfsCompression;
+
+/*
+ * Where a file's bytes live in the AppImage: enough to read it again
+ * without the superblock, directory or inode tables.  Stored as-is (host
+ * byte order) by the icon index; positions are absolute file offsets.
+ */
+typedef struct {
+    guint16 compression;
+    guint32 block_size;
+    guint64 file_size;
+    guint64 blocks_start;    /* first data block */
+    guint64 fragment_start;  /* fragment block holding the tail */
+    guint32 fragment_block;  /* its on-disk size word, 0 if there is no tail */
+    guint32 fragment_offset; /* tail offset within the decompressed fragment */
+    guint32 n_blocks;
+    guint32 blocks[];        /* on-disk size words of the data blocks */
+} SquashfsLocation;
+
+/**
+ * Read one entry from a SquashFS image embedded in an AppImage.
+ *
+ * As with squashfs_extract_entry(), a symlink entry yields its target
+ * text as the payload so the caller can follow it.
+ *
+ * @param reader   Reader for the AppImage
+ * @param offset   SquashFS payload offset within the AppImage
+ * @param entry    Path of the entry (leading slash optional)
+ * @param output   Payload in the decompression buffer (set on success,
+ *                 caller unrefs)
+ * @param location Where the entry's data lives, for regular files (set on
+ *                 success, caller frees; may be NULL)
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean squashfs_read_entry(AppImageReader *reader, off_t offset, const char *entry,
+                             GBytes **output, SquashfsLocation **location);
+
+/**
+ * Find where a regular file's data lives, reading only metadata.
+ *
+ * @return The location (caller frees), or NULL if @entry is not a
+ *         regular file or the image cannot be read natively
+ */
+SquashfsLocation *squashfs_locate_entry(AppImageReader *reader, off_t offset, const char *entry);
+
+/**
+ * Read a file from its recorded location: one read per data block plus
+ * the fragment, no table traversal.
+ *
+ * @return The file contents (caller unrefs), or NULL on failure
+ */
+GBytes *squashfs_read_location(AppImageReader *reader, const SquashfsLocation *location);
+
+/**
+ * Size in bytes of a location record, including its block list.
+ */
+gsize squashfs_location_size(const SquashfsLocation *location);
+
+/**
+ * Check that @len bytes hold a self-consistent location record.
+ */
+gboolean squashfs_location_valid(const SquashfsLocation *location, gsize len);
+
+/**
+ * Read the compressor id from the superblock of a SquashFS image.
+ *
+ * @param reader Reader for the AppImage
+ * @param offset SquashFS payload offset within the AppImage
+ * @return A SquashfsCompression id, or 0 if there is no superblock there
+ */
+guint16 squashfs_read_compression(AppImageReader *reader, off_t offset);
+
+/**
+ * @return TRUE if this build decodes @compression in-process
+ */
+gboolean squashfs_compression_native(guint16 compression);
+
+/**
+ * Name of a compressor as squashfs-tools spells it ("gzip", "xz", ...).
+ */
+const char *squashfs_compression_name(guint16 compression);
+
+#endif /* SQUASHFS_READER_H */
@@ -0,0 +1,96 @@
+/*
+ * thumbnail-alloc.c - Counting malloc hooks for --trace=alloc
+ *
+ * Only built with -Dalloc_accounting=true.  The executable's malloc
+ * family takes precedence over the C library's for every object in the
+ * process (GLib, gdk-pixbuf, librsvg, cairo), and forwards to glibc's
+ * __libc_* entry points, so no dlsym() bootstrapping is needed.  Sizes
+ * are counted as malloc_usable_size(), so a block counts the same when it
+ * is allocated and when it is released.  While counting is off each call
+ * costs one extra function call and branch.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <malloc.h>
+#include <stddef.h>
+
+#include "thumbnail-trace.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void  __libc_free(void *ptr);
+
+static inline void *
+counted(void *ptr)
+{
+    if (ptr && thumbnail_trace_counting_allocs())
+        thumbnail_trace_note_alloc(malloc_usable_size(ptr));
+    return ptr;
+}
+
+void *
+malloc(size_t size)
+{
+    return counted(__libc_malloc(size));
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    return counted(__libc_calloc(n, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if (!thumbnail_trace_counting_allocs())
+        return __libc_realloc(ptr, size);
+
+    const size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *moved = __libc_realloc(ptr, size);
+    /* realloc(ptr, 0) releases ptr; a failed realloc leaves it alone */
+    if (moved || (ptr && size == 0)) {
+        thumbnail_trace_note_free(old_size);
+        counted(moved);
+    }
+    return moved;
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+    return counted(__libc_memalign(alignment, size));
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    return counted(__libc_memalign(alignment, size));
+}
+
+int
+posix_memalign(void **out, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    void *ptr = counted(__libc_memalign(alignment, size));
+    if (!ptr)
+        return ENOMEM;
+    *out = ptr;
+    return 0;
+}
+
+void
+free(void *ptr)
+{
+    if (ptr && thumbnail_trace_counting_allocs())
+        thumbnail_trace_note_free(malloc_usable_size(ptr));
+    __libc_free(ptr);
+}
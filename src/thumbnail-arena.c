@@ -0,0 +1,194 @@
+/*
+ * thumbnail-arena.c - Per-job bump allocator for the extraction hot path
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-arena.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "thumbnail-trace.h"
+
+/* What thumbnail-arena.h promises; chunk data follows a three-word header */
+#define ARENA_ALIGN sizeof(gpointer)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    gsize size;
+    gsize used;
+    guchar data[];
+} ArenaChunk;
+
+G_STATIC_ASSERT(offsetof(ArenaChunk, data) % ARENA_ALIGN == 0);
+
+struct ThumbnailArena {
+    ArenaChunk *first;     /* kept across resets */
+    ArenaChunk *current;   /* chunk being filled: first or the head of overflow */
+    ArenaChunk *overflow;  /* chunks added during the current job */
+    guint n_allocs;        /* statistics since the last reset */
+    guint n_chunks;
+    gsize n_bytes;
+};
+
+static ArenaChunk *
+chunk_new(gsize size)
+{
+    ArenaChunk *chunk = g_malloc(sizeof(ArenaChunk) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+ThumbnailArena *
+thumbnail_arena_new(void)
+{
+    ThumbnailArena *arena = g_new0(ThumbnailArena, 1);
+    arena->first = chunk_new(THUMBNAIL_ARENA_CHUNK_SIZE);
+    arena->current = arena->first;
+    return arena;
+}
+
+static void
+free_overflow(ThumbnailArena *arena)
+{
+    while (arena->overflow) {
+        ArenaChunk *next = arena->overflow->next;
+        g_free(arena->overflow);
+        arena->overflow = next;
+    }
+}
+
+void
+thumbnail_arena_free(ThumbnailArena *arena)
+{
+    if (!arena)
+        return;
+    free_overflow(arena);
+    g_free(arena->first);
+    g_free(arena);
+}
+
+static void
+arena_free_notify(gpointer data)
+{
+    thumbnail_arena_free(data);
+}
+
+static GPrivate thread_arena = G_PRIVATE_INIT(arena_free_notify);
+
+ThumbnailArena *
+thumbnail_arena_for_thread(void)
+{
+    ThumbnailArena *arena = g_private_get(&thread_arena);
+    if (!arena) {
+        arena = thumbnail_arena_new();
+        g_private_set(&thread_arena, arena);
+    }
+    return arena;
+}
+
+void
+thumbnail_arena_release_thread(void)
+{
+    g_private_replace(&thread_arena, NULL);
+}
+
+gpointer
+thumbnail_arena_alloc(ThumbnailArena *arena, gsize size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size == 0)
+        size = ARENA_ALIGN;
+
+    ArenaChunk *chunk = arena->current;
+    if (chunk->size - chunk->used < size) {
+        chunk = chunk_new(MAX(size, (gsize)THUMBNAIL_ARENA_CHUNK_SIZE));
+        chunk->next = arena->overflow;
+        arena->overflow = chunk;
+        arena->current = chunk;
+        arena->n_chunks++;
+    }
+
+    gpointer p = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->n_allocs++;
+    arena->n_bytes += size;
+    return p;
+}
+
+gchar *
+thumbnail_arena_strndup(ThumbnailArena *arena, const gchar *str, gsize n)
+{
+    const gchar *end = memchr(str, '\0', n);
+    const gsize len = end ? (gsize)(end - str) : n;
+
+    gchar *copy = thumbnail_arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+gchar *
+thumbnail_arena_strdup(ThumbnailArena *arena, const gchar *str)
+{
+    return thumbnail_arena_strndup(arena, str, strlen(str));
+}
+
+gchar *
+thumbnail_arena_build_path(ThumbnailArena *arena, const gchar *dir, const gchar *name)
+{
+    gsize dir_len = strlen(dir);
+    while (dir_len > 1 && dir[dir_len - 1] == '/')
+        dir_len--;
+    while (*name == '/')
+        name++;
+
+    const gsize name_len = strlen(name);
+    gchar *path = thumbnail_arena_alloc(arena, dir_len + 1 + name_len + 1);
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+gchar *
+thumbnail_arena_printf(ThumbnailArena *arena, const gchar *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    const int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0)
+        return NULL;
+
+    gchar *str = thumbnail_arena_alloc(arena, (gsize)len + 1);
+    va_start(args, format);
+    vsnprintf(str, (gsize)len + 1, format, args);
+    va_end(args);
+    return str;
+}
+
+void
+thumbnail_arena_reset(ThumbnailArena *arena, const char *job)
+{
+    g_debug("thumbnail_arena_reset: %s: %u allocation(s), %" G_GSIZE_FORMAT " bytes, "
+            "%u overflow chunk(s)", job, arena->n_allocs, arena->n_bytes, arena->n_chunks);
+    thumbnail_trace_arena_job(arena->n_allocs, arena->n_bytes, arena->n_chunks);
+
+    free_overflow(arena);
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->n_allocs = 0;
+    arena->n_chunks = 0;
+    arena->n_bytes = 0;
+}
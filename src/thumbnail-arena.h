@@ -0,0 +1,77 @@
+/*
+ * thumbnail-arena.h - Per-job bump allocator for the extraction hot path
+ *
+ * Paths, pointer strings and scratch buffers of one extraction job are
+ * carved out of a chunk that is rewound, not freed, when the job ends,
+ * so a warm process extracts icons with a handful of mallocs per job.
+ * Nothing allocated here may outlive thumbnail_arena_reset().
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_ARENA_H
+#define THUMBNAIL_ARENA_H
+
+#include <glib.h>
+
+#define THUMBNAIL_ARENA_CHUNK_SIZE 16384
+
+typedef struct ThumbnailArena ThumbnailArena;
+
+/**
+ * Create an arena with one chunk of THUMBNAIL_ARENA_CHUNK_SIZE bytes.
+ */
+ThumbnailArena *thumbnail_arena_new(void);
+
+/**
+ * Free the arena and everything allocated from it.
+ */
+void thumbnail_arena_free(ThumbnailArena *arena);
+
+/**
+ * The calling thread's job arena, created on first use.
+ */
+ThumbnailArena *thumbnail_arena_for_thread(void);
+
+/**
+ * Free the calling thread's job arena, first chunk included; the next
+ * thumbnail_arena_for_thread() creates a new one.  Only call this
+ * between jobs.
+ */
+void thumbnail_arena_release_thread(void);
+
+/**
+ * Allocate size bytes (pointer aligned, uninitialized).  Requests that
+ * do not fit the current chunk get a chunk of their own.
+ */
+gpointer thumbnail_arena_alloc(ThumbnailArena *arena, gsize size);
+
+/**
+ * Copy at most n bytes of str into the arena, NUL-terminated.
+ */
+gchar *thumbnail_arena_strndup(ThumbnailArena *arena, const gchar *str, gsize n);
+
+/**
+ * Copy str into the arena.
+ */
+gchar *thumbnail_arena_strdup(ThumbnailArena *arena, const gchar *str);
+
+/**
+ * Join two path elements with a single '/'.
+ */
+gchar *thumbnail_arena_build_path(ThumbnailArena *arena, const gchar *dir, const gchar *name);
+
+/**
+ * printf() into the arena.
+ */
+gchar *thumbnail_arena_printf(ThumbnailArena *arena, const gchar *format, ...) G_GNUC_PRINTF(2, 3);
+
+/**
+ * Rewind the arena at the end of a job, keeping its first chunk and
+ * releasing any overflow chunks.
+ *
+ * @param job Name used in the per-job allocation statistics (debug log)
+ */
+void thumbnail_arena_reset(ThumbnailArena *arena, const char *job);
+
+#endif /* THUMBNAIL_ARENA_H */
@@ -0,0 +1,449 @@
+/*
+ * thumbnail-backend.c - Extraction backends and their registry
+ *
+ * State file: a key file with one group per backend and payload format
+ * ("unsquashfs:unknown") holding the window of outcomes, oldest first,
+ * the run of consecutive failures and when an open circuit closes again.
+ * Concurrent processes may overwrite each other's latest samples, which
+ * only slows the learning down.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-backend.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "dwarfs-extract.h"
+#include "squashfs-extract.h"
+
+/* Outcomes remembered per backend and format */
+#define BACKEND_WINDOW 16
+#define BACKEND_FORMATS 3
+/* How long an open circuit keeps a backend out of the plans */
+#define CIRCUIT_COOLDOWN_USEC (10 * 60 * G_USEC_PER_SEC)
+/* Writes of the state file are at most this frequent, unless a circuit
+ * opens or closes */
+#define SAVE_INTERVAL_USEC (5 * G_USEC_PER_SEC)
+/* Success rate below which a backend's cost stops growing */
+#define MIN_SUCCESS_RATE 0.05
+
+typedef struct {
+    guint    n;                      /* outcomes in the window */
+    gboolean ok[BACKEND_WINDOW];
+    gint     usec[BACKEND_WINDOW];
+    guint    failures;               /* consecutive failures */
+    gint64   open_until;             /* wall clock, 0 when closed */
+} BackendStats;
+
+static const char *const format_keys[BACKEND_FORMATS] = {
+    [APPIMAGE_FORMAT_UNKNOWN]  = "unknown",
+    [APPIMAGE_FORMAT_SQUASHFS] = "squashfs",
+    [APPIMAGE_FORMAT_DWARFS]   = "dwarfs",
+};
+
+/* Expected latency of a backend before it has any record: spawning a
+ * tool costs tens of milliseconds, the in-process reader a few. */
+static const double prior_usec[THUMBNAIL_BACKEND_COUNT] = {
+    [THUMBNAIL_BACKEND_READER]        = 2000,
+    [THUMBNAIL_BACKEND_UNSQUASHFS]    = 20000,
+    [THUMBNAIL_BACKEND_DWARFSEXTRACT] = 30000,
+};
+
+static GMutex stats_lock;
+static gboolean stats_loaded = FALSE;
+static gint64 last_save = 0;
+static BackendStats stats[THUMBNAIL_BACKEND_COUNT][BACKEND_FORMATS];
+
+/* ------------------------------------------------------------------ */
+/*  Link resolution                                                   */
+/* ------------------------------------------------------------------ */
+
+/* Relative targets start from the link's directory, absolute ones from
+ * the image root; "." and ".." are folded so every backend gets a plain
+ * path without a leading slash. */
+static const gchar *
+resolve_in_image(const ThumbnailBackendImage *image, const char *entry, const char *target)
+{
+    while (*entry == '/')
+        entry++;
+
+    gchar *path = thumbnail_arena_alloc(image->arena, strlen(entry) + strlen(target) + 2);
+    gsize len = 0;
+
+    const char *slash = strrchr(entry, '/');
+    if (target[0] != '/' && slash) {
+        len = (gsize)(slash - entry);
+        memcpy(path, entry, len);
+    }
+
+    for (const char *p = target; *p != '\0';) {
+        while (*p == '/')
+            p++;
+        const gsize n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.') {
+            if (len == 0) {
+                g_debug("resolve_in_image: '%s' in '%s' leaves the image", target, entry);
+                return NULL;
+            }
+            while (len > 0 && path[len - 1] != '/')
+                len--;
+            if (len > 0)
+                len--;
+        } else if (n > 0 && !(n == 1 && p[0] == '.')) {
+            if (len > 0)
+                path[len++] = '/';
+            memcpy(path + len, p, n);
+            len += n;
+        }
+        p += n;
+    }
+    path[len] = '\0';
+    return len > 0 ? path : NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Backends                                                          */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+probe_reader(const ThumbnailBackendImage *image)
+{
+    return image->reader && image->format == APPIMAGE_FORMAT_SQUASHFS
+           && squashfs_compression_native(image->compression);
+}
+
+static gboolean
+extract_reader(const ThumbnailBackendImage *image, const char *entry,
+               GBytes **output, SquashfsLocation **location)
+{
+    return squashfs_read_entry(image->reader, image->offset, entry, output, location);
+}
+
+static gboolean
+probe_unsquashfs(const ThumbnailBackendImage *image)
+{
+    return !image->remote && image->offset > 0
+           && thumbnail_backend_available(THUMBNAIL_BACKEND_UNSQUASHFS, image->format)
+           && (image->compression == 0 || squashfs_tools_support(image->compression));
+}
+
+static gboolean
+extract_unsquashfs(const ThumbnailBackendImage *image, const char *entry,
+                   GBytes **output, SquashfsLocation **location G_GNUC_UNUSED)
+{
+    return squashfs_extract_entry(image->archive, entry, image->offset, image->arena, output);
+}
+
+static gboolean
+probe_dwarfsextract(const ThumbnailBackendImage *image)
+{
+    return !image->remote
+           && thumbnail_backend_available(THUMBNAIL_BACKEND_DWARFSEXTRACT, image->format);
+}
+
+static gboolean
+extract_dwarfsextract(const ThumbnailBackendImage *image, const char *entry,
+                      GBytes **output, SquashfsLocation **location G_GNUC_UNUSED)
+{
+    return dwarfs_extract_entry(image->archive, entry, image->arena, output);
+}
+
+static const ThumbnailBackendOps backends[THUMBNAIL_BACKEND_COUNT] = {
+    [THUMBNAIL_BACKEND_READER] = {
+        THUMBNAIL_BACKEND_READER, "reader",
+        probe_reader, extract_reader, resolve_in_image,
+    },
+    [THUMBNAIL_BACKEND_UNSQUASHFS] = {
+        THUMBNAIL_BACKEND_UNSQUASHFS, "unsquashfs",
+        probe_unsquashfs, extract_unsquashfs, resolve_in_image,
+    },
+    [THUMBNAIL_BACKEND_DWARFSEXTRACT] = {
+        THUMBNAIL_BACKEND_DWARFSEXTRACT, "dwarfsextract",
+        probe_dwarfsextract, extract_dwarfsextract, resolve_in_image,
+    },
+};
+
+const char *
+thumbnail_backend_name(ThumbnailBackend backend)
+{
+    if (backend == THUMBNAIL_BACKEND_AUTO)
+        return "auto";
+    return backend < THUMBNAIL_BACKEND_COUNT ? backends[backend].name : "unknown";
+}
+
+gboolean
+thumbnail_backend_from_name(const char *name, ThumbnailBackend *backend)
+{
+    for (guint i = 0; i < THUMBNAIL_BACKEND_COUNT; ++i) {
+        if (g_strcmp0(name, thumbnail_backend_name((ThumbnailBackend)i)) == 0) {
+            *backend = (ThumbnailBackend)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+gboolean
+thumbnail_backend_available(ThumbnailBackend backend, AppImageFormat format)
+{
+    switch (backend) {
+    case THUMBNAIL_BACKEND_AUTO:
+        return TRUE;
+    case THUMBNAIL_BACKEND_READER:
+        return format == APPIMAGE_FORMAT_SQUASHFS;
+    case THUMBNAIL_BACKEND_UNSQUASHFS:
+        return format != APPIMAGE_FORMAT_DWARFS && squashfs_tools_available();
+    case THUMBNAIL_BACKEND_DWARFSEXTRACT:
+        return format != APPIMAGE_FORMAT_SQUASHFS && dwarfs_tools_available();
+    default:
+        return FALSE;
+    }
+}
+
+const ThumbnailBackendOps *
+thumbnail_backend_ops(ThumbnailBackend backend)
+{
+    if (backend == THUMBNAIL_BACKEND_AUTO || backend >= THUMBNAIL_BACKEND_COUNT)
+        return NULL;
+    return &backends[backend];
+}
+
+/* ------------------------------------------------------------------ */
+/*  Outcome record                                                    */
+/* ------------------------------------------------------------------ */
+
+static gchar *
+state_path(void)
+{
+    return g_build_filename(g_get_user_cache_dir(), "appimage-thumbnailer", "backends", NULL);
+}
+
+static gchar *
+group_name(guint backend, guint format)
+{
+    return g_strdup_printf("%s:%s", backends[backend].name, format_keys[format]);
+}
+
+/* Called with stats_lock held */
+static void
+load_state(void)
+{
+    if (stats_loaded)
+        return;
+    stats_loaded = TRUE;
+
+    GKeyFile *file = g_key_file_new();
+    gchar *path = state_path();
+    if (!g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, NULL)) {
+        g_key_file_free(file);
+        g_free(path);
+        return;
+    }
+
+    for (guint b = THUMBNAIL_BACKEND_READER; b < THUMBNAIL_BACKEND_COUNT; ++b) {
+        for (guint f = 0; f < BACKEND_FORMATS; ++f) {
+            gchar *group = group_name(b, f);
+            gsize n_ok = 0;
+            gsize n_usec = 0;
+            gint *ok = g_key_file_get_integer_list(file, group, "ok", &n_ok, NULL);
+            gint *usec = g_key_file_get_integer_list(file, group, "usec", &n_usec, NULL);
+
+            BackendStats *s = &stats[b][f];
+            s->n = (guint)MIN(MIN(n_ok, n_usec), (gsize)BACKEND_WINDOW);
+            for (guint i = 0; i < s->n; ++i) {
+                s->ok[i] = ok[i] != 0;
+                s->usec[i] = MAX(usec[i], 0);
+            }
+            s->failures = (guint)MAX(g_key_file_get_integer(file, group, "failures", NULL), 0);
+            s->open_until = g_key_file_get_int64(file, group, "open-until", NULL);
+
+            g_free(ok);
+            g_free(usec);
+            g_free(group);
+        }
+    }
+
+    g_key_file_free(file);
+    g_free(path);
+}
+
+/* Called with stats_lock held */
+static gchar *
+serialize_state(gsize *length)
+{
+    GKeyFile *file = g_key_file_new();
+
+    for (guint b = THUMBNAIL_BACKEND_READER; b < THUMBNAIL_BACKEND_COUNT; ++b) {
+        for (guint f = 0; f < BACKEND_FORMATS; ++f) {
+            const BackendStats *s = &stats[b][f];
+            if (s->n == 0 && s->open_until == 0)
+                continue;
+
+            gint ok[BACKEND_WINDOW];
+            for (guint i = 0; i < s->n; ++i)
+                ok[i] = s->ok[i];
+
+            gchar *group = group_name(b, f);
+            g_key_file_set_integer_list(file, group, "ok", ok, s->n);
+            g_key_file_set_integer_list(file, group, "usec", s->usec, s->n);
+            g_key_file_set_integer(file, group, "failures", (gint)s->failures);
+            g_key_file_set_int64(file, group, "open-until", s->open_until);
+            g_free(group);
+        }
+    }
+
+    gchar *data = g_key_file_to_data(file, length, NULL);
+    g_key_file_free(file);
+    return data;
+}
+
+static void
+write_state(const gchar *data, gsize length)
+{
+    gchar *path = state_path();
+    gchar *dir = g_path_get_dirname(path);
+
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_debug("write_state: cannot create '%s': %s", dir, g_strerror(errno));
+    } else if (!g_file_set_contents(path, data, (gssize)length, &error)) {
+        g_debug("write_state: %s", error->message);
+        g_error_free(error);
+    }
+
+    g_free(dir);
+    g_free(path);
+}
+
+/* Mean latency over the window, the prior counting as one sample,
+ * divided by the success rate (Laplace-smoothed, so an empty record
+ * scores 1/2 and one bad outcome does not bury a backend). */
+static double
+expected_cost(ThumbnailBackend backend, const BackendStats *s)
+{
+    double latency = prior_usec[backend];
+    guint ok = 0;
+    for (guint i = 0; i < s->n; ++i) {
+        latency += s->usec[i];
+        ok += s->ok[i] ? 1 : 0;
+    }
+    latency /= s->n + 1;
+
+    const double success = (ok + 1.0) / (s->n + 2.0);
+    return latency / MAX(success, MIN_SUCCESS_RATE);
+}
+
+void
+thumbnail_backend_record(ThumbnailBackend backend, AppImageFormat format,
+                         gboolean ok, gint64 elapsed_usec)
+{
+    if (backend == THUMBNAIL_BACKEND_AUTO || backend >= THUMBNAIL_BACKEND_COUNT
+        || (guint)format >= BACKEND_FORMATS)
+        return;
+
+    const gint64 now = g_get_real_time();
+    gchar *data = NULL;
+    gsize length = 0;
+
+    g_mutex_lock(&stats_lock);
+    load_state();
+
+    BackendStats *s = &stats[backend][format];
+    if (s->n == BACKEND_WINDOW) {
+        memmove(s->ok, s->ok + 1, (BACKEND_WINDOW - 1) * sizeof(s->ok[0]));
+        memmove(s->usec, s->usec + 1, (BACKEND_WINDOW - 1) * sizeof(s->usec[0]));
+        s->n--;
+    }
+    s->ok[s->n] = ok;
+    s->usec[s->n] = (gint)CLAMP(elapsed_usec, 0, G_MAXINT);
+    s->n++;
+
+    gboolean changed = FALSE;
+    if (ok) {
+        changed = s->open_until != 0;
+        s->failures = 0;
+        s->open_until = 0;
+    } else if (++s->failures >= THUMBNAIL_BACKEND_CIRCUIT_FAILURES) {
+        changed = TRUE;
+        s->open_until = now + CIRCUIT_COOLDOWN_USEC;
+        g_debug("thumbnail_backend_record: %s failed %u times in a row on %s images, "
+                "skipping it for %d s", backends[backend].name, s->failures,
+                format_keys[format], (int)(CIRCUIT_COOLDOWN_USEC / G_USEC_PER_SEC));
+    }
+
+    if (changed || now - last_save >= SAVE_INTERVAL_USEC) {
+        data = serialize_state(&length);
+        last_save = now;
+    }
+    g_mutex_unlock(&stats_lock);
+
+    if (data) {
+        write_state(data, length);
+        g_free(data);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Planning                                                          */
+/* ------------------------------------------------------------------ */
+
+guint
+thumbnail_backend_plan(const ThumbnailBackendImage *image, ThumbnailBackend forced,
+                       const ThumbnailBackendOps **plan)
+{
+    if (forced != THUMBNAIL_BACKEND_AUTO) {
+        const ThumbnailBackendOps *ops = thumbnail_backend_ops(forced);
+        if (!ops || !ops->probe(image))
+            return 0;
+        plan[0] = ops;
+        return 1;
+    }
+
+    /* Probes may look for tools; keep them out of the lock */
+    gboolean capable[THUMBNAIL_BACKEND_COUNT] = { FALSE };
+    for (guint b = THUMBNAIL_BACKEND_READER; b < THUMBNAIL_BACKEND_COUNT; ++b)
+        capable[b] = backends[b].probe(image);
+
+    const guint format = (guint)image->format < BACKEND_FORMATS ? (guint)image->format
+                                                                 : APPIMAGE_FORMAT_UNKNOWN;
+    const gint64 now = g_get_real_time();
+    double cost[THUMBNAIL_BACKEND_COUNT];
+    guint n = 0;
+
+    g_mutex_lock(&stats_lock);
+    load_state();
+    for (guint b = THUMBNAIL_BACKEND_READER; b < THUMBNAIL_BACKEND_COUNT; ++b) {
+        if (!capable[b])
+            continue;
+
+        const BackendStats *s = &stats[b][format];
+        if (s->open_until > now) {
+            g_debug("thumbnail_backend_plan: circuit of %s open for %s images",
+                    backends[b].name, format_keys[format]);
+            continue;
+        }
+
+        /* Insertion sort, cheapest first */
+        const double c = expected_cost((ThumbnailBackend)b, s);
+        guint at = n++;
+        for (; at > 0 && cost[at - 1] > c; --at) {
+            plan[at] = plan[at - 1];
+            cost[at] = cost[at - 1];
+        }
+        plan[at] = &backends[b];
+        cost[at] = c;
+    }
+    g_mutex_unlock(&stats_lock);
+
+    for (guint i = 0; i < n; ++i)
+        g_debug("thumbnail_backend_plan: %u. %s (expected %.1f ms)", i + 1, plan[i]->name,
+                cost[i] / 1000.0);
+    return n;
+}
@@ -0,0 +1,125 @@
+/*
+ * thumbnail-backend.h - Extraction backends and their registry
+ *
+ * Every way of getting an entry out of an AppImage (the in-process
+ * SquashFS reader, unsquashfs, dwarfsextract) implements one interface:
+ * a capability probe for a given image, the extraction itself, and the
+ * resolution of a symlink or pointer target into the next entry to read.
+ *
+ * The registry plans the backends for an image: those whose probe
+ * accepts it, cheapest expected cost first.  The cost is learned per
+ * backend and payload format from the last outcomes on this host (mean
+ * latency divided by success rate), kept in
+ * $XDG_CACHE_HOME/appimage-thumbnailer/backends so one-shot thumbnailer
+ * runs learn as well.  A failure only counts against a backend when
+ * another one then read the same entry, so broken images do not.  After
+ * THUMBNAIL_BACKEND_CIRCUIT_FAILURES such failures in a row the backend
+ * is skipped for that format for a while, then given one more try.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_BACKEND_H
+#define THUMBNAIL_BACKEND_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+#include "appimage-reader.h"
+#include "appimage-type.h"
+#include "squashfs-reader.h"
+#include "thumbnail-arena.h"
+
+#define THUMBNAIL_BACKEND_CIRCUIT_FAILURES 5
+
+/*
+ * Extraction backends.  THUMBNAIL_BACKEND_AUTO uses the shortcuts (icons
+ * installed by desktop integrators, the icon index) and then the planned
+ * backends in turn.  Any other backend is used alone, without the
+ * shortcuts, to benchmark or cross-check it.  Remote URIs are always read
+ * in-process.
+ */
+typedef enum {
+    THUMBNAIL_BACKEND_AUTO = 0,
+    THUMBNAIL_BACKEND_READER,        /* in-process SquashFS reader */
+    THUMBNAIL_BACKEND_UNSQUASHFS,
+    THUMBNAIL_BACKEND_DWARFSEXTRACT,
+    THUMBNAIL_BACKEND_COUNT
+} ThumbnailBackend;
+
+/* The image an extraction works on */
+typedef struct {
+    const char     *archive;     /* local path or URI */
+    gboolean        remote;      /* @archive is a URI, only readable in-process */
+    AppImageReader *reader;      /* open reader for @archive, or NULL */
+    AppImageFormat  format;
+    off_t           offset;
+    guint16         compression; /* SquashFS compressor id, 0 if not known */
+    ThumbnailArena *arena;       /* job arena for scratch strings */
+} ThumbnailBackendImage;
+
+typedef struct {
+    ThumbnailBackend id;
+    const char      *name;
+
+    /* Whether the backend can read @image on this host, from its format,
+     * locality and compressor; cheap, no I/O on the image itself. */
+    gboolean (*probe)(const ThumbnailBackendImage *image);
+
+    /* Read @entry; a symlink yields its target text.  @location is only
+     * set by backends that know where the bytes live. */
+    gboolean (*extract)(const ThumbnailBackendImage *image, const char *entry,
+                        GBytes **output, SquashfsLocation **location);
+
+    /* The entry a symlink or pointer @target found in @entry refers to,
+     * in the job arena, or NULL if it leaves the image. */
+    const gchar *(*resolve_link)(const ThumbnailBackendImage *image, const char *entry,
+                                 const char *target);
+} ThumbnailBackendOps;
+
+/**
+ * Name of a backend ("auto", "reader", "unsquashfs", "dwarfsextract").
+ */
+const char *thumbnail_backend_name(ThumbnailBackend backend);
+
+/**
+ * Look up a backend by name.
+ *
+ * @return TRUE if @name is a backend
+ */
+gboolean thumbnail_backend_from_name(const char *name, ThumbnailBackend *backend);
+
+/**
+ * @return TRUE if @backend is installed and can read images of @format
+ */
+gboolean thumbnail_backend_available(ThumbnailBackend backend, AppImageFormat format);
+
+/**
+ * @return The operations of @backend, or NULL for THUMBNAIL_BACKEND_AUTO
+ */
+const ThumbnailBackendOps *thumbnail_backend_ops(ThumbnailBackend backend);
+
+/**
+ * Order the backends to try for an image.  A forced backend is planned
+ * alone if its probe accepts the image, whatever its record.
+ *
+ * @param image  The image to read
+ * @param forced THUMBNAIL_BACKEND_AUTO, or the only backend to plan
+ * @param plan   Receives up to THUMBNAIL_BACKEND_COUNT backends
+ * @return Number of backends planned
+ */
+guint thumbnail_backend_plan(const ThumbnailBackendImage *image, ThumbnailBackend forced,
+                             const ThumbnailBackendOps **plan);
+
+/**
+ * Add an outcome to a backend's record for a payload format.
+ *
+ * @param backend      Backend that was tried
+ * @param format       Payload format of the image
+ * @param ok           TRUE if the backend read the entry
+ * @param elapsed_usec Time the attempt took
+ */
+void thumbnail_backend_record(ThumbnailBackend backend, AppImageFormat format,
+                              gboolean ok, gint64 elapsed_usec);
+
+#endif /* THUMBNAIL_BACKEND_H */
@@ -0,0 +1,240 @@
+/*
+ * thumbnail-cache.c - freedesktop.org thumbnail cache support
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "thumbnail-pipeline.h"
+#include "thumbnail-usdt.h"
+
+#ifndef APPIMAGE_THUMBNAILER_VERSION
+#define APPIMAGE_THUMBNAILER_VERSION "unknown"
+#endif
+
+static const struct {
+    const char *name;
+    int size;
+} FLAVORS[] = {
+    { "normal",   128  },
+    { "large",    256  },
+    { "x-large",  512  },
+    { "xx-large", 1024 },
+};
+
+int
+thumbnail_cache_flavor_size(const char *flavor)
+{
+    for (gsize i = 0; flavor && i < G_N_ELEMENTS(FLAVORS); ++i) {
+        if (strcmp(flavor, FLAVORS[i].name) == 0)
+            return FLAVORS[i].size;
+    }
+    return 0;
+}
+
+gchar *
+thumbnail_cache_path(const char *uri, const char *flavor)
+{
+    gchar *md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+    gchar *name = g_strconcat(md5, ".png", NULL);
+    gchar *path = g_build_filename(g_get_user_cache_dir(), "thumbnails", flavor, name, NULL);
+    g_free(name);
+    g_free(md5);
+    return path;
+}
+
+const char *
+thumbnail_cache_flavor_for_size(int size)
+{
+    for (gsize i = 0; i < G_N_ELEMENTS(FLAVORS); ++i) {
+        if (FLAVORS[i].size >= size)
+            return FLAVORS[i].name;
+    }
+    return NULL;
+}
+
+/* Atomically write @pixbuf to @path with the spec's text attributes.
+ * Shared repositories are read by every user of the share; the personal
+ * cache is private. */
+static gboolean
+write_thumbnail(GdkPixbuf *pixbuf, const char *path, const char *uri, gint64 mtime,
+                gboolean shared)
+{
+    gchar *dir = g_path_get_dirname(path);
+
+    if (g_mkdir_with_parents(dir, shared ? 0755 : 0700) < 0) {
+        g_debug("write_thumbnail: cannot create '%s': %s", dir, g_strerror(errno));
+        g_free(dir);
+        return FALSE;
+    }
+
+    gchar *tmp_path = g_strconcat(path, ".XXXXXX", NULL);
+    int fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, shared ? 0644 : 0600);
+    if (fd < 0) {
+        g_debug("write_thumbnail: cannot create temp file in '%s': %s",
+                dir, g_strerror(errno));
+        g_free(tmp_path);
+        g_free(dir);
+        return FALSE;
+    }
+
+    gchar *mtime_str = g_strdup_printf("%" G_GINT64_FORMAT, mtime);
+    const char *text[] = {
+        "Thumb::URI", uri,
+        "Thumb::MTime", mtime_str,
+        "Software", "appimage-thumbnailer " APPIMAGE_THUMBNAILER_VERSION,
+        NULL
+    };
+
+    gboolean ok = thumbnail_pipeline_write_png_fd(pixbuf, fd, text);
+    if (close(fd) < 0)
+        ok = FALSE;
+
+    if (ok && g_rename(tmp_path, path) < 0) {
+        g_debug("write_thumbnail: rename to '%s' failed: %s", path, g_strerror(errno));
+        ok = FALSE;
+    }
+    if (!ok)
+        g_unlink(tmp_path);
+    else
+        g_debug("write_thumbnail: wrote '%s' for '%s'", path, uri);
+
+    g_free(mtime_str);
+    g_free(tmp_path);
+    g_free(dir);
+    return ok;
+}
+
+gboolean
+thumbnail_cache_save(GdkPixbuf *pixbuf, const char *uri, gint64 mtime, const char *flavor)
+{
+    gchar *path = thumbnail_cache_path(uri, flavor);
+    gboolean ok = write_thumbnail(pixbuf, path, uri, mtime, FALSE);
+    g_free(path);
+    return ok;
+}
+
+/* Whether a thumbnail file was rendered from a file with this mtime */
+static GdkPixbuf *
+load_current(const char *path, gint64 mtime)
+{
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, NULL);
+    if (!pixbuf)
+        return NULL;
+
+    const char *recorded = gdk_pixbuf_get_option(pixbuf, "tEXt::Thumb::MTime");
+    if (!recorded || g_ascii_strtoll(recorded, NULL, 10) != mtime)
+        g_clear_object(&pixbuf);
+    return pixbuf;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Shared repository                                                 */
+/* ------------------------------------------------------------------ */
+
+gchar *
+thumbnail_cache_shared_path(const char *path, const char *flavor)
+{
+    gchar *dir = g_path_get_dirname(path);
+    gchar *base = g_path_get_basename(path);
+    gchar *md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, base, -1);
+    gchar *name = g_strconcat(md5, ".png", NULL);
+    gchar *shared = g_build_filename(dir, ".sh_thumbnails", flavor, name, NULL);
+    g_free(name);
+    g_free(md5);
+    g_free(base);
+    g_free(dir);
+    return shared;
+}
+
+GdkPixbuf *
+thumbnail_cache_load_shared(const char *path, gint64 mtime, const char *flavor)
+{
+    gchar *shared = thumbnail_cache_shared_path(path, flavor);
+    GdkPixbuf *pixbuf = load_current(shared, mtime);
+    if (pixbuf) {
+        g_debug("thumbnail_cache_load_shared: using '%s'", shared);
+        THUMBNAIL_USDT2(cache__hit, "shared", thumbnail_cache_flavor_size(flavor));
+    } else {
+        THUMBNAIL_USDT2(cache__miss, "shared", thumbnail_cache_flavor_size(flavor));
+    }
+    g_free(shared);
+    return pixbuf;
+}
+
+gboolean
+thumbnail_cache_save_shared(GdkPixbuf *pixbuf, const char *path, gint64 mtime,
+                            const char *flavor)
+{
+    /* The spec keys shared thumbnails by the relative name, so the
+     * repository stays valid wherever the share is mounted */
+    gchar *shared = thumbnail_cache_shared_path(path, flavor);
+    gchar *base = g_path_get_basename(path);
+    gboolean ok = write_thumbnail(pixbuf, shared, base, mtime, TRUE);
+    g_free(base);
+    g_free(shared);
+    return ok;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Failure cache                                                     */
+/* ------------------------------------------------------------------ */
+
+static gchar *
+failure_path(const char *uri)
+{
+    gchar *md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+    gchar *name = g_strconcat(md5, ".png", NULL);
+    gchar *path = g_build_filename(g_get_user_cache_dir(), "thumbnails", "fail",
+                                   "appimage-thumbnailer", name, NULL);
+    g_free(name);
+    g_free(md5);
+    return path;
+}
+
+gboolean
+thumbnail_cache_save_failure(const char *uri, gint64 mtime)
+{
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
+    if (!pixbuf)
+        return FALSE;
+    gdk_pixbuf_fill(pixbuf, 0);
+
+    gchar *path = failure_path(uri);
+    gboolean ok = write_thumbnail(pixbuf, path, uri, mtime, FALSE);
+    g_free(path);
+    g_object_unref(pixbuf);
+    return ok;
+}
+
+gboolean
+thumbnail_cache_has_failure(const char *uri, gint64 mtime)
+{
+    gchar *path = failure_path(uri);
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        g_free(path);
+        return FALSE;
+    }
+
+    GdkPixbuf *pixbuf = load_current(path, mtime);
+    const gboolean current = pixbuf != NULL;
+    if (!current) {
+        g_debug("thumbnail_cache_has_failure: dropping stale entry for '%s'", uri);
+        g_unlink(path);
+    }
+
+    g_clear_object(&pixbuf);
+    g_free(path);
+    return current;
+}
@@ -0,0 +1,100 @@
+/*
+ * thumbnail-cache.h - freedesktop.org thumbnail cache support
+ *
+ * Implements the parts of the thumbnail specification the service mode
+ * needs: flavor sizes, the $XDG_CACHE_HOME/thumbnails/<flavor>/<md5>.png
+ * naming scheme, atomically writing a PNG with the Thumb::URI and
+ * Thumb::MTime attributes, the per-application failure cache, and shared
+ * repositories (<dir>/.sh_thumbnails/<flavor>/<md5 of the file name>.png),
+ * which let one admin job thumbnail a read-mostly share for all users.
+ *
+ * <https://specifications.freedesktop.org/thumbnail-spec/latest>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_CACHE_H
+#define THUMBNAIL_CACHE_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+
+/**
+ * Return the edge length for a thumbnail flavor ("normal", "large",
+ * "x-large", "xx-large"), or 0 for an unknown flavor.
+ */
+int thumbnail_cache_flavor_size(const char *flavor);
+
+/**
+ * Return the smallest flavor whose thumbnails are at least @size pixels,
+ * or NULL if @size exceeds every flavor.
+ */
+const char *thumbnail_cache_flavor_for_size(int size);
+
+/**
+ * Build the cache path for a URI and flavor.
+ *
+ * @return Newly allocated path (caller frees)
+ */
+gchar *thumbnail_cache_path(const char *uri, const char *flavor);
+
+/**
+ * Write a thumbnail to its spec location, creating the flavor directory
+ * as needed.  The PNG is written to a temporary file and renamed into
+ * place so readers never see a partial thumbnail.
+ *
+ * @param pixbuf Rendered thumbnail
+ * @param uri    URI of the original file (stored as Thumb::URI)
+ * @param mtime  Modification time of the original (stored as Thumb::MTime)
+ * @param flavor Thumbnail flavor
+ * @return TRUE on success
+ */
+gboolean thumbnail_cache_save(GdkPixbuf *pixbuf, const char *uri, gint64 mtime,
+                              const char *flavor);
+
+/**
+ * Build the shared repository path of a local file for a flavor.
+ *
+ * @return Newly allocated path (caller frees)
+ */
+gchar *thumbnail_cache_shared_path(const char *path, const char *flavor);
+
+/**
+ * Load a thumbnail from the shared repository next to a file, if one
+ * exists and was rendered from the same mtime.
+ *
+ * @param path   Local path of the original file
+ * @param mtime  Current modification time of the original
+ * @param flavor Thumbnail flavor
+ * @return The thumbnail (caller unrefs), or NULL
+ */
+GdkPixbuf *thumbnail_cache_load_shared(const char *path, gint64 mtime, const char *flavor);
+
+/**
+ * Write a thumbnail into the shared repository next to a file.  The
+ * directories and the PNG are world-readable, and Thumb::URI holds the
+ * file name relative to the repository.
+ *
+ * @return TRUE on success
+ */
+gboolean thumbnail_cache_save_shared(GdkPixbuf *pixbuf, const char *path, gint64 mtime,
+                                     const char *flavor);
+
+/**
+ * Record a failed thumbnail in $XDG_CACHE_HOME/thumbnails/fail/
+ * appimage-thumbnailer/, as the spec describes: an empty PNG carrying
+ * Thumb::URI and Thumb::MTime, so the entry lapses once the file changes.
+ *
+ * @param uri   URI of the original file
+ * @param mtime Modification time of the original
+ * @return TRUE on success
+ */
+gboolean thumbnail_cache_save_failure(const char *uri, gint64 mtime);
+
+/**
+ * Whether a failure entry for @uri with the same mtime exists.  Entries
+ * recorded for an older mtime are removed.
+ */
+gboolean thumbnail_cache_has_failure(const char *uri, gint64 mtime);
+
+#endif /* THUMBNAIL_CACHE_H */
@@ -0,0 +1,819 @@
+/*
+ * thumbnail-dbus.c - D-Bus frontend for the appimage-thumbnailer service
+ *
+ * Jobs are processed one URI per main loop iteration so socket clients
+ * and D-Bus callers interleave instead of waiting for whole batches.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-dbus.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "appimage-reader.h"
+#include "appimage-type.h"
+#include "thumbnail-cache.h"
+#include "thumbnail-layout.h"
+#include "thumbnail-pipeline.h"
+#include "thumbnail-recorder.h"
+#include "thumbnail-server.h"
+#include "thumbnail-usdt.h"
+#include "thumbnail-xattr.h"
+#include "thumbnail-zygote.h"
+
+/* Budget of each URI of a "foreground" job, counted from when the job
+ * was queued */
+#define FOREGROUND_DEADLINE_MS 50
+
+/* Success statuses outside the 1 + ThumbnailDBusError range: a URI was
+ * rendered below its preset to meet the deadline, or only a preview was
+ * written and the full render still has to follow */
+#define STATUS_DEGRADED 0x40
+#define STATUS_PREVIEW  0x20
+
+typedef struct DBusJob DBusJob;
+
+struct DBusJob {
+    guint handle;
+    gchar **uris;
+    guint next;
+    gchar *flavor;
+    int size;
+    gboolean started;
+    gboolean dispatched; /* every URI handed out, no longer queued */
+    guint in_flight;     /* URIs currently rendering in workers */
+    ThumbnailQuality quality;
+    guint deadline_ms;   /* per-URI budget, 0 = none */
+    gint64 received;     /* monotonic time the job was queued */
+    gboolean progressive; /* write a preview of expensive icons first */
+    DBusJob *parent;     /* follow-up render reporting under the parent's handle */
+    gboolean follow_up;  /* reports Ready/Error only, no Started/Finished */
+    gboolean sorting;    /* URIs being put in disk order in a worker thread */
+    gboolean sorted;
+};
+
+typedef struct {
+    DBusJob *job;
+    gchar *uri;
+} DBusWorkItem;
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='" THUMBNAIL_DBUS_INTERFACE "'>"
+    "    <method name='Queue'>"
+    "      <arg type='as' name='uris' direction='in'/>"
+    "      <arg type='s' name='flavor' direction='in'/>"
+    "      <arg type='s' name='scheduler' direction='in'/>"
+    "      <arg type='u' name='handle' direction='out'/>"
+    "    </method>"
+    "    <method name='Dequeue'>"
+    "      <arg type='u' name='handle' direction='in'/>"
+    "    </method>"
+    "    <signal name='Started'>"
+    "      <arg type='u' name='handle'/>"
+    "    </signal>"
+    "    <signal name='Ready'>"
+    "      <arg type='u' name='handle'/>"
+    "      <arg type='as' name='uris'/>"
+    "    </signal>"
+    "    <signal name='Error'>"
+    "      <arg type='u' name='handle'/>"
+    "      <arg type='as' name='failed_uris'/>"
+    "      <arg type='i' name='error_code'/>"
+    "      <arg type='s' name='message'/>"
+    "    </signal>"
+    "    <signal name='Finished'>"
+    "      <arg type='u' name='handle'/>"
+    "    </signal>"
+    "  </interface>"
+    "</node>";
+
+static GDBusConnection *bus_connection = NULL;
+static GDBusNodeInfo *introspection_data = NULL;
+static guint owner_id = 0;
+static guint registration_id = 0;
+static guint process_source_id = 0;
+static guint next_handle = 1;
+static GQueue jobs = G_QUEUE_INIT;
+static GHashTable *work_items = NULL; /* worker job id -> DBusWorkItem */
+static guint32 next_work_id = 1;
+static gboolean refine_degraded = FALSE;
+static gboolean progressive_delivery = FALSE;
+static gboolean layout_order = FALSE;
+
+/* ------------------------------------------------------------------ */
+/*  Jobs                                                              */
+/* ------------------------------------------------------------------ */
+
+static void
+dbus_job_free(DBusJob *job)
+{
+    g_strfreev(job->uris);
+    g_free(job->flavor);
+    g_free(job);
+}
+
+static void
+emit_signal(const char *name, GVariant *parameters)
+{
+    if (!bus_connection) {
+        g_variant_unref(g_variant_ref_sink(parameters));
+        return;
+    }
+
+    g_dbus_connection_emit_signal(bus_connection, NULL, THUMBNAIL_DBUS_PATH,
+                                  THUMBNAIL_DBUS_INTERFACE, name, parameters, NULL);
+}
+
+static void
+emit_uri_signal(guint handle, const char *uri, gboolean ok, int code, const char *message)
+{
+    const gchar *uris[] = { uri, NULL };
+
+    if (ok)
+        emit_signal("Ready", g_variant_new("(u^as)", handle, uris));
+    else
+        emit_signal("Error", g_variant_new("(u^asis)", handle, uris, code, message));
+}
+
+static const char *
+error_message(ThumbnailDBusError code)
+{
+    switch (code) {
+    case THUMBNAIL_DBUS_ERROR_UNSUPPORTED:
+        return "Only local files are supported";
+    case THUMBNAIL_DBUS_ERROR_INVALID:
+        return "Failed to extract .DirIcon from AppImage";
+    case THUMBNAIL_DBUS_ERROR_INCOMPLETE:
+        return "AppImage is truncated (incomplete download?)";
+    default:
+        return "Failed to render or save thumbnail";
+    }
+}
+
+/* Render one AppImage into the thumbnail cache, with a cheaper preset
+ * if the deadline (monotonic time, 0 = none) requires it.
+ * Returns 0, STATUS_DEGRADED or STATUS_PREVIEW on success,
+ * 1 + ThumbnailDBusError on failure. */
+static int
+render_to_cache(const char *path, const char *uri, const char *flavor, gint64 mtime,
+                ThumbnailQuality quality, gint64 deadline, gboolean preview_first)
+{
+    const int size = thumbnail_cache_flavor_size(flavor);
+    if (size == 0)
+        return 1 + THUMBNAIL_DBUS_ERROR_UNSUPPORTED;
+
+    const ThumbnailQuality default_quality = thumbnail_pipeline_get_quality();
+    thumbnail_pipeline_set_quality(quality);
+
+    int status = 1 + THUMBNAIL_DBUS_ERROR_INVALID;
+    GBytes *payload = thumbnail_pipeline_load_icon(path);
+    gsize len = 0;
+    const guchar *data = payload ? g_bytes_get_data(payload, &len) : NULL;
+
+    /* The preview is cached and announced on its own; a follow-up job
+     * renders the full thumbnail over it. */
+    if (payload && preview_first
+        && thumbnail_pipeline_wants_preview(data, len, size)) {
+        GdkPixbuf *preview = thumbnail_pipeline_render_preview(data, len, size);
+        gboolean saved = preview && thumbnail_cache_save(preview, uri, mtime, flavor);
+        if (preview)
+            g_object_unref(preview);
+        if (saved) {
+            g_bytes_unref(payload);
+            thumbnail_pipeline_set_quality(default_quality);
+            return STATUS_PREVIEW;
+        }
+    }
+
+    if (payload) {
+        ThumbnailQuality used = quality;
+        if (deadline > 0)
+            used = thumbnail_pipeline_quality_for_deadline(quality, size,
+                                                           deadline - g_get_monotonic_time());
+        thumbnail_pipeline_set_quality(used);
+
+        GdkPixbuf *pixbuf = thumbnail_pipeline_render(data, len, size);
+        g_bytes_unref(payload);
+
+        status = 1 + THUMBNAIL_DBUS_ERROR_FAILED;
+        if (pixbuf && thumbnail_cache_save(pixbuf, uri, mtime, flavor))
+            status = used < quality ? STATUS_DEGRADED : 0;
+        /* Degraded thumbnails are replaced by a refinement; only full
+         * quality ones are worth keeping on the file itself */
+        if (status == 0)
+            thumbnail_xattr_store(path, pixbuf);
+        if (pixbuf)
+            g_object_unref(pixbuf);
+    }
+
+    thumbnail_pipeline_set_quality(default_quality);
+    return status;
+}
+
+static void schedule_processing(void);
+
+/* Re-render a thumbnail that was degraded to meet its deadline, at the
+ * best preset and behind everything else in the queue.  The caller may
+ * have seen Finished by then, so only a second Ready is sent, under the
+ * handle the caller knows. */
+static void
+queue_refinement(const DBusJob *job, const char *uri)
+{
+    DBusJob *refine = g_new0(DBusJob, 1);
+    refine->handle = job->handle;
+    refine->follow_up = TRUE;
+    refine->started = TRUE;
+    refine->uris = g_new0(gchar *, 2);
+    refine->uris[0] = g_strdup(uri);
+    refine->flavor = g_strdup(job->flavor);
+    refine->size = job->size;
+    refine->quality = THUMBNAIL_QUALITY_BEST;
+    g_queue_push_tail(&jobs, refine);
+
+    g_debug("queue_refinement: refining '%s' of job %u", uri, job->handle);
+    schedule_processing();
+}
+
+/* Queue the full render of a URI that so far only has a preview.  It
+ * runs next, and its parent job only finishes once it is done. */
+static void
+queue_full_render(DBusJob *job, const char *uri)
+{
+    DBusJob *parent = job->parent ? job->parent : job;
+
+    DBusJob *full = g_new0(DBusJob, 1);
+    full->handle = parent->handle;
+    full->uris = g_new0(gchar *, 2);
+    full->uris[0] = g_strdup(uri);
+    full->flavor = g_strdup(job->flavor);
+    full->size = job->size;
+    full->quality = job->quality;
+    full->started = TRUE;
+    full->parent = parent;
+    parent->in_flight++;
+
+    DBusJob *head = g_queue_peek_head(&jobs);
+    if (head && head->started)
+        g_queue_insert_after(&jobs, jobs.head, full);
+    else
+        g_queue_push_head(&jobs, full);
+
+    g_debug("queue_full_render: '%s' of job %u", uri, parent->handle);
+    schedule_processing();
+}
+
+/* A preview sits under the final thumbnail name, where clients take it
+ * for the real thing: it must not outlive a full render that failed or
+ * never ran. */
+static void
+discard_preview(const char *uri, const char *flavor)
+{
+    gchar *cached = thumbnail_cache_path(uri, flavor);
+    if (cached && g_unlink(cached) == 0)
+        g_debug("discard_preview: removed the preview of '%s'", uri);
+    g_free(cached);
+}
+
+static gboolean
+status_ok(int status)
+{
+    return status == 0 || status == STATUS_DEGRADED || status == STATUS_PREVIEW;
+}
+
+static void
+emit_result(guint handle, const char *uri, int status)
+{
+    if (status_ok(status))
+        emit_uri_signal(handle, uri, TRUE, 0, NULL);
+    else if (status < 0)
+        emit_uri_signal(handle, uri, FALSE, THUMBNAIL_DBUS_ERROR_FAILED, "Thumbnail worker crashed");
+    else
+        emit_uri_signal(handle, uri, FALSE, status - 1, error_message(status - 1));
+}
+
+static void
+finish_uri(DBusJob *job, const char *uri, int status)
+{
+    emit_result(job->handle, uri, status);
+    if (job->parent && !status_ok(status))
+        discard_preview(uri, job->flavor);
+    if (status == STATUS_PREVIEW)
+        queue_full_render(job, uri);
+    else if (status == STATUS_DEGRADED && refine_degraded)
+        queue_refinement(job, uri);
+}
+
+static void
+finish_job_if_done(DBusJob *job)
+{
+    if (!job->dispatched || job->in_flight > 0)
+        return;
+
+    DBusJob *parent = job->parent;
+    if (parent) {
+        dbus_job_free(job);
+        parent->in_flight--;
+        finish_job_if_done(parent);
+        return;
+    }
+
+    if (job->started && !job->follow_up)
+        emit_signal("Finished", g_variant_new("(u)", job->handle));
+    dbus_job_free(job);
+}
+
+/* Job wire format for workers:
+ * "path\0uri\0flavor\0mtime\0quality\0deadline\0preview\0" */
+static gboolean
+dispatch_uri(DBusJob *job, const char *path, const char *uri, gint64 mtime, gint64 deadline)
+{
+    GString *data = g_string_new(NULL);
+    g_string_append(data, path);
+    g_string_append_c(data, '\0');
+    g_string_append(data, uri);
+    g_string_append_c(data, '\0');
+    g_string_append(data, job->flavor);
+    g_string_append_c(data, '\0');
+    g_string_append_printf(data, "%" G_GINT64_FORMAT, mtime);
+    g_string_append_c(data, '\0');
+    g_string_append_printf(data, "%d", (int)job->quality);
+    g_string_append_c(data, '\0');
+    /* Monotonic time is system-wide, so workers can compare against it */
+    g_string_append_printf(data, "%" G_GINT64_FORMAT, deadline);
+    g_string_append_c(data, '\0');
+    g_string_append_c(data, job->progressive ? '1' : '0');
+    g_string_append_c(data, '\0');
+
+    const guint32 work_id = next_work_id++;
+    gboolean ok = thumbnail_zygote_run_job(work_id, (const guchar *)data->str, data->len);
+    g_string_free(data, TRUE);
+    if (!ok)
+        return FALSE;
+
+    if (!work_items)
+        work_items = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    DBusWorkItem *item = g_new0(DBusWorkItem, 1);
+    item->job = job;
+    item->uri = g_strdup(uri);
+    g_hash_table_insert(work_items, GUINT_TO_POINTER(work_id), item);
+    job->in_flight++;
+    return TRUE;
+}
+
+static void
+process_uri(DBusJob *job, const char *uri)
+{
+    GFile *file = g_file_new_for_uri(uri);
+    gchar *path = g_file_get_path(file);
+    gint64 mtime = 0;
+
+    if (path) {
+        GStatBuf st;
+        if (g_stat(path, &st) < 0) {
+            emit_uri_signal(job->handle, uri, FALSE, THUMBNAIL_DBUS_ERROR_INVALID,
+                            g_strerror(errno));
+            g_object_unref(file);
+            g_free(path);
+            return;
+        }
+        mtime = (gint64)st.st_mtime;
+    } else {
+        /* No local path (and no GVfs FUSE mount): read the remote file in
+         * place through GIO instead of refusing it */
+        GError *error = NULL;
+        GFileInfo *info = g_file_query_info(file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                            G_FILE_QUERY_INFO_NONE, NULL, &error);
+        if (!info) {
+            emit_uri_signal(job->handle, uri, FALSE, THUMBNAIL_DBUS_ERROR_UNSUPPORTED,
+                            error->message);
+            g_error_free(error);
+            g_object_unref(file);
+            return;
+        }
+        mtime = (gint64)g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+        g_object_unref(info);
+        path = g_strdup(uri);
+    }
+    g_object_unref(file);
+    thumbnail_usdt_job_begin(job->size, path);
+
+    /* Partial downloads are refused without a worker round trip or an
+     * extractor spawn; the failure entry lapses when the file changes. */
+    if (thumbnail_cache_has_failure(uri, mtime)) {
+        thumbnail_usdt_job_end(1 + THUMBNAIL_DBUS_ERROR_INCOMPLETE);
+        finish_uri(job, uri, 1 + THUMBNAIL_DBUS_ERROR_INCOMPLETE);
+        g_free(path);
+        return;
+    }
+    if (appimage_payload_truncated(path)) {
+        thumbnail_cache_save_failure(uri, mtime);
+        thumbnail_usdt_job_end(1 + THUMBNAIL_DBUS_ERROR_INCOMPLETE);
+        finish_uri(job, uri, 1 + THUMBNAIL_DBUS_ERROR_INCOMPLETE);
+        g_free(path);
+        return;
+    }
+
+    /* A thumbnail from the share's repository, or one a moved AppImage
+     * brought along, is recached under this URI without extracting */
+    GdkPixbuf *stored = NULL;
+    if (!appimage_reader_is_uri(path))
+        stored = thumbnail_cache_load_shared(path, mtime, job->flavor);
+    if (!stored)
+        stored = thumbnail_xattr_load(path, thumbnail_cache_flavor_size(job->flavor));
+    if (stored) {
+        const gboolean saved = thumbnail_cache_save(stored, uri, mtime, job->flavor);
+        g_object_unref(stored);
+        if (saved) {
+            thumbnail_usdt_job_end(0);
+            finish_uri(job, uri, 0);
+            g_free(path);
+            return;
+        }
+    }
+
+    /* One budget per URI in order, all running from the Queue call, so
+     * time spent waiting behind other work counts against them */
+    const gint64 deadline = job->deadline_ms > 0
+        ? job->received + (gint64)(job->next + 1) * job->deadline_ms * 1000 : 0;
+    /* GVfs streams go through the session bus, which forked workers
+     * cannot share: remote locations are rendered in-process */
+    if (thumbnail_zygote_active() && !appimage_reader_is_uri(path)
+        && dispatch_uri(job, path, uri, mtime, deadline)) {
+        thumbnail_usdt_job_end(THUMBNAIL_USDT_DISPATCHED);
+    } else {
+        const int status = render_to_cache(path, uri, job->flavor, mtime, job->quality,
+                                           deadline, job->progressive);
+        thumbnail_usdt_job_end(status);
+        finish_uri(job, uri, status);
+    }
+    g_free(path);
+}
+
+static void
+on_layout_sorted(GObject *source G_GNUC_UNUSED, GAsyncResult *result, gpointer user_data)
+{
+    gchar **uris = thumbnail_layout_sort_uris_finish(result);
+    const guint handle = GPOINTER_TO_UINT(user_data);
+
+    /* The job may have been dequeued meanwhile */
+    for (GList *l = jobs.head; l != NULL; l = l->next) {
+        DBusJob *job = l->data;
+        if (job->handle == handle && job->sorting) {
+            g_strfreev(job->uris);
+            job->uris = g_steal_pointer(&uris);
+            job->sorting = FALSE;
+            job->sorted = TRUE;
+            break;
+        }
+    }
+    g_strfreev(uris);
+    schedule_processing();
+}
+
+/* Only bulk work is reordered: foreground jobs, single URIs and follow-up
+ * renders keep their place, and so does the queue of jobs */
+static gboolean
+wants_layout_sort(const DBusJob *job)
+{
+    return layout_order && !job->sorted && job->deadline_ms == 0 && !job->parent
+           && job->uris[0] && job->uris[1];
+}
+
+static gboolean
+process_next_uri(gpointer user_data G_GNUC_UNUSED)
+{
+    DBusJob *job = g_queue_peek_head(&jobs);
+    if (!job) {
+        process_source_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    /* All workers busy: thumbnail_dbus_job_done() reschedules us */
+    if (thumbnail_zygote_active() && work_items
+        && g_hash_table_size(work_items) >= thumbnail_zygote_max_jobs()) {
+        process_source_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    thumbnail_server_touch();
+
+    /* The sort opens every file, which must not hold up the main loop;
+     * the job starts once its URIs are back (on_layout_sorted()).  A
+     * foreground job queued meanwhile still goes first. */
+    if (!job->started && wants_layout_sort(job)) {
+        if (!job->sorting) {
+            job->sorting = TRUE;
+            thumbnail_layout_sort_uris_async(job->uris, on_layout_sorted,
+                                             GUINT_TO_POINTER(job->handle));
+        }
+        process_source_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    if (!job->started) {
+        job->started = TRUE;
+        emit_signal("Started", g_variant_new("(u)", job->handle));
+    }
+
+    if (job->uris[job->next] != NULL) {
+        g_debug("process_next_uri: job %u, '%s'", job->handle, job->uris[job->next]);
+        process_uri(job, job->uris[job->next]);
+        job->next++;
+    }
+
+    if (job->uris[job->next] == NULL) {
+        g_queue_pop_head(&jobs);
+        job->dispatched = TRUE;
+        finish_job_if_done(job);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+schedule_processing(void)
+{
+    if (process_source_id == 0 && !g_queue_is_empty(&jobs))
+        process_source_id = g_idle_add(process_next_uri, NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Method dispatch                                                   */
+/* ------------------------------------------------------------------ */
+
+static void
+handle_queue(GVariant *parameters, GDBusMethodInvocation *invocation)
+{
+    gchar **uris = NULL;
+    const gchar *flavor = NULL;
+    const gchar *scheduler = NULL;
+    g_variant_get(parameters, "(^as&s&s)", &uris, &flavor, &scheduler);
+
+    const int size = thumbnail_cache_flavor_size(flavor);
+    if (size == 0) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                              "Unsupported flavor '%s'", flavor);
+        g_strfreev(uris);
+        return;
+    }
+
+    DBusJob *job = g_new0(DBusJob, 1);
+    job->handle = next_handle++;
+    job->uris = uris;
+    job->flavor = g_strdup(flavor);
+    job->size = size;
+    job->quality = thumbnail_pipeline_get_quality();
+    job->progressive = progressive_delivery;
+    job->received = g_get_monotonic_time();
+
+    /* Foreground requests come from a user looking at the files right
+     * now, so they overtake queued background work (but never the job
+     * currently in progress) and trade quality for latency. */
+    const gboolean foreground = g_strcmp0(scheduler, "foreground") == 0;
+    if (foreground)
+        job->deadline_ms = FOREGROUND_DEADLINE_MS;
+
+    if (foreground && !g_queue_is_empty(&jobs)) {
+        DBusJob *head = g_queue_peek_head(&jobs);
+        if (head->started)
+            g_queue_insert_after(&jobs, jobs.head, job);
+        else
+            g_queue_push_head(&jobs, job);
+    } else {
+        g_queue_push_tail(&jobs, job);
+    }
+
+    g_debug("handle_queue: job %u, %u uri(s), flavor '%s', scheduler '%s'",
+            job->handle, g_strv_length(uris), flavor, scheduler);
+    thumbnail_recorder_queue(job->handle, (const char *const *)uris, flavor, foreground);
+
+    g_dbus_method_invocation_return_value(invocation, g_variant_new("(u)", job->handle));
+    thumbnail_server_touch();
+    schedule_processing();
+}
+
+static void
+handle_dequeue(GVariant *parameters, GDBusMethodInvocation *invocation)
+{
+    guint handle = 0;
+    g_variant_get(parameters, "(u)", &handle);
+    thumbnail_recorder_dequeue(handle);
+
+    /* URIs already rendering in workers still report back.  Full renders
+     * behind a cached preview share the handle but stay queued: only they
+     * replace the preview. */
+    GList *l = jobs.head;
+    while (l != NULL) {
+        GList *next = l->next;
+        DBusJob *job = l->data;
+        if (job->handle == handle && !job->parent) {
+            g_queue_delete_link(&jobs, l);
+            job->dispatched = TRUE;
+            finish_job_if_done(job);
+        }
+        l = next;
+    }
+
+    g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+on_method_call(GDBusConnection *connection G_GNUC_UNUSED, const gchar *sender G_GNUC_UNUSED,
+               const gchar *object_path G_GNUC_UNUSED, const gchar *interface_name G_GNUC_UNUSED,
+               const gchar *method_name, GVariant *parameters,
+               GDBusMethodInvocation *invocation, gpointer user_data G_GNUC_UNUSED)
+{
+    if (g_strcmp0(method_name, "Queue") == 0)
+        handle_queue(parameters, invocation);
+    else if (g_strcmp0(method_name, "Dequeue") == 0)
+        handle_dequeue(parameters, invocation);
+    else
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "Unknown method '%s'", method_name);
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+    .method_call = on_method_call,
+};
+
+/* ------------------------------------------------------------------ */
+/*  Bus name ownership                                                */
+/* ------------------------------------------------------------------ */
+
+static void
+on_bus_acquired(GDBusConnection *connection, const gchar *name G_GNUC_UNUSED,
+                gpointer user_data G_GNUC_UNUSED)
+{
+    GError *error = NULL;
+
+    bus_connection = g_object_ref(connection);
+    registration_id = g_dbus_connection_register_object(connection, THUMBNAIL_DBUS_PATH,
+                                                        introspection_data->interfaces[0],
+                                                        &interface_vtable, NULL, NULL, &error);
+    if (registration_id == 0) {
+        g_printerr("Failed to register D-Bus object: %s\n", error->message);
+        g_error_free(error);
+        thumbnail_server_quit();
+    }
+}
+
+static void
+on_name_acquired(GDBusConnection *connection G_GNUC_UNUSED, const gchar *name,
+                 gpointer user_data G_GNUC_UNUSED)
+{
+    g_debug("on_name_acquired: own '%s'", name);
+}
+
+static void
+on_name_lost(GDBusConnection *connection G_GNUC_UNUSED, const gchar *name,
+             gpointer user_data G_GNUC_UNUSED)
+{
+    /* Another instance owns the name (or there is no session bus) */
+    g_printerr("Lost or could not acquire D-Bus name %s\n", name);
+    thumbnail_server_quit();
+}
+
+void
+thumbnail_dbus_start(const ThumbnailServerOptions *options)
+{
+    if (owner_id != 0)
+        return;
+
+    refine_degraded = options->refine;
+    progressive_delivery = options->progressive;
+    layout_order = options->disk_order;
+    introspection_data = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+    owner_id = g_bus_own_name(G_BUS_TYPE_SESSION, THUMBNAIL_DBUS_NAME,
+                              G_BUS_NAME_OWNER_FLAGS_NONE,
+                              on_bus_acquired, on_name_acquired, on_name_lost,
+                              NULL, NULL);
+}
+
+gboolean
+thumbnail_dbus_busy(void)
+{
+    return !g_queue_is_empty(&jobs) || (work_items && g_hash_table_size(work_items) > 0);
+}
+
+int
+thumbnail_dbus_run_job(const guchar *data, gsize len)
+{
+    /* Seven NUL-terminated fields, see dispatch_uri() */
+    const char *fields[7];
+    gsize pos = 0;
+    for (guint i = 0; i < G_N_ELEMENTS(fields); ++i) {
+        const guchar *end = pos < len ? memchr(data + pos, '\0', len - pos) : NULL;
+        if (!end)
+            return 1 + THUMBNAIL_DBUS_ERROR_FAILED;
+        fields[i] = (const char *)data + pos;
+        pos = (gsize)(end - data) + 1;
+    }
+
+    thumbnail_usdt_job_begin(thumbnail_cache_flavor_size(fields[2]), fields[0]);
+    const int status = render_to_cache(fields[0], fields[1], fields[2],
+                                       g_ascii_strtoll(fields[3], NULL, 10),
+                                       (ThumbnailQuality)g_ascii_strtoull(fields[4], NULL, 10),
+                                       g_ascii_strtoll(fields[5], NULL, 10),
+                                       fields[6][0] == '1');
+    thumbnail_usdt_job_end(status);
+    return status;
+}
+
+void
+thumbnail_dbus_job_done(guint32 job_id, int status, gpointer user_data G_GNUC_UNUSED)
+{
+    DBusWorkItem *item = work_items
+        ? g_hash_table_lookup(work_items, GUINT_TO_POINTER(job_id)) : NULL;
+    if (!item)
+        return;
+    g_hash_table_remove(work_items, GUINT_TO_POINTER(job_id));
+
+    DBusJob *job = item->job;
+    finish_uri(job, item->uri, status);
+    job->in_flight--;
+    finish_job_if_done(job);
+
+    g_free(item->uri);
+    g_free(item);
+
+    thumbnail_server_touch();
+    schedule_processing();
+}
+
+void
+thumbnail_dbus_stop(void)
+{
+    if (process_source_id != 0) {
+        g_source_remove(process_source_id);
+        process_source_id = 0;
+    }
+
+    /* A job can be queued, rendering in workers and the parent of
+     * follow-ups all at once: collect them so each is freed once. */
+    GHashTable *orphans = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTableIter iter;
+    gpointer value;
+    DBusJob *job;
+
+    while ((job = g_queue_pop_head(&jobs)) != NULL) {
+        g_hash_table_add(orphans, job);
+        if (job->parent) {
+            discard_preview(job->uris[0], job->flavor);
+            g_hash_table_add(orphans, job->parent);
+        }
+    }
+
+    if (work_items) {
+        g_hash_table_iter_init(&iter, work_items);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            DBusWorkItem *item = value;
+            g_hash_table_add(orphans, item->job);
+            if (item->job->parent) {
+                discard_preview(item->uri, item->job->flavor);
+                g_hash_table_add(orphans, item->job->parent);
+            }
+            g_free(item->uri);
+            g_free(item);
+        }
+        g_hash_table_unref(work_items);
+        work_items = NULL;
+    }
+
+    g_hash_table_iter_init(&iter, orphans);
+    while (g_hash_table_iter_next(&iter, &value, NULL)) {
+        job = value;
+        if (job->started && !job->parent)
+            emit_signal("Finished", g_variant_new("(u)", job->handle));
+        dbus_job_free(job);
+    }
+    g_hash_table_unref(orphans);
+
+    if (bus_connection && registration_id != 0)
+        g_dbus_connection_unregister_object(bus_connection, registration_id);
+    registration_id = 0;
+
+    if (owner_id != 0)
+        g_bus_unown_name(owner_id);
+    owner_id = 0;
+
+    if (bus_connection) {
+        g_dbus_connection_flush_sync(bus_connection, NULL, NULL);
+        g_object_unref(bus_connection);
+        bus_connection = NULL;
+    }
+
+    if (introspection_data) {
+        g_dbus_node_info_unref(introspection_data);
+        introspection_data = NULL;
+    }
+}
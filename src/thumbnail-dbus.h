@@ -0,0 +1,69 @@
+/*
+ * thumbnail-dbus.h - D-Bus frontend for the appimage-thumbnailer service
+ *
+ * Exposes a Queue/Dequeue interface modelled on the thumbnail spec's
+ * Thumbnailer1 API.  Thumbnails are written to the user's thumbnail
+ * cache and announced with Started/Ready/Error/Finished signals, which
+ * makes the service D-Bus activatable.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_DBUS_H
+#define THUMBNAIL_DBUS_H
+
+#include <glib.h>
+
+#include "thumbnail-server.h"
+
+#define THUMBNAIL_DBUS_NAME      "io.github.kem_a.AppImageThumbnailer1"
+#define THUMBNAIL_DBUS_PATH      "/io/github/kem_a/AppImageThumbnailer1"
+#define THUMBNAIL_DBUS_INTERFACE THUMBNAIL_DBUS_NAME
+
+/* error_code values of the Error signal */
+typedef enum {
+    THUMBNAIL_DBUS_ERROR_UNSUPPORTED = 0, /* unreadable location / unknown flavor */
+    THUMBNAIL_DBUS_ERROR_INVALID     = 1, /* not an AppImage or no usable icon */
+    THUMBNAIL_DBUS_ERROR_FAILED      = 2, /* rendering or saving failed */
+    THUMBNAIL_DBUS_ERROR_INCOMPLETE  = 3, /* AppImage truncated, still downloading */
+} ThumbnailDBusError;
+
+/**
+ * Own THUMBNAIL_DBUS_NAME on the session bus and start serving.
+ * Losing the name stops the service.
+ *
+ * "foreground" requests get a short per-URI deadline and may be rendered
+ * with a cheaper quality preset to meet it (re-rendered later with
+ * options->refine).  With options->progressive, expensive icons get a
+ * preview written and announced with Ready first, followed by a second
+ * Ready for the full thumbnail.  With options->disk_order, the URIs of
+ * each background job are sorted by physical location when it starts.
+ *
+ * @param options Service configuration
+ */
+void thumbnail_dbus_start(const ThumbnailServerOptions *options);
+
+/**
+ * Whether queued D-Bus jobs are still pending.
+ */
+gboolean thumbnail_dbus_busy(void);
+
+/**
+ * Release the bus name and drop pending jobs.
+ */
+void thumbnail_dbus_stop(void);
+
+/**
+ * Worker entry point for one queued URI (a ThumbnailZygoteJobFunc).
+ *
+ * @return 0 on success (0x40 if degraded to meet a deadline, 0x20 if
+ *         only a preview was written), 1 + ThumbnailDBusError on failure
+ */
+int thumbnail_dbus_run_job(const guchar *data, gsize len);
+
+/**
+ * Completion callback for worker jobs (a ThumbnailZygoteDoneFunc).
+ */
+void thumbnail_dbus_job_done(guint32 job_id, int status, gpointer user_data);
+
+#endif /* THUMBNAIL_DBUS_H */
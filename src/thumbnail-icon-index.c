@@ -0,0 +1,112 @@
+/*
+ * thumbnail-icon-index.c - Per-AppImage icon location index
+ *
+ * Record layout (host byte order, the index is per machine):
+ *   IndexHeader | SquashfsLocation | guint32 blocks[n_blocks]
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-icon-index.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define INDEX_MAGIC "AITIDX1"
+
+typedef struct {
+    gchar                  magic[8];
+    AppImageReaderIdentity identity;
+} IndexHeader;
+
+static gchar *
+record_path(const AppImageReaderIdentity *identity)
+{
+    gchar *name = g_compute_checksum_for_data(G_CHECKSUM_MD5, (const guchar *)identity,
+                                              sizeof(*identity));
+    gchar *path = g_build_filename(g_get_user_cache_dir(), "appimage-thumbnailer", "icon-index",
+                                   name, NULL);
+    g_free(name);
+    return path;
+}
+
+SquashfsLocation *
+thumbnail_icon_index_lookup(const AppImageReaderIdentity *identity)
+{
+    gchar *path = record_path(identity);
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (!mapped)
+        return NULL;
+
+    const gchar *data = g_mapped_file_get_contents(mapped);
+    const gsize len = g_mapped_file_get_length(mapped);
+    SquashfsLocation *location = NULL;
+
+    IndexHeader header;
+    if (len > sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+        const gsize body = len - sizeof(header);
+        /* The hash only names the file; the identity inside decides */
+        if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0
+            && memcmp(&header.identity, identity, sizeof(*identity)) == 0) {
+            location = g_malloc(body);
+            memcpy(location, data + sizeof(header), body);
+            if (!squashfs_location_valid(location, body))
+                g_clear_pointer(&location, g_free);
+        }
+    }
+
+    g_mapped_file_unref(mapped);
+    g_debug("thumbnail_icon_index_lookup: %s", location ? "hit" : "no valid record");
+    return location;
+}
+
+void
+thumbnail_icon_index_store(const AppImageReaderIdentity *identity,
+                           const SquashfsLocation *location)
+{
+    gchar *path = record_path(identity);
+    gchar *dir = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_debug("thumbnail_icon_index_store: cannot create '%s': %s", dir, g_strerror(errno));
+        g_free(dir);
+        g_free(path);
+        return;
+    }
+    g_free(dir);
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.identity = *identity;
+
+    const gsize body = squashfs_location_size(location);
+    gchar *record = g_malloc(sizeof(header) + body);
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), location, body);
+
+    GError *error = NULL;
+    if (!g_file_set_contents(path, record, (gssize)(sizeof(header) + body), &error)) {
+        g_debug("thumbnail_icon_index_store: %s", error->message);
+        g_error_free(error);
+    } else {
+        g_debug("thumbnail_icon_index_store: %u block(s)%s recorded in '%s'", location->n_blocks,
+                location->fragment_block ? " + fragment" : "", path);
+    }
+    g_free(record);
+    g_free(path);
+}
+
+void
+thumbnail_icon_index_forget(const AppImageReaderIdentity *identity)
+{
+    gchar *path = record_path(identity);
+    g_unlink(path);
+    g_free(path);
+}
@@ -0,0 +1,43 @@
+/*
+ * thumbnail-icon-index.h - Per-AppImage icon location index
+ *
+ * After the first extraction of a SquashFS AppImage's icon, the blocks
+ * holding it (offsets, compressed sizes, fragment, compressor) are
+ * recorded under $XDG_CACHE_HOME/appimage-thumbnailer/icon-index/, one
+ * small record per file identity (device, inode, size, mtime).  A later
+ * request at any size maps the record and reads just those blocks: no
+ * directory or inode table walk, no extractor process.  This sits below
+ * the PNG thumbnail cache, which only helps for sizes already rendered.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_ICON_INDEX_H
+#define THUMBNAIL_ICON_INDEX_H
+
+#include <glib.h>
+
+#include "appimage-reader.h"
+#include "squashfs-reader.h"
+
+/**
+ * Look up the recorded icon location of an AppImage.
+ *
+ * @param identity Identity of the AppImage
+ * @return The location (caller frees), or NULL if none is recorded
+ */
+SquashfsLocation *thumbnail_icon_index_lookup(const AppImageReaderIdentity *identity);
+
+/**
+ * Record where an AppImage's icon lives.  The record is replaced
+ * atomically, so concurrent readers see the old or the new one.
+ */
+void thumbnail_icon_index_store(const AppImageReaderIdentity *identity,
+                                const SquashfsLocation *location);
+
+/**
+ * Drop the record of an AppImage (after it failed to read back).
+ */
+void thumbnail_icon_index_forget(const AppImageReaderIdentity *identity);
+
+#endif /* THUMBNAIL_ICON_INDEX_H */
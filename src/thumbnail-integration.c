@@ -0,0 +1,122 @@
+/*
+ * thumbnail-integration.c - Icons installed by AppImage desktop integrators
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-integration.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "thumbnail-payload.h"
+
+typedef struct {
+    const gchar *name;  /* hicolor subdirectory, e.g. "256x256" */
+    int          size;  /* G_MAXINT for "scalable" */
+} IconDir;
+
+static gint
+compare_dirs(gconstpointer a, gconstpointer b)
+{
+    const IconDir *x = a;
+    const IconDir *y = b;
+    return x->size > y->size ? -1 : (x->size < y->size);
+}
+
+/* Size directories worth looking into, largest first */
+static GArray *
+list_icon_dirs(const gchar *hicolor, ThumbnailArena *arena)
+{
+    GDir *dir = g_dir_open(hicolor, 0, NULL);
+    if (!dir)
+        return NULL;
+
+    GArray *dirs = g_array_new(FALSE, FALSE, sizeof(IconDir));
+    const gchar *name;
+    while ((name = g_dir_read_name(dir))) {
+        IconDir entry = { .name = NULL, .size = 0 };
+        if (strcmp(name, "scalable") == 0)
+            entry.size = G_MAXINT;
+        else
+            entry.size = (int)MIN(g_ascii_strtoull(name, NULL, 10), (guint64)G_MAXINT - 1);
+        if (entry.size < THUMBNAIL_INTEGRATION_MIN_SIZE)
+            continue;
+        entry.name = thumbnail_arena_strdup(arena, name);
+        g_array_append_val(dirs, entry);
+    }
+    g_dir_close(dir);
+
+    g_array_sort(dirs, compare_dirs);
+    return dirs;
+}
+
+/* An icon in @apps for @prefix, regular and not older than the AppImage */
+static const gchar *
+find_icon(const gchar *apps, const gchar *prefix, time_t not_before, ThumbnailArena *arena)
+{
+    GDir *dir = g_dir_open(apps, 0, NULL);
+    if (!dir)
+        return NULL;
+
+    const gchar *found = NULL;
+    const gchar *name;
+    while (!found && (name = g_dir_read_name(dir))) {
+        if (!g_str_has_prefix(name, prefix))
+            continue;
+
+        gchar *icon = thumbnail_arena_build_path(arena, apps, name);
+        struct stat st;
+        if (lstat(icon, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (st.st_mtime < not_before) {
+            g_debug("find_icon: '%s' predates the AppImage, ignoring", icon);
+            continue;
+        }
+        found = icon;
+    }
+    g_dir_close(dir);
+    return found;
+}
+
+GBytes *
+thumbnail_integration_lookup(const char *path, ThumbnailArena *arena)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return NULL;
+
+    gchar *uri = g_filename_to_uri(path, NULL, NULL);
+    if (!uri)
+        return NULL;
+    gchar *md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+    const gchar *prefix = thumbnail_arena_printf(arena, "appimagekit_%s_", md5);
+    g_free(md5);
+    g_free(uri);
+
+    gchar *hicolor = g_build_filename(g_get_user_data_dir(), "icons", "hicolor", NULL);
+    GArray *dirs = list_icon_dirs(hicolor, arena);
+    GBytes *payload = NULL;
+
+    for (guint i = 0; dirs && !payload && i < dirs->len; ++i) {
+        const IconDir *dir = &g_array_index(dirs, IconDir, i);
+        gchar *apps = thumbnail_arena_printf(arena, "%s/%s/apps", hicolor, dir->name);
+        const gchar *icon = find_icon(apps, prefix, st.st_mtime, arena);
+        if (!icon)
+            continue;
+
+        payload = thumbnail_payload_from_file(icon, arena);
+        if (payload)
+            g_debug("thumbnail_integration_lookup: using integrated icon '%s'", icon);
+    }
+
+    if (dirs)
+        g_array_free(dirs, TRUE);
+    g_free(hicolor);
+    return payload;
+}
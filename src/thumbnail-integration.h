@@ -0,0 +1,37 @@
+/*
+ * thumbnail-integration.h - Icons installed by AppImage desktop integrators
+ *
+ * appimaged and AppImageLauncher copy the icon of every integrated
+ * AppImage into $XDG_DATA_HOME/icons/hicolor/<size>/apps/ as
+ * appimagekit_<md5 of the file:// URI>_<icon name>.{png,svg}.  Those are
+ * the AppImages users browse most, and their icon is already on disk
+ * uncompressed: looking it up costs a few directory reads instead of an
+ * extraction.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_INTEGRATION_H
+#define THUMBNAIL_INTEGRATION_H
+
+#include <glib.h>
+
+#include "thumbnail-arena.h"
+
+/* Raster icons smaller than this are not worth scaling up into a
+ * thumbnail; the embedded .DirIcon is used instead */
+#define THUMBNAIL_INTEGRATION_MIN_SIZE 256
+
+/**
+ * Find the icon an integrator installed for an AppImage: the scalable
+ * one if present, else the largest raster of at least
+ * THUMBNAIL_INTEGRATION_MIN_SIZE.  Icons older than the AppImage are
+ * ignored (the AppImage was replaced since it was integrated).
+ *
+ * @param path  Local path of the AppImage
+ * @param arena Job arena for scratch memory
+ * @return The icon payload (caller unrefs), or NULL
+ */
+GBytes *thumbnail_integration_lookup(const char *path, ThumbnailArena *arena);
+
+#endif /* THUMBNAIL_INTEGRATION_H */
@@ -0,0 +1,176 @@
+/*
+ * thumbnail-layout.c - Physical-layout ordering of bulk thumbnail jobs
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include "thumbnail-layout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+
+#include <gio/gio.h>
+#include <glib.h>
+
+typedef enum {
+    LAYOUT_RANK_PHYSICAL = 0, /* key is the disk address of the first extent */
+    LAYOUT_RANK_INODE    = 1, /* key is the inode number */
+    LAYOUT_RANK_UNKNOWN  = 2, /* remote or unreadable, original order */
+} LayoutRank;
+
+typedef struct {
+    gchar     *uri;
+    guint64    dev;
+    LayoutRank rank;
+    guint64    key;
+    guint      index;   /* position in the request, keeps the sort stable */
+} LayoutEntry;
+
+/* Disk address of the first mapped extent within the probe range */
+static gboolean
+first_extent(int fd, guint64 *physical)
+{
+#ifdef FS_IOC_FIEMAP
+    union {
+        struct fiemap map;
+        guchar buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.map.fm_start = 0;
+    req.map.fm_length = THUMBNAIL_LAYOUT_PROBE_LENGTH;
+    req.map.fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, &req.map) < 0) {
+        g_debug("first_extent: FIEMAP failed: %s", g_strerror(errno));
+        return FALSE;
+    }
+    if (req.map.fm_mapped_extents == 0)
+        return FALSE;
+
+    /* Inline or not-yet-allocated data has no meaningful address */
+    const struct fiemap_extent *extent = &req.map.fm_extents[0];
+    if (extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))
+        return FALSE;
+
+    *physical = extent->fe_physical;
+    return TRUE;
+#else
+    (void)fd;
+    (void)physical;
+    return FALSE;
+#endif
+}
+
+static void
+locate_entry(LayoutEntry *entry)
+{
+    entry->rank = LAYOUT_RANK_UNKNOWN;
+
+    /* The FUSE path of an sftp:// or smb:// URI would be opened over the
+     * network, and its extents say nothing about seeks anyway */
+    GFile *file = g_file_new_for_uri(entry->uri);
+    gchar *path = g_file_is_native(file) ? g_file_get_path(file) : NULL;
+    g_object_unref(file);
+    if (!path)
+        return;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    g_free(path);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        entry->dev = (guint64)st.st_dev;
+        if (first_extent(fd, &entry->key)) {
+            entry->rank = LAYOUT_RANK_PHYSICAL;
+        } else {
+            entry->rank = LAYOUT_RANK_INODE;
+            entry->key = (guint64)st.st_ino;
+        }
+    }
+    close(fd);
+}
+
+static gint
+compare_entries(gconstpointer a, gconstpointer b)
+{
+    const LayoutEntry *x = a;
+    const LayoutEntry *y = b;
+
+    if (x->rank != y->rank)
+        return x->rank < y->rank ? -1 : 1;
+    if (x->rank != LAYOUT_RANK_UNKNOWN) {
+        if (x->dev != y->dev)
+            return x->dev < y->dev ? -1 : 1;
+        if (x->key != y->key)
+            return x->key < y->key ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+void
+thumbnail_layout_sort_uris(gchar **uris)
+{
+    const guint n = uris ? g_strv_length(uris) : 0;
+    if (n < 2)
+        return;
+
+    const gint64 start = g_get_monotonic_time();
+    LayoutEntry *entries = g_new0(LayoutEntry, n);
+    guint mapped = 0;
+
+    for (guint i = 0; i < n; ++i) {
+        entries[i].uri = uris[i];
+        entries[i].index = i;
+        locate_entry(&entries[i]);
+        if (entries[i].rank == LAYOUT_RANK_PHYSICAL)
+            mapped++;
+    }
+
+    qsort(entries, n, sizeof(*entries), compare_entries);
+    for (guint i = 0; i < n; ++i)
+        uris[i] = entries[i].uri;
+    g_free(entries);
+
+    g_debug("thumbnail_layout_sort_uris: ordered %u uri(s), %u by extent, in %" G_GINT64_FORMAT " us",
+            n, mapped, g_get_monotonic_time() - start);
+}
+
+static void
+sort_in_thread(GTask *task, gpointer source_object G_GNUC_UNUSED, gpointer task_data,
+               GCancellable *cancellable G_GNUC_UNUSED)
+{
+    gchar **uris = task_data;
+    thumbnail_layout_sort_uris(uris);
+    g_task_return_pointer(task, uris, (GDestroyNotify)g_strfreev);
+}
+
+void
+thumbnail_layout_sort_uris_async(gchar *const *uris, GAsyncReadyCallback callback,
+                                 gpointer user_data)
+{
+    GTask *task = g_task_new(NULL, NULL, callback, user_data);
+    g_task_set_task_data(task, g_strdupv((gchar **)uris), NULL);
+    g_task_run_in_thread(task, sort_in_thread);
+    g_object_unref(task);
+}
+
+gchar **
+thumbnail_layout_sort_uris_finish(GAsyncResult *result)
+{
+    return g_task_propagate_pointer(G_TASK(result), NULL);
+}
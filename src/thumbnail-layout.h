@@ -0,0 +1,51 @@
+/*
+ * thumbnail-layout.h - Physical-layout ordering of bulk thumbnail jobs
+ *
+ * Bulk requests (cache prefill, indexers) list AppImages in directory
+ * order, which on a rotational disk has little to do with where the
+ * files live.  Sorting them by the disk address of their first extent
+ * (FIEMAP), or by inode number where the filesystem cannot map extents,
+ * turns the random seeks of a cold-cache pass into a mostly forward
+ * sweep.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_LAYOUT_H
+#define THUMBNAIL_LAYOUT_H
+
+#include <gio/gio.h>
+#include <glib.h>
+
+/* Range whose first extent is looked up; the ELF header, SquashFS
+ * superblock and directory tables sit at the start of an AppImage */
+#define THUMBNAIL_LAYOUT_PROBE_LENGTH (4 * 1024 * 1024)
+
+/**
+ * Reorder a NULL-terminated URI list by physical location.
+ *
+ * Local files are grouped by device and sorted by the physical offset
+ * of their first extent; files whose extents cannot be mapped follow in
+ * inode order.  Non-native URIs (GVfs locations, even with a FUSE path)
+ * and files that cannot be opened keep their relative order at the end.  The sort is stable.
+ *
+ * @param uris URI list to reorder in place
+ */
+void thumbnail_layout_sort_uris(gchar **uris);
+
+/**
+ * Sort a copy of @uris in a worker thread; every file is opened, so a
+ * long list takes many seeks on the cold disks this is meant for.
+ *
+ * @param uris     URI list to sort (copied, the caller keeps it)
+ * @param callback Called in the thread-default main context when done
+ */
+void thumbnail_layout_sort_uris_async(gchar *const *uris, GAsyncReadyCallback callback,
+                                      gpointer user_data);
+
+/**
+ * @return The sorted copy (caller frees with g_strfreev())
+ */
+gchar **thumbnail_layout_sort_uris_finish(GAsyncResult *result);
+
+#endif /* THUMBNAIL_LAYOUT_H */
@@ -0,0 +1,286 @@
+/*
+ * thumbnail-mipcache.c - Decoded mip pyramids shared across processes
+ *
+ * Entry layout (host byte order, the cache is per machine):
+ *   MipHeader | MipLevel[n_levels] | pixels of each level, largest first
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-mipcache.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define MIP_MAGIC      "AITMIP1"
+#define MIP_MAX_LEVELS 16
+
+typedef struct {
+    gchar   magic[8];
+    guint32 quality;   /* ThumbnailQuality of the top level */
+    guint32 n_levels;
+} MipHeader;
+
+typedef struct {
+    guint32 width;
+    guint32 height;
+    guint32 rowstride; /* always width * 4 */
+    guint32 reserved;
+    guint64 offset;    /* of the pixels, from the start of the entry */
+} MipLevel;
+
+static gboolean mipcache_enabled = FALSE;
+
+void
+thumbnail_mipcache_set_enabled(gboolean enabled)
+{
+    mipcache_enabled = enabled;
+}
+
+gboolean
+thumbnail_mipcache_enabled(void)
+{
+    return mipcache_enabled;
+}
+
+gchar *
+thumbnail_mipcache_key(const guchar *data, gsize len)
+{
+    return g_compute_checksum_for_data(G_CHECKSUM_SHA1, data, len);
+}
+
+int
+thumbnail_mipcache_top_edge(int size)
+{
+    if (size <= 0 || size > THUMBNAIL_MIPCACHE_MAX_EDGE)
+        return 0;
+
+    int edge = THUMBNAIL_MIPCACHE_MIN_EDGE;
+    while (edge < size)
+        edge *= 2;
+    return edge;
+}
+
+static gchar *
+cache_dir(void)
+{
+    return g_build_filename(g_get_user_cache_dir(), "appimage-thumbnailer", "mip", NULL);
+}
+
+static gchar *
+entry_path(const gchar *key)
+{
+    gchar *dir = cache_dir();
+    gchar *path = g_build_filename(dir, key, NULL);
+    g_free(dir);
+    return path;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Lookup                                                            */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+level_valid(const MipLevel *level, gsize len)
+{
+    const guint64 bytes = (guint64)level->rowstride * level->height;
+    return level->width > 0 && level->height > 0
+           && level->rowstride == level->width * 4
+           && level->offset <= len && bytes <= len - level->offset;
+}
+
+GdkPixbuf *
+thumbnail_mipcache_lookup(const gchar *key, int size, ThumbnailQuality quality)
+{
+    gchar *path = entry_path(key);
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+    if (!mapped) {
+        g_free(path);
+        return NULL;
+    }
+
+    const gchar *data = g_mapped_file_get_contents(mapped);
+    const gsize len = g_mapped_file_get_length(mapped);
+    GdkPixbuf *pixbuf = NULL;
+
+    MipHeader header;
+    if (len >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, MIP_MAGIC, sizeof(header.magic)) != 0
+            || header.n_levels == 0 || header.n_levels > MIP_MAX_LEVELS
+            || len < sizeof(header) + header.n_levels * sizeof(MipLevel))
+            header.n_levels = 0;
+        if (header.quality < (guint32)quality)
+            header.n_levels = 0;
+    } else {
+        header.n_levels = 0;
+    }
+
+    /* Levels are stored largest first: the last one covering @size wins */
+    MipLevel chosen = { 0 };
+    for (guint32 i = 0; i < header.n_levels; ++i) {
+        MipLevel level;
+        memcpy(&level, data + sizeof(header) + i * sizeof(MipLevel), sizeof(level));
+        if (!level_valid(&level, len)) {
+            chosen.width = 0;
+            break;
+        }
+        if (MAX(level.width, level.height) < (guint32)size)
+            break;
+        chosen = level;
+    }
+
+    if (chosen.width > 0) {
+        GBytes *whole = g_mapped_file_get_bytes(mapped);
+        GBytes *pixels = g_bytes_new_from_bytes(whole, chosen.offset,
+                                                (gsize)chosen.rowstride * chosen.height);
+        pixbuf = gdk_pixbuf_new_from_bytes(pixels, GDK_COLORSPACE_RGB, TRUE, 8,
+                                           (int)chosen.width, (int)chosen.height,
+                                           (int)chosen.rowstride);
+        g_bytes_unref(pixels);
+        g_bytes_unref(whole);
+
+        /* Recently used entries survive the size bound */
+        g_utime(path, NULL);
+        g_debug("thumbnail_mipcache_lookup: %ux%u level for %dpx", chosen.width,
+                chosen.height, size);
+    }
+
+    g_mapped_file_unref(mapped);
+    g_free(path);
+    return pixbuf;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Store                                                             */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    gchar  *path;
+    goffset size;
+    gint64  mtime;
+} CacheFile;
+
+static gint
+compare_by_age(gconstpointer a, gconstpointer b)
+{
+    const CacheFile *x = a;
+    const CacheFile *y = b;
+    return x->mtime < y->mtime ? -1 : (x->mtime > y->mtime);
+}
+
+/* Drop the least recently used entries until the cache fits its bound */
+static void
+prune(const gchar *dir_path)
+{
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    if (!dir)
+        return;
+
+    GArray *files = g_array_new(FALSE, FALSE, sizeof(CacheFile));
+    guint64 total = 0;
+    const gchar *name;
+    while ((name = g_dir_read_name(dir))) {
+        CacheFile file = { g_build_filename(dir_path, name, NULL), 0, 0 };
+        GStatBuf st;
+        if (g_stat(file.path, &st) < 0) {
+            g_free(file.path);
+            continue;
+        }
+        file.size = st.st_size;
+        file.mtime = (gint64)st.st_mtime;
+        total += (guint64)st.st_size;
+        g_array_append_val(files, file);
+    }
+    g_dir_close(dir);
+
+    g_array_sort(files, compare_by_age);
+    for (guint i = 0; i < files->len; ++i) {
+        CacheFile *file = &g_array_index(files, CacheFile, i);
+        if (total > THUMBNAIL_MIPCACHE_MAX_BYTES && g_unlink(file->path) == 0) {
+            g_debug("prune: dropped '%s'", file->path);
+            total -= (guint64)file->size;
+        }
+        g_free(file->path);
+    }
+    g_array_free(files, TRUE);
+}
+
+void
+thumbnail_mipcache_store(const gchar *key, GdkPixbuf *top, ThumbnailQuality quality,
+                         GdkInterpType interp)
+{
+    if (gdk_pixbuf_get_n_channels(top) != 4 || gdk_pixbuf_get_bits_per_sample(top) != 8)
+        return;
+
+    GPtrArray *levels = g_ptr_array_new_with_free_func(g_object_unref);
+    g_ptr_array_add(levels, g_object_ref(top));
+    for (GdkPixbuf *level = top; levels->len < MIP_MAX_LEVELS;) {
+        const int width = gdk_pixbuf_get_width(level);
+        const int height = gdk_pixbuf_get_height(level);
+        if (MAX(width, height) / 2 < THUMBNAIL_MIPCACHE_MIN_EDGE)
+            break;
+        level = gdk_pixbuf_scale_simple(level, MAX(1, width / 2), MAX(1, height / 2), interp);
+        if (!level)
+            break;
+        g_ptr_array_add(levels, level);
+    }
+
+    gsize len = sizeof(MipHeader) + levels->len * sizeof(MipLevel);
+    for (guint i = 0; i < levels->len; ++i) {
+        GdkPixbuf *level = levels->pdata[i];
+        len += (gsize)gdk_pixbuf_get_width(level) * 4 * gdk_pixbuf_get_height(level);
+    }
+
+    gchar *entry = g_malloc(len);
+    MipHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MIP_MAGIC, sizeof(MIP_MAGIC));
+    header.quality = quality;
+    header.n_levels = levels->len;
+    memcpy(entry, &header, sizeof(header));
+
+    /* Pixel rows are packed, whatever the rowstride of the pixbuf */
+    guint64 offset = sizeof(MipHeader) + levels->len * sizeof(MipLevel);
+    for (guint i = 0; i < levels->len; ++i) {
+        GdkPixbuf *level = levels->pdata[i];
+        MipLevel info = {
+            .width = (guint32)gdk_pixbuf_get_width(level),
+            .height = (guint32)gdk_pixbuf_get_height(level),
+            .rowstride = (guint32)gdk_pixbuf_get_width(level) * 4,
+            .offset = offset,
+        };
+        memcpy(entry + sizeof(MipHeader) + i * sizeof(MipLevel), &info, sizeof(info));
+
+        const guchar *pixels = gdk_pixbuf_read_pixels(level);
+        const int stride = gdk_pixbuf_get_rowstride(level);
+        for (guint32 y = 0; y < info.height; ++y)
+            memcpy(entry + offset + (gsize)y * info.rowstride, pixels + (gsize)y * stride,
+                   info.rowstride);
+        offset += (guint64)info.rowstride * info.height;
+    }
+
+    gchar *dir = cache_dir();
+    gchar *path = entry_path(key);
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_debug("thumbnail_mipcache_store: cannot create '%s': %s", dir, g_strerror(errno));
+    } else if (!g_file_set_contents(path, entry, (gssize)len, &error)) {
+        g_debug("thumbnail_mipcache_store: %s", error->message);
+        g_error_free(error);
+    } else {
+        g_debug("thumbnail_mipcache_store: %u level(s), %" G_GSIZE_FORMAT " bytes in '%s'",
+                levels->len, len, path);
+        prune(dir);
+    }
+
+    g_free(path);
+    g_free(dir);
+    g_free(entry);
+    g_ptr_array_unref(levels);
+}
@@ -0,0 +1,79 @@
+/*
+ * thumbnail-mipcache.h - Decoded mip pyramids shared across processes
+ *
+ * Decoding the icon (PNG inflate, SVG rendering) dominates a render once
+ * the payload itself is cached.  In mip cache mode (opt-in, --mip-cache)
+ * the first render of a payload decodes it once at the next power of two
+ * at or above the requested size and stores that image plus its halvings
+ * (e.g. 256, 128, 64 ... 16) as raw RGBA under
+ * $XDG_CACHE_HOME/appimage-thumbnailer/mip/<sha1 of the payload>.  Any
+ * process asking for a size up to the top level then maps the file and
+ * resamples the nearest larger level: no decoding, no SVG rendering.
+ *
+ * Entries are keyed by content, so AppImages shipping the same icon share
+ * one.  They are published with an atomic rename, and the directory is
+ * kept under THUMBNAIL_MIPCACHE_MAX_BYTES by dropping the least recently
+ * used entries.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_MIPCACHE_H
+#define THUMBNAIL_MIPCACHE_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+
+#include "thumbnail-pipeline.h"
+
+#define THUMBNAIL_MIPCACHE_MAX_EDGE  1024
+#define THUMBNAIL_MIPCACHE_MIN_EDGE  16
+#define THUMBNAIL_MIPCACHE_MAX_BYTES (64 * 1024 * 1024)
+
+/**
+ * Enable or disable the mip cache (disabled by default).
+ */
+void thumbnail_mipcache_set_enabled(gboolean enabled);
+
+/**
+ * @return TRUE if the mip cache is enabled
+ */
+gboolean thumbnail_mipcache_enabled(void);
+
+/**
+ * Cache key of an icon payload.
+ *
+ * @return Newly allocated key (caller frees)
+ */
+gchar *thumbnail_mipcache_key(const guchar *data, gsize len);
+
+/**
+ * Edge of the top level to decode for a request, or 0 if @size is too
+ * large to be cached.
+ */
+int thumbnail_mipcache_top_edge(int size);
+
+/**
+ * Find the smallest cached level at least @size pixels on its longer
+ * edge, rendered at @quality or better.
+ *
+ * @param key     Payload key from thumbnail_mipcache_key()
+ * @param size    Requested edge in pixels
+ * @param quality Preset the caller renders with
+ * @return The level (caller unrefs; it may reference the mapped entry),
+ *         or NULL on a miss
+ */
+GdkPixbuf *thumbnail_mipcache_lookup(const gchar *key, int size, ThumbnailQuality quality);
+
+/**
+ * Build the pyramid below a freshly decoded top level and publish it.
+ *
+ * @param key     Payload key from thumbnail_mipcache_key()
+ * @param top     RGBA image at thumbnail_mipcache_top_edge()
+ * @param quality Preset @top was rendered with
+ * @param interp  Kernel for the halvings
+ */
+void thumbnail_mipcache_store(const gchar *key, GdkPixbuf *top, ThumbnailQuality quality,
+                              GdkInterpType interp);
+
+#endif /* THUMBNAIL_MIPCACHE_H */
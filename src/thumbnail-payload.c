@@ -0,0 +1,104 @@
+/*
+ * thumbnail-payload.c - Icon payloads handed out by the extractors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-payload.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#define LINK_TARGET_MAX 4096
+
+typedef struct {
+    gpointer addr;
+    gsize    len;
+} PayloadMapping;
+
+static void
+payload_mapping_free(gpointer data)
+{
+    PayloadMapping *mapping = data;
+    munmap(mapping->addr, mapping->len);
+    g_free(mapping);
+}
+
+/* Fallback for files that cannot be mapped (odd filesystems) */
+static GBytes *
+read_whole(int fd, gsize len)
+{
+    guchar *buf = g_malloc(len);
+    gsize done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (gsize)n;
+    }
+
+    if (done != len) {
+        g_free(buf);
+        return NULL;
+    }
+    return g_bytes_new_take(buf, len);
+}
+
+GBytes *
+thumbnail_payload_from_file(const gchar *path, ThumbnailArena *arena)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        g_debug("thumbnail_payload_from_file: '%s' not found", path);
+        return NULL;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        gchar *target = thumbnail_arena_alloc(arena, LINK_TARGET_MAX);
+        ssize_t len = readlink(path, target, LINK_TARGET_MAX);
+        if (len < 0 || len == LINK_TARGET_MAX)
+            return NULL;
+        g_debug("thumbnail_payload_from_file: symlink -> '%.*s'", (int)len, target);
+        return g_bytes_new(target, (gsize)len);
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > G_MAXUINT) {
+        g_debug("thumbnail_payload_from_file: cannot read '%s': %s", path, g_strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    const gsize len = (gsize)st.st_size;
+    if (len == 0) {
+        close(fd);
+        return g_bytes_new(NULL, 0);
+    }
+
+    GBytes *bytes = NULL;
+    gpointer addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+        PayloadMapping *mapping = g_new(PayloadMapping, 1);
+        mapping->addr = addr;
+        mapping->len = len;
+        bytes = g_bytes_new_with_free_func(addr, len, payload_mapping_free, mapping);
+    } else {
+        g_debug("thumbnail_payload_from_file: mmap of '%s' failed: %s, reading",
+                path, g_strerror(errno));
+        bytes = read_whole(fd, len);
+        if (!bytes)
+            g_debug("thumbnail_payload_from_file: short read on '%s'", path);
+    }
+    close(fd);
+    return bytes;
+}
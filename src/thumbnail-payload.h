@@ -0,0 +1,33 @@
+/*
+ * thumbnail-payload.h - Icon payloads handed out by the extractors
+ *
+ * Extractors return the icon as GBytes so the bytes stay with whatever
+ * produced them: a private mmap of the file the tool extracted (which
+ * survives the temporary directory being removed), or the buffer the
+ * native reader decompressed into.  Decoders read the mapping directly;
+ * nothing is copied between extraction and decoding.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_PAYLOAD_H
+#define THUMBNAIL_PAYLOAD_H
+
+#include <glib.h>
+
+#include "thumbnail-arena.h"
+
+/**
+ * Take the payload of a file an extraction tool wrote.
+ *
+ * A symlink yields its target text, so the caller can follow it like a
+ * pointer file.  A regular file is mapped read-only; the mapping is
+ * released with the last reference to the returned bytes.
+ *
+ * @param path  Extracted file
+ * @param arena Job arena for scratch memory
+ * @return The payload (caller unrefs), or NULL on failure
+ */
+GBytes *thumbnail_payload_from_file(const gchar *path, ThumbnailArena *arena);
+
+#endif /* THUMBNAIL_PAYLOAD_H */
@@ -0,0 +1,898 @@
+/*
+ * thumbnail-pipeline.c - Icon extraction and rendering for appimage-thumbnailer
+ *
+ * Shared by the one-shot command line mode and the socket server: pulls
+ * .DirIcon out of the AppImage payload (unsquashfs / dwarfsextract),
+ * follows pointer files, and turns the icon into a scaled RGBA pixbuf.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-pipeline.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cairo.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <librsvg/rsvg.h>
+
+#include "appimage-reader.h"
+#include "squashfs-reader.h"
+#include "thumbnail-arena.h"
+#include "thumbnail-backend.h"
+#include "thumbnail-icon-index.h"
+#include "thumbnail-integration.h"
+#include "thumbnail-mipcache.h"
+#include "thumbnail-trace.h"
+#include "thumbnail-usdt.h"
+
+#define MAX_SYMLINK_DEPTH 5
+#define POINTER_TEXT_LIMIT 1024
+
+/* Weight of the newest sample in the render cost estimates */
+#define COST_SMOOTHING 0.25
+
+/* Payloads worth a preview: SVGs above this size, rasters at least this
+ * many times the target edge */
+#define PREVIEW_SVG_BYTES    (64 * 1024)
+#define PREVIEW_RASTER_RATIO 4
+#define PREVIEW_DIVISOR      4
+#define PREVIEW_MIN_SIZE     32
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* ------------------------------------------------------------------ */
+/*  Quality presets                                                   */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    const char *name;
+    GdkInterpType interp;          /* raster resampling kernel */
+    int png_compression;           /* zlib level for PNG output */
+    cairo_antialias_t svg_antialias;
+    int svg_supersample;           /* SVG render scale before downsampling */
+    int max_pointer_depth;         /* .DirIcon pointer/symlink hops */
+} QualityPreset;
+
+static const QualityPreset quality_presets[] = {
+    [THUMBNAIL_QUALITY_FAST]     = { "fast",     GDK_INTERP_NEAREST,  1, CAIRO_ANTIALIAS_FAST,    1, 3 },
+    [THUMBNAIL_QUALITY_BALANCED] = { "balanced", GDK_INTERP_BILINEAR, 6, CAIRO_ANTIALIAS_DEFAULT, 1, MAX_SYMLINK_DEPTH },
+    [THUMBNAIL_QUALITY_BEST]     = { "best",     GDK_INTERP_HYPER,    9, CAIRO_ANTIALIAS_BEST,    2, 8 },
+};
+
+static ThumbnailQuality current_quality = THUMBNAIL_QUALITY_BALANCED;
+static ThumbnailBackend current_backend = THUMBNAIL_BACKEND_AUTO;
+
+/* Render cost per output megapixel in microseconds, per preset.  Seeded
+ * with rough desktop figures and refined by every render. */
+static double render_cost[] = {
+    [THUMBNAIL_QUALITY_FAST]     = 15000,
+    [THUMBNAIL_QUALITY_BALANCED] = 40000,
+    [THUMBNAIL_QUALITY_BEST]     = 200000,
+};
+
+static const QualityPreset *
+preset(void)
+{
+    return &quality_presets[current_quality];
+}
+
+void
+thumbnail_pipeline_set_quality(ThumbnailQuality quality)
+{
+    if (quality <= THUMBNAIL_QUALITY_BEST)
+        current_quality = quality;
+}
+
+ThumbnailQuality
+thumbnail_pipeline_get_quality(void)
+{
+    return current_quality;
+}
+
+const char *
+thumbnail_quality_name(ThumbnailQuality quality)
+{
+    return quality <= THUMBNAIL_QUALITY_BEST ? quality_presets[quality].name : "unknown";
+}
+
+ThumbnailQuality
+thumbnail_pipeline_quality_for_deadline(ThumbnailQuality preferred, int size, gint64 remaining_usec)
+{
+    const double mpx = (double)size * (double)size / 1e6;
+    ThumbnailQuality quality = MIN(preferred, THUMBNAIL_QUALITY_BEST);
+
+    while (quality > THUMBNAIL_QUALITY_FAST && render_cost[quality] * mpx > (double)remaining_usec)
+        quality--;
+
+    if (quality != preferred)
+        g_debug("thumbnail_pipeline_quality_for_deadline: %s -> %s (%" G_GINT64_FORMAT " us left)",
+                thumbnail_quality_name(preferred), thumbnail_quality_name(quality), remaining_usec);
+    return quality;
+}
+
+static void
+record_render_cost(int size, gint64 elapsed_usec)
+{
+    const double mpx = MAX((double)size * (double)size / 1e6, 1e-3);
+    const double sample = (double)elapsed_usec / mpx;
+    render_cost[current_quality] += COST_SMOOTHING * (sample - render_cost[current_quality]);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Backends                                                          */
+/* ------------------------------------------------------------------ */
+
+void
+thumbnail_pipeline_set_backend(ThumbnailBackend backend)
+{
+    if (backend < THUMBNAIL_BACKEND_COUNT)
+        current_backend = backend;
+}
+
+ThumbnailBackend
+thumbnail_pipeline_get_backend(void)
+{
+    return current_backend;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Entry extraction dispatch                                         */
+/* ------------------------------------------------------------------ */
+
+/* Try the planned backends in turn.  A backend's failure is only put on
+ * its record when a later one reads the entry: if none can, the image is
+ * more likely at fault than the backends. */
+static const ThumbnailBackendOps *
+extract_entry(const ThumbnailBackendImage *image, const char *entry,
+              GBytes **output, SquashfsLocation **location)
+{
+    if (!image->archive || !entry || *entry == '\0')
+        return NULL;
+
+    g_debug("extract_entry: trying '%s' from '%s' (format=%s, offset=%" G_GINT64_FORMAT ")",
+            entry, image->archive, appimage_format_name(image->format), (gint64)image->offset);
+
+    const ThumbnailBackendOps *plan[THUMBNAIL_BACKEND_COUNT];
+    gint64 failed_usec[THUMBNAIL_BACKEND_COUNT];
+    const guint n = thumbnail_backend_plan(image, current_backend, plan);
+    if (n == 0)
+        g_debug("extract_entry: no backend can read this %s image (compression %s)",
+                appimage_format_name(image->format),
+                squashfs_compression_name(image->compression));
+
+    for (guint i = 0; i < n; ++i) {
+        THUMBNAIL_USDT2(backend__chosen, plan[i]->name, entry);
+        const gint64 start = g_get_monotonic_time();
+        const gboolean ok = plan[i]->extract(image, entry, output, location);
+        const gint64 elapsed = g_get_monotonic_time() - start;
+
+        if (!ok) {
+            g_debug("extract_entry: %s failed for '%s'", plan[i]->name, entry);
+            failed_usec[i] = elapsed;
+            continue;
+        }
+
+        g_debug("extract_entry: %s succeeded for '%s'", plan[i]->name, entry);
+        for (guint j = 0; j < i; ++j)
+            thumbnail_backend_record(plan[j]->id, image->format, FALSE, failed_usec[j]);
+        thumbnail_backend_record(plan[i]->id, image->format, TRUE, elapsed);
+        return plan[i];
+    }
+
+    g_debug("extract_entry: all extraction methods failed for '%s'", entry);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Symlink / pointer detection                                       */
+/* ------------------------------------------------------------------ */
+
+/* The pointer target is trimmed in place and only copied (into the job
+ * arena) once the payload is known to be one. */
+static gboolean
+is_pointer_candidate(const guchar *data, gsize len, ThumbnailArena *arena, gchar **pointer_out)
+{
+    if (!data || len == 0 || len > POINTER_TEXT_LIMIT)
+        return FALSE;
+
+    for (gsize i = 0; i < len; ++i) {
+        if (data[i] == '\0')
+            return FALSE;
+        if (!g_ascii_isprint(data[i]) && !g_ascii_isspace(data[i]))
+            return FALSE;
+    }
+
+    gsize start = 0;
+    gsize end = len;
+    while (start < end && g_ascii_isspace(data[start]))
+        start++;
+    while (end > start && g_ascii_isspace(data[end - 1]))
+        end--;
+    if (start == end)
+        return FALSE;
+
+    for (gsize i = start; i < end; ++i) {
+        const gchar c = (gchar)data[i];
+        if (c == '/' || c == '.' || c == '-' || c == '_' || g_ascii_isalnum(c))
+            continue;
+        return FALSE;
+    }
+
+    gchar *target = thumbnail_arena_strndup(arena, (const gchar *)data + start, end - start);
+    if (pointer_out)
+        *pointer_out = target;
+
+    g_debug("is_pointer_candidate: detected pointer/symlink target '%s'", target);
+    return TRUE;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Image processing (SVG / raster)                                   */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+payload_is_svg(const guchar *data, gsize len)
+{
+    if (!data || len == 0)
+        return FALSE;
+
+    gboolean uncertain = FALSE;
+    gchar *mime = g_content_type_guess(NULL, data, len, &uncertain);
+    gboolean is_svg = mime && g_content_type_is_a(mime, "image/svg+xml");
+    g_debug("payload_is_svg: content-type guess '%s' (uncertain=%d, is_svg=%d)",
+            mime ? mime : "(null)", uncertain, is_svg);
+    g_free(mime);
+    if (is_svg)
+        return TRUE;
+
+    /* Case-insensitive "<svg" in the first KiB, without a lowered copy */
+    const gsize probe = MIN(len, (gsize)1024);
+    gboolean found = FALSE;
+    for (gsize i = 0; i + 4 <= probe && !found; ++i)
+        found = data[i] == '<' && g_ascii_strncasecmp((const gchar *)data + i + 1, "svg", 3) == 0;
+    g_debug("payload_is_svg: <svg> tag probe result: %s", found ? "found" : "not found");
+    return found;
+}
+
+/* Convert a premultiplied native-endian ARGB32 cairo surface into a
+ * non-premultiplied RGBA pixbuf, so both decode paths hand out the same
+ * pixel layout. */
+static GdkPixbuf *
+pixbuf_from_surface(cairo_surface_t *surface)
+{
+    cairo_surface_flush(surface);
+
+    const int width  = cairo_image_surface_get_width(surface);
+    const int height = cairo_image_surface_get_height(surface);
+    const int src_stride = cairo_image_surface_get_stride(surface);
+    const guchar *src = cairo_image_surface_get_data(surface);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+    if (!pixbuf || !src)
+        return pixbuf;
+
+    const int dst_stride = gdk_pixbuf_get_rowstride(pixbuf);
+    guchar *dst = gdk_pixbuf_get_pixels(pixbuf);
+
+    for (int y = 0; y < height; ++y) {
+        const guint32 *s = (const guint32 *)(src + (gsize)y * src_stride);
+        guchar *d = dst + (gsize)y * dst_stride;
+        for (int x = 0; x < width; ++x) {
+            const guint32 px = s[x];
+            const guint a = px >> 24;
+            guint r = (px >> 16) & 0xff;
+            guint g = (px >> 8) & 0xff;
+            guint b = px & 0xff;
+            if (a != 0 && a != 255) {
+                r = (r * 255 + a / 2) / a;
+                g = (g * 255 + a / 2) / a;
+                b = (b * 255 + a / 2) / a;
+            }
+            d[4 * x + 0] = (guchar)r;
+            d[4 * x + 1] = (guchar)g;
+            d[4 * x + 2] = (guchar)b;
+            d[4 * x + 3] = (guchar)a;
+        }
+    }
+
+    return pixbuf;
+}
+
+static GdkPixbuf *
+render_svg_payload(const guchar *data, gsize len, int size)
+{
+    g_debug("render_svg_payload: %" G_GSIZE_FORMAT " bytes, target %d", len, size);
+
+    /* Parse from a stream over the payload: new_from_data() would copy
+     * it first.  Loading completes here, so static bytes are safe. */
+    GError *error = NULL;
+    GBytes *bytes = g_bytes_new_static(data, len);
+    GInputStream *stream = g_memory_input_stream_new_from_bytes(bytes);
+    RsvgHandle *handle = rsvg_handle_new_from_stream_sync(stream, NULL, RSVG_HANDLE_FLAGS_NONE,
+                                                          NULL, &error);
+    g_object_unref(stream);
+    g_bytes_unref(bytes);
+    if (!handle) {
+        g_debug("render_svg_payload: parse failed: %s", error ? error->message : "unknown");
+        g_printerr("Failed to parse SVG icon: %s\n", error ? error->message : "unknown");
+        if (error)
+            g_error_free(error);
+        return NULL;
+    }
+
+    RsvgDimensionData dim;
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    rsvg_handle_get_dimensions(handle, &dim);
+    G_GNUC_END_IGNORE_DEPRECATIONS
+
+    double width  = dim.width  > 0 ? dim.width  : size;
+    double height = dim.height > 0 ? dim.height : size;
+    if (width  <= 0) width  = size;
+    if (height <= 0) height = size;
+
+    double scale = MIN((double)size / width, (double)size / height);
+    if (!isfinite(scale) || scale <= 0)
+        scale = (double)size / MAX(width, height);
+    if (!isfinite(scale) || scale <= 0)
+        scale = 1.0;
+
+    /* The best preset renders oversized and downsamples, which
+     * smooths thin strokes that cairo would otherwise alias. */
+    const int supersample = size <= 16 ? 1 : preset()->svg_supersample;
+    scale *= supersample;
+
+    const double scaled_w = width * scale;
+    const double scaled_h = height * scale;
+    const int target_w = size * supersample;
+    const int target_h = size * supersample;
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, target_w, target_h);
+    cairo_t *cr = cairo_create(surface);
+    cairo_set_antialias(cr, preset()->svg_antialias);
+
+    cairo_save(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_restore(cr);
+
+    const double translate_x = (target_w - scaled_w) / 2.0;
+    const double translate_y = (target_h - scaled_h) / 2.0;
+    cairo_translate(cr, translate_x, translate_y);
+    cairo_scale(cr, scale, scale);
+
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    gboolean render_ok = rsvg_handle_render_cairo(handle, cr);
+    G_GNUC_END_IGNORE_DEPRECATIONS
+    cairo_destroy(cr);
+    g_object_unref(handle);
+
+    if (!render_ok || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        g_printerr("Failed to render SVG icon\n");
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+
+    GdkPixbuf *pixbuf = pixbuf_from_surface(surface);
+    cairo_surface_destroy(surface);
+
+    if (pixbuf && supersample > 1) {
+        GdkPixbuf *scaled = gdk_pixbuf_scale_simple(pixbuf, size, size, preset()->interp);
+        g_object_unref(pixbuf);
+        pixbuf = scaled;
+    }
+    return pixbuf;
+}
+
+static GdkPixbuf *
+scale_pixbuf(GdkPixbuf *pixbuf, int size)
+{
+    const int width  = gdk_pixbuf_get_width(pixbuf);
+    const int height = gdk_pixbuf_get_height(pixbuf);
+
+    if (width <= 0 || height <= 0)
+        return NULL;
+
+    double scale = MIN((double)size / (double)width, (double)size / (double)height);
+    if (!isfinite(scale) || scale <= 0)
+        scale = 1.0;
+
+    int target_w = MAX(1, (int)lround(width * scale));
+    int target_h = MAX(1, (int)lround(height * scale));
+    target_w = MIN(target_w, size);
+    target_h = MIN(target_h, size);
+
+    if (target_w == width && target_h == height) {
+        g_object_ref(pixbuf);
+        return pixbuf;
+    }
+
+    thumbnail_trace_begin(THUMBNAIL_STAGE_SCALE);
+    GdkPixbuf *scaled = gdk_pixbuf_scale_simple(pixbuf, target_w, target_h, preset()->interp);
+    thumbnail_trace_end(THUMBNAIL_STAGE_SCALE);
+    return scaled;
+}
+
+static GdkPixbuf *
+render_raster_payload(const guchar *data, gsize len, int size)
+{
+    GError *error = NULL;
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+
+    if (!gdk_pixbuf_loader_write(loader, data, len, &error)) {
+        g_printerr("Failed to load image bytes: %s\n", error->message);
+        g_error_free(error);
+        g_object_unref(loader);
+        return NULL;
+    }
+
+    if (!gdk_pixbuf_loader_close(loader, &error)) {
+        g_printerr("Failed to finalize image decode: %s\n", error->message);
+        g_error_free(error);
+        g_object_unref(loader);
+        return NULL;
+    }
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    if (!pixbuf) {
+        g_printerr("Image loader returned NULL pixbuf\n");
+        g_object_unref(loader);
+        return NULL;
+    }
+
+    g_object_ref(pixbuf);
+    g_object_unref(loader);
+
+    g_debug("render_raster_payload: loaded raster %dx%d",
+            gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf));
+
+    GdkPixbuf *scaled = scale_pixbuf(pixbuf, size);
+    if (!scaled)
+        scaled = g_object_ref(pixbuf);
+    g_object_unref(pixbuf);
+
+    /* Hand out RGBA regardless of the source (JPEG/XPM icons are RGB) */
+    if (!gdk_pixbuf_get_has_alpha(scaled)) {
+        GdkPixbuf *with_alpha = gdk_pixbuf_add_alpha(scaled, FALSE, 0, 0, 0);
+        g_object_unref(scaled);
+        scaled = with_alpha;
+    }
+
+    return scaled;
+}
+
+GdkPixbuf *
+thumbnail_pipeline_render(const guchar *data, gsize len, int size)
+{
+    g_debug("thumbnail_pipeline_render: %" G_GSIZE_FORMAT " bytes, target size %d", len, size);
+
+    static gboolean empty_warned = FALSE;
+    if (!data || len == 0) {
+        if (!empty_warned) {
+            g_printerr("Icon payload is empty or missing\n");
+            empty_warned = TRUE;
+        }
+        return NULL;
+    }
+
+    /* A cached pyramid only needs resampling; on a miss the payload is
+     * decoded at the pyramid's top edge and the pyramid is published */
+    gchar *mip_key = NULL;
+    int render_size = size;
+    if (thumbnail_mipcache_enabled() && thumbnail_mipcache_top_edge(size) > 0) {
+        mip_key = thumbnail_mipcache_key(data, len);
+        GdkPixbuf *level = thumbnail_mipcache_lookup(mip_key, size, current_quality);
+        if (level)
+            THUMBNAIL_USDT2(cache__hit, "mip", size);
+        else
+            THUMBNAIL_USDT2(cache__miss, "mip", size);
+        if (level) {
+            GdkPixbuf *scaled = scale_pixbuf(level, size);
+            g_object_unref(level);
+            g_free(mip_key);
+            return scaled;
+        }
+        render_size = thumbnail_mipcache_top_edge(size);
+    }
+
+    const gint64 start = g_get_monotonic_time();
+    GdkPixbuf *pixbuf = NULL;
+
+    thumbnail_trace_begin(THUMBNAIL_STAGE_CLASSIFY);
+    const gboolean svg = payload_is_svg(data, len);
+    thumbnail_trace_end(THUMBNAIL_STAGE_CLASSIFY);
+
+    THUMBNAIL_USDT2(decode__start, (guint64)len, render_size);
+    thumbnail_trace_begin(THUMBNAIL_STAGE_DECODE);
+    if (svg) {
+        g_debug("thumbnail_pipeline_render: detected SVG, delegating");
+        pixbuf = render_svg_payload(data, len, render_size);
+        if (!pixbuf)
+            g_debug("thumbnail_pipeline_render: SVG failed, trying raster fallback");
+    }
+
+    if (!pixbuf)
+        pixbuf = render_raster_payload(data, len, render_size);
+    thumbnail_trace_end(THUMBNAIL_STAGE_DECODE);
+    THUMBNAIL_USDT2(decode__end, pixbuf ? gdk_pixbuf_get_width(pixbuf) : 0,
+                    pixbuf ? gdk_pixbuf_get_height(pixbuf) : 0);
+
+    if (pixbuf)
+        record_render_cost(render_size, g_get_monotonic_time() - start);
+
+    if (pixbuf && mip_key) {
+        thumbnail_mipcache_store(mip_key, pixbuf, current_quality, preset()->interp);
+        GdkPixbuf *scaled = scale_pixbuf(pixbuf, size);
+        g_object_unref(pixbuf);
+        pixbuf = scaled;
+    }
+    g_free(mip_key);
+    return pixbuf;
+}
+
+/* PNG dimensions straight from the IHDR chunk, without decoding */
+static gboolean
+png_dimensions(const guchar *data, gsize len, guint32 *width, guint32 *height)
+{
+    static const guchar signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    if (len < 24 || memcmp(data, signature, sizeof(signature)) != 0
+        || memcmp(data + 12, "IHDR", 4) != 0)
+        return FALSE;
+
+    *width  = (guint32)data[16] << 24 | (guint32)data[17] << 16 | (guint32)data[18] << 8 | data[19];
+    *height = (guint32)data[20] << 24 | (guint32)data[21] << 16 | (guint32)data[22] << 8 | data[23];
+    return TRUE;
+}
+
+gboolean
+thumbnail_pipeline_wants_preview(const guchar *data, gsize len, int size)
+{
+    if (!data || len == 0 || size < PREVIEW_MIN_SIZE * 2)
+        return FALSE;
+
+    guint32 width = 0;
+    guint32 height = 0;
+    if (png_dimensions(data, len, &width, &height))
+        return MAX(width, height) >= (guint32)size * PREVIEW_RASTER_RATIO;
+
+    if (payload_is_svg(data, len))
+        return len >= PREVIEW_SVG_BYTES;
+
+    /* Other rasters: judge by the compressed size of a 4x-target image */
+    return len >= (gsize)size * size * PREVIEW_RASTER_RATIO;
+}
+
+GdkPixbuf *
+thumbnail_pipeline_render_preview(const guchar *data, gsize len, int size)
+{
+    const ThumbnailQuality quality = current_quality;
+    const int preview_size = MAX(size / PREVIEW_DIVISOR, PREVIEW_MIN_SIZE);
+
+    g_debug("thumbnail_pipeline_render_preview: %d -> %d px", size, preview_size);
+
+    /* Not through thumbnail_pipeline_render(), so the preview does not
+     * skew the cost estimate of the fast preset */
+    current_quality = THUMBNAIL_QUALITY_FAST;
+    GdkPixbuf *pixbuf = NULL;
+    if (payload_is_svg(data, len))
+        pixbuf = render_svg_payload(data, len, preview_size);
+    if (!pixbuf)
+        pixbuf = render_raster_payload(data, len, preview_size);
+    current_quality = quality;
+
+    return pixbuf;
+}
+
+/* ------------------------------------------------------------------ */
+/*  PNG encoding                                                      */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    int     fd;
+    guint64 written;
+} FdWriter;
+
+static gboolean
+write_to_fd_cb(const gchar *buf, gsize count, GError **error, gpointer user_data)
+{
+    FdWriter *writer = user_data;
+    const int fd = writer->fd;
+
+    while (count > 0) {
+        ssize_t n = write(fd, buf, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "%s", g_strerror(errno));
+            return FALSE;
+        }
+        buf += n;
+        count -= (gsize)n;
+        writer->written += (guint64)n;
+    }
+    return TRUE;
+}
+
+gboolean
+thumbnail_pipeline_write_png_fd(GdkPixbuf *pixbuf, int fd, const char *const *text_pairs)
+{
+    GPtrArray *keys = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *values = g_ptr_array_new();
+    gchar compression[4];
+    g_snprintf(compression, sizeof(compression), "%d", preset()->png_compression);
+
+    g_ptr_array_add(keys, g_strdup("compression"));
+    g_ptr_array_add(values, compression);
+
+    for (guint i = 0; text_pairs && text_pairs[i] && text_pairs[i + 1]; i += 2) {
+        g_ptr_array_add(keys, g_strconcat("tEXt::", text_pairs[i], NULL));
+        g_ptr_array_add(values, (gpointer)text_pairs[i + 1]);
+    }
+    g_ptr_array_add(keys, NULL);
+    g_ptr_array_add(values, NULL);
+
+    GError *error = NULL;
+    FdWriter writer = { .fd = fd };
+    thumbnail_trace_begin(THUMBNAIL_STAGE_ENCODE);
+    gboolean ok = gdk_pixbuf_save_to_callbackv(pixbuf, write_to_fd_cb, &writer, "png",
+                                               (gchar **)keys->pdata, (gchar **)values->pdata,
+                                               &error);
+    thumbnail_trace_end(THUMBNAIL_STAGE_ENCODE);
+    if (!ok) {
+        g_printerr("Failed to encode thumbnail: %s\n", error->message);
+        g_error_free(error);
+    } else {
+        THUMBNAIL_USDT3(encode__done, gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf),
+                        writer.written);
+    }
+
+    g_ptr_array_unref(keys);
+    g_ptr_array_unref(values);
+    return ok;
+}
+
+/* Through the fd encoder, which counts the bytes for encode__done as
+ * they are written instead of a stat() afterwards */
+gboolean
+thumbnail_pipeline_save_png(GdkPixbuf *pixbuf, const char *out_path)
+{
+    int fd = g_open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        g_printerr("Failed to write thumbnail: %s: %s\n", out_path, g_strerror(errno));
+        return FALSE;
+    }
+
+    gboolean ok = thumbnail_pipeline_write_png_fd(pixbuf, fd, NULL);
+    if (close(fd) != 0 && ok) {
+        g_printerr("Failed to write thumbnail: %s: %s\n", out_path, g_strerror(errno));
+        ok = FALSE;
+    }
+    if (ok)
+        g_debug("thumbnail_pipeline_save_png: thumbnail written to '%s'", out_path);
+    return ok;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Icon location index                                               */
+/* ------------------------------------------------------------------ */
+
+static GBytes *
+read_indexed_icon(AppImageReader *reader)
+{
+    const AppImageReaderIdentity *identity = appimage_reader_identity(reader);
+    SquashfsLocation *location = thumbnail_icon_index_lookup(identity);
+    if (!location)
+        return NULL;
+
+    GBytes *bytes = squashfs_read_location(reader, location);
+    if (!bytes || g_bytes_get_size(bytes) != location->file_size) {
+        g_debug("read_indexed_icon: stale record for '%s'", appimage_reader_name(reader));
+        g_clear_pointer(&bytes, g_bytes_unref);
+        thumbnail_icon_index_forget(identity);
+    }
+    g_free(location);
+    return bytes;
+}
+
+/* The tools do not report where the entry was; find out from metadata */
+static void
+record_icon_location(AppImageReader *reader, off_t offset, const char *entry,
+                     SquashfsLocation *location, GBytes *payload)
+{
+    SquashfsLocation *found = location ? location : squashfs_locate_entry(reader, offset, entry);
+    if (found && found->file_size == g_bytes_get_size(payload))
+        thumbnail_icon_index_store(appimage_reader_identity(reader), found);
+    if (found != location)
+        g_free(found);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Symlink-following entry extraction (up to MAX_SYMLINK_DEPTH)      */
+/* ------------------------------------------------------------------ */
+
+GBytes *
+thumbnail_pipeline_extract_icon(const char *archive, const char *entry,
+                                AppImageFormat format, off_t offset)
+{
+    if (!entry)
+        return NULL;
+
+    g_debug("thumbnail_pipeline_extract_icon: starting with '%s'", entry);
+
+    /* Every scratch string of this extraction lives in the job arena,
+     * which is rewound before returning. */
+    ThumbnailArena *arena = thumbnail_arena_for_thread();
+    AppImageReader *reader = NULL;
+    SquashfsLocation *location = NULL;
+    GBytes *result = NULL;
+    const gchar *current = entry;
+
+    /* An icon a desktop integrator already installed needs no extraction */
+    const gboolean remote = appimage_reader_is_uri(archive);
+    const gboolean automatic = current_backend == THUMBNAIL_BACKEND_AUTO;
+    if (automatic && !remote && strcmp(entry, THUMBNAIL_ICON_ENTRY) == 0) {
+        thumbnail_trace_begin(THUMBNAIL_STAGE_EXTRACT);
+        result = thumbnail_integration_lookup(archive, arena);
+        thumbnail_trace_end(THUMBNAIL_STAGE_EXTRACT);
+        if (result) {
+            THUMBNAIL_USDT2(cache__hit, "integration", 0);
+            goto out;
+        }
+        THUMBNAIL_USDT2(cache__miss, "integration", 0);
+    }
+
+    /* One reader for the whole chain, so its block cache carries over.
+     * Local SquashFS images get one as well, for the icon index and as
+     * a backend the registry can plan. */
+    const gboolean native = automatic && format == APPIMAGE_FORMAT_SQUASHFS;
+    const gboolean indexed = native && strcmp(entry, THUMBNAIL_ICON_ENTRY) == 0;
+    const gboolean in_process = remote || current_backend == THUMBNAIL_BACKEND_READER;
+    if (in_process || native) {
+        reader = appimage_reader_open(archive);
+        if (!reader && in_process)
+            goto out;
+    }
+
+    if (reader && indexed) {
+        thumbnail_trace_begin(THUMBNAIL_STAGE_EXTRACT);
+        result = read_indexed_icon(reader);
+        thumbnail_trace_end(THUMBNAIL_STAGE_EXTRACT);
+        if (result) {
+            THUMBNAIL_USDT2(cache__hit, "index", 0);
+            g_debug("thumbnail_pipeline_extract_icon: served from the icon index");
+            goto out;
+        }
+        THUMBNAIL_USDT2(cache__miss, "index", 0);
+    }
+
+    const ThumbnailBackendImage image = {
+        .archive = archive,
+        .remote = remote,
+        .reader = reader,
+        .format = format,
+        .offset = offset,
+        .compression = reader && format == APPIMAGE_FORMAT_SQUASHFS
+                       ? squashfs_read_compression(reader, offset) : 0,
+        .arena = arena,
+    };
+
+    const int max_depth = preset()->max_pointer_depth;
+    for (int depth = 0; depth < max_depth; ++depth) {
+        g_debug("thumbnail_pipeline_extract_icon: depth %d, trying '%s'", depth, current);
+
+        GBytes *payload = NULL;
+        g_clear_pointer(&location, g_free);
+        thumbnail_trace_begin(THUMBNAIL_STAGE_EXTRACT);
+        const ThumbnailBackendOps *backend = extract_entry(&image, current, &payload, &location);
+        thumbnail_trace_end(THUMBNAIL_STAGE_EXTRACT);
+        if (!backend) {
+            g_debug("thumbnail_pipeline_extract_icon: extraction failed for '%s' at depth %d",
+                    current, depth);
+            break;
+        }
+
+        gchar *next = NULL;
+        gsize len = 0;
+        const guchar *data = g_bytes_get_data(payload, &len);
+        thumbnail_trace_begin(THUMBNAIL_STAGE_CLASSIFY);
+        const gboolean pointer = is_pointer_candidate(data, len, arena, &next);
+        thumbnail_trace_end(THUMBNAIL_STAGE_CLASSIFY);
+        if (pointer) {
+            g_bytes_unref(payload);
+            const gchar *resolved = backend->resolve_link(&image, current, next);
+            if (!resolved)
+                break;
+            g_debug("thumbnail_pipeline_extract_icon: '%s' -> '%s' (depth %d)",
+                    current, resolved, depth);
+            current = resolved;
+            if (depth + 1 == max_depth)
+                g_debug("thumbnail_pipeline_extract_icon: exceeded max depth (%d) for '%s'",
+                        max_depth, entry);
+            continue;
+        }
+
+        g_debug("thumbnail_pipeline_extract_icon: '%s' is data (%" G_GSIZE_FORMAT " bytes)",
+                current, len);
+        result = payload;
+        break;
+    }
+
+    if (result && reader && indexed)
+        record_icon_location(reader, offset, current, location, result);
+
+out:
+    g_free(location);
+    appimage_reader_free(reader);
+    thumbnail_arena_reset(arena, entry);
+    return result;
+}
+
+GBytes *
+thumbnail_pipeline_load_icon(const char *archive)
+{
+    off_t offset;
+    thumbnail_trace_begin(THUMBNAIL_STAGE_PROBE);
+    AppImageFormat format = appimage_locate_payload(archive, &offset);
+    const gboolean truncated = offset > 0 && appimage_payload_truncated(archive);
+    thumbnail_trace_end(THUMBNAIL_STAGE_PROBE);
+    THUMBNAIL_USDT3(probe__done, (int)format, (gint64)offset, truncated);
+
+    g_debug("thumbnail_pipeline_load_icon: '%s' format=%s, offset=%" G_GINT64_FORMAT,
+            archive, appimage_format_name(format), (gint64)offset);
+
+    if (offset <= 0)
+        return NULL;
+    if (truncated) {
+        g_debug("thumbnail_pipeline_load_icon: '%s' is incomplete, not extracting", archive);
+        return NULL;
+    }
+    return thumbnail_pipeline_extract_icon(archive, THUMBNAIL_ICON_ENTRY, format, offset);
+}
+
+void
+thumbnail_pipeline_warm_up(void)
+{
+    static const char warm_up_svg[] =
+        "<svg xmlns='http://www.w3.org/2000/svg' width='16' height='16'>"
+        "<rect width='16' height='16' fill='#000'/>"
+        "<text x='0' y='12' font-size='12'>A</text>"
+        "</svg>";
+
+    g_debug("thumbnail_pipeline_warm_up: initializing decoders");
+
+    GSList *formats = gdk_pixbuf_get_formats();
+    g_slist_free(formats);
+
+    GdkPixbuf *pixbuf = render_svg_payload((const guchar *)warm_up_svg,
+                                           sizeof(warm_up_svg) - 1, 16);
+    if (!pixbuf)
+        return;
+
+    gchar *png = NULL;
+    gsize png_len = 0;
+    if (gdk_pixbuf_save_to_buffer(pixbuf, &png, &png_len, "png", NULL, NULL)) {
+        GdkPixbuf *decoded = render_raster_payload((const guchar *)png, png_len, 8);
+        if (decoded)
+            g_object_unref(decoded);
+        g_free(png);
+    }
+    g_object_unref(pixbuf);
+}
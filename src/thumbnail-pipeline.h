@@ -0,0 +1,163 @@
+/*
+ * thumbnail-pipeline.h - Icon extraction and rendering for appimage-thumbnailer
+ *
+ * The pipeline is split into two stages so that callers which render the
+ * same icon at several sizes (the socket server) only extract it once:
+ *   1. thumbnail_pipeline_extract_icon() resolves .DirIcon pointers and
+ *      returns the raw icon bytes (usually a mapping of the extracted
+ *      file, see thumbnail-payload.h).
+ *   2. thumbnail_pipeline_render() decodes (SVG or raster) and scales the
+ *      bytes into a non-premultiplied RGBA pixbuf.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_PIPELINE_H
+#define THUMBNAIL_PIPELINE_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+#include <sys/types.h>
+
+#include "appimage-type.h"
+#include "thumbnail-backend.h"
+
+#define THUMBNAIL_ICON_ENTRY ".DirIcon"
+
+/*
+ * Quality presets, ordered from cheapest to most expensive.  A preset
+ * selects the resampling kernel, PNG compression level, SVG render path
+ * (antialiasing, supersampling) and how many .DirIcon pointer hops are
+ * followed.
+ */
+typedef enum {
+    THUMBNAIL_QUALITY_FAST = 0,
+    THUMBNAIL_QUALITY_BALANCED,
+    THUMBNAIL_QUALITY_BEST,
+} ThumbnailQuality;
+
+/**
+ * Select the preset used by subsequent extract/render/encode calls
+ * (THUMBNAIL_QUALITY_BALANCED by default).
+ */
+void thumbnail_pipeline_set_quality(ThumbnailQuality quality);
+
+/**
+ * The preset currently in effect.
+ */
+ThumbnailQuality thumbnail_pipeline_get_quality(void);
+
+/**
+ * Name of a preset ("fast", "balanced", "best").
+ */
+const char *thumbnail_quality_name(ThumbnailQuality quality);
+
+/**
+ * Pick the best preset, no better than preferred, whose estimated render
+ * time for a size x size thumbnail fits in the remaining time.  The
+ * estimates are learned from previous renders in this process.
+ *
+ * @param preferred      Preset to use if time allows
+ * @param size           Target edge length in pixels
+ * @param remaining_usec Time left until the deadline (may be negative)
+ * @return The preset to render with
+ */
+ThumbnailQuality thumbnail_pipeline_quality_for_deadline(ThumbnailQuality preferred, int size,
+                                                         gint64 remaining_usec);
+
+/**
+ * Select the backend used by subsequent extractions
+ * (THUMBNAIL_BACKEND_AUTO by default).
+ */
+void thumbnail_pipeline_set_backend(ThumbnailBackend backend);
+
+/**
+ * The backend currently in effect.
+ */
+ThumbnailBackend thumbnail_pipeline_get_backend(void);
+
+/**
+ * Extract an icon entry from an AppImage, following pointer files and
+ * symlinks (up to the depth of the current quality preset).
+ *
+ * SquashFS entries of URI archives (sftp://, smb:// via GVfs) are read in
+ * place with the native reader; DwarFS needs a local path.
+ *
+ * @param archive Path to the AppImage file (may be a /proc/self/fd path),
+ *                or a URI GIO can open
+ * @param entry   Entry to start from, usually THUMBNAIL_ICON_ENTRY
+ * @param format  Payload format from appimage_detect_format()
+ * @param offset  Payload offset from appimage_payload_offset()
+ * @return The icon bytes (caller unrefs), or NULL on failure
+ */
+GBytes *thumbnail_pipeline_extract_icon(const char *archive, const char *entry,
+                                        AppImageFormat format, off_t offset);
+
+/**
+ * Detect the payload format of an AppImage and extract its .DirIcon.
+ *
+ * @param archive Path or URI of the AppImage file
+ * @return The icon bytes (caller unrefs), or NULL on failure
+ */
+GBytes *thumbnail_pipeline_load_icon(const char *archive);
+
+/**
+ * Decode icon bytes and scale them to fit a size x size box.
+ * SVG payloads are rendered centred on a transparent size x size canvas,
+ * raster payloads keep their aspect ratio.
+ *
+ * @param data Icon bytes
+ * @param len  Number of bytes
+ * @param size Target edge length in pixels
+ * @return An RGBA pixbuf (caller unrefs), or NULL on failure
+ */
+GdkPixbuf *thumbnail_pipeline_render(const guchar *data, gsize len, int size);
+
+/**
+ * Whether an icon is expensive enough to render that a quick preview
+ * should be delivered first (large SVGs, rasters far above the target
+ * size).
+ *
+ * @param data Icon bytes
+ * @param len  Number of bytes
+ * @param size Target edge length in pixels
+ * @return TRUE if thumbnail_pipeline_render_preview() is worth calling
+ */
+gboolean thumbnail_pipeline_wants_preview(const guchar *data, gsize len, int size);
+
+/**
+ * Render a low-resolution preview with the fast preset, at a quarter of
+ * the target size (at least 32 px).
+ *
+ * @return An RGBA pixbuf (caller unrefs), or NULL on failure
+ */
+GdkPixbuf *thumbnail_pipeline_render_preview(const guchar *data, gsize len, int size);
+
+/**
+ * Write a rendered thumbnail to a PNG file.
+ */
+gboolean thumbnail_pipeline_save_png(GdkPixbuf *pixbuf, const char *out_path);
+
+/**
+ * Encode a rendered thumbnail as PNG straight into a file descriptor
+ * (used for memfds and cache temp files, so no intermediate buffer is
+ * needed).
+ *
+ * @param pixbuf     Rendered thumbnail
+ * @param fd         Writable file descriptor, positioned where the PNG starts
+ * @param text_pairs NULL-terminated key, value, ... list of PNG tEXt chunks,
+ *                   or NULL
+ * @return TRUE on success
+ */
+gboolean thumbnail_pipeline_write_png_fd(GdkPixbuf *pixbuf, int fd,
+                                         const char *const *text_pairs);
+
+/**
+ * Initialize the decoders ahead of the first request: GdkPixbuf loader
+ * discovery, the PNG loader/saver, librsvg and fontconfig (through a
+ * text-bearing SVG).  Used before forking workers so that they start
+ * with everything loaded.
+ */
+void thumbnail_pipeline_warm_up(void);
+
+#endif /* THUMBNAIL_PIPELINE_H */
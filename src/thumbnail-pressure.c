@@ -0,0 +1,140 @@
+/*
+ * thumbnail-pressure.c - PSI memory/IO pressure monitoring
+ *
+ * A PSI trigger is a "<some|full> <stall us> <window us>" line written
+ * to the pressure file; the kernel then reports POLLPRI on that fd
+ * whenever the stall threshold is exceeded within a window.
+ * Unprivileged triggers need a window that is a multiple of 2 s.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-pressure.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#define TRIGGER_WINDOW_USEC 2000000
+
+static const struct {
+    const char *path;
+    const char *trigger;
+} TRIGGERS[] = {
+    /* any task stalled on memory for 15% of the window */
+    { "/proc/pressure/memory", "some 300000 2000000" },
+    /* all tasks stalled on IO for 25% of the window */
+    { "/proc/pressure/io",     "full 500000 2000000" },
+};
+
+static int trigger_fds[G_N_ELEMENTS(TRIGGERS)] = { -1, -1 };
+static guint trigger_source_ids[G_N_ELEMENTS(TRIGGERS)];
+static guint recovery_source_id = 0;
+static gint64 last_stall = 0;
+static ThumbnailPressureFunc pressure_func = NULL;
+static gpointer pressure_user_data = NULL;
+
+static gboolean
+on_recovery_tick(gpointer user_data G_GNUC_UNUSED)
+{
+    if (g_get_monotonic_time() - last_stall
+        < (gint64)THUMBNAIL_PRESSURE_RECOVERY_INTERVAL * G_USEC_PER_SEC)
+        return G_SOURCE_CONTINUE;
+
+    if (pressure_func(FALSE, pressure_user_data))
+        return G_SOURCE_CONTINUE;
+
+    g_debug("on_recovery_tick: fully recovered");
+    recovery_source_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_trigger(gint fd G_GNUC_UNUSED, GIOCondition condition, gpointer user_data)
+{
+    const guint index = GPOINTER_TO_UINT(user_data);
+
+    if (condition & (G_IO_ERR | G_IO_NVAL)) {
+        /* The monitored cgroup or PSI itself went away */
+        g_debug("on_trigger: %s monitor failed", TRIGGERS[index].path);
+        close(trigger_fds[index]);
+        trigger_fds[index] = -1;
+        trigger_source_ids[index] = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    /* Several triggers (or events) within one window count once */
+    const gint64 now = g_get_monotonic_time();
+    if (now - last_stall < TRIGGER_WINDOW_USEC)
+        return G_SOURCE_CONTINUE;
+    last_stall = now;
+
+    g_debug("on_trigger: stall reported by %s", TRIGGERS[index].path);
+    pressure_func(TRUE, pressure_user_data);
+
+    if (recovery_source_id == 0)
+        recovery_source_id = g_timeout_add_seconds(THUMBNAIL_PRESSURE_RECOVERY_INTERVAL,
+                                                   on_recovery_tick, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean
+thumbnail_pressure_start(ThumbnailPressureFunc func, gpointer user_data)
+{
+    gboolean any = FALSE;
+
+    pressure_func = func;
+    pressure_user_data = user_data;
+
+    for (guint i = 0; i < G_N_ELEMENTS(TRIGGERS); ++i) {
+        if (trigger_fds[i] >= 0) {
+            any = TRUE;
+            continue;
+        }
+
+        int fd = open(TRIGGERS[i].path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            g_debug("thumbnail_pressure_start: %s: %s", TRIGGERS[i].path, g_strerror(errno));
+            continue;
+        }
+
+        const gsize len = strlen(TRIGGERS[i].trigger) + 1;
+        if (write(fd, TRIGGERS[i].trigger, len) != (ssize_t)len) {
+            g_debug("thumbnail_pressure_start: trigger '%s' rejected by %s: %s",
+                    TRIGGERS[i].trigger, TRIGGERS[i].path, g_strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        trigger_fds[i] = fd;
+        trigger_source_ids[i] = g_unix_fd_add(fd, G_IO_PRI | G_IO_ERR, on_trigger,
+                                              GUINT_TO_POINTER(i));
+        any = TRUE;
+    }
+
+    return any;
+}
+
+void
+thumbnail_pressure_stop(void)
+{
+    for (guint i = 0; i < G_N_ELEMENTS(TRIGGERS); ++i) {
+        if (trigger_source_ids[i] != 0)
+            g_source_remove(trigger_source_ids[i]);
+        trigger_source_ids[i] = 0;
+        if (trigger_fds[i] >= 0)
+            close(trigger_fds[i]);
+        trigger_fds[i] = -1;
+    }
+
+    if (recovery_source_id != 0)
+        g_source_remove(recovery_source_id);
+    recovery_source_id = 0;
+    pressure_func = NULL;
+}
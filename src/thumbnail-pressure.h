@@ -0,0 +1,39 @@
+/*
+ * thumbnail-pressure.h - PSI memory/IO pressure monitoring
+ *
+ * Registers pressure stall triggers on /proc/pressure/memory and
+ * /proc/pressure/io (Linux >= 5.2) so long-running modes can shed work
+ * before the system starts swapping, and take it back once stalls stop.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_PRESSURE_H
+#define THUMBNAIL_PRESSURE_H
+
+#include <glib.h>
+
+/* Seconds without a stall before recovery ticks start */
+#define THUMBNAIL_PRESSURE_RECOVERY_INTERVAL 10
+
+/**
+ * Pressure callback.  Called with stalled = TRUE when a trigger fires
+ * (at most once per trigger window), and with stalled = FALSE once per
+ * THUMBNAIL_PRESSURE_RECOVERY_INTERVAL without stalls afterwards.
+ * Return TRUE from a recovery tick to keep receiving them.
+ */
+typedef gboolean (*ThumbnailPressureFunc)(gboolean stalled, gpointer user_data);
+
+/**
+ * Start monitoring on the default main context.
+ *
+ * @return TRUE if at least one PSI trigger could be registered
+ */
+gboolean thumbnail_pressure_start(ThumbnailPressureFunc func, gpointer user_data);
+
+/**
+ * Stop monitoring and close the trigger files.
+ */
+void thumbnail_pressure_stop(void);
+
+#endif /* THUMBNAIL_PRESSURE_H */
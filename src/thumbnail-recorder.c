@@ -0,0 +1,270 @@
+/*
+ * thumbnail-recorder.c - Request traces of the service frontends
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "thumbnail-recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+typedef struct {
+    guint8  type;        /* ThumbnailRecordType */
+    guint8  format;
+    guint16 flags;       /* socket flags; Queue: 1 = foreground */
+    guint16 deadline_ms;
+    guint16 n_sizes;
+    guint32 handle;
+    guint32 n_strings;
+    gint64  time_usec;
+} RecordHeader;
+
+static int record_fd = -1;
+
+/* Serialize one record and append it with a single write() */
+static void
+append_record(RecordHeader *header, const guint16 *sizes, const char *const *strings)
+{
+    header->time_usec = g_get_monotonic_time();
+
+    GByteArray *buf = g_byte_array_new();
+    g_byte_array_append(buf, (const guint8 *)header, sizeof(*header));
+    g_byte_array_append(buf, (const guint8 *)sizes, header->n_sizes * sizeof(guint16));
+    for (guint32 i = 0; i < header->n_strings; ++i) {
+        const guint32 len = (guint32)strlen(strings[i]);
+        g_byte_array_append(buf, (const guint8 *)&len, sizeof(len));
+        g_byte_array_append(buf, (const guint8 *)strings[i], len);
+    }
+
+    if (write(record_fd, buf->data, buf->len) != (ssize_t)buf->len)
+        g_debug("append_record: %s", g_strerror(errno));
+    g_byte_array_unref(buf);
+}
+
+gboolean
+thumbnail_recorder_open(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_printerr("Cannot open trace file '%s': %s\n", path, g_strerror(errno));
+        return FALSE;
+    }
+
+    /* A new trace starts with its magic; appended traces already have it */
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0
+        && write(fd, THUMBNAIL_RECORD_MAGIC, sizeof(THUMBNAIL_RECORD_MAGIC))
+           != (ssize_t)sizeof(THUMBNAIL_RECORD_MAGIC)) {
+        g_printerr("Cannot write trace file '%s': %s\n", path, g_strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    thumbnail_recorder_close();
+    record_fd = fd;
+
+    /* Ties this session's monotonic times to the wall clock */
+    gchar *realtime = g_strdup_printf("%" G_GINT64_FORMAT, g_get_real_time());
+    const char *strings[] = { realtime };
+    RecordHeader header = { .type = THUMBNAIL_RECORD_SESSION, .n_strings = 1 };
+    append_record(&header, NULL, strings);
+    g_free(realtime);
+
+    g_debug("thumbnail_recorder_open: recording requests to '%s'", path);
+    return TRUE;
+}
+
+void
+thumbnail_recorder_close(void)
+{
+    if (record_fd >= 0)
+        close(record_fd);
+    record_fd = -1;
+}
+
+void
+thumbnail_recorder_queue(guint32 handle, const char *const *uris, const char *flavor,
+                         gboolean foreground)
+{
+    if (record_fd < 0)
+        return;
+
+    GPtrArray *strings = g_ptr_array_new();
+    g_ptr_array_add(strings, (gpointer)flavor);
+    for (guint i = 0; uris && uris[i]; ++i)
+        g_ptr_array_add(strings, (gpointer)uris[i]);
+
+    RecordHeader header = {
+        .type = THUMBNAIL_RECORD_QUEUE,
+        .flags = foreground ? 1 : 0,
+        .handle = handle,
+        .n_strings = strings->len,
+    };
+    append_record(&header, NULL, (const char *const *)strings->pdata);
+    g_ptr_array_unref(strings);
+}
+
+void
+thumbnail_recorder_dequeue(guint32 handle)
+{
+    if (record_fd < 0)
+        return;
+
+    RecordHeader header = { .type = THUMBNAIL_RECORD_DEQUEUE, .handle = handle };
+    append_record(&header, NULL, NULL);
+}
+
+void
+thumbnail_recorder_socket(const ThumbnailServerRequest *req, const guint16 *sizes,
+                          const char *path)
+{
+    if (record_fd < 0)
+        return;
+
+    /* Passed fds are recorded under the name the client opened */
+    gchar *target = g_str_has_prefix(path, "/proc/self/fd/") ? g_file_read_link(path, NULL) : NULL;
+    const char *strings[] = { target ? target : path };
+
+    RecordHeader header = {
+        .type = THUMBNAIL_RECORD_SOCKET,
+        .format = req->format,
+        .flags = req->flags,
+        .deadline_ms = req->deadline_ms,
+        .n_sizes = req->n_sizes,
+        .n_strings = 1,
+    };
+    append_record(&header, sizes, strings);
+    g_free(target);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Reading                                                           */
+/* ------------------------------------------------------------------ */
+
+static void
+record_free(gpointer data)
+{
+    ThumbnailRecord *record = data;
+    g_free(record->flavor);
+    g_strfreev(record->paths);
+    g_free(record);
+}
+
+static gboolean
+take(const gchar **pos, const gchar *end, gpointer out, gsize len)
+{
+    if ((gsize)(end - *pos) < len)
+        return FALSE;
+    memcpy(out, *pos, len);
+    *pos += len;
+    return TRUE;
+}
+
+static gchar *
+take_string(const gchar **pos, const gchar *end)
+{
+    guint32 len = 0;
+    if (!take(pos, end, &len, sizeof(len)) || (gsize)(end - *pos) < len)
+        return NULL;
+    gchar *str = g_strndup(*pos, len);
+    *pos += len;
+    return str;
+}
+
+static ThumbnailRecord *
+parse_record(const gchar **pos, const gchar *end)
+{
+    RecordHeader header;
+    if (!take(pos, end, &header, sizeof(header)) || header.n_sizes > THUMBNAIL_SERVER_MAX_SIZES
+        || header.type < THUMBNAIL_RECORD_QUEUE || header.type > THUMBNAIL_RECORD_SESSION)
+        return NULL;
+
+    ThumbnailRecord *record = g_new0(ThumbnailRecord, 1);
+    record->type = header.type;
+    record->time_usec = header.time_usec;
+    record->handle = header.handle;
+    record->foreground = header.type == THUMBNAIL_RECORD_QUEUE && header.flags == 1;
+    record->format = header.format;
+    record->flags = header.type == THUMBNAIL_RECORD_SOCKET ? header.flags : 0;
+    record->deadline_ms = header.deadline_ms;
+    record->n_sizes = header.n_sizes;
+
+    GPtrArray *paths = g_ptr_array_new();
+    gboolean ok = take(pos, end, record->sizes, header.n_sizes * sizeof(guint16));
+    for (guint32 i = 0; ok && i < header.n_strings; ++i) {
+        gchar *str = take_string(pos, end);
+        if (!str)
+            ok = FALSE;
+        else if (i == 0 && header.type == THUMBNAIL_RECORD_QUEUE)
+            record->flavor = str;
+        else
+            g_ptr_array_add(paths, str);
+    }
+    g_ptr_array_add(paths, NULL);
+    record->paths = (gchar **)g_ptr_array_free(paths, FALSE);
+
+    if (!ok) {
+        record_free(record);
+        return NULL;
+    }
+    return record;
+}
+
+GPtrArray *
+thumbnail_recorder_load(const char *path, GError **error)
+{
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, error);
+    if (!mapped)
+        return NULL;
+
+    const gchar *pos = g_mapped_file_get_contents(mapped);
+    const gchar *end = pos + g_mapped_file_get_length(mapped);
+    if ((gsize)(end - pos) < sizeof(THUMBNAIL_RECORD_MAGIC)
+        || memcmp(pos, THUMBNAIL_RECORD_MAGIC, sizeof(THUMBNAIL_RECORD_MAGIC)) != 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "'%s' is not a request trace", path);
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+    pos += sizeof(THUMBNAIL_RECORD_MAGIC);
+
+    GPtrArray *records = g_ptr_array_new_with_free_func(record_free);
+    guint session = 0;
+    gboolean rebase = FALSE; /* traces without sessions keep their monotonic times */
+    gint64 monotonic_base = 0;
+    gint64 realtime_base = 0;
+    while (pos < end) {
+        ThumbnailRecord *record = parse_record(&pos, end);
+        if (!record) {
+            /* A service killed mid-write leaves a torn last record */
+            g_debug("thumbnail_recorder_load: ignoring %" G_GSIZE_FORMAT " trailing byte(s)",
+                    (gsize)(end - pos));
+            break;
+        }
+
+        if (record->type == THUMBNAIL_RECORD_SESSION) {
+            if (records->len > 0)
+                session++;
+            rebase = record->paths[0] != NULL;
+            monotonic_base = record->time_usec;
+            realtime_base = rebase ? g_ascii_strtoll(record->paths[0], NULL, 10) : 0;
+            record_free(record);
+            continue;
+        }
+
+        if (rebase)
+            record->time_usec = realtime_base + (record->time_usec - monotonic_base);
+        record->session = session;
+        g_ptr_array_add(records, record);
+    }
+
+    g_mapped_file_unref(mapped);
+    return records;
+}
@@ -0,0 +1,108 @@
+/*
+ * thumbnail-recorder.h - Request traces of the service frontends
+ *
+ * With --record=FILE the service appends every request it receives to a
+ * compact binary trace: D-Bus Queue calls (URIs, flavor, scheduler) and
+ * Dequeue calls, and socket requests (path, sizes, flags, deadline).
+ * appimage-thumbnailer-replay turns such a trace into a repeatable load
+ * test against a local service instance.
+ *
+ * File layout (host byte order, traces are replayed on the same kind of
+ * machine):
+ *
+ *   "AITREC1\0"
+ *   for each request:
+ *     RecordHeader
+ *     guint16 sizes[n_sizes]
+ *     n_strings x (guint32 length, char bytes[length])
+ *
+ * Queue records carry the flavor as their first string, followed by the
+ * URIs; socket records carry the path (the target of /proc/self/fd for
+ * requests that passed an fd).  Each record is appended with a single
+ * write() to an O_APPEND descriptor, so socket workers forked from the
+ * service can share the file.  Times are CLOCK_MONOTONIC microseconds.
+ *
+ * Every open appends a session record first: its time is the monotonic
+ * base and its one string the wall-clock time (decimal microseconds) of
+ * the same instant.  The monotonic clock restarts with the machine, so
+ * the loader rebases the records of each session onto the wall clock and
+ * numbers the sessions; a trace appended to across restarts still reads
+ * back in order.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_RECORDER_H
+#define THUMBNAIL_RECORDER_H
+
+#include <glib.h>
+
+#include "thumbnail-server.h"
+
+#define THUMBNAIL_RECORD_MAGIC "AITREC1"
+
+typedef enum {
+    THUMBNAIL_RECORD_QUEUE   = 1, /* D-Bus Queue */
+    THUMBNAIL_RECORD_DEQUEUE = 2, /* D-Bus Dequeue */
+    THUMBNAIL_RECORD_SOCKET  = 3, /* socket request */
+    THUMBNAIL_RECORD_SESSION = 4, /* recorder opened; not returned by the loader */
+} ThumbnailRecordType;
+
+typedef struct {
+    ThumbnailRecordType type;
+    gint64   time_usec;   /* wall clock once loaded (monotonic in traces without sessions) */
+    guint    session;     /* increases with each recorder open */
+    guint32  handle;      /* D-Bus job handle */
+    gboolean foreground;  /* Queue: "foreground" scheduler */
+    guint8   format;      /* socket: ThumbnailServerFormat */
+    guint16  flags;       /* socket: ThumbnailServerRequestFlags */
+    guint16  deadline_ms; /* socket: render budget */
+    guint16  n_sizes;
+    guint16  sizes[THUMBNAIL_SERVER_MAX_SIZES];
+    gchar   *flavor;      /* Queue only */
+    gchar  **paths;       /* URIs (Queue) or the path (socket) */
+} ThumbnailRecord;
+
+/**
+ * Start recording to @path (appending to an existing trace) with a new
+ * session record.
+ *
+ * @return TRUE on success
+ */
+gboolean thumbnail_recorder_open(const char *path);
+
+/**
+ * Stop recording.
+ */
+void thumbnail_recorder_close(void);
+
+/**
+ * Record a D-Bus Queue call.  No-op unless recording.
+ */
+void thumbnail_recorder_queue(guint32 handle, const char *const *uris, const char *flavor,
+                              gboolean foreground);
+
+/**
+ * Record a D-Bus Dequeue call.  No-op unless recording.
+ */
+void thumbnail_recorder_dequeue(guint32 handle);
+
+/**
+ * Record a socket request.  No-op unless recording.
+ *
+ * @param req   Validated request header
+ * @param sizes Requested sizes (req->n_sizes)
+ * @param path  AppImage path, or the /proc/self/fd path of a passed fd
+ */
+void thumbnail_recorder_socket(const ThumbnailServerRequest *req, const guint16 *sizes,
+                               const char *path);
+
+/**
+ * Read a whole trace, its times rebased session by session.
+ *
+ * @return Array of ThumbnailRecord (free with g_ptr_array_unref), or
+ *         NULL with @error set
+ */
+GPtrArray *thumbnail_recorder_load(const char *path, GError **error);
+
+#endif /* THUMBNAIL_RECORDER_H */
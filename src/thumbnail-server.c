@@ -0,0 +1,831 @@
+/*
+ * thumbnail-server.c - Unix-socket thumbnail service for appimage-thumbnailer
+ *
+ * Keeps one process warm and answers requests with sealed memfds passed
+ * over SCM_RIGHTS, so clients mmap the PNG or RGBA result instead of
+ * reading a file back from disk.  See thumbnail-server.h for the framing.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include "thumbnail-server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+
+#include "appimage-type.h"
+#include "thumbnail-arena.h"
+#include "thumbnail-dbus.h"
+#include "thumbnail-pipeline.h"
+#include "thumbnail-pressure.h"
+#include "thumbnail-recorder.h"
+#include "thumbnail-usdt.h"
+#include "thumbnail-zygote.h"
+
+#define MAX_THUMBNAIL_SIZE 4096
+
+/* A client that stalls mid-frame (or, on a pooled worker, between
+ * requests) for this long is dropped rather than holding the server */
+#define CLIENT_IO_TIMEOUT_SEC 5
+
+/* First inherited fd in the sd_listen_fds() protocol */
+#define SD_LISTEN_FDS_START 3
+
+typedef struct {
+    GMainLoop *loop;
+    int listen_fd;
+    gchar *socket_path; /* NULL for abstract and inherited sockets */
+    guint idle_timeout;
+    guint idle_source_id;
+    int activity_fd;    /* read end of the worker activity pipe, or -1 */
+} ThumbnailServer;
+
+static ThumbnailServer *running_server = NULL;
+
+typedef struct {
+    ThumbnailServer *server;
+    int fd;
+} ServerClient;
+
+/* ------------------------------------------------------------------ */
+/*  Socket I/O helpers                                                */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+read_full(int fd, void *buf, gsize len)
+{
+    guchar *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        len -= (gsize)n;
+    }
+    return TRUE;
+}
+
+/* Read the fixed request header; an AppImage fd, if any, rides along
+ * with its first byte. */
+static gboolean
+recv_request_header(int fd, ThumbnailServerRequest *req, int *passed_fd)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    *passed_fd = -1;
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return FALSE;
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS
+            && c->cmsg_len >= CMSG_LEN(sizeof(int))) {
+            memcpy(passed_fd, CMSG_DATA(c), sizeof(int));
+            break;
+        }
+    }
+
+    if ((gsize)n < sizeof(*req)
+        && !read_full(fd, (guchar *)req + n, sizeof(*req) - (gsize)n)) {
+        if (*passed_fd >= 0)
+            close(*passed_fd);
+        *passed_fd = -1;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+send_reply(int fd, const ThumbnailServerReply *reply, int memfd)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = (void *)reply, .iov_len = sizeof(*reply) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (memfd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &memfd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    /* The header is far below the socket buffer size, a short write
+     * means the peer went away. */
+    return n == (ssize_t)sizeof(*reply);
+}
+
+static gboolean
+send_error(int fd, guint8 format, int status)
+{
+    ThumbnailServerReply reply = {
+        .magic = THUMBNAIL_SERVER_MAGIC,
+        .status = status,
+        .format = format,
+    };
+    return send_reply(fd, &reply, -1);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Sealed memfd results                                              */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+write_rgba_fd(GdkPixbuf *pixbuf, int fd)
+{
+    const int width  = gdk_pixbuf_get_width(pixbuf);
+    const int height = gdk_pixbuf_get_height(pixbuf);
+    const int stride = gdk_pixbuf_get_rowstride(pixbuf);
+    const guchar *pixels = gdk_pixbuf_read_pixels(pixbuf);
+    const gsize row = (gsize)width * 4;
+
+    if (ftruncate(fd, (off_t)(row * (gsize)height)) < 0)
+        return FALSE;
+
+    for (int y = 0; y < height; ++y) {
+        const guchar *src = pixels + (gsize)y * (gsize)stride;
+        gsize done = 0;
+        while (done < row) {
+            ssize_t n = pwrite(fd, src + done, row - done, (off_t)(y * row + done));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return FALSE;
+            done += (gsize)n;
+        }
+    }
+    return TRUE;
+}
+
+/* Returns a read-only, fully sealed memfd holding the encoded thumbnail,
+ * or -1 with errno set. */
+static int
+create_result_memfd(GdkPixbuf *pixbuf, guint8 format, ThumbnailServerReply *reply)
+{
+    int fd = memfd_create("appimage-thumbnail", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+
+    errno = 0;
+    gboolean ok;
+    if (format == THUMBNAIL_FORMAT_RGBA)
+        ok = write_rgba_fd(pixbuf, fd);
+    else
+        ok = thumbnail_pipeline_write_png_fd(pixbuf, fd, NULL);
+
+    struct stat st;
+    if (!ok || fstat(fd, &st) < 0) {
+        int saved = errno ? errno : EIO;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    reply->width  = (guint32)gdk_pixbuf_get_width(pixbuf);
+    reply->height = (guint32)gdk_pixbuf_get_height(pixbuf);
+    reply->stride = format == THUMBNAIL_FORMAT_RGBA ? reply->width * 4 : 0;
+    reply->length = (guint64)st.st_size;
+    return fd;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Request handling                                                  */
+/* ------------------------------------------------------------------ */
+
+/* Send a low-resolution frame ahead of an expensive render.  A failed
+ * preview is skipped silently; only a dead connection returns FALSE. */
+static gboolean
+send_preview(int client_fd, guint8 format, const guchar *data, gsize len, int size)
+{
+    GdkPixbuf *pixbuf = thumbnail_pipeline_render_preview(data, len, size);
+    if (!pixbuf)
+        return TRUE;
+
+    ThumbnailServerReply reply = {
+        .magic = THUMBNAIL_SERVER_MAGIC,
+        .format = format,
+        .quality = THUMBNAIL_QUALITY_FAST,
+        .flags = THUMBNAIL_REPLY_PREVIEW,
+    };
+    int memfd = create_result_memfd(pixbuf, format, &reply);
+    g_object_unref(pixbuf);
+    if (memfd < 0)
+        return TRUE;
+
+    g_debug("send_preview: size %d -> %ux%u preview", size, reply.width, reply.height);
+    gboolean alive = send_reply(client_fd, &reply, memfd);
+    close(memfd);
+    return alive;
+}
+
+/* Reply to every requested size; returns FALSE if the connection is dead.
+ * With a deadline (monotonic time, 0 = none) each size is rendered with
+ * the best preset whose estimated cost still fits. */
+static gboolean
+serve_sizes(int client_fd, const char *archive, guint8 format,
+            const guint16 *sizes, guint n_sizes,
+            ThumbnailQuality quality, gint64 deadline, gboolean progressive)
+{
+    g_debug("serve_sizes: archive='%s', %u size(s), quality %s",
+            archive, n_sizes, thumbnail_quality_name(quality));
+
+    int largest = 0;
+    for (guint i = 0; i < n_sizes; ++i)
+        largest = MAX(largest, sizes[i]);
+    thumbnail_usdt_job_begin(largest, archive);
+
+    const ThumbnailQuality default_quality = thumbnail_pipeline_get_quality();
+    thumbnail_pipeline_set_quality(quality);
+    const gboolean truncated = appimage_payload_truncated(archive);
+    GBytes *payload = truncated ? NULL : thumbnail_pipeline_load_icon(archive);
+    gsize len = 0;
+    const guchar *data = payload ? g_bytes_get_data(payload, &len) : NULL;
+    int status = 0;
+
+    gboolean alive = TRUE;
+    for (guint i = 0; i < n_sizes && alive; ++i) {
+        if (!payload) {
+            status = truncated ? EAGAIN : ENOENT;
+            alive = send_error(client_fd, format, status);
+            continue;
+        }
+
+        if (progressive && thumbnail_pipeline_wants_preview(data, len, sizes[i])) {
+            alive = send_preview(client_fd, format, data, len, sizes[i]);
+            if (!alive)
+                continue;
+        }
+
+        ThumbnailQuality used = quality;
+        if (deadline > 0)
+            used = thumbnail_pipeline_quality_for_deadline(quality, sizes[i],
+                                                           deadline - g_get_monotonic_time());
+        thumbnail_pipeline_set_quality(used);
+
+        GdkPixbuf *pixbuf = thumbnail_pipeline_render(data, len, sizes[i]);
+        if (!pixbuf) {
+            status = EIO;
+            alive = send_error(client_fd, format, status);
+            continue;
+        }
+
+        ThumbnailServerReply reply = {
+            .magic = THUMBNAIL_SERVER_MAGIC,
+            .format = format,
+            .quality = (guint8)used,
+        };
+        int memfd = create_result_memfd(pixbuf, format, &reply);
+        g_object_unref(pixbuf);
+
+        if (memfd < 0) {
+            status = errno;
+            alive = send_error(client_fd, format, status);
+            continue;
+        }
+
+        g_debug("serve_sizes: size %u -> %ux%u, %" G_GUINT64_FORMAT " bytes",
+                (unsigned)sizes[i], reply.width, reply.height, reply.length);
+        alive = send_reply(client_fd, &reply, memfd);
+        close(memfd);
+    }
+
+    if (payload)
+        g_bytes_unref(payload);
+    thumbnail_pipeline_set_quality(default_quality);
+    thumbnail_usdt_job_end(alive ? status : EPIPE);
+    return alive;
+}
+
+/* Handle one framed request; returns FALSE when the connection should close. */
+static gboolean
+handle_request(int client_fd)
+{
+    ThumbnailServerRequest req;
+    int appimage_fd = -1;
+
+    if (!recv_request_header(client_fd, &req, &appimage_fd))
+        return FALSE;
+
+    const gint64 received = g_get_monotonic_time();
+    thumbnail_server_touch();
+
+    gboolean alive = FALSE;
+    gchar *path = NULL;
+    guint16 sizes[THUMBNAIL_SERVER_MAX_SIZES];
+    const gboolean by_fd = (req.flags & THUMBNAIL_REQUEST_FD) != 0;
+
+    if (req.magic != THUMBNAIL_SERVER_MAGIC || req.version != THUMBNAIL_SERVER_VERSION) {
+        g_debug("handle_request: bad magic/version (0x%08x, %u)", req.magic, (unsigned)req.version);
+        send_error(client_fd, req.format, EPROTO);
+        goto out;
+    }
+
+    /* Malformed framing leaves the stream unsynchronised, so drop the peer */
+    if (req.n_sizes == 0 || req.n_sizes > THUMBNAIL_SERVER_MAX_SIZES
+        || (by_fd && req.path_len != 0)
+        || (!by_fd && (req.path_len == 0 || req.path_len > THUMBNAIL_SERVER_MAX_PATH))) {
+        send_error(client_fd, req.format, EINVAL);
+        goto out;
+    }
+
+    if (!read_full(client_fd, sizes, req.n_sizes * sizeof(sizes[0])))
+        goto out;
+
+    if (!by_fd) {
+        path = g_malloc(req.path_len + 1);
+        if (!read_full(client_fd, path, req.path_len))
+            goto out;
+        path[req.path_len] = '\0';
+    }
+
+    alive = TRUE;
+
+    gboolean valid = req.format == THUMBNAIL_FORMAT_PNG || req.format == THUMBNAIL_FORMAT_RGBA;
+    for (guint i = 0; i < req.n_sizes; ++i)
+        valid = valid && sizes[i] > 0 && sizes[i] <= MAX_THUMBNAIL_SIZE;
+
+    int status = 0;
+    if (!valid)
+        status = EINVAL;
+    else if (by_fd && appimage_fd < 0)
+        status = EBADF;
+    else if (!by_fd && (strlen(path) != req.path_len || !g_path_is_absolute(path)))
+        status = EINVAL;
+
+    if (status != 0) {
+        for (guint i = 0; i < req.n_sizes && alive; ++i)
+            alive = send_error(client_fd, req.format, status);
+        goto out;
+    }
+
+    /* The extractors take paths; /proc/self/fd keeps the client's fd
+     * authoritative without ever resolving its original name. */
+    ThumbnailQuality quality = thumbnail_pipeline_get_quality();
+    if (req.flags & THUMBNAIL_REQUEST_FAST)
+        quality = THUMBNAIL_QUALITY_FAST;
+    else if (req.flags & THUMBNAIL_REQUEST_BEST)
+        quality = THUMBNAIL_QUALITY_BEST;
+    const gint64 deadline = req.deadline_ms > 0
+        ? received + (gint64)req.deadline_ms * 1000 : 0;
+
+    gchar *archive = by_fd ? g_strdup_printf("/proc/self/fd/%d", appimage_fd) : g_strdup(path);
+    thumbnail_recorder_socket(&req, sizes, archive);
+    alive = serve_sizes(client_fd, archive, req.format, sizes, req.n_sizes, quality, deadline,
+                        (req.flags & THUMBNAIL_REQUEST_PROGRESSIVE) != 0);
+    g_free(archive);
+
+out:
+    if (appimage_fd >= 0)
+        close(appimage_fd);
+    g_free(path);
+    return alive;
+}
+
+static void
+set_client_timeouts(int fd)
+{
+    const struct timeval timeout = { .tv_sec = CLIENT_IO_TIMEOUT_SEC };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0
+        || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+        g_debug("set_client_timeouts: %s", g_strerror(errno));
+}
+
+static gboolean
+peer_is_same_user(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return FALSE;
+    return cred.uid == getuid();
+}
+
+/* Request handler of pooled workers, which accept() by themselves */
+static gboolean
+handle_pooled_request(int client_fd)
+{
+    if (!peer_is_same_user(client_fd)) {
+        g_debug("handle_pooled_request: rejecting client of another user");
+        return FALSE;
+    }
+    set_client_timeouts(client_fd);
+    return handle_request(client_fd);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Main loop plumbing                                                */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+on_client_ready(gint fd, GIOCondition condition, gpointer user_data)
+{
+    ServerClient *client = user_data;
+
+    if ((condition & G_IO_IN) && handle_request(fd))
+        return G_SOURCE_CONTINUE;
+
+    g_debug("on_client_ready: closing client fd %d", fd);
+    close(fd);
+    g_free(client);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_listen_ready(gint fd, GIOCondition condition G_GNUC_UNUSED, gpointer user_data)
+{
+    ThumbnailServer *server = user_data;
+
+    int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    thumbnail_server_touch();
+    if (client_fd < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+            g_printerr("Failed to accept connection: %s\n", g_strerror(errno));
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* Requests read arbitrary files with our privileges */
+    if (!peer_is_same_user(client_fd)) {
+        g_debug("on_listen_ready: rejecting client of another user");
+        close(client_fd);
+        return G_SOURCE_CONTINUE;
+    }
+
+    set_client_timeouts(client_fd);
+    ServerClient *client = g_new0(ServerClient, 1);
+    client->server = server;
+    client->fd = client_fd;
+    g_unix_fd_add(client_fd, G_IO_IN | G_IO_HUP | G_IO_ERR, on_client_ready, client);
+    g_debug("on_listen_ready: accepted client fd %d", client_fd);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+on_worker_activity(gint fd, GIOCondition condition G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    thumbnail_server_touch();
+    return G_SOURCE_CONTINUE;
+}
+
+/* Move request handling into zygote-forked workers.  Must run before
+ * anything in this process starts a thread. */
+static gboolean
+start_workers(ThumbnailServer *server, const ThumbnailServerOptions *options)
+{
+    int activity[2] = { -1, -1 };
+    if (server->listen_fd >= 0 && g_unix_open_pipe(activity, FD_CLOEXEC, NULL)) {
+        g_unix_set_fd_nonblocking(activity[0], TRUE, NULL);
+        g_unix_set_fd_nonblocking(activity[1], TRUE, NULL);
+    }
+
+    ThumbnailZygoteOptions zygote_options = {
+        .workers = options->workers,
+        .jobs_per_worker = options->jobs_per_worker > 0
+            ? options->jobs_per_worker : THUMBNAIL_ZYGOTE_DEFAULT_JOBS_PER_WORKER,
+        .address_space_limit = THUMBNAIL_ZYGOTE_DEFAULT_ADDRESS_SPACE,
+        .cpu_time_limit = THUMBNAIL_ZYGOTE_DEFAULT_CPU_TIME,
+    };
+
+    gboolean ok = thumbnail_zygote_start(&zygote_options, server->listen_fd, activity[1],
+                                         handle_pooled_request, thumbnail_dbus_run_job,
+                                         thumbnail_dbus_job_done, NULL);
+    if (activity[1] >= 0)
+        close(activity[1]);
+
+    if (!ok) {
+        if (activity[0] >= 0)
+            close(activity[0]);
+        return FALSE;
+    }
+
+    server->activity_fd = activity[0];
+    return TRUE;
+}
+
+static gboolean
+on_quit_signal(gpointer user_data G_GNUC_UNUSED)
+{
+    thumbnail_server_quit();
+    return G_SOURCE_CONTINUE;
+}
+
+/* Drop what a warm process keeps between requests (cached payload
+ * locations, this thread's job arena), then hand the freed heap pages
+ * back to the kernel.  Runs from the main loop, never inside a job. */
+static void
+release_memory(void)
+{
+    appimage_payload_cache_flush();
+    thumbnail_arena_release_thread();
+#ifdef HAVE_MALLOC_TRIM
+    malloc_trim(0);
+#endif
+}
+
+/* Halve the worker pool on every memory/IO stall and add one worker
+ * back per calm recovery interval. */
+static gboolean
+on_memory_pressure(gboolean stalled, gpointer user_data G_GNUC_UNUSED)
+{
+    if (!thumbnail_zygote_active()) {
+        if (stalled)
+            release_memory();
+        return FALSE;
+    }
+
+    const guint configured = thumbnail_zygote_configured_workers();
+    const guint current = thumbnail_zygote_max_jobs();
+
+    if (stalled) {
+        g_debug("on_memory_pressure: stall, shrinking pool from %u worker(s)", current);
+        thumbnail_zygote_set_workers(MAX(1, current / 2));
+        release_memory();
+        return TRUE;
+    }
+
+    if (current >= configured)
+        return FALSE;
+
+    g_debug("on_memory_pressure: calm, growing pool to %u worker(s)", current + 1);
+    thumbnail_zygote_set_workers(current + 1);
+    return current + 1 < configured;
+}
+
+static gboolean
+on_idle_timeout(gpointer user_data)
+{
+    ThumbnailServer *server = user_data;
+
+    if (thumbnail_dbus_busy())
+        return G_SOURCE_CONTINUE;
+
+    g_debug("on_idle_timeout: idle for %u s, exiting", server->idle_timeout);
+    server->idle_source_id = 0;
+    release_memory();
+    g_main_loop_quit(server->loop);
+    return G_SOURCE_REMOVE;
+}
+
+void
+thumbnail_server_touch(void)
+{
+    ThumbnailServer *server = running_server;
+    if (!server || server->idle_timeout == 0)
+        return;
+
+    if (server->idle_source_id != 0)
+        g_source_remove(server->idle_source_id);
+    server->idle_source_id = g_timeout_add_seconds(server->idle_timeout, on_idle_timeout, server);
+}
+
+void
+thumbnail_server_quit(void)
+{
+    if (running_server)
+        g_main_loop_quit(running_server->loop);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Listening sockets                                                 */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+is_unix_stream_listener(int fd)
+{
+    int type = 0;
+    int listening = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM)
+        return FALSE;
+
+    len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+        return FALSE;
+
+    struct sockaddr_un addr;
+    len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+        return FALSE;
+    return addr.sun_family == AF_UNIX;
+}
+
+/* sd_listen_fds() without libsystemd: the fds start at 3 and the
+ * variables are only meant for us, so they must not leak to children. */
+static int
+listen_fd_from_systemd(void)
+{
+    const char *pid_str = g_getenv("LISTEN_PID");
+    const char *fds_str = g_getenv("LISTEN_FDS");
+    if (!pid_str || !fds_str)
+        return -1;
+
+    gint64 pid = g_ascii_strtoll(pid_str, NULL, 10);
+    gint64 n_fds = g_ascii_strtoll(fds_str, NULL, 10);
+
+    g_unsetenv("LISTEN_PID");
+    g_unsetenv("LISTEN_FDS");
+    g_unsetenv("LISTEN_FDNAMES");
+
+    if (pid != (gint64)getpid() || n_fds <= 0) {
+        g_debug("listen_fd_from_systemd: LISTEN_PID=%s is not us or no fds", pid_str);
+        return -1;
+    }
+
+    int found = -1;
+    for (int fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n_fds; ++fd) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (found < 0 && is_unix_stream_listener(fd))
+            found = fd;
+    }
+
+    g_debug("listen_fd_from_systemd: %" G_GINT64_FORMAT " fd(s), using %d", n_fds, found);
+    return found;
+}
+
+static int
+listen_on(const char *socket_path, gchar **bound_path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    socklen_t addr_len;
+    const gboolean abstract = socket_path[0] == '@';
+    const gsize name_len = strlen(socket_path);
+
+    *bound_path = NULL;
+
+    if (name_len >= sizeof(addr.sun_path)) {
+        g_printerr("Socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+
+    if (abstract) {
+        /* Leading NUL selects the abstract namespace */
+        memcpy(addr.sun_path + 1, socket_path + 1, name_len - 1);
+        addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + name_len);
+    } else {
+        memcpy(addr.sun_path, socket_path, name_len);
+        addr_len = (socklen_t)sizeof(addr);
+
+        /* Replace a stale socket left behind by a previous instance */
+        struct stat st;
+        if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+            g_unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        g_printerr("Failed to create socket: %s\n", g_strerror(errno));
+        return -1;
+    }
+
+    mode_t old_mask = umask(0077);
+    int rc = bind(fd, (struct sockaddr *)&addr, addr_len);
+    umask(old_mask);
+
+    if (rc < 0 || listen(fd, SOMAXCONN) < 0) {
+        g_printerr("Failed to listen on %s: %s\n", socket_path, g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (!abstract)
+        *bound_path = g_strdup(socket_path);
+    return fd;
+}
+
+int
+thumbnail_server_run(const ThumbnailServerOptions *options)
+{
+    ThumbnailServer server = {
+        .listen_fd = -1,
+        .idle_timeout = options->idle_timeout,
+        .activity_fd = -1,
+    };
+
+    if (options->socket_path) {
+        if (*options->socket_path == '\0' || g_strcmp0(options->socket_path, "@") == 0) {
+            g_printerr("No socket path given\n");
+            return EXIT_FAILURE;
+        }
+        server.listen_fd = listen_on(options->socket_path, &server.socket_path);
+        if (server.listen_fd < 0)
+            return EXIT_FAILURE;
+    } else {
+        server.listen_fd = listen_fd_from_systemd();
+    }
+
+    if (server.listen_fd < 0 && !options->dbus) {
+        g_printerr("No socket path given and no socket passed by systemd\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Clients that hang up mid-reply must not kill the service */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Opened before the workers fork so that they append to it too */
+    if ((options->record_path && !thumbnail_recorder_open(options->record_path))
+        || (options->workers > 0 && !start_workers(&server, options))) {
+        thumbnail_recorder_close();
+        if (server.listen_fd >= 0)
+            close(server.listen_fd);
+        g_free(server.socket_path);
+        return EXIT_FAILURE;
+    }
+
+    running_server = &server;
+    server.loop = g_main_loop_new(NULL, FALSE);
+    if (server.activity_fd >= 0)
+        g_unix_fd_add(server.activity_fd, G_IO_IN, on_worker_activity, &server);
+    else if (server.listen_fd >= 0 && !thumbnail_zygote_active())
+        g_unix_fd_add(server.listen_fd, G_IO_IN, on_listen_ready, &server);
+    g_unix_signal_add(SIGINT, on_quit_signal, &server);
+    g_unix_signal_add(SIGTERM, on_quit_signal, &server);
+    if (!thumbnail_pressure_start(on_memory_pressure, &server))
+        g_debug("thumbnail_server_run: PSI triggers unavailable, not throttling");
+
+    if (options->dbus)
+        thumbnail_dbus_start(options);
+    thumbnail_server_touch();
+
+    g_debug("thumbnail_server_run: listening (fd %d, dbus=%d, idle timeout %u s, %u worker(s), "
+            "quality %s)", server.listen_fd, options->dbus, server.idle_timeout, options->workers,
+            thumbnail_quality_name(thumbnail_pipeline_get_quality()));
+    g_main_loop_run(server.loop);
+    g_debug("thumbnail_server_run: shutting down");
+
+    if (options->dbus)
+        thumbnail_dbus_stop();
+    thumbnail_pressure_stop();
+    thumbnail_zygote_stop();
+    thumbnail_recorder_close();
+    if (server.activity_fd >= 0)
+        close(server.activity_fd);
+    if (server.idle_source_id != 0)
+        g_source_remove(server.idle_source_id);
+    running_server = NULL;
+
+    g_main_loop_unref(server.loop);
+    if (server.listen_fd >= 0)
+        close(server.listen_fd);
+    if (server.socket_path) {
+        g_unlink(server.socket_path);
+        g_free(server.socket_path);
+    }
+    return EXIT_SUCCESS;
+}
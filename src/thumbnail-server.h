@@ -0,0 +1,123 @@
+/*
+ * thumbnail-server.h - Unix-socket thumbnail service for appimage-thumbnailer
+ *
+ * Wire protocol (host byte order, SOCK_STREAM, one reply per size):
+ *
+ *   client -> server
+ *     ThumbnailServerRequest
+ *     guint16 sizes[n_sizes]
+ *     char    path[path_len]           (absent with THUMBNAIL_REQUEST_FD)
+ *     SCM_RIGHTS: AppImage fd          (only with THUMBNAIL_REQUEST_FD,
+ *                                       attached to the header)
+ *
+ *   server -> client, for each requested size in order
+ *     ThumbnailServerReply
+ *     SCM_RIGHTS: sealed memfd         (only when status == 0)
+ *
+ * With worker processes enabled, a connection may be closed between two
+ * replies when its worker is recycled; clients should reconnect and
+ * resend the request that got no reply.
+ *
+ * With THUMBNAIL_REQUEST_PROGRESSIVE, a size whose icon is expensive to
+ * render (large SVG, huge raster) is answered twice: first a fast
+ * low-resolution reply flagged THUMBNAIL_REPLY_PREVIEW, then the final
+ * reply.  Clients must keep reading until a reply without the flag.
+ *
+ * Without FAST/BEST flags the service's default preset is used.  With a
+ * deadline, sizes that would miss it are rendered with a cheaper preset;
+ * the reply reports the preset actually used.
+ *
+ * A status of EAGAIN means the AppImage is truncated, typically because
+ * it is still being downloaded; retry once the file has changed.
+ *
+ * The memfd holds either an encoded PNG or width*height*4 bytes of
+ * non-premultiplied RGBA (stride = width * 4), is sealed against writes
+ * and resizing, and can be mmap()ed read-only by the client.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_SERVER_H
+#define THUMBNAIL_SERVER_H
+
+#include <glib.h>
+
+#define THUMBNAIL_SERVER_MAGIC     0x53544941u /* "AITS" */
+#define THUMBNAIL_SERVER_VERSION   1
+#define THUMBNAIL_SERVER_MAX_SIZES 8
+#define THUMBNAIL_SERVER_MAX_PATH  4096
+
+typedef enum {
+    THUMBNAIL_FORMAT_PNG  = 0,
+    THUMBNAIL_FORMAT_RGBA = 1,
+} ThumbnailServerFormat;
+
+typedef enum {
+    THUMBNAIL_REQUEST_FD          = 1 << 0, /* AppImage passed via SCM_RIGHTS */
+    THUMBNAIL_REQUEST_FAST        = 1 << 1, /* use the fast preset */
+    THUMBNAIL_REQUEST_BEST        = 1 << 2, /* use the best preset */
+    THUMBNAIL_REQUEST_PROGRESSIVE = 1 << 3, /* previews before expensive sizes */
+} ThumbnailServerRequestFlags;
+
+typedef enum {
+    THUMBNAIL_REPLY_PREVIEW = 1 << 0, /* low-resolution, the final reply follows */
+} ThumbnailServerReplyFlags;
+
+typedef struct {
+    guint32 magic;
+    guint8  version;
+    guint8  format;      /* ThumbnailServerFormat */
+    guint16 flags;       /* ThumbnailServerRequestFlags */
+    guint16 n_sizes;     /* 1..THUMBNAIL_SERVER_MAX_SIZES */
+    guint16 deadline_ms; /* render budget from receipt, 0 = none */
+    guint32 path_len;    /* 0 with THUMBNAIL_REQUEST_FD */
+} ThumbnailServerRequest;
+
+typedef struct {
+    guint32 magic;
+    gint32  status;   /* 0 on success, errno value otherwise */
+    guint8  format;
+    guint8  quality;  /* ThumbnailQuality actually used */
+    guint8  flags;    /* ThumbnailServerReplyFlags */
+    guint8  reserved;
+    guint32 width;
+    guint32 height;
+    guint32 stride;   /* 0 for PNG */
+    guint64 length;   /* bytes in the memfd */
+} ThumbnailServerReply;
+
+typedef struct {
+    const char *socket_path; /* NULL: use a socket passed by systemd, if any */
+    gboolean dbus;           /* also serve the D-Bus interface */
+    guint idle_timeout;      /* seconds without requests before exiting, 0 = never */
+    guint workers;           /* isolated worker processes, 0 = render in-process */
+    guint jobs_per_worker;   /* requests a worker serves before it is replaced */
+    gboolean refine;         /* re-render deadline-degraded D-Bus thumbnails */
+    gboolean progressive;    /* D-Bus: cache and announce previews of expensive icons first */
+    gboolean disk_order;     /* D-Bus: sort background jobs by on-disk location */
+    const char *record_path; /* append a trace of incoming requests here, NULL = off */
+} ThumbnailServerOptions;
+
+/**
+ * Serve thumbnail requests until terminated or idle.
+ *
+ * The socket is either created at options->socket_path ("@name" selects
+ * an abstract socket) or inherited through the sd_listen_fds() protocol
+ * (LISTEN_PID/LISTEN_FDS) when the service is socket-activated.
+ *
+ * @param options Service configuration
+ * @return Process exit status
+ */
+int thumbnail_server_run(const ThumbnailServerOptions *options);
+
+/**
+ * Note request activity, restarting the idle-exit countdown.
+ */
+void thumbnail_server_touch(void);
+
+/**
+ * Stop the running service after the current main loop iteration.
+ */
+void thumbnail_server_quit(void);
+
+#endif /* THUMBNAIL_SERVER_H */
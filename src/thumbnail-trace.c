@@ -0,0 +1,404 @@
+/*
+ * thumbnail-trace.c - Per-stage timing and hardware counters
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include "thumbnail-trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include <glib.h>
+
+#define MAX_SPAN_DEPTH 16
+
+typedef enum {
+    COUNTER_CYCLES = 0,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    N_COUNTERS
+} Counter;
+
+static const char *const COUNTER_NAMES[N_COUNTERS] = {
+    "cycles", "instructions", "cache-misses", "branch-misses",
+};
+
+static const char *const STAGE_NAMES[THUMBNAIL_STAGE_COUNT] = {
+    [THUMBNAIL_STAGE_PROBE]    = "probe",
+    [THUMBNAIL_STAGE_EXTRACT]  = "extract",
+    [THUMBNAIL_STAGE_CLASSIFY] = "classify",
+    [THUMBNAIL_STAGE_DECODE]   = "decode",
+    [THUMBNAIL_STAGE_SCALE]    = "scale",
+    [THUMBNAIL_STAGE_ENCODE]   = "encode",
+};
+
+typedef struct {
+    guint   calls;
+    gint64  wall_usec;
+    guint64 counts[N_COUNTERS];
+    guint64 allocs;
+    guint64 alloc_bytes;
+    gint64  net_bytes;       /* allocated minus released */
+    gint64  peak_bytes;      /* highest live bytes above the stage's start */
+    glong   child_maxrss;    /* KiB, largest extractor child */
+} StageTotals;
+
+/* Running totals updated by the allocation hooks.  Live bytes are
+ * relative to when counting started, so they can go negative. */
+typedef struct {
+    gsize  allocs;
+    gsize  alloc_bytes;
+    gsize  free_bytes;
+    gssize peak_live;
+} AllocTotals;
+
+static gboolean trace_enabled = FALSE;
+static gboolean alloc_counting = FALSE;
+static AllocTotals alloc_totals;
+static int counter_fds[N_COUNTERS] = { -1, -1, -1, -1 };
+static gchar *counters_unavailable = NULL;
+
+static StageTotals totals[THUMBNAIL_STAGE_COUNT];
+
+/* Job arena use, summed over extraction jobs */
+typedef struct {
+    guint   jobs;
+    guint64 allocs;
+    guint64 bytes;
+    guint   max_allocs;
+    guint   overflow_chunks;
+} ArenaTotals;
+
+static ArenaTotals arena_totals;
+static ThumbnailStage span_stack[MAX_SPAN_DEPTH];
+static guint span_depth = 0;
+
+/* Readings at the last span transition; the difference to the next one
+ * is charged to the innermost open stage */
+static gint64 mark_usec = 0;
+static guint64 mark_counts[N_COUNTERS];
+static AllocTotals mark_alloc;
+static gint64 trace_start_usec = 0;
+
+/* ------------------------------------------------------------------ */
+/*  Hardware counters                                                 */
+/* ------------------------------------------------------------------ */
+
+#ifdef __linux__
+static int
+open_counter(Counter counter)
+{
+    static const guint64 configs[N_COUNTERS] = {
+        [COUNTER_CYCLES]        = PERF_COUNT_HW_CPU_CYCLES,
+        [COUNTER_INSTRUCTIONS]  = PERF_COUNT_HW_INSTRUCTIONS,
+        [COUNTER_CACHE_MISSES]  = PERF_COUNT_HW_CACHE_MISSES,
+        [COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[counter];
+    attr.inherit = 1;           /* extractor children count towards their stage */
+    attr.exclude_kernel = 1;    /* permitted at perf_event_paranoid 2 */
+    attr.exclude_hv = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+#endif
+
+static void
+open_counters(void)
+{
+#ifdef __linux__
+    int first_errno = 0;
+    guint opened = 0;
+    for (Counter c = 0; c < N_COUNTERS; ++c) {
+        counter_fds[c] = open_counter(c);
+        if (counter_fds[c] >= 0)
+            opened++;
+        else if (first_errno == 0)
+            first_errno = errno;
+    }
+
+    if (opened == 0) {
+        const char *hint = "";
+        if (first_errno == EACCES || first_errno == EPERM)
+            hint = " (see kernel.perf_event_paranoid)";
+        else if (first_errno == ENOENT || first_errno == EOPNOTSUPP)
+            hint = " (no hardware PMU, e.g. in a VM)";
+        counters_unavailable = g_strdup_printf("%s%s", g_strerror(first_errno), hint);
+    } else if (opened < N_COUNTERS) {
+        g_debug("open_counters: %u of %d hardware counters available", opened, N_COUNTERS);
+    }
+#else
+    counters_unavailable = g_strdup("not supported on this platform");
+#endif
+}
+
+static void
+read_counters(guint64 counts[N_COUNTERS])
+{
+    for (Counter c = 0; c < N_COUNTERS; ++c) {
+        guint64 value = 0;
+        if (counter_fds[c] >= 0 && read(counter_fds[c], &value, sizeof(value)) != sizeof(value))
+            value = 0;
+        counts[c] = value;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Allocation accounting                                             */
+/* ------------------------------------------------------------------ */
+
+gboolean
+thumbnail_trace_counting_allocs(void)
+{
+    return alloc_counting;
+}
+
+static gssize
+live_bytes(const AllocTotals *totals)
+{
+    return (gssize)(totals->alloc_bytes - totals->free_bytes);
+}
+
+/* Relaxed: instrumentation tolerates a lost peak update under threads */
+void
+thumbnail_trace_note_alloc(gsize size)
+{
+    __atomic_add_fetch(&alloc_totals.allocs, 1, __ATOMIC_RELAXED);
+    const gsize total = __atomic_add_fetch(&alloc_totals.alloc_bytes, size, __ATOMIC_RELAXED);
+    const gssize live = (gssize)(total - __atomic_load_n(&alloc_totals.free_bytes,
+                                                         __ATOMIC_RELAXED));
+    if (live > __atomic_load_n(&alloc_totals.peak_live, __ATOMIC_RELAXED))
+        __atomic_store_n(&alloc_totals.peak_live, live, __ATOMIC_RELAXED);
+}
+
+void
+thumbnail_trace_note_free(gsize size)
+{
+    __atomic_add_fetch(&alloc_totals.free_bytes, size, __ATOMIC_RELAXED);
+}
+
+static void
+read_alloc_totals(AllocTotals *totals)
+{
+    totals->allocs = __atomic_load_n(&alloc_totals.allocs, __ATOMIC_RELAXED);
+    totals->alloc_bytes = __atomic_load_n(&alloc_totals.alloc_bytes, __ATOMIC_RELAXED);
+    totals->free_bytes = __atomic_load_n(&alloc_totals.free_bytes, __ATOMIC_RELAXED);
+    totals->peak_live = __atomic_load_n(&alloc_totals.peak_live, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Spans                                                             */
+/* ------------------------------------------------------------------ */
+
+void
+thumbnail_trace_enable(ThumbnailTraceFlags flags)
+{
+    if (trace_enabled)
+        return;
+
+    trace_enabled = TRUE;
+    if (flags & THUMBNAIL_TRACE_COUNTERS)
+        open_counters();
+
+    trace_start_usec = g_get_monotonic_time();
+    mark_usec = trace_start_usec;
+    read_counters(mark_counts);
+    alloc_counting = (flags & THUMBNAIL_TRACE_ALLOC) != 0;
+}
+
+gboolean
+thumbnail_trace_enabled(void)
+{
+    return trace_enabled;
+}
+
+const char *
+thumbnail_trace_stage_name(ThumbnailStage stage)
+{
+    return stage < THUMBNAIL_STAGE_COUNT ? STAGE_NAMES[stage] : "unknown";
+}
+
+/* Charge everything since the last transition to the innermost stage */
+static void
+charge_current(void)
+{
+    const gint64 now = g_get_monotonic_time();
+    guint64 counts[N_COUNTERS];
+    read_counters(counts);
+
+    AllocTotals alloc;
+    read_alloc_totals(&alloc);
+
+    if (span_depth > 0) {
+        StageTotals *stage = &totals[span_stack[span_depth - 1]];
+        stage->wall_usec += now - mark_usec;
+        for (Counter c = 0; c < N_COUNTERS; ++c)
+            stage->counts[c] += counts[c] - mark_counts[c];
+        stage->allocs += alloc.allocs - mark_alloc.allocs;
+        stage->alloc_bytes += alloc.alloc_bytes - mark_alloc.alloc_bytes;
+        stage->net_bytes += live_bytes(&alloc) - live_bytes(&mark_alloc);
+        stage->peak_bytes = MAX(stage->peak_bytes, alloc.peak_live - live_bytes(&mark_alloc));
+    }
+
+    mark_usec = now;
+    memcpy(mark_counts, counts, sizeof(counts));
+
+    /* The next segment's peak starts from the current live bytes */
+    alloc.peak_live = live_bytes(&alloc);
+    __atomic_store_n(&alloc_totals.peak_live, alloc.peak_live, __ATOMIC_RELAXED);
+    mark_alloc = alloc;
+}
+
+void
+thumbnail_trace_begin(ThumbnailStage stage)
+{
+    if (!trace_enabled)
+        return;
+    if (span_depth == MAX_SPAN_DEPTH) {
+        g_debug("thumbnail_trace_begin: spans nested too deeply, ignoring %s",
+                thumbnail_trace_stage_name(stage));
+        return;
+    }
+
+    charge_current();
+    span_stack[span_depth++] = stage;
+    totals[stage].calls++;
+}
+
+void
+thumbnail_trace_child_exited(const struct rusage *usage)
+{
+    if (!trace_enabled || span_depth == 0)
+        return;
+
+    StageTotals *stage = &totals[span_stack[span_depth - 1]];
+    stage->child_maxrss = MAX(stage->child_maxrss, usage->ru_maxrss);
+}
+
+void
+thumbnail_trace_end(ThumbnailStage stage)
+{
+    if (!trace_enabled)
+        return;
+    if (span_depth == 0 || span_stack[span_depth - 1] != stage) {
+        g_debug("thumbnail_trace_end: %s is not the innermost span",
+                thumbnail_trace_stage_name(stage));
+        return;
+    }
+
+    charge_current();
+    span_depth--;
+}
+
+void
+thumbnail_trace_arena_job(guint allocs, gsize bytes, guint overflow_chunks)
+{
+    if (!trace_enabled)
+        return;
+
+    arena_totals.jobs++;
+    arena_totals.allocs += allocs;
+    arena_totals.bytes += bytes;
+    arena_totals.max_allocs = MAX(arena_totals.max_allocs, allocs);
+    arena_totals.overflow_chunks += overflow_chunks;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Report                                                            */
+/* ------------------------------------------------------------------ */
+
+static void
+report_memory(void)
+{
+    g_printerr("Memory (KiB):\n");
+    g_printerr("  %-9s", "stage");
+    if (alloc_counting)
+        g_printerr(" %10s %12s %12s %12s", "allocs", "allocated", "net live", "peak live");
+    g_printerr(" %14s\n", "child max RSS");
+
+    for (ThumbnailStage s = 0; s < THUMBNAIL_STAGE_COUNT; ++s) {
+        if (totals[s].calls == 0)
+            continue;
+        g_printerr("  %-9s", STAGE_NAMES[s]);
+        if (alloc_counting)
+            g_printerr(" %10" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " %12" G_GINT64_FORMAT
+                       " %12" G_GINT64_FORMAT, totals[s].allocs, totals[s].alloc_bytes / 1024,
+                       totals[s].net_bytes / 1024, totals[s].peak_bytes / 1024);
+        if (totals[s].child_maxrss > 0)
+            g_printerr(" %14ld\n", totals[s].child_maxrss);
+        else
+            g_printerr(" %14s\n", "-");
+    }
+
+    /* Whole-process figures, for comparison with the per-stage ones */
+    struct rusage self;
+    struct rusage children;
+    if (getrusage(RUSAGE_SELF, &self) == 0 && getrusage(RUSAGE_CHILDREN, &children) == 0)
+        g_printerr("  peak RSS: this process %ld, largest child %ld\n", self.ru_maxrss,
+                   children.ru_maxrss);
+
+    if (arena_totals.jobs > 0)
+        g_printerr("  job arena: %u job(s), %.1f allocation(s) and %.1f KiB per job "
+                   "(at most %u), %u overflow chunk(s)\n", arena_totals.jobs,
+                   (double)arena_totals.allocs / arena_totals.jobs,
+                   (double)arena_totals.bytes / 1024.0 / arena_totals.jobs,
+                   arena_totals.max_allocs, arena_totals.overflow_chunks);
+}
+
+void
+thumbnail_trace_report(void)
+{
+    if (!trace_enabled)
+        return;
+
+    charge_current();
+    const gint64 total_usec = g_get_monotonic_time() - trace_start_usec;
+    const gboolean counters = counter_fds[COUNTER_CYCLES] >= 0
+                              || counter_fds[COUNTER_INSTRUCTIONS] >= 0
+                              || counter_fds[COUNTER_CACHE_MISSES] >= 0
+                              || counter_fds[COUNTER_BRANCH_MISSES] >= 0;
+
+    g_printerr("Trace (exclusive time per stage):\n");
+    g_printerr("  %-9s %6s %10s", "stage", "calls", "wall ms");
+    for (Counter c = 0; counters && c < N_COUNTERS; ++c)
+        g_printerr(" %14s", COUNTER_NAMES[c]);
+    g_printerr("\n");
+
+    gint64 staged_usec = 0;
+    for (ThumbnailStage s = 0; s < THUMBNAIL_STAGE_COUNT; ++s) {
+        if (totals[s].calls == 0)
+            continue;
+        staged_usec += totals[s].wall_usec;
+        g_printerr("  %-9s %6u %10.3f", STAGE_NAMES[s], totals[s].calls,
+                   (double)totals[s].wall_usec / 1000.0);
+        for (Counter c = 0; counters && c < N_COUNTERS; ++c) {
+            if (counter_fds[c] >= 0)
+                g_printerr(" %14" G_GUINT64_FORMAT, totals[s].counts[c]);
+            else
+                g_printerr(" %14s", "-");
+        }
+        g_printerr("\n");
+    }
+
+    g_printerr("  %-9s %6s %10.3f\n", "other", "", (double)(total_usec - staged_usec) / 1000.0);
+    g_printerr("  %-9s %6s %10.3f\n", "total", "", (double)total_usec / 1000.0);
+    if (counters_unavailable)
+        g_printerr("  hardware counters unavailable: %s\n", counters_unavailable);
+
+    report_memory();
+}
@@ -0,0 +1,113 @@
+/*
+ * thumbnail-trace.h - Per-stage timing and hardware counters
+ *
+ * With --trace, the pipeline brackets its stages (probe, extract,
+ * classify, decode, scale, encode) with spans and a report of where the
+ * time went is printed to stderr when the run ends.  Spans nest: a stage
+ * is only charged for the time outside its inner stages (scaling inside a
+ * raster decode counts as scale), so the rows add up to the total.
+ *
+ * When counters are requested and the kernel allows it, each span also
+ * reads cycles, instructions, cache misses and branch misses of this
+ * process through perf_event_open(), inherited by the extractor children
+ * it spawns (their counts are folded in when they exit).  Where perf
+ * events are not permitted (perf_event_paranoid, containers, VMs without
+ * a PMU) the report says so and keeps the timings.
+ *
+ * Memory is accounted per stage as well: the peak RSS of every extractor
+ * child (from wait4()), and, in builds with -Dalloc_accounting=true and
+ * --trace=alloc, the allocations made through malloc (count, bytes, net
+ * live bytes and the peak of live bytes above where the stage started).
+ * GLib >= 2.46 ignores g_mem_set_vtable(), so the counting hooks replace
+ * malloc itself, which also sees gdk-pixbuf, librsvg and cairo.  The job
+ * arena's own allocations (which never reach malloc) are reported per
+ * extraction job.
+ *
+ * Tracing is process-wide and meant for the single-threaded CLI; with
+ * tracing off, a span costs one branch.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_TRACE_H
+#define THUMBNAIL_TRACE_H
+
+#include <glib.h>
+#include <sys/resource.h>
+
+typedef enum {
+    THUMBNAIL_STAGE_PROBE = 0, /* format detection, payload offset, truncation check */
+    THUMBNAIL_STAGE_EXTRACT,   /* reading the entry out of the image (incl. children) */
+    THUMBNAIL_STAGE_CLASSIFY,  /* pointer-file and SVG sniffing */
+    THUMBNAIL_STAGE_DECODE,    /* PNG/SVG decoding and rasterization */
+    THUMBNAIL_STAGE_SCALE,     /* resampling to the target size */
+    THUMBNAIL_STAGE_ENCODE,    /* PNG encoding of the thumbnail */
+    THUMBNAIL_STAGE_COUNT
+} ThumbnailStage;
+
+typedef enum {
+    THUMBNAIL_TRACE_COUNTERS = 1 << 0, /* hardware counters, where permitted */
+    THUMBNAIL_TRACE_ALLOC    = 1 << 1, /* allocation accounting (needs the hooks) */
+} ThumbnailTraceFlags;
+
+/**
+ * Start tracing.
+ *
+ * @param flags What to sample besides wall time
+ */
+void thumbnail_trace_enable(ThumbnailTraceFlags flags);
+
+/**
+ * @return TRUE if tracing is enabled
+ */
+gboolean thumbnail_trace_enabled(void);
+
+/**
+ * Enter a stage.  Spans must be properly nested.
+ */
+void thumbnail_trace_begin(ThumbnailStage stage);
+
+/**
+ * Leave the innermost stage, which must be @stage.
+ */
+void thumbnail_trace_end(ThumbnailStage stage);
+
+/**
+ * Account the resource usage of a reaped extractor child to the current
+ * stage.
+ */
+void thumbnail_trace_child_exited(const struct rusage *usage);
+
+/**
+ * @return TRUE while the allocation hooks should count
+ */
+gboolean thumbnail_trace_counting_allocs(void);
+
+/**
+ * Count an allocation or a release of @size usable bytes.  Called from
+ * the allocation hooks; neither allocates.
+ */
+void thumbnail_trace_note_alloc(gsize size);
+void thumbnail_trace_note_free(gsize size);
+
+/**
+ * Account one extraction job's use of the job arena, for the report.
+ * Called when the arena is rewound.
+ *
+ * @param allocs          Allocations carved from the arena
+ * @param bytes           Bytes handed out
+ * @param overflow_chunks Chunks added because the first one was full
+ */
+void thumbnail_trace_arena_job(guint allocs, gsize bytes, guint overflow_chunks);
+
+/**
+ * Name of a stage ("probe", "extract", ...).
+ */
+const char *thumbnail_trace_stage_name(ThumbnailStage stage);
+
+/**
+ * Print the per-stage report to stderr.
+ */
+void thumbnail_trace_report(void);
+
+#endif /* THUMBNAIL_TRACE_H */
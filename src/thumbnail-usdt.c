@@ -0,0 +1,33 @@
+/*
+ * thumbnail-usdt.c - Static tracepoints at pipeline stage boundaries
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "thumbnail-usdt.h"
+
+static guint64 last_job = 0;
+static guint64 current_job = 0;
+static int current_size = 0;
+
+void
+thumbnail_usdt_job_begin(int size, const char *path)
+{
+    current_job = ++last_job;
+    current_size = size;
+    THUMBNAIL_USDT2(job__start, size, path);
+}
+
+void
+thumbnail_usdt_job_end(int status)
+{
+    THUMBNAIL_USDT2(job__end, current_size, status);
+    current_job = 0;
+    current_size = 0;
+}
+
+guint64
+thumbnail_usdt_job(void)
+{
+    return current_job;
+}
@@ -0,0 +1,79 @@
+/*
+ * thumbnail-usdt.h - Static tracepoints at pipeline stage boundaries
+ *
+ * Builds with <sys/sdt.h> (-Dusdt, auto-detected) place USDT probes of
+ * the provider "appimage_thumbnailer" at the stage boundaries.  A probe
+ * that no tracer is attached to is a single nop, so they stay in release
+ * builds; bpftrace, perf or SystemTap can attach to a running service:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/appimage-thumbnailer:appimage_thumbnailer:decode__end
+ *                { @[pid] = hist(arg2) }'
+ *
+ * Every probe's first argument is the job id, numbered per process, so
+ * (pid, job) identifies a job across forked workers:
+ *
+ *   job__start       (job, size, path)
+ *   job__end         (job, size, status)          status 0 = success
+ *   probe__done      (job, format, offset, truncated)
+ *   backend__chosen  (job, backend, entry)
+ *   extractor__spawn (job, pid, tool)
+ *   extractor__exit  (job, pid, wait status, peak RSS in KiB)
+ *   cache__hit       (job, cache, size)
+ *   cache__miss      (job, cache, size)
+ *   decode__start    (job, payload bytes, size)
+ *   decode__end      (job, width, height)         0x0 on failure
+ *   encode__done     (job, width, height, bytes)
+ *
+ * Backends are "reader" (in-process SquashFS), "unsquashfs" and
+ * "dwarfsextract"; caches are "integration" (icons installed by desktop
+ * integrators), "index", "mip", "shared" and "xattr", with size 0 where
+ * the cache holds icons rather than thumbnails.  The size of a socket job
+ * is its largest requested size, that of a --populate-shared job 0.  A
+ * D-Bus job handed to a worker process ends with THUMBNAIL_USDT_DISPATCHED
+ * and runs as a new job in the worker.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_USDT_H
+#define THUMBNAIL_USDT_H
+
+#include <glib.h>
+
+#define THUMBNAIL_USDT_DISPATCHED (-1)
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define THUMBNAIL_USDT1(name, a) \
+    DTRACE_PROBE2(appimage_thumbnailer, name, thumbnail_usdt_job(), a)
+#define THUMBNAIL_USDT2(name, a, b) \
+    DTRACE_PROBE3(appimage_thumbnailer, name, thumbnail_usdt_job(), a, b)
+#define THUMBNAIL_USDT3(name, a, b, c) \
+    DTRACE_PROBE4(appimage_thumbnailer, name, thumbnail_usdt_job(), a, b, c)
+#else
+#define THUMBNAIL_USDT1(name, a)       do { (void)(a); } while (0)
+#define THUMBNAIL_USDT2(name, a, b)    do { (void)(a); (void)(b); } while (0)
+#define THUMBNAIL_USDT3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+/**
+ * Start a job: number it and fire job__start.  Jobs do not nest.
+ *
+ * @param size Requested thumbnail size
+ * @param path AppImage path or URI
+ */
+void thumbnail_usdt_job_begin(int size, const char *path);
+
+/**
+ * End the current job and fire job__end.
+ *
+ * @param status 0 on success, a frontend-specific failure code otherwise
+ */
+void thumbnail_usdt_job_end(int status);
+
+/**
+ * @return Id of the current job, 0 outside of jobs
+ */
+guint64 thumbnail_usdt_job(void);
+
+#endif /* THUMBNAIL_USDT_H */
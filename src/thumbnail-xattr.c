@@ -0,0 +1,257 @@
+/*
+ * thumbnail-xattr.c - Thumbnails stored on the AppImage itself
+ *
+ * Attribute layout (little-endian, the attribute moves between machines):
+ *   XattrHeader | PNG
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include "thumbnail-xattr.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "appimage-reader.h"
+#include "thumbnail-usdt.h"
+
+#define XATTR_MAGIC "AIT1"
+
+/* Linux limit for a single attribute value (XATTR_SIZE_MAX) */
+#define XATTR_VALUE_MAX 65536
+
+typedef struct {
+    gchar   magic[4];
+    guint32 edge;       /* longer edge of the PNG */
+    guint64 file_size;  /* AppImage size the PNG was rendered from */
+    gint64  mtime_sec;  /* ... and its mtime */
+    guint32 mtime_nsec;
+    guint32 reserved;
+} XattrHeader;
+
+static gboolean xattr_enabled = FALSE;
+
+void
+thumbnail_xattr_set_enabled(gboolean enabled)
+{
+    xattr_enabled = enabled;
+}
+
+gboolean
+thumbnail_xattr_enabled(void)
+{
+    return xattr_enabled;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Attribute access                                                  */
+/* ------------------------------------------------------------------ */
+
+static int
+open_appimage(const char *path, struct stat *st)
+{
+    if (!xattr_enabled || !path || appimage_reader_is_uri(path))
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+fill_header(XattrHeader *header, const struct stat *st, guint32 edge)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, XATTR_MAGIC, sizeof(header->magic));
+    header->edge = GUINT32_TO_LE(edge);
+    header->file_size = GUINT64_TO_LE((guint64)st->st_size);
+    header->mtime_sec = GINT64_TO_LE((gint64)st->st_mtim.tv_sec);
+    header->mtime_nsec = GUINT32_TO_LE((guint32)st->st_mtim.tv_nsec);
+}
+
+/* Read the attribute and check it still describes the file; returns the
+ * whole value (caller frees) with the stored edge, or NULL */
+static guchar *
+read_attribute(int fd, const struct stat *st, gsize *len, guint32 *edge)
+{
+    ssize_t size = fgetxattr(fd, THUMBNAIL_XATTR_NAME, NULL, 0);
+    if (size < 0) {
+        if (errno != ENODATA && errno != ENOTSUP)
+            g_debug("read_attribute: %s", g_strerror(errno));
+        return NULL;
+    }
+    if ((gsize)size <= sizeof(XattrHeader) || size > XATTR_VALUE_MAX)
+        return NULL;
+
+    guchar *value = g_malloc((gsize)size);
+    size = fgetxattr(fd, THUMBNAIL_XATTR_NAME, value, (gsize)size);
+    if (size <= (ssize_t)sizeof(XattrHeader)) {
+        g_free(value);
+        return NULL;
+    }
+
+    XattrHeader stored;
+    XattrHeader expected;
+    memcpy(&stored, value, sizeof(stored));
+    fill_header(&expected, st, GUINT32_FROM_LE(stored.edge));
+    if (memcmp(&stored, &expected, sizeof(stored)) != 0) {
+        g_debug("read_attribute: stale attribute (file changed since it was written)");
+        g_free(value);
+        return NULL;
+    }
+
+    *len = (gsize)size;
+    *edge = GUINT32_FROM_LE(stored.edge);
+    return value;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Lookup and store                                                  */
+/* ------------------------------------------------------------------ */
+
+static GdkPixbuf *
+decode_png(const guchar *data, gsize len)
+{
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new_with_type("png", NULL);
+    if (!loader)
+        return NULL;
+
+    GdkPixbuf *pixbuf = NULL;
+    gboolean ok = gdk_pixbuf_loader_write(loader, data, len, NULL);
+    if (gdk_pixbuf_loader_close(loader, NULL) && ok) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (pixbuf)
+            g_object_ref(pixbuf);
+    }
+    g_object_unref(loader);
+    return pixbuf;
+}
+
+static GdkPixbuf *
+scale_to_edge(GdkPixbuf *pixbuf, int edge)
+{
+    const int width = gdk_pixbuf_get_width(pixbuf);
+    const int height = gdk_pixbuf_get_height(pixbuf);
+    if (MAX(width, height) <= edge)
+        return g_object_ref(pixbuf);
+
+    const double scale = (double)edge / MAX(width, height);
+    return gdk_pixbuf_scale_simple(pixbuf, MAX(1, (int)(width * scale + 0.5)),
+                                   MAX(1, (int)(height * scale + 0.5)),
+                                   GDK_INTERP_BILINEAR);
+}
+
+GdkPixbuf *
+thumbnail_xattr_load(const char *path, int size)
+{
+    struct stat st;
+    int fd = size > 0 ? open_appimage(path, &st) : -1;
+    if (fd < 0)
+        return NULL;
+
+    gsize len = 0;
+    guint32 edge = 0;
+    guchar *value = read_attribute(fd, &st, &len, &edge);
+    close(fd);
+    if (!value) {
+        THUMBNAIL_USDT2(cache__miss, "xattr", size);
+        return NULL;
+    }
+
+    GdkPixbuf *pixbuf = NULL;
+    if (edge >= (guint32)size) {
+        GdkPixbuf *stored = decode_png(value + sizeof(XattrHeader), len - sizeof(XattrHeader));
+        if (stored) {
+            pixbuf = scale_to_edge(stored, size);
+            g_object_unref(stored);
+        }
+    } else {
+        g_debug("thumbnail_xattr_load: stored %upx thumbnail too small for %dpx", edge, size);
+    }
+    g_free(value);
+
+    if (pixbuf) {
+        g_debug("thumbnail_xattr_load: %dpx thumbnail from %s of '%s'", size,
+                THUMBNAIL_XATTR_NAME, path);
+        THUMBNAIL_USDT2(cache__hit, "xattr", size);
+    } else {
+        THUMBNAIL_USDT2(cache__miss, "xattr", size);
+    }
+    return pixbuf;
+}
+
+void
+thumbnail_xattr_store(const char *path, GdkPixbuf *pixbuf)
+{
+    struct stat st;
+    int fd = pixbuf ? open_appimage(path, &st) : -1;
+    if (fd < 0)
+        return;
+
+    int edge = MAX(gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf));
+
+    gsize old_len = 0;
+    guint32 old_edge = 0;
+    guchar *old = read_attribute(fd, &st, &old_len, &old_edge);
+    if (old) {
+        g_free(old);
+        if (old_edge >= (guint32)edge) {
+            close(fd);
+            return;
+        }
+    }
+
+    /* Never replace a valid attribute by a smaller one */
+    const int min_edge = MAX(THUMBNAIL_XATTR_MIN_EDGE, (int)old_edge + 1);
+
+    /* Maximum compression: the attribute is written once and read on
+     * every lookup, and small values fit inline in the inode */
+    while (edge >= min_edge) {
+        GdkPixbuf *scaled = scale_to_edge(pixbuf, edge);
+        gchar *png = NULL;
+        gsize png_len = 0;
+        gboolean encoded = scaled && gdk_pixbuf_save_to_buffer(scaled, &png, &png_len, "png",
+                                                               NULL, "compression", "9", NULL);
+        if (scaled)
+            g_object_unref(scaled);
+        if (!encoded)
+            break;
+
+        const gsize len = sizeof(XattrHeader) + png_len;
+        int saved_errno = E2BIG;
+        if (len <= XATTR_VALUE_MAX) {
+            guchar *value = g_malloc(len);
+            fill_header((XattrHeader *)value, &st, (guint32)edge);
+            memcpy(value + sizeof(XattrHeader), png, png_len);
+            saved_errno = fsetxattr(fd, THUMBNAIL_XATTR_NAME, value, len, 0) == 0 ? 0 : errno;
+            g_free(value);
+        }
+        g_free(png);
+
+        if (saved_errno == 0) {
+            g_debug("thumbnail_xattr_store: %dpx thumbnail (%" G_GSIZE_FORMAT " bytes) on '%s'",
+                    edge, len, path);
+            break;
+        }
+        /* ext4 limits a value to one block unless ea_inode is enabled */
+        if (saved_errno != E2BIG && saved_errno != ENOSPC) {
+            g_debug("thumbnail_xattr_store: not stored on '%s': %s", path, g_strerror(saved_errno));
+            break;
+        }
+        edge /= 2;
+    }
+    close(fd);
+}
@@ -0,0 +1,63 @@
+/*
+ * thumbnail-xattr.h - Thumbnails stored on the AppImage itself
+ *
+ * The freedesktop cache is keyed by URI, so a moved or renamed AppImage
+ * loses its thumbnail.  In xattr mode (opt-in, --xattr-cache) a compact
+ * PNG is also written to the "user.appimage.thumbnail" extended attribute
+ * of the AppImage, together with the size and mtime it was rendered
+ * from.  The attribute travels with the inode across renames (and with
+ * `cp -a` / `rsync -X`), so a moved file gets its thumbnail back from a
+ * single getxattr instead of an extraction.
+ *
+ * Filesystems that refuse user xattrs (tmpfs without user_xattr, vfat,
+ * most network mounts) or files the user cannot modify are skipped
+ * silently; the normal cache still works for them.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_XATTR_H
+#define THUMBNAIL_XATTR_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+
+#define THUMBNAIL_XATTR_NAME "user.appimage.thumbnail"
+
+/* Smallest edge worth storing when a larger PNG does not fit the
+ * filesystem's attribute size limit (one block on ext4) */
+#define THUMBNAIL_XATTR_MIN_EDGE 64
+
+/**
+ * Enable or disable xattr mode (disabled by default).
+ */
+void thumbnail_xattr_set_enabled(gboolean enabled);
+
+/**
+ * @return TRUE if xattr mode is enabled
+ */
+gboolean thumbnail_xattr_enabled(void);
+
+/**
+ * Load the thumbnail stored on an AppImage, if it is still valid (the
+ * file's size and mtime match) and at least @size pixels on its longer
+ * edge.  Larger thumbnails are scaled down to @size.
+ *
+ * @param path Local path of the AppImage
+ * @param size Requested size in pixels
+ * @return The thumbnail (caller unrefs), or NULL if xattr mode is off or
+ *         there is no usable attribute
+ */
+GdkPixbuf *thumbnail_xattr_load(const char *path, int size);
+
+/**
+ * Store a freshly rendered thumbnail on an AppImage.  A valid attribute
+ * that is at least as large is left alone; a PNG too large for the
+ * filesystem is halved down to THUMBNAIL_XATTR_MIN_EDGE before giving up.
+ *
+ * @param path   Local path of the AppImage
+ * @param pixbuf Thumbnail rendered from the file's current contents
+ */
+void thumbnail_xattr_store(const char *path, GdkPixbuf *pixbuf);
+
+#endif /* THUMBNAIL_XATTR_H */
@@ -0,0 +1,582 @@
+/*
+ * thumbnail-zygote.c - Pre-initialized worker processes for the service mode
+ *
+ * The zygote is deliberately single-threaded and GLib-main-loop free: it
+ * multiplexes its control socket and a signalfd for SIGCHLD with poll(),
+ * so fork() from it is always safe.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include "thumbnail-zygote.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "thumbnail-pipeline.h"
+#include "thumbnail-server.h"
+
+/* A pooled worker that dies abnormally this soon after being forked is
+ * replaced with a delay, so a systematic crash cannot fork-bomb. */
+#define RESPAWN_BACKOFF_USEC G_USEC_PER_SEC
+
+typedef enum {
+    ZYGOTE_MSG_JOB,         /* id = job id, followed by len bytes of job data */
+    ZYGOTE_MSG_SET_WORKERS, /* id = new pool size */
+} ZygoteMessageType;
+
+typedef struct {
+    guint32 type;
+    guint32 id;
+    guint32 len;
+} ZygoteJobHeader;
+
+typedef struct {
+    guint32 job_id;
+    gint32 status;
+} ZygoteJobResult;
+
+/* Service side */
+static int control_fd = -1;
+static pid_t zygote_pid = -1;
+static guint control_source_id = 0;
+static guint max_jobs = 0;
+static guint configured_workers = 0;
+static ThumbnailZygoteDoneFunc done_callback = NULL;
+static gpointer done_user_data = NULL;
+
+/* ------------------------------------------------------------------ */
+/*  Worker side                                                       */
+/* ------------------------------------------------------------------ */
+
+static void
+apply_worker_limits(const ThumbnailZygoteOptions *options)
+{
+    struct rlimit rl;
+
+    /* Only the soft limits: extractor children lift the address-space
+     * cap again because dwarfsextract maps whole images. */
+    if (options->address_space_limit > 0 && getrlimit(RLIMIT_AS, &rl) == 0) {
+        rl.rlim_cur = MIN((rlim_t)options->address_space_limit, rl.rlim_max);
+        setrlimit(RLIMIT_AS, &rl);
+    }
+}
+
+/* RLIMIT_CPU counts the whole life of the process, so a pooled worker
+ * moves the soft limit past what it has used so far before each request:
+ * every request gets the full budget, however many came before it. */
+static void
+arm_cpu_limit(const ThumbnailZygoteOptions *options)
+{
+    struct rlimit rl;
+    struct rusage usage;
+
+    if (options->cpu_time_limit == 0 || getrlimit(RLIMIT_CPU, &rl) < 0
+        || getrusage(RUSAGE_SELF, &usage) < 0)
+        return;
+
+    /* Whole seconds used, rounded up */
+    const rlim_t used = (rlim_t)usage.ru_utime.tv_sec + (rlim_t)usage.ru_stime.tv_sec + 1;
+    rl.rlim_cur = MIN(used + (rlim_t)options->cpu_time_limit, rl.rlim_max);
+    setrlimit(RLIMIT_CPU, &rl);
+}
+
+static void
+note_activity(int activity_fd)
+{
+    if (activity_fd < 0)
+        return;
+
+    /* Non-blocking: a full pipe already tells the service we are busy */
+    const char byte = 1;
+    ssize_t n G_GNUC_UNUSED = write(activity_fd, &byte, 1);
+}
+
+static volatile sig_atomic_t worker_retiring = 0;
+
+static void
+on_retire_signal(int signo G_GNUC_UNUSED)
+{
+    worker_retiring = 1;
+}
+
+static void G_GNUC_NORETURN
+pool_worker_main(const ThumbnailZygoteOptions *options, int listen_fd, int activity_fd,
+                 ThumbnailZygoteRequestFunc request_func)
+{
+    guint served = 0;
+
+    /* SIGUSR1 asks the worker to leave the pool once its current request
+     * is done.  It is only deliverable while waiting in accept(), which
+     * it interrupts (no SA_RESTART). */
+    struct sigaction sa = { .sa_handler = on_retire_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    sigset_t retire_mask;
+    sigemptyset(&retire_mask);
+    sigaddset(&retire_mask, SIGUSR1);
+
+    while (served < options->jobs_per_worker && !worker_retiring) {
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+
+        sigprocmask(SIG_BLOCK, &retire_mask, NULL);
+        while (served < options->jobs_per_worker) {
+            arm_cpu_limit(options);
+            if (!request_func(client_fd))
+                break;
+            served++;
+            note_activity(activity_fd);
+        }
+        close(client_fd);
+        sigprocmask(SIG_UNBLOCK, &retire_mask, NULL);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Zygote process                                                    */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    gint64 spawned;
+    gboolean retiring; /* asked to exit, will not be replaced */
+} PoolWorker;
+
+typedef struct {
+    const ThumbnailZygoteOptions *options;
+    int control_fd;
+    int signal_fd;
+    int listen_fd;
+    int activity_fd;
+    sigset_t worker_sigmask;
+    ThumbnailZygoteRequestFunc request_func;
+    ThumbnailZygoteJobFunc job_func;
+    GHashTable *pool;        /* pid -> PoolWorker */
+    GHashTable *jobs;        /* pid -> job id */
+    guint target_workers;    /* current pool size, lowered under memory pressure */
+    guint active_workers;    /* pool workers that are not retiring */
+    guint pending_respawns;
+    gint64 respawn_at;
+} Zygote;
+
+/* Common setup for every process forked from the zygote */
+static void
+enter_worker(Zygote *z)
+{
+    close(z->control_fd);
+    close(z->signal_fd);
+    sigprocmask(SIG_SETMASK, &z->worker_sigmask, NULL);
+    apply_worker_limits(z->options);
+}
+
+static void
+spawn_pool_worker(Zygote *z)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        g_debug("spawn_pool_worker: fork failed: %s", g_strerror(errno));
+        z->active_workers++;
+        z->pending_respawns++;
+        z->respawn_at = g_get_monotonic_time() + RESPAWN_BACKOFF_USEC;
+        return;
+    }
+
+    if (pid == 0) {
+        enter_worker(z);
+        pool_worker_main(z->options, z->listen_fd, z->activity_fd, z->request_func);
+    }
+
+    PoolWorker *worker = g_new0(PoolWorker, 1);
+    worker->spawned = g_get_monotonic_time();
+    g_hash_table_insert(z->pool, GINT_TO_POINTER(pid), worker);
+    z->active_workers++;
+    g_debug("spawn_pool_worker: worker %d started", (int)pid);
+}
+
+/* Grow the pool right away; shrink it by letting workers finish the
+ * request they are serving and exit without a replacement. */
+static void
+resize_pool(Zygote *z, guint workers)
+{
+    z->target_workers = CLAMP(workers, 1, z->options->workers);
+    if (z->listen_fd < 0)
+        return;
+
+    g_debug("resize_pool: %u -> %u worker(s)", z->active_workers, z->target_workers);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, z->pool);
+    while (z->active_workers > z->target_workers && g_hash_table_iter_next(&iter, &key, &value)) {
+        PoolWorker *worker = value;
+        if (worker->retiring)
+            continue;
+        worker->retiring = TRUE;
+        z->active_workers--;
+        kill(GPOINTER_TO_INT(key), SIGUSR1);
+    }
+
+    /* Workers waiting for a delayed respawn count as active */
+    while (z->active_workers > z->target_workers && z->pending_respawns > 0) {
+        z->pending_respawns--;
+        z->active_workers--;
+    }
+
+    while (z->active_workers < z->target_workers)
+        spawn_pool_worker(z);
+}
+
+static void
+handle_control_message(Zygote *z, const guchar *msg, gsize len)
+{
+    ZygoteJobHeader header;
+    if (len < sizeof(header))
+        return;
+    memcpy(&header, msg, sizeof(header));
+    if (header.len > len - sizeof(header))
+        return;
+
+    if (header.type == ZYGOTE_MSG_SET_WORKERS) {
+        resize_pool(z, header.id);
+        return;
+    }
+    if (header.type != ZYGOTE_MSG_JOB)
+        return;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        ZygoteJobResult result = { header.id, -SIGKILL };
+        send(z->control_fd, &result, sizeof(result), MSG_NOSIGNAL);
+        return;
+    }
+
+    if (pid == 0) {
+        enter_worker(z);
+        if (z->listen_fd >= 0)
+            close(z->listen_fd);
+        arm_cpu_limit(z->options);
+        _exit(z->job_func(msg + sizeof(header), header.len) & 0xff);
+    }
+
+    g_hash_table_insert(z->jobs, GINT_TO_POINTER(pid), GUINT_TO_POINTER(header.id));
+}
+
+static void
+reap_workers(Zygote *z)
+{
+    int status = 0;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        gpointer value = NULL;
+
+        if (g_hash_table_lookup_extended(z->jobs, GINT_TO_POINTER(pid), NULL, &value)) {
+            ZygoteJobResult result = {
+                .job_id = GPOINTER_TO_UINT(value),
+                .status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status),
+            };
+            if (WIFSIGNALED(status))
+                g_printerr("Thumbnail worker %d crashed (signal %d)\n", (int)pid, WTERMSIG(status));
+            send(z->control_fd, &result, sizeof(result), MSG_NOSIGNAL);
+            g_hash_table_remove(z->jobs, GINT_TO_POINTER(pid));
+            continue;
+        }
+
+        PoolWorker *worker = g_hash_table_lookup(z->pool, GINT_TO_POINTER(pid));
+        if (!worker)
+            continue;
+
+        if (worker->retiring) {
+            g_debug("reap_workers: worker %d retired", (int)pid);
+            g_hash_table_remove(z->pool, GINT_TO_POINTER(pid));
+            continue;
+        }
+
+        const gboolean abnormal = !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+        const gboolean early = g_get_monotonic_time() - worker->spawned < RESPAWN_BACKOFF_USEC;
+        g_hash_table_remove(z->pool, GINT_TO_POINTER(pid));
+        z->active_workers--;
+
+        if (WIFSIGNALED(status))
+            g_printerr("Thumbnail worker %d crashed (signal %d), replacing it\n",
+                       (int)pid, WTERMSIG(status));
+        else
+            g_debug("reap_workers: worker %d exited with %d", (int)pid, WEXITSTATUS(status));
+
+        if (abnormal && early) {
+            z->active_workers++;
+            z->pending_respawns++;
+            z->respawn_at = g_get_monotonic_time() + RESPAWN_BACKOFF_USEC;
+        } else {
+            spawn_pool_worker(z);
+        }
+    }
+}
+
+static void
+kill_workers(GHashTable *table)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        kill(GPOINTER_TO_INT(key), SIGTERM);
+}
+
+static void G_GNUC_NORETURN
+zygote_main(const ThumbnailZygoteOptions *options, int fd, pid_t parent,
+            int listen_fd, int activity_fd,
+            ThumbnailZygoteRequestFunc request_func, ThumbnailZygoteJobFunc job_func)
+{
+    /* Never outlive the service */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+        _exit(EXIT_SUCCESS);
+
+    Zygote z = {
+        .options = options,
+        .control_fd = fd,
+        .listen_fd = listen_fd,
+        .activity_fd = activity_fd,
+        .request_func = request_func,
+        .job_func = job_func,
+        .pool = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free),
+        .jobs = g_hash_table_new(g_direct_hash, g_direct_equal),
+        .target_workers = options->workers,
+    };
+
+    /* Pay for loader discovery, librsvg and fontconfig once; every
+     * worker inherits the initialized state copy-on-write. */
+    thumbnail_pipeline_warm_up();
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &z.worker_sigmask);
+    z.signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (z.signal_fd < 0)
+        _exit(EXIT_FAILURE);
+
+    if (listen_fd >= 0) {
+        for (guint i = 0; i < options->workers; ++i)
+            spawn_pool_worker(&z);
+    }
+
+    guchar msg[sizeof(ZygoteJobHeader) + THUMBNAIL_ZYGOTE_MAX_JOB_DATA];
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = z.control_fd, .events = POLLIN },
+            { .fd = z.signal_fd,  .events = POLLIN },
+        };
+
+        int timeout = -1;
+        if (z.pending_respawns > 0)
+            timeout = (int)MAX(0, (z.respawn_at - g_get_monotonic_time()) / 1000);
+
+        if (poll(fds, G_N_ELEMENTS(fds), timeout) < 0 && errno != EINTR)
+            break;
+
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(z.signal_fd, &info, sizeof(info)) < 0 && errno == EINTR)
+                ;
+            reap_workers(&z);
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(z.control_fd, msg, sizeof(msg), 0);
+            if (n == 0 || (n < 0 && errno != EINTR))
+                break; /* service went away */
+            if (n > 0)
+                handle_control_message(&z, msg, (gsize)n);
+        }
+
+        if (z.pending_respawns > 0 && g_get_monotonic_time() >= z.respawn_at) {
+            guint n = z.pending_respawns;
+            z.pending_respawns = 0;
+            z.active_workers -= n;
+            while (n-- > 0)
+                spawn_pool_worker(&z);
+        }
+    }
+
+    kill_workers(z.pool);
+    kill_workers(z.jobs);
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+    _exit(EXIT_SUCCESS);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Service side                                                      */
+/* ------------------------------------------------------------------ */
+
+static gboolean
+on_control_ready(gint fd, GIOCondition condition G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
+{
+    ZygoteJobResult result;
+    ssize_t n = recv(fd, &result, sizeof(result), MSG_DONTWAIT);
+
+    if (n == (ssize_t)sizeof(result)) {
+        if (done_callback)
+            done_callback(result.job_id, result.status, done_user_data);
+        return G_SOURCE_CONTINUE;
+    }
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return G_SOURCE_CONTINUE;
+
+    g_printerr("Thumbnail worker zygote exited unexpectedly\n");
+    control_source_id = 0;
+    thumbnail_zygote_stop();
+    thumbnail_server_quit();
+    return G_SOURCE_REMOVE;
+}
+
+gboolean
+thumbnail_zygote_start(const ThumbnailZygoteOptions *options,
+                       int listen_fd, int activity_fd,
+                       ThumbnailZygoteRequestFunc request_func,
+                       ThumbnailZygoteJobFunc job_func,
+                       ThumbnailZygoteDoneFunc done_func,
+                       gpointer user_data)
+{
+    if (control_fd >= 0 || options->workers == 0)
+        return control_fd >= 0;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        g_printerr("Failed to create zygote socket: %s\n", g_strerror(errno));
+        return FALSE;
+    }
+
+    const pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        g_printerr("Failed to fork zygote: %s\n", g_strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return FALSE;
+    }
+
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(options, sv[1], parent, listen_fd, activity_fd, request_func, job_func);
+    }
+
+    close(sv[1]);
+    control_fd = sv[0];
+    zygote_pid = pid;
+    max_jobs = options->workers;
+    configured_workers = options->workers;
+    done_callback = done_func;
+    done_user_data = user_data;
+    control_source_id = g_unix_fd_add(control_fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                      on_control_ready, NULL);
+
+    g_debug("thumbnail_zygote_start: zygote %d, %u worker(s), %u job(s) each",
+            (int)pid, options->workers, options->jobs_per_worker);
+    return TRUE;
+}
+
+gboolean
+thumbnail_zygote_active(void)
+{
+    return control_fd >= 0;
+}
+
+guint
+thumbnail_zygote_max_jobs(void)
+{
+    return max_jobs;
+}
+
+gboolean
+thumbnail_zygote_run_job(guint32 job_id, const guchar *data, gsize len)
+{
+    if (control_fd < 0 || len > THUMBNAIL_ZYGOTE_MAX_JOB_DATA)
+        return FALSE;
+
+    guchar msg[sizeof(ZygoteJobHeader) + THUMBNAIL_ZYGOTE_MAX_JOB_DATA];
+    ZygoteJobHeader header = { ZYGOTE_MSG_JOB, job_id, (guint32)len };
+    memcpy(msg, &header, sizeof(header));
+    memcpy(msg + sizeof(header), data, len);
+
+    ssize_t n;
+    do {
+        n = send(control_fd, msg, sizeof(header) + len, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)(sizeof(header) + len);
+}
+
+void
+thumbnail_zygote_set_workers(guint workers)
+{
+    if (control_fd < 0)
+        return;
+
+    workers = CLAMP(workers, 1, configured_workers);
+    if (workers == max_jobs)
+        return;
+
+    ZygoteJobHeader header = { ZYGOTE_MSG_SET_WORKERS, workers, 0 };
+    ssize_t n;
+    do {
+        n = send(control_fd, &header, sizeof(header), MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n == (ssize_t)sizeof(header))
+        max_jobs = workers;
+}
+
+guint
+thumbnail_zygote_configured_workers(void)
+{
+    return configured_workers;
+}
+
+void
+thumbnail_zygote_stop(void)
+{
+    if (control_source_id != 0) {
+        g_source_remove(control_source_id);
+        control_source_id = 0;
+    }
+
+    if (control_fd >= 0) {
+        /* EOF on the control socket makes the zygote reap its workers */
+        close(control_fd);
+        control_fd = -1;
+    }
+
+    if (zygote_pid > 0) {
+        while (waitpid(zygote_pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        zygote_pid = -1;
+    }
+    max_jobs = 0;
+    configured_workers = 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * thumbnail-zygote.h - Pre-initialized worker processes for the service mode
+ *
+ * The zygote is forked from the service before any threads exist, warms
+ * up GdkPixbuf loaders, librsvg and fontconfig once, and then forks
+ * copy-on-write workers from that state:
+ *   - a pool of connection workers that accept() on the service socket
+ *     and each serve a bounded number of requests before being replaced;
+ *   - one-shot job workers for D-Bus requests, whose exit status is
+ *     reported back to the service.
+ * Workers run under an address-space rlimit and a CPU-time rlimit that
+ * is re-armed for every request; a crashing worker only takes its own
+ * request down and is replaced automatically.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THUMBNAIL_ZYGOTE_H
+#define THUMBNAIL_ZYGOTE_H
+
+#include <glib.h>
+
+#define THUMBNAIL_ZYGOTE_DEFAULT_WORKERS         1
+#define THUMBNAIL_ZYGOTE_DEFAULT_JOBS_PER_WORKER 64
+#define THUMBNAIL_ZYGOTE_DEFAULT_ADDRESS_SPACE   (G_GUINT64_CONSTANT(1) << 30) /* 1 GiB */
+#define THUMBNAIL_ZYGOTE_DEFAULT_CPU_TIME        60                          /* seconds */
+#define THUMBNAIL_ZYGOTE_MAX_JOB_DATA            8192
+
+/* Serve one request on an accepted connection; FALSE closes it */
+typedef gboolean (*ThumbnailZygoteRequestFunc)(int client_fd);
+
+/* Run a one-shot job inside a worker; the return value is its exit status */
+typedef int (*ThumbnailZygoteJobFunc)(const guchar *data, gsize len);
+
+/* Called in the service when a job worker finished: status is the exit
+ * status, or minus the signal number if the worker crashed */
+typedef void (*ThumbnailZygoteDoneFunc)(guint32 job_id, int status, gpointer user_data);
+
+typedef struct {
+    guint workers;               /* pooled connection workers (and job concurrency) */
+    guint jobs_per_worker;       /* requests a pooled worker serves before it exits */
+    guint64 address_space_limit; /* RLIMIT_AS soft limit per worker in bytes, 0 = none */
+    guint cpu_time_limit;        /* RLIMIT_CPU budget per request in seconds, 0 = none */
+} ThumbnailZygoteOptions;
+
+/**
+ * Fork the zygote.  Must be called before the service starts threads
+ * (D-Bus, GLib signal or child watches).
+ *
+ * @param options      Pool configuration
+ * @param listen_fd    Listening socket for pooled workers, or -1
+ * @param activity_fd  Pipe the workers write a byte to per request, or -1
+ * @param request_func Request handler for pooled workers
+ * @param job_func     Handler for one-shot jobs
+ * @param done_func    Completion callback for one-shot jobs (service side)
+ * @param user_data    Passed to done_func
+ * @return TRUE if the zygote is running
+ */
+gboolean thumbnail_zygote_start(const ThumbnailZygoteOptions *options,
+                                int listen_fd, int activity_fd,
+                                ThumbnailZygoteRequestFunc request_func,
+                                ThumbnailZygoteJobFunc job_func,
+                                ThumbnailZygoteDoneFunc done_func,
+                                gpointer user_data);
+
+/**
+ * Whether a zygote is running and jobs should go through it.
+ */
+gboolean thumbnail_zygote_active(void);
+
+/**
+ * Number of one-shot jobs that may be in flight at once.
+ */
+guint thumbnail_zygote_max_jobs(void);
+
+/**
+ * Hand a one-shot job to a fresh worker.
+ *
+ * @param job_id Identifier passed back to the done callback
+ * @param data   Job description (at most THUMBNAIL_ZYGOTE_MAX_JOB_DATA bytes)
+ * @param len    Length of data
+ * @return TRUE if the job was queued
+ */
+gboolean thumbnail_zygote_run_job(guint32 job_id, const guchar *data, gsize len);
+
+/**
+ * Change the number of pooled workers and the job concurrency at
+ * runtime, e.g. under memory pressure.  Surplus workers finish their
+ * current request before exiting.
+ *
+ * @param workers New pool size, clamped to 1 .. the configured size
+ */
+void thumbnail_zygote_set_workers(guint workers);
+
+/**
+ * Pool size the zygote was started with.
+ */
+guint thumbnail_zygote_configured_workers(void);
+
+/**
+ * Shut down the zygote and all of its workers.
+ */
+void thumbnail_zygote_stop(void);
+
+#endif /* THUMBNAIL_ZYGOTE_H */
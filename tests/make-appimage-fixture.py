@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+#
+# make-appimage-fixture.py - Build a tiny SquashFS AppImage for the tests
+#
+# Writes a type 2 AppImage made of a bare ELF64 header (with the "AI"
+# magic and a one-entry section table, whose end is the payload offset)
+# followed by a gzip SquashFS 4.0 image holding only /.DirIcon.  The icon
+# is a little over one block, so reading it takes a full data block and
+# a fragment.  The output is deterministic; no squashfs-tools needed.
+#
+# Into OUTDIR:
+#   fixture.AppImage             the AppImage
+#   fixture-DirIcon              the icon it holds
+#   fixture-bad-block.AppImage   the icon's block size word exceeds the block size
+#   fixture-bad-dirent.AppImage  the root listing ends inside the icon's entry
+#   fixture-truncated.AppImage   one byte short of the image's bytes_used
+#   fixture-lying-elf.AppImage   e_shoff points into the runtime, which holds
+#                                decoy "hsqs" magics; the image is at
+#                                LYING_PAYLOAD_OFFSET
+#
+# Usage: make-appimage-fixture.py OUTDIR
+#
+# SPDX-License-Identifier: MIT
+
+import os
+import struct
+import sys
+import zlib
+
+BLOCK_LOG = 12
+BLOCK_SIZE = 1 << BLOCK_LOG
+METADATA_SIZE = 8192
+COMPRESSION_GZIP = 1
+NO_TABLE = 0xFFFFFFFFFFFFFFFF
+MTIME = 1700000000
+
+INODE_DIR = 1
+INODE_FILE = 2
+
+ELF_HEADER_SIZE = 64
+ELF_SHENTSIZE = 64
+
+# Layout of fixture-lying-elf.AppImage (test-appimage-reader.c knows it)
+LYING_SHOFF = 256
+LYING_DECOY_OFFSETS = (512, 1024)
+LYING_PAYLOAD_OFFSET = 2048
+
+
+def icon_bytes():
+    # Compressible but not constant, and not a multiple of the block size
+    lines = [b"appimage-thumbnailer test icon line %04d\n" % i for i in range(150)]
+    return b"".join(lines)
+
+
+def compress_block(data):
+    """Data block and its on-disk size word."""
+    packed = zlib.compress(data, 9)
+    if len(packed) < len(data):
+        return packed, len(packed)
+    return data, len(data) | (1 << 24)
+
+
+def metadata_block(data):
+    assert len(data) <= METADATA_SIZE
+    packed = zlib.compress(data, 9)
+    if len(packed) < len(data):
+        return struct.pack("<H", len(packed)) + packed
+    return struct.pack("<H", len(data) | 0x8000) + data
+
+
+def inode_header(kind, number):
+    return struct.pack("<HHHHII", kind, 0o755 if kind == INODE_DIR else 0o644,
+                       0, 0, MTIME, number)
+
+
+def squashfs_image(icon, block_word=None, listing_cut=0):
+    """The image; @block_word overrides the icon's block size word,
+    @listing_cut shortens the root listing size by that many bytes."""
+    superblock_size = 96
+    out = bytearray(superblock_size)
+
+    # Data: one full block of the icon, then the fragment with its tail
+    full = icon[:BLOCK_SIZE]
+    tail = icon[BLOCK_SIZE:]
+    blocks_start = len(out)
+    block, word = compress_block(full)
+    if block_word is None:
+        block_word = word
+    out += block
+    fragment_start = len(out)
+    fragment, fragment_word = compress_block(tail)
+    out += fragment
+
+    # Inodes: /.DirIcon (1) then the root directory (2), in one metadata block
+    name = b".DirIcon"
+    listing = struct.pack("<III", 0, 0, 1) + struct.pack("<HhHH", 0, 0, INODE_FILE, len(name) - 1) + name
+    file_inode = inode_header(INODE_FILE, 1) + struct.pack(
+        "<IIII", blocks_start, 0, 0, len(icon)) + struct.pack("<I", block_word)
+    root_offset = len(file_inode)
+    root_inode = inode_header(INODE_DIR, 2) + struct.pack(
+        "<IIHHI", 0, 2, len(listing) + 3 - listing_cut, 0, 3)
+
+    inode_table = len(out)
+    out += metadata_block(file_inode + root_inode)
+
+    directory_table = len(out)
+    out += metadata_block(listing)
+
+    # Fragment table: one entry, then the index of its metadata blocks
+    fragment_entries = len(out)
+    out += metadata_block(struct.pack("<QII", fragment_start, fragment_word, 0))
+    fragment_table = len(out)
+    out += struct.pack("<Q", fragment_entries)
+
+    # Id table: uid/gid 0
+    id_entries = len(out)
+    out += metadata_block(struct.pack("<I", 0))
+    id_table = len(out)
+    out += struct.pack("<Q", id_entries)
+
+    bytes_used = len(out)
+    out[0:superblock_size] = struct.pack(
+        "<4sIIIIHHHHHHQQQQQQQQ",
+        b"hsqs", 2, MTIME, BLOCK_SIZE, 1, COMPRESSION_GZIP, BLOCK_LOG,
+        0, 1, 4, 0,
+        root_offset,  # root inode: block 0 of the inode table
+        bytes_used, id_table, NO_TABLE, inode_table, directory_table,
+        fragment_table, NO_TABLE)
+
+    # mksquashfs pads the image to 4 KiB
+    out += bytes(-len(out) % 4096)
+    return bytes(out)
+
+
+def elf_stub(shoff=ELF_HEADER_SIZE):
+    ident = b"\x7fELF" + bytes([2, 1, 1, 0]) + b"AI\x02" + bytes(5)
+    header = ident + struct.pack(
+        "<HHIQQQIHHHHHH",
+        2, 0x3E, 1,  # ET_EXEC, x86-64, EV_CURRENT
+        0, 0, shoff,  # entry, no program headers, section table
+        0, ELF_HEADER_SIZE, 0, 0, ELF_SHENTSIZE, 1, 0)
+    assert len(header) == ELF_HEADER_SIZE
+    return header + bytes(ELF_SHENTSIZE)  # SHT_NULL section
+
+
+def lying_elf(image):
+    """A runtime whose section table ends in its own code, carrying the
+    magic the way squashfuse does: once as a bare string, once followed
+    by a superblock-like header that claims more bytes than the file has."""
+    runtime = bytearray(elf_stub(shoff=LYING_SHOFF))
+    runtime += bytes(LYING_DECOY_OFFSETS[0] - len(runtime))
+    runtime += b"hsqs: bad magic\0"
+    runtime += bytes(LYING_DECOY_OFFSETS[1] - len(runtime))
+    decoy = bytearray(image[:96])
+    struct.pack_into("<Q", decoy, 40, 1 << 40)  # bytes_used
+    runtime += decoy
+    runtime += bytes(LYING_PAYLOAD_OFFSET - len(runtime))
+    return bytes(runtime) + image
+
+
+def write(outdir, name, data):
+    with open(os.path.join(outdir, name), "wb") as f:
+        f.write(data)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s OUTDIR" % sys.argv[0])
+
+    outdir = sys.argv[1]
+    icon = icon_bytes()
+    image = squashfs_image(icon)
+    write(outdir, "fixture.AppImage", elf_stub() + image)
+    write(outdir, "fixture-DirIcon", icon)
+    write(outdir, "fixture-bad-block.AppImage",
+          elf_stub() + squashfs_image(icon, block_word=BLOCK_SIZE + 1))
+    # Cuts into the name of the only entry
+    write(outdir, "fixture-bad-dirent.AppImage", elf_stub() + squashfs_image(icon, listing_cut=4))
+    # A download cut off just before the end of the image
+    bytes_used = struct.unpack_from("<Q", image, 40)[0]
+    write(outdir, "fixture-truncated.AppImage", elf_stub() + image[:bytes_used - 1])
+    write(outdir, "fixture-lying-elf.AppImage", lying_elf(image))
+
+
+if __name__ == "__main__":
+    main()
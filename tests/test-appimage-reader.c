@@ -0,0 +1,269 @@
+/*
+ * test-appimage-reader.c - Local path and file:// URI reads must agree
+ *
+ * The GIO range reader is what serves sftp:// and smb:// AppImages; a
+ * file:// URI takes the same path without a remote.  Probes the fixture
+ * both ways and checks the payload format, offset, compressor and
+ * .DirIcon bytes match each other and the icon the fixture was built from,
+ * and that damaged images fail to read the same way.  A truncated image
+ * must be refused both ways, and by the thumbnailer named in
+ * $APPIMAGE_THUMBNAILER with its "incomplete" exit status.  When the ELF
+ * section table lies, the magic scan has to find the real image past
+ * the decoy magics in the runtime.
+ *
+ * Usage: test-appimage-reader FIXTURE-DIR (see make-appimage-fixture.py)
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "appimage-reader.h"
+#include "appimage-type.h"
+#include "squashfs-reader.h"
+
+/* EXIT_INCOMPLETE of appimage-thumbnailer */
+#define THUMBNAILER_EXIT_INCOMPLETE 75
+
+/* Layout of fixture-lying-elf.AppImage, see make-appimage-fixture.py */
+#define LYING_SECTION_TABLE_END 320
+#define LYING_DECOY_OFFSET_1    512
+#define LYING_DECOY_OFFSET_2    1024
+#define LYING_PAYLOAD_OFFSET    2048
+
+static gchar *fixture_dir = NULL;
+
+typedef struct {
+    AppImageFormat format;
+    off_t          offset;
+    guint16        compression;
+    GBytes        *icon;
+} Probe;
+
+/*
+ * Probe results are cached per file identity; giving the file a new
+ * mtime first makes each probe read the payload through its own reader.
+ */
+static void
+set_mtime(const char *path, time_t mtime)
+{
+    const struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    g_assert_cmpint(utimensat(AT_FDCWD, path, times, 0), ==, 0);
+}
+
+static void
+probe(const char *location, Probe *result)
+{
+    result->format = appimage_locate_payload(location, &result->offset);
+    g_assert_cmpint(result->format, ==, APPIMAGE_FORMAT_SQUASHFS);
+    g_assert_cmpint(result->offset, >, 0);
+    g_assert_false(appimage_payload_truncated(location));
+
+    AppImageReader *reader = appimage_reader_open(location);
+    g_assert_nonnull(reader);
+    result->compression = squashfs_read_compression(reader, result->offset);
+    result->icon = NULL;
+    g_assert_true(squashfs_read_entry(reader, result->offset, ".DirIcon", &result->icon, NULL));
+    appimage_reader_free(reader);
+}
+
+static void
+test_local_and_uri(void)
+{
+    gchar *fixture_path = g_build_filename(fixture_dir, "fixture.AppImage", NULL);
+    gchar *expected_icon = g_build_filename(fixture_dir, "fixture-DirIcon", NULL);
+    gchar *uri = g_filename_to_uri(fixture_path, NULL, NULL);
+    g_assert_nonnull(uri);
+    g_assert_false(appimage_reader_is_uri(fixture_path));
+    g_assert_true(appimage_reader_is_uri(uri));
+
+    Probe local;
+    Probe remote;
+    set_mtime(fixture_path, 1000000000);
+    probe(fixture_path, &local);
+    set_mtime(fixture_path, 1000000001);
+    probe(uri, &remote);
+
+    g_assert_cmpint(remote.format, ==, local.format);
+    g_assert_cmpint(remote.offset, ==, local.offset);
+    g_assert_cmpuint(local.compression, ==, SQFS_COMPRESSION_GZIP);
+    g_assert_cmpuint(remote.compression, ==, local.compression);
+
+    gchar *contents = NULL;
+    gsize len = 0;
+    g_assert_true(g_file_get_contents(expected_icon, &contents, &len, NULL));
+    GBytes *expected = g_bytes_new_take(contents, len);
+    g_assert_true(g_bytes_equal(local.icon, expected));
+    g_assert_true(g_bytes_equal(remote.icon, local.icon));
+
+    g_bytes_unref(expected);
+    g_bytes_unref(local.icon);
+    g_bytes_unref(remote.icon);
+    g_free(uri);
+    g_free(expected_icon);
+    g_free(fixture_path);
+}
+
+/* The payload is found, but reading .DirIcon must fail without output */
+static void
+assert_icon_unreadable(const char *name)
+{
+    gchar *path = g_build_filename(fixture_dir, name, NULL);
+    gchar *uri = g_filename_to_uri(path, NULL, NULL);
+    const char *locations[] = { path, uri };
+
+    for (guint i = 0; i < G_N_ELEMENTS(locations); ++i) {
+        off_t offset = 0;
+        g_assert_cmpint(appimage_locate_payload(locations[i], &offset), ==,
+                        APPIMAGE_FORMAT_SQUASHFS);
+
+        AppImageReader *reader = appimage_reader_open(locations[i]);
+        g_assert_nonnull(reader);
+        GBytes *icon = NULL;
+        SquashfsLocation *location = NULL;
+        g_assert_false(squashfs_read_entry(reader, offset, ".DirIcon", &icon, &location));
+        g_assert_null(icon);
+        g_assert_null(location);
+        appimage_reader_free(reader);
+    }
+
+    g_free(uri);
+    g_free(path);
+}
+
+static void
+test_bad_block_size(void)
+{
+    assert_icon_unreadable("fixture-bad-block.AppImage");
+}
+
+static void
+test_entry_past_listing(void)
+{
+    assert_icon_unreadable("fixture-bad-dirent.AppImage");
+}
+
+static void
+test_truncated(void)
+{
+    gchar *path = g_build_filename(fixture_dir, "fixture-truncated.AppImage", NULL);
+    gchar *uri = g_filename_to_uri(path, NULL, NULL);
+    const char *locations[] = { path, uri };
+
+    for (guint i = 0; i < G_N_ELEMENTS(locations); ++i) {
+        g_assert_cmpint(appimage_locate_payload(locations[i], NULL), ==,
+                        APPIMAGE_FORMAT_SQUASHFS);
+        g_assert_true(appimage_payload_truncated(locations[i]));
+    }
+
+    g_free(uri);
+    g_free(path);
+}
+
+static void
+test_lying_section_table(void)
+{
+    gchar *path = g_build_filename(fixture_dir, "fixture-lying-elf.AppImage", NULL);
+    gchar *expected_icon = g_build_filename(fixture_dir, "fixture-DirIcon", NULL);
+    gchar *uri = g_filename_to_uri(path, NULL, NULL);
+    const char *locations[] = { path, uri };
+
+    gchar *contents = NULL;
+    gsize len = 0;
+    g_assert_true(g_file_get_contents(expected_icon, &contents, &len, NULL));
+
+    for (guint i = 0; i < G_N_ELEMENTS(locations); ++i) {
+        set_mtime(path, 1000000000 + (time_t)i);
+
+        off_t offset = 0;
+        g_assert_cmpint(appimage_locate_payload(locations[i], &offset), ==,
+                        APPIMAGE_FORMAT_SQUASHFS);
+        g_assert_cmpint(offset, !=, LYING_SECTION_TABLE_END);
+        g_assert_cmpint(offset, !=, LYING_DECOY_OFFSET_1);
+        g_assert_cmpint(offset, !=, LYING_DECOY_OFFSET_2);
+        g_assert_cmpint(offset, ==, LYING_PAYLOAD_OFFSET);
+        g_assert_false(appimage_payload_truncated(locations[i]));
+
+        AppImageReader *reader = appimage_reader_open(locations[i]);
+        g_assert_nonnull(reader);
+        GBytes *icon = NULL;
+        g_assert_true(squashfs_read_entry(reader, offset, ".DirIcon", &icon, NULL));
+        g_assert_cmpmem(g_bytes_get_data(icon, NULL), g_bytes_get_size(icon), contents, len);
+        g_bytes_unref(icon);
+        appimage_reader_free(reader);
+    }
+
+    g_free(contents);
+    g_free(uri);
+    g_free(expected_icon);
+    g_free(path);
+}
+
+static void
+test_truncated_exit_status(void)
+{
+    const char *thumbnailer = g_getenv("APPIMAGE_THUMBNAILER");
+    if (!thumbnailer) {
+        g_test_skip("APPIMAGE_THUMBNAILER is not set");
+        return;
+    }
+
+    gchar *path = g_build_filename(fixture_dir, "fixture-truncated.AppImage", NULL);
+    gchar *output = g_build_filename(fixture_dir, "truncated.png", NULL);
+    g_unlink(output);
+
+    gchar *argv[] = { (gchar *)thumbnailer, path, output, (gchar *)"128", NULL };
+    gint wait_status = 0;
+    GError *error = NULL;
+    g_assert_true(g_spawn_sync(NULL, argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, NULL, NULL,
+                               &wait_status, &error));
+    g_assert_no_error(error);
+    g_assert_true(WIFEXITED(wait_status));
+    g_assert_cmpint(WEXITSTATUS(wait_status), ==, THUMBNAILER_EXIT_INCOMPLETE);
+    g_assert_false(g_file_test(output, G_FILE_TEST_EXISTS));
+
+    g_free(output);
+    g_free(path);
+}
+
+/* Relative to the directory the test runs in */
+static gchar *
+absolute_path(const char *path)
+{
+    if (g_path_is_absolute(path))
+        return g_strdup(path);
+
+    gchar *cwd = g_get_current_dir();
+    gchar *absolute = g_build_filename(cwd, path, NULL);
+    g_free(cwd);
+    return absolute;
+}
+
+int
+main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    if (argc != 2) {
+        g_printerr("usage: %s FIXTURE-DIR\n", argv[0]);
+        return 1;
+    }
+    fixture_dir = absolute_path(argv[1]);
+
+    g_test_add_func("/reader/local-and-uri", test_local_and_uri);
+    g_test_add_func("/reader/bad-block-size", test_bad_block_size);
+    g_test_add_func("/reader/entry-past-listing", test_entry_past_listing);
+    g_test_add_func("/reader/truncated", test_truncated);
+    g_test_add_func("/reader/lying-section-table", test_lying_section_table);
+    g_test_add_func("/thumbnailer/truncated-exit-status", test_truncated_exit_status);
+    int status = g_test_run();
+
+    g_free(fixture_dir);
+    return status;
+}